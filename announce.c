@@ -0,0 +1,331 @@
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+void
+announce_self_init(struct announce_self* self,
+                   struct net_context* ctx,
+                   unsigned char role)
+{
+  memset(self, 0, sizeof *self);
+
+  self->ctx = ctx;
+  self->role = role;
+
+  self->callback.events =
+    NET_EVENT_ESTABLISHED | NET_EVENT_CLOSED | NET_EVENT_TICK;
+  self->callback.p = self;
+  self->callback.cb = net_cb_announce_self;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &self->callback, entry);
+}
+
+void
+announce_self_free(struct announce_self* self)
+{
+  LIST_REMOVE(&self->callback, entry);
+
+  /* the heap elements are command states, freed with their connection */
+  free(self->heap);
+  self->heap = NULL;
+  self->count = 0;
+  self->capacity = 0;
+
+  mem_shared_unref(self->encoded);
+  self->encoded = NULL;
+}
+
+/* Forget the encoding, connections it was queued on keep their reference */
+static void
+announce_self_changed(struct announce_self* self)
+{
+  mem_shared_unref(self->encoded);
+  self->encoded = NULL;
+}
+
+void
+announce_self_set_addrs(struct announce_self* self,
+                        struct net_addr* addrs,
+                        size_t count)
+{
+  unsigned char blocks[sizeof self->address_blocks];
+  size_t blocks_size = 0;
+  unsigned char block_count = 0;
+
+  for (size_t i = 0; i < count && i < NET_PEER_ADDRS_MAX; ++i) {
+    size_t size;
+
+    if (encode_address_block((struct sockaddr*)&addrs[i].sa,
+                             addrs[i].sa_len,
+                             blocks + blocks_size,
+                             &size) != ENCODE_ADDRESS_BLOCK_OK)
+      continue;
+
+    blocks_size += size;
+    ++block_count;
+  }
+
+  if (block_count == self->address_block_count &&
+      blocks_size == self->address_blocks_size &&
+      memcmp(blocks, self->address_blocks, blocks_size) == 0)
+    return;
+
+  memcpy(self->address_blocks, blocks, blocks_size);
+  self->address_blocks_size = blocks_size;
+  self->address_block_count = block_count;
+
+  announce_self_changed(self);
+}
+
+int
+announce_self_set_keys(struct announce_self* self,
+                       struct announce_view* keys)
+{
+  if (keys->public_key_size > sizeof self->public_key ||
+      keys->signature_size > sizeof self->signature ||
+      keys->master_signature_size > sizeof self->master_signature)
+    return E(ANNOUNCE_SELF_SET_KEYS_SIZE);
+
+  self->public_key_type = keys->public_key_type;
+  self->public_key_size = keys->public_key_size;
+  memcpy(self->public_key, keys->public_key, keys->public_key_size);
+
+  self->signature_size = keys->signature_size;
+  memcpy(self->signature, keys->signature, keys->signature_size);
+
+  self->master_signature_type = keys->master_signature_type;
+  self->master_signature_size = keys->master_signature_size;
+  memcpy(self->master_signature,
+         keys->master_signature,
+         keys->master_signature_size);
+
+  announce_self_changed(self);
+
+  return ANNOUNCE_SELF_SET_KEYS_OK;
+}
+
+struct mem_shared*
+announce_self_encoded(struct announce_self* self)
+{
+  if (self->encoded)
+    return self->encoded;
+
+  struct announce_view announce = {
+    .role = self->role,
+    .address_block_count = self->address_block_count,
+    .address_blocks = self->address_blocks,
+    .public_key_type = self->public_key_type,
+    .public_key_size = self->public_key_size,
+    .public_key = self->public_key,
+    .signature_size = self->signature_size,
+    .signature = self->signature,
+    .master_signature_type = self->master_signature_type,
+    .master_signature_size = self->master_signature_size,
+    .master_signature = self->master_signature,
+  };
+
+  size_t size = announce_size(&announce);
+  struct mem_shared* encoded = mem_shared_alloc(COMMAND_HEADER_SIZE + size);
+
+  if (encoded == NULL)
+    return NULL;
+
+  struct command_header header = {
+    .flags = COMMAND_HEADER_IS_REQUEST,
+    .type = COMMAND_ANNOUNCE,
+    .size = size,
+  };
+
+  codec_encode_command_header(encoded->data, &header);
+  encode_announce(&announce, encoded->data + COMMAND_HEADER_SIZE);
+
+  self->encoded = encoded;
+  ++self->builds;
+
+  return encoded;
+}
+
+static void
+announce_self_swap(struct announce_self* self, size_t a, size_t b)
+{
+  struct announce_due* due = self->heap[a];
+
+  self->heap[a] = self->heap[b];
+  self->heap[b] = due;
+
+  self->heap[a]->index = a;
+  self->heap[b]->index = b;
+}
+
+static void
+announce_self_up(struct announce_self* self, size_t i)
+{
+  while (i > 0 && self->heap[(i - 1) / 2]->at > self->heap[i]->at) {
+    announce_self_swap(self, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+announce_self_down(struct announce_self* self, size_t i)
+{
+  for (;;) {
+    size_t first = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+
+    if (left < self->count && self->heap[left]->at < self->heap[first]->at)
+      first = left;
+
+    if (right < self->count && self->heap[right]->at < self->heap[first]->at)
+      first = right;
+
+    if (first == i)
+      return;
+
+    announce_self_swap(self, i, first);
+    i = first;
+  }
+}
+
+static int
+announce_self_push(struct announce_self* self, struct announce_due* due)
+{
+  if (self->count == self->capacity) {
+    size_t capacity = self->capacity ? self->capacity * 2 : 16;
+    struct announce_due** heap =
+      realloc(self->heap, capacity * sizeof *self->heap);
+
+    if (heap == NULL)
+      return -1;
+
+    self->heap = heap;
+    self->capacity = capacity;
+  }
+
+  due->index = self->count;
+  self->heap[self->count++] = due;
+  announce_self_up(self, due->index);
+
+  return 0;
+}
+
+static void
+announce_self_remove(struct announce_self* self, struct announce_due* due)
+{
+  size_t i = due->index;
+
+  if (--self->count == i)
+    return;
+
+  self->heap[i] = self->heap[self->count];
+  self->heap[i]->index = i;
+
+  announce_self_up(self, i);
+  announce_self_down(self, i);
+}
+
+/* Jittered time of the next periodic announce */
+static unsigned long
+announce_self_next(struct announce_self* self)
+{
+  return self->ctx->now + ANNOUNCE_INTERVAL - ANNOUNCE_INTERVAL / 4 +
+         net_random(self->ctx, ANNOUNCE_INTERVAL / 2);
+}
+
+/* Send the announce to every connection due now or within ANNOUNCE_BATCH,
+ * sharing a single encoding */
+static void
+announce_self_send(struct announce_self* self)
+{
+  unsigned long now = self->ctx->now;
+
+  if (self->count == 0 || self->heap[0]->at > now)
+    return;
+
+  struct mem_shared* encoded = announce_self_encoded(self);
+
+  if (encoded == NULL)
+    return;
+
+  while (self->count > 0 && self->heap[0]->at <= now + ANNOUNCE_BATCH) {
+    struct announce_due* due = self->heap[0];
+
+    /* a connection in the middle of writing a frame is tried again later */
+    if (net_tcp_conn_send_shared(due->tcp_conn, encoded) ==
+        NET_TCP_CONN_SEND_SHARED_OK) {
+      due->tcp_conn->flags |= NET_TCP_CONN_ANNOUNCE_SENT;
+      due->at = announce_self_next(self);
+      ++self->sends;
+    } else {
+      due->at = now + 2 * ANNOUNCE_BATCH;
+    }
+
+    announce_self_down(self, 0);
+  }
+}
+
+int
+net_cb_announce_self(int event, void* event_data, void** p)
+{
+  struct announce_self* self = *p;
+
+  if (event == NET_EVENT_ESTABLISHED) {
+    struct net_event_data_established* established = event_data;
+    struct net_tcp_conn* tcp_conn = established->tcp_conn;
+
+    /* announces are for peers, not for local clients */
+    if (tcp_conn->flags & NET_TCP_CONN_UNIX)
+      return 0;
+
+    struct command_state* state = calloc(1, sizeof *state);
+    struct announce_due* due = calloc(1, sizeof *due);
+
+    if (state == NULL || due == NULL) {
+      free(state);
+      free(due);
+      return 0;
+    }
+
+    /* due right away, peers learn our addresses as soon as possible */
+    due->tcp_conn = tcp_conn;
+    due->at = self->ctx->now;
+
+    if (announce_self_push(self, due) != 0) {
+      free(state);
+      free(due);
+      return 0;
+    }
+
+    state->type = COMMAND_ANNOUNCE;
+    state->state = due;
+    state->free = free;
+
+    LIST_INSERT_HEAD(&tcp_conn->states, state, entry);
+
+    net_context_wake_at(self->ctx, due->at);
+  } else if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+    struct command_state* state;
+
+    LIST_FOREACH(state, &closed->tcp_conn->states, entry)
+    {
+      if (state->type == COMMAND_ANNOUNCE) {
+        announce_self_remove(self, state->state);
+        break;
+      }
+    }
+  } else if (event == NET_EVENT_TICK) {
+    announce_self_send(self);
+
+    /* still due when out of memory, the next tick tries again */
+    if (self->count > 0 && self->heap[0]->at > self->ctx->now)
+      net_context_wake_at(self->ctx, self->heap[0]->at);
+  }
+
+  return 0;
+}
@@ -0,0 +1,374 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+#include "unilink.h"
+
+/*
+  Codec microbenchmark.
+
+  usage: bench [-n frames] [-r rounds] [-s seed] [-w directory]
+               [-p peers] [-m memory] [-v signatures]
+
+  Generates a corpus of valid and malformed commands, checks that the decoders
+  accept exactly the valid ones and reports how many nanoseconds each decoder
+  spends per frame. With -w, every frame is also written to its own file in
+  directory so that the corpus can seed the fuzzing harness.
+
+  Then announces from peers distinct peers are fed to a peer directory capped
+  to memory octets, reporting the time per update and per lookup.
+
+  Finally the RFC 8032 test signatures are verified signatures times, one at a
+  time and in batches of VERIFY_BATCH_MAX.
+*/
+
+static volatile unsigned long bench_sink;
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char* name, double start, size_t frames)
+{
+  if (frames > 0)
+    printf("%-24s %10.2f ns/frame\n", name, (bench_now() - start) / frames);
+}
+
+static unsigned long
+bench_announce(unsigned char* buf, size_t size)
+{
+  struct announce_view announce;
+  struct address_block_iterator it;
+  struct address_block block;
+  unsigned long sum = 0;
+
+  if (decode_announce(buf, size, &announce) != DECODE_ANNOUNCE_OK)
+    return 0;
+
+  announce_address_blocks(&announce, &it);
+
+  while (address_block_next(&it, &block)) {
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+
+    if (address_block_sockaddr(&block, &sa, &sa_len) ==
+        ADDRESS_BLOCK_SOCKADDR_OK)
+      sum += sa_len;
+  }
+
+  return sum + announce.public_key_size + announce.signature_size;
+}
+
+static int
+bench_directory(size_t peers, size_t memory)
+{
+  struct directory dir;
+
+  if (directory_init(&dir, memory) != DIRECTORY_INIT_OK) {
+    fprintf(stderr, "could not allocate directory\n");
+    return -1;
+  }
+
+  /* a single IPv4 address block, peers only differ by their key */
+  unsigned char blocks[CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA) + 2 + 4];
+  struct address_block_head head = { FAMILY_IPV4, 2 + 4 };
+
+  codec_encode_address_block_head(blocks, &head);
+  memcpy(blocks + CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA),
+         "\x1f\x90\x7f\x00\x00\x01",
+         2 + 4);
+
+  struct directory_key key;
+
+  memset(&key, 0, sizeof key);
+  key.type = DIRECTORY_KEY_PUBLIC_KEY;
+  key.size = DIRECTORY_KEY_DATA_SIZE;
+
+  double start = bench_now();
+
+  for (size_t i = 0; i < peers; ++i) {
+    struct address_block_iterator it = { blocks, 1 };
+
+    memcpy(key.data, &i, sizeof i);
+    directory_update(&dir, &key, ROLE_MASTER, &it, i);
+  }
+
+  bench_report("directory_update", start, peers);
+
+  start = bench_now();
+
+  size_t found = 0;
+
+  /* the most recent peers are the ones still in the directory */
+  for (size_t i = 0; i < peers; ++i) {
+    size_t id = peers - 1 - i;
+
+    memcpy(key.data, &id, sizeof id);
+    found += directory_find(&dir, &key) != NULL;
+  }
+
+  bench_report("directory_find", start, peers);
+
+  printf("%zu entries of %zu octets, %zu found, %lu evicted\n",
+         dir.count,
+         sizeof *dir.entries,
+         found,
+         dir.evictions);
+
+  directory_free(&dir);
+
+  return 0;
+}
+
+/* RFC 8032 section 7.1, tests 1 and 2 */
+static const unsigned char bench_public_keys[2][ED25519_PUBLIC_KEY_SIZE] = {
+  { 0xd7, 0x5a, 0x98, 0x01, 0x82, 0xb1, 0x0a, 0xb7, 0xd5, 0x4b, 0xfe,
+    0xd3, 0xc9, 0x64, 0x07, 0x3a, 0x0e, 0xe1, 0x72, 0xf3, 0xda, 0xa6,
+    0x23, 0x25, 0xaf, 0x02, 0x1a, 0x68, 0xf7, 0x07, 0x51, 0x1a },
+  { 0x3d, 0x40, 0x17, 0xc3, 0xe8, 0x43, 0x89, 0x5a, 0x92, 0xb7, 0x0a,
+    0xa7, 0x4d, 0x1b, 0x7e, 0xbc, 0x9c, 0x98, 0x2c, 0xcf, 0x2e, 0xc4,
+    0x96, 0x8c, 0xc0, 0xcd, 0x55, 0xf1, 0x2a, 0xf4, 0x66, 0x0c },
+};
+
+static const unsigned char bench_signatures[2][ED25519_SIGNATURE_SIZE] = {
+  { 0xe5, 0x56, 0x43, 0x00, 0xc3, 0x60, 0xac, 0x72, 0x90, 0x86, 0xe2,
+    0xcc, 0x80, 0x6e, 0x82, 0x8a, 0x84, 0x87, 0x7f, 0x1e, 0xb8, 0xe5,
+    0xd9, 0x74, 0xd8, 0x73, 0xe0, 0x65, 0x22, 0x49, 0x01, 0x55, 0x5f,
+    0xb8, 0x82, 0x15, 0x90, 0xa3, 0x3b, 0xac, 0xc6, 0x1e, 0x39, 0x70,
+    0x1c, 0xf9, 0xb4, 0x6b, 0xd2, 0x5b, 0xf5, 0xf0, 0x59, 0x5b, 0xbe,
+    0x24, 0x65, 0x51, 0x41, 0x43, 0x8e, 0x7a, 0x10, 0x0b },
+  { 0x92, 0xa0, 0x09, 0xa9, 0xf0, 0xd4, 0xca, 0xb8, 0x72, 0x0e, 0x82,
+    0x0b, 0x5f, 0x64, 0x25, 0x40, 0xa2, 0xb2, 0x7b, 0x54, 0x16, 0x50,
+    0x3f, 0x8f, 0xb3, 0x76, 0x22, 0x23, 0xeb, 0xdb, 0x69, 0xda, 0x08,
+    0x5a, 0xc1, 0xe4, 0x3e, 0x15, 0x99, 0x6e, 0x45, 0x8f, 0x36, 0x13,
+    0xd0, 0xf1, 0x1d, 0x8c, 0x38, 0x7b, 0x2e, 0xae, 0xb4, 0x30, 0x2a,
+    0xee, 0xb0, 0x0d, 0x29, 0x16, 0x12, 0xbb, 0x0c, 0x00 },
+};
+
+static const unsigned char bench_message = 0x72;
+
+static int
+bench_verify(size_t signatures)
+{
+  struct ed25519_item items[VERIFY_BATCH_MAX];
+  size_t failures = 0;
+
+  ed25519_init();
+
+  for (size_t i = 0; i < VERIFY_BATCH_MAX; ++i) {
+    items[i].public_key = bench_public_keys[i % 2];
+    items[i].signature = bench_signatures[i % 2];
+    items[i].message = &bench_message;
+    items[i].message_size = i % 2;
+  }
+
+  double start = bench_now();
+
+  for (size_t i = 0; i < signatures; ++i) {
+    struct ed25519_item* item = &items[i % VERIFY_BATCH_MAX];
+
+    failures += !ed25519_verify(item->public_key,
+                                item->signature,
+                                item->message,
+                                item->message_size);
+  }
+
+  bench_report("ed25519_verify", start, signatures);
+
+  start = bench_now();
+
+  for (size_t i = 0; i < signatures; i += VERIFY_BATCH_MAX) {
+    size_t count = signatures - i < VERIFY_BATCH_MAX ? signatures - i
+                                                     : VERIFY_BATCH_MAX;
+
+    ed25519_verify_batch(items, count);
+
+    for (size_t j = 0; j < count; ++j)
+      failures += !items[j].valid;
+  }
+
+  bench_report("ed25519_verify_batch", start, signatures);
+
+  printf("%zu signatures, %zu failures\n", signatures, failures);
+
+  return failures == 0 ? 0 : -1;
+}
+
+static int
+bench_write(struct corpus* corpus, const char* directory)
+{
+  if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+    perror("mkdir");
+    return -1;
+  }
+
+  for (size_t i = 0; i < corpus->count; ++i) {
+    char path[4096];
+
+    snprintf(path, sizeof path, "%s/frame-%06zu", directory, i);
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+      perror("fopen");
+      return -1;
+    }
+
+    fwrite((unsigned char*)corpus->buf.p + corpus->frames[i].offset,
+           1,
+           corpus->frames[i].size,
+           f);
+    fclose(f);
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  size_t count = 1 << 16;
+  size_t rounds = 16;
+  unsigned long seed = 1;
+  const char* directory = NULL;
+  size_t peers = 1 << 20;
+  size_t memory = DIRECTORY_MEMORY_DEFAULT;
+  size_t signatures = 1 << 12;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0)
+      count = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-r") == 0)
+      rounds = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-s") == 0)
+      seed = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-w") == 0)
+      directory = argv[i + 1];
+    else if (strcmp(argv[i], "-p") == 0)
+      peers = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-m") == 0)
+      memory = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-v") == 0)
+      signatures = strtoul(argv[i + 1], NULL, 0);
+  }
+
+  struct corpus corpus;
+
+  if (corpus_generate(&corpus, count, seed) != CORPUS_GENERATE_OK) {
+    fprintf(stderr, "could not generate corpus\n");
+    return EXIT_FAILURE;
+  }
+
+  if (directory && bench_write(&corpus, directory) != 0) {
+    corpus_free(&corpus);
+    return EXIT_FAILURE;
+  }
+
+  unsigned char* base = corpus.buf.p;
+  size_t announces = 0;
+  size_t failures = 0;
+
+  /* the decoders must accept the valid frames and only those */
+  for (size_t i = 0; i < corpus.count; ++i) {
+    struct corpus_frame* frame = &corpus.frames[i];
+    struct command_header header;
+    int valid;
+
+    if (decode_header(base + frame->offset, frame->size, &header) !=
+        DECODE_HEADER_OK) {
+      ++failures;
+      continue;
+    }
+
+    if (header.type == COMMAND_ANNOUNCE) {
+      struct announce_view announce;
+
+      ++announces;
+      valid = decode_announce(base + frame->offset + COMMAND_HEADER_SIZE,
+                              header.size,
+                              &announce) == DECODE_ANNOUNCE_OK;
+    } else {
+      valid = 1;
+    }
+
+    if (valid != !!(frame->flags & CORPUS_FRAME_VALID))
+      ++failures;
+  }
+
+  printf("%zu frames, %zu announces, %zu rounds, %zu failures\n",
+         corpus.count,
+         announces,
+         rounds,
+         failures);
+
+  double start = bench_now();
+  unsigned long sum = 0;
+
+  for (size_t round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < corpus.count; ++i) {
+      struct command_header header;
+
+      decode_header(
+        base + corpus.frames[i].offset, COMMAND_HEADER_SIZE, &header);
+      sum += header.size + header.tag;
+    }
+  }
+
+  bench_report("decode_header", start, rounds * corpus.count);
+
+  start = bench_now();
+
+  for (size_t round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < corpus.count; ++i) {
+      unsigned char* p = base + corpus.frames[i].offset;
+
+      sum += read_net_octet(&p);
+      sum += read_net_4_octets(&p);
+      sum += read_net_2_octets(&p);
+      sum += read_net_2_octets(&p);
+      sum += read_net_4_octets(&p);
+    }
+  }
+
+  bench_report("read_net_*_octets", start, rounds * corpus.count);
+
+  start = bench_now();
+
+  for (size_t round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < corpus.count; ++i) {
+      unsigned char* p = base + corpus.frames[i].offset;
+      struct command_header header;
+
+      codec_decode_command_header(p, &header);
+
+      if (header.type == COMMAND_ANNOUNCE)
+        sum += bench_announce(p + COMMAND_HEADER_SIZE, header.size);
+    }
+  }
+
+  bench_report("decode_announce", start, rounds * announces);
+
+  bench_sink = sum;
+
+  corpus_free(&corpus);
+
+  if (bench_directory(peers, memory) != 0)
+    return EXIT_FAILURE;
+
+  if (bench_verify(signatures) != 0)
+    return EXIT_FAILURE;
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
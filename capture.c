@@ -0,0 +1,134 @@
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+int
+capture_open(struct capture* capture,
+             struct net_context* ctx,
+             const char* path)
+{
+  memset(capture, 0, sizeof *capture);
+
+  capture->file = fopen(path, "wb");
+
+  if (capture->file == NULL)
+    return E(CAPTURE_OPEN_FILE);
+
+  if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE, 1, capture->file) != 1) {
+    fclose(capture->file);
+    capture->file = NULL;
+    return E(CAPTURE_OPEN_FILE);
+  }
+
+  capture->ctx = ctx;
+  capture->last = net_nanoseconds();
+
+  capture->callback.events =
+    NET_EVENT_ESTABLISHED | NET_EVENT_CLOSED | NET_EVENT_RECEIVED |
+    NET_EVENT_TICK;
+  capture->callback.p = capture;
+  capture->callback.cb = net_cb_capture;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &capture->callback, entry);
+
+  return CAPTURE_OPEN_OK;
+}
+
+void
+capture_close(struct capture* capture)
+{
+  if (capture->ctx == NULL)
+    return;
+
+  LIST_REMOVE(&capture->callback, entry);
+  capture->ctx = NULL;
+
+  if (capture->file) {
+    fclose(capture->file);
+    capture->file = NULL;
+  }
+}
+
+/* Connections whose received octets are captured, those that can be
+ * replayed by connecting to the node */
+static int
+capture_target(struct net_tcp_conn* tcp_conn)
+{
+  return !(tcp_conn->flags & (NET_TCP_CONN_UNIX | NET_TCP_CONN_OUTBOUND));
+}
+
+static void
+capture_write(struct capture* capture,
+              unsigned char kind,
+              struct net_tcp_conn* tcp_conn,
+              const void* data,
+              size_t size)
+{
+  uint64_t now = net_nanoseconds();
+  uint64_t delay = (now - capture->last) / 1000;
+  unsigned char buf[CAPTURE_RECORD_SIZE];
+
+  struct capture_record record = {
+    .kind = kind,
+    .conn_id = tcp_conn->id & 0xffffffffUL,
+    .delay = delay > 0xffffffffUL ? 0xffffffffUL : (unsigned long)delay,
+    .size = size,
+  };
+
+  /* the remainder of the delay is carried to the next record */
+  capture->last += record.delay * 1000;
+
+  codec_encode_capture_record(buf, &record);
+
+  if (fwrite(buf, sizeof buf, 1, capture->file) != 1 ||
+      (size > 0 && fwrite(data, size, 1, capture->file) != 1)) {
+    /* the file is truncated, stop there */
+    fclose(capture->file);
+    capture->file = NULL;
+    return;
+  }
+
+  ++capture->records;
+}
+
+int
+net_cb_capture(int event, void* event_data, void** p)
+{
+  struct capture* capture = *p;
+
+  if (capture->file == NULL)
+    return 0;
+
+  if (event == NET_EVENT_ESTABLISHED) {
+    struct net_event_data_established* established = event_data;
+
+    if (capture_target(established->tcp_conn))
+      capture_write(capture, CAPTURE_OPEN, established->tcp_conn, NULL, 0);
+  } else if (event == NET_EVENT_RECEIVED) {
+    struct net_event_data_received* received = event_data;
+    struct net_tcp_conn* tcp_conn = received->tcp_conn;
+
+    /* what was received is at the end of the buffer */
+    if (capture_target(tcp_conn))
+      capture_write(capture,
+                    CAPTURE_DATA,
+                    tcp_conn,
+                    (unsigned char*)tcp_conn->receive_buf.p +
+                      tcp_conn->receive_buf.size - received->count,
+                    received->count);
+  } else if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+
+    if (capture_target(closed->tcp_conn))
+      capture_write(capture, CAPTURE_CLOSE, closed->tcp_conn, NULL, 0);
+  } else if (event == NET_EVENT_TICK) {
+    /* a crash loses a second of traffic at most */
+    fflush(capture->file);
+  }
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+  Codec generator for the fixed size sections of the protocol.
+
+  A section is described by a schema macro taking two macro names, F and S,
+  and listing its fields in wire order:
+
+    F(name, octets)
+      An unsigned integer of 1, 2 or 4 octets in network byte order.
+
+    S(hi, lo, octets, lo_bits)
+      An unsigned integer of 1, 2 or 4 octets in network byte order split in
+      two members, hi takes the upper bits and lo the lower lo_bits bits.
+
+  CODEC_DEFINE(name, SCHEMA) defines struct name with a member per field and
+  the codec_decode_name and codec_encode_name functions, CODEC_SIZE(SCHEMA) is
+  the size of the section in octets. Every offset is a compile-time constant
+  so the functions compile down to a few unaligned loads or stores and byte
+  swaps, callers check the size of the whole section once before calling
+  them.
+*/
+
+#if CHAR_BIT != 8
+#error "Implement for CHAR_BIT != 8"
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CODEC_BE16(x) __builtin_bswap16(x)
+#define CODEC_BE32(x) __builtin_bswap32(x)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CODEC_BE16(x) (x)
+#define CODEC_BE32(x) (x)
+#endif
+
+static inline unsigned char
+codec_load_1(const unsigned char* p)
+{
+  return p[0];
+}
+
+static inline unsigned short
+codec_load_2(const unsigned char* p)
+{
+#ifdef CODEC_BE16
+  uint16_t v;
+
+  memcpy(&v, p, sizeof v);
+
+  return CODEC_BE16(v);
+#else
+  return (unsigned short)((p[0] << 8) | p[1]);
+#endif
+}
+
+static inline unsigned long
+codec_load_4(const unsigned char* p)
+{
+#ifdef CODEC_BE32
+  uint32_t v;
+
+  memcpy(&v, p, sizeof v);
+
+  return CODEC_BE32(v);
+#else
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+         ((unsigned long)p[2] << 8) | p[3];
+#endif
+}
+
+static inline void
+codec_store_1(unsigned char* p, unsigned char v)
+{
+  p[0] = v;
+}
+
+static inline void
+codec_store_2(unsigned char* p, unsigned short v)
+{
+#ifdef CODEC_BE16
+  uint16_t be = CODEC_BE16((uint16_t)v);
+
+  memcpy(p, &be, sizeof be);
+#else
+  p[0] = (v >> 8) & UCHAR_MAX;
+  p[1] = v & UCHAR_MAX;
+#endif
+}
+
+static inline void
+codec_store_4(unsigned char* p, unsigned long v)
+{
+#ifdef CODEC_BE32
+  uint32_t be = CODEC_BE32((uint32_t)v);
+
+  memcpy(p, &be, sizeof be);
+#else
+  p[0] = (v >> 24) & UCHAR_MAX;
+  p[1] = (v >> 16) & UCHAR_MAX;
+  p[2] = (v >> 8) & UCHAR_MAX;
+  p[3] = v & UCHAR_MAX;
+#endif
+}
+
+#define CODEC_TYPE_1 unsigned char
+#define CODEC_TYPE_2 unsigned short
+#define CODEC_TYPE_4 unsigned long
+
+#define CODEC_SIZE_F(name, octets) +(octets)
+#define CODEC_SIZE_S(hi, lo, octets, lo_bits) +(octets)
+
+/* Size in octets of a section on the wire */
+#define CODEC_SIZE(SCHEMA) (0 SCHEMA(CODEC_SIZE_F, CODEC_SIZE_S))
+
+#define CODEC_MEMBER_F(name, octets) CODEC_TYPE_##octets name;
+#define CODEC_MEMBER_S(hi, lo, octets, lo_bits)                                \
+  unsigned char hi;                                                            \
+  CODEC_TYPE_##octets lo;
+
+#define CODEC_DECODE_F(name, octets)                                           \
+  codec_out->name = codec_load_##octets(codec_p);                              \
+  codec_p += (octets);
+#define CODEC_DECODE_S(hi, lo, octets, lo_bits)                                \
+  codec_out->hi = codec_load_##octets(codec_p) >> (lo_bits);                   \
+  codec_out->lo = codec_load_##octets(codec_p) & ~(~0UL << (lo_bits));         \
+  codec_p += (octets);
+
+#define CODEC_ENCODE_F(name, octets)                                           \
+  codec_store_##octets(codec_p, codec_in->name);                               \
+  codec_p += (octets);
+#define CODEC_ENCODE_S(hi, lo, octets, lo_bits)                                \
+  codec_store_##octets(codec_p,                                                \
+                       ((unsigned long)codec_in->hi << (lo_bits)) |            \
+                         (codec_in->lo & ~(~0UL << (lo_bits))));               \
+  codec_p += (octets);
+
+#define CODEC_DEFINE(name, SCHEMA)                                             \
+  struct name                                                                  \
+  {                                                                            \
+    SCHEMA(CODEC_MEMBER_F, CODEC_MEMBER_S)                                     \
+  };                                                                           \
+                                                                               \
+  static inline void codec_decode_##name(const unsigned char* codec_p,         \
+                                         struct name* codec_out)               \
+  {                                                                            \
+    SCHEMA(CODEC_DECODE_F, CODEC_DECODE_S)                                     \
+    (void)codec_p;                                                             \
+  }                                                                            \
+                                                                               \
+  static inline void codec_encode_##name(unsigned char* codec_p,               \
+                                         const struct name* codec_in)          \
+  {                                                                            \
+    SCHEMA(CODEC_ENCODE_F, CODEC_ENCODE_S)                                     \
+    (void)codec_p;                                                             \
+  }
+
+#endif
@@ -0,0 +1,441 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+int
+command_register(struct command_context* cctx, struct command_handler* handler)
+{
+  if (handler->type_min > handler->type_max ||
+      handler->type_max >= COMMAND_TYPES_SIZE ||
+      handler->version_min > handler->version_max) {
+    return E(COMMAND_REGISTER_RANGE);
+  }
+
+  /* check that every type of the range has a free element and no handler
+   * for the same versions before touching the table so that a failed
+   * registration leaves it unchanged */
+  for (unsigned int type = handler->type_min; type <= handler->type_max;
+       ++type) {
+    size_t i = 0;
+
+    while (i < COMMAND_HANDLERS_PER_TYPE && cctx->handlers[type][i] != NULL) {
+      struct command_handler* other = cctx->handlers[type][i];
+
+      if (other->version_min <= handler->version_max &&
+          handler->version_min <= other->version_max)
+        return E(COMMAND_REGISTER_OVERLAP);
+
+      ++i;
+    }
+
+    if (i == COMMAND_HANDLERS_PER_TYPE)
+      return E(COMMAND_REGISTER_FULL);
+  }
+
+  for (unsigned int type = handler->type_min; type <= handler->type_max;
+       ++type) {
+    size_t i = 0;
+
+    while (cctx->handlers[type][i] != NULL)
+      ++i;
+
+    cctx->handlers[type][i] = handler;
+  }
+
+  return COMMAND_REGISTER_OK;
+}
+
+struct command_handler*
+command_lookup(struct command_context* cctx,
+               unsigned short type,
+               unsigned short version)
+{
+  if (type >= COMMAND_TYPES_SIZE)
+    return NULL;
+
+  for (size_t i = 0; i < COMMAND_HANDLERS_PER_TYPE; ++i) {
+    struct command_handler* handler = cctx->handlers[type][i];
+
+    if (handler == NULL)
+      break;
+
+    if (version >= handler->version_min && version <= handler->version_max)
+      return handler;
+  }
+
+  return NULL;
+}
+
+int
+net_cb_command_received(int event, void* event_data, void** p)
+{
+  struct command_context* cctx = *p;
+
+  if (event == NET_EVENT_RECEIVED) {
+    struct net_event_data_received* received = event_data;
+    struct net_tcp_conn* tcp_conn = received->tcp_conn;
+    struct command_frame frame;
+
+    frame.tcp_conn = tcp_conn;
+    frame.datagram = NULL;
+
+    /* handle every command that is available in the receive buffer, a single
+     * recv(2) may have brought in several of them */
+    do {
+      unsigned char* buf = tcp_conn->receive_buf.p;
+
+      if (tcp_conn->stream_remaining > 0) {
+        /* hand whatever part of the streamed payload we have to its handler,
+         * or drop it if the command is being skipped */
+        size_t size = tcp_conn->receive_buf.size;
+
+        if (size == 0)
+          break;
+
+        if (size > tcp_conn->stream_remaining)
+          size = tcp_conn->stream_remaining;
+
+        struct command_handler* handler = tcp_conn->stream_handler;
+
+        if (handler) {
+          frame.header = tcp_conn->stream_header;
+          frame.data = buf;
+          frame.size = size;
+          frame.offset =
+            tcp_conn->stream_header.size - tcp_conn->stream_remaining;
+
+          uint64_t start = net_nanoseconds();
+
+          if (handler->fn(&frame, &handler->p) != 0)
+            goto close_fd;
+
+          uint64_t duration = net_nanoseconds() - start;
+
+          TRACE_EVENT(TRACE_DISPATCH,
+                      tcp_conn->id,
+                      frame.header.type,
+                      size,
+                      duration);
+
+          tcp_conn->stream_service += duration;
+        }
+
+        tcp_conn->stream_remaining -= size;
+
+        if (handler && tcp_conn->stream_remaining == 0)
+          net_metrics_service(tcp_conn->ctx,
+                              &tcp_conn->stream_header,
+                              tcp_conn->stream_service);
+
+        if (mem_shrink_buf_head(&tcp_conn->receive_buf, size) !=
+            MEM_SHRINK_BUF_HEAD_OK) {
+          goto close_fd;
+        }
+
+        continue;
+      }
+
+      if (decode_header(buf, tcp_conn->receive_buf.size, &frame.header) !=
+          DECODE_HEADER_OK)
+        break;
+
+      buf += COMMAND_HEADER_SIZE;
+
+      TRACE_EVENT(TRACE_DECODE,
+                  tcp_conn->id,
+                  frame.header.type,
+                  frame.header.tag,
+                  frame.header.size);
+
+#ifdef DEBUG
+      printf("command_header {\n\tflags: 0x%hhx\n\ttag: 0x%lx\n\ttype: "
+             "0x%hx\n\tversion: 0x%hx\n"
+             "\tsize: 0x%lx\n}\n",
+             frame.header.flags,
+             frame.header.tag,
+             frame.header.type,
+             frame.header.version,
+             frame.header.size);
+#endif
+
+      /* reject oversized frames before buffering any of their payload */
+      if (cctx->max_frame_size > 0 &&
+          frame.header.size > cctx->max_frame_size)
+        goto close_fd;
+
+      if (!(frame.header.flags & COMMAND_HEADER_IS_REQUEST))
+        net_metrics_response(tcp_conn, &frame.header);
+
+      struct command_handler* handler =
+        command_lookup(cctx, frame.header.type, frame.header.version);
+
+      size_t available = tcp_conn->receive_buf.size - COMMAND_HEADER_SIZE;
+
+      if (handler == NULL || (handler->flags & COMMAND_HANDLER_STREAM)) {
+        /* unknown commands are skipped as they arrive using the size of the
+         * header, so that they can't stall the connection */
+        size_t size = available;
+
+        if (size > frame.header.size)
+          size = frame.header.size;
+
+        net_metrics_frame(tcp_conn->ctx, tcp_conn, &frame.header, 0);
+
+        tcp_conn->stream_service = 0;
+
+        if (handler) {
+          ++handler->hits;
+
+          frame.data = buf;
+          frame.size = size;
+          frame.offset = 0;
+
+          uint64_t start = net_nanoseconds();
+
+          if (handler->fn(&frame, &handler->p) != 0)
+            goto close_fd;
+
+          tcp_conn->stream_service = net_nanoseconds() - start;
+
+          TRACE_EVENT(TRACE_DISPATCH,
+                      tcp_conn->id,
+                      frame.header.type,
+                      size,
+                      tcp_conn->stream_service);
+
+          if (size == frame.header.size)
+            net_metrics_service(
+              tcp_conn->ctx, &frame.header, tcp_conn->stream_service);
+        } else {
+          ++cctx->unknown;
+        }
+
+        tcp_conn->stream_header = frame.header;
+        tcp_conn->stream_remaining = frame.header.size - size;
+        tcp_conn->stream_handler = handler;
+
+        if (mem_shrink_buf_head(&tcp_conn->receive_buf,
+                                COMMAND_HEADER_SIZE + size) !=
+            MEM_SHRINK_BUF_HEAD_OK) {
+          goto close_fd;
+        }
+      } else {
+        /* wait for the entire frame */
+        if (available < frame.header.size)
+          break;
+
+        net_metrics_frame(tcp_conn->ctx, tcp_conn, &frame.header, 0);
+
+        ++handler->hits;
+
+        frame.data = buf;
+        frame.size = frame.header.size;
+        frame.offset = 0;
+
+        uint64_t start = net_nanoseconds();
+
+        if (handler->fn(&frame, &handler->p) != 0)
+          goto close_fd;
+
+        uint64_t duration = net_nanoseconds() - start;
+
+        TRACE_EVENT(TRACE_DISPATCH,
+                    tcp_conn->id,
+                    frame.header.type,
+                    frame.header.size,
+                    duration);
+
+        net_metrics_service(tcp_conn->ctx, &frame.header, duration);
+
+        if (mem_shrink_buf_head(&tcp_conn->receive_buf,
+                                COMMAND_HEADER_SIZE + frame.header.size) !=
+            MEM_SHRINK_BUF_HEAD_OK) {
+          goto close_fd;
+        }
+      }
+    } while (1);
+
+    /* don't go into this code path unless goto is used */
+    if (0) {
+      /* This will cause the networking loop to discard the fd and all resources
+       * associated with it */
+
+    close_fd:
+      net_tcp_conn_close(tcp_conn, NET_EVENT_CLOSED_RECV);
+      shutdown(tcp_conn->fd, SHUT_RDWR);
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+int
+net_cb_command_datagram(int event, void* event_data, void** p)
+{
+  struct command_context* cctx = *p;
+
+  if (event == NET_EVENT_DATAGRAM) {
+    struct net_event_data_datagram* datagram = event_data;
+    struct command_frame frame;
+
+    /* a datagram carries exactly one command, there is nothing to resume so
+     * malformed datagrams are simply dropped */
+    if (decode_header(datagram->data, datagram->size, &frame.header) !=
+          DECODE_HEADER_OK ||
+        datagram->size - COMMAND_HEADER_SIZE != frame.header.size)
+      return 0;
+
+    if (cctx->max_frame_size > 0 && frame.header.size > cctx->max_frame_size)
+      return 0;
+
+    net_metrics_frame(datagram->ctx, NULL, &frame.header, 0);
+
+    struct command_handler* handler =
+      command_lookup(cctx, frame.header.type, frame.header.version);
+
+    if (handler == NULL) {
+      ++cctx->unknown;
+      return 0;
+    }
+
+    ++handler->hits;
+
+    /* streaming handlers get the whole payload as a single chunk */
+    frame.tcp_conn = NULL;
+    frame.datagram = datagram;
+    frame.data = datagram->data + COMMAND_HEADER_SIZE;
+    frame.size = frame.header.size;
+    frame.offset = 0;
+
+    uint64_t start = net_nanoseconds();
+
+    handler->fn(&frame, &handler->p);
+
+    uint64_t duration = net_nanoseconds() - start;
+
+    /* datagrams have no connection */
+    TRACE_EVENT(TRACE_DISPATCH, 0, frame.header.type, frame.size, duration);
+
+    net_metrics_service(datagram->ctx, &frame.header, duration);
+  }
+
+  return 0;
+}
+
+void
+command_state_free_ping(void* state)
+{
+  struct command_state_ping* state_ping = state;
+
+  free(state_ping->data);
+  state_ping->data = NULL;
+  state_ping->size = 0;
+}
+
+int
+command_ping_stream(struct command_frame* frame, void** p)
+{
+  (void)p;
+
+  struct net_tcp_conn* tcp_conn = frame->tcp_conn;
+  struct command_header* header = &frame->header;
+  unsigned char* chunk = frame->data;
+  size_t size = frame->size;
+  unsigned long offset = frame->offset;
+
+  if (frame->datagram) {
+    /* datagrams are answered whole and have no state to match responses */
+    struct net_event_data_datagram* datagram = frame->datagram;
+    unsigned char response[NET_UDP_DATAGRAM_SIZE];
+    struct command_header response_header = *header;
+
+    if (!(header->flags & COMMAND_HEADER_IS_REQUEST) ||
+        COMMAND_HEADER_SIZE + size > sizeof response)
+      return 0;
+
+    response_header.flags = 0;
+    response_header.version = 0;
+
+    codec_encode_command_header(response, &response_header);
+    memcpy(response + COMMAND_HEADER_SIZE, chunk, size);
+
+    net_metrics_frame(datagram->ctx, NULL, &response_header, 1);
+
+    net_udp_send(datagram->ctx,
+                 datagram->fd,
+                 (struct sockaddr*)datagram->sa,
+                 datagram->sa_len,
+                 response,
+                 COMMAND_HEADER_SIZE + size);
+
+    return 0;
+  }
+
+  if (header->flags & COMMAND_HEADER_IS_REQUEST) {
+    /* echo the payload back as it arrives, the response header is only
+     * written once, before the first chunk */
+    size_t header_size = offset == 0 ? COMMAND_HEADER_SIZE : 0;
+
+    unsigned char* sbuf =
+      net_tcp_conn_write(tcp_conn, NULL, header_size + size);
+
+    if (sbuf == NULL)
+      return -1;
+
+    if (offset == 0) {
+      struct command_header response = *header;
+
+      response.flags = 0;
+      response.version = 0;
+
+      codec_encode_command_header(sbuf, &response);
+      sbuf += COMMAND_HEADER_SIZE;
+
+      net_metrics_frame(tcp_conn->ctx, tcp_conn, &response, 1);
+    }
+
+    /* ping data */
+    memcpy(sbuf, chunk, size);
+
+    /* other frames can't be sent until the response is complete */
+    tcp_conn->send_partial = header->size - offset - size;
+  } else {
+    struct command_state* state;
+
+    LIST_FOREACH(state, &tcp_conn->states, entry)
+    {
+      if (state->type != COMMAND_PING)
+        continue;
+
+      struct command_state_ping* state_ping = state->state;
+
+      if (state_ping->tag != header->tag)
+        continue;
+
+      if (state_ping->size != header->size ||
+          (memcmp((unsigned char*)state_ping->data + offset, chunk, size) !=
+           0)) {
+        state_ping->progress |= COMMAND_STATE_PING_INVALID_RESPONSE;
+      } else if (offset + size == header->size &&
+                 !(state_ping->progress &
+                   COMMAND_STATE_PING_INVALID_RESPONSE)) {
+        state_ping->progress |= COMMAND_STATE_PING_VALID_RESPONSE;
+      }
+
+      break;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "unilink.h"
+
+static unsigned long long
+corpus_random(unsigned long long* state)
+{
+  /* xorshift64*, good enough to shape frames and reproducible everywhere */
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+corpus_fill(unsigned char* p, size_t size, unsigned long long* state)
+{
+  for (size_t i = 0; i < size; ++i)
+    p[i] = corpus_random(state) & 0xff;
+}
+
+/* Encodes a random announce at p and returns its size, p may be NULL to only
+ * compute the size. Calls made with the same state encode the same announce. */
+static size_t
+corpus_announce(unsigned char* p, unsigned long long* state)
+{
+  size_t size = 0;
+
+  struct announce_head head;
+
+  head.role = corpus_random(state) % (ROLE_MASTER + 1);
+  head.address_block_count = corpus_random(state) % 5;
+
+  if (p)
+    codec_encode_announce_head(p + size, &head);
+  size += CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA);
+
+  for (size_t i = 0; i < head.address_block_count; ++i) {
+    struct address_block_head block;
+
+    block.family = corpus_random(state) % 3;
+    block.size = block.family == FAMILY_IPV4   ? 2 + 4
+                 : block.family == FAMILY_IPV6 ? 2 + 16
+                                               : corpus_random(state) % 32;
+
+    if (p) {
+      codec_encode_address_block_head(p + size, &block);
+      corpus_fill(
+        p + size + CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA), block.size, state);
+    } else {
+      for (size_t j = 0; j < block.size; ++j)
+        corpus_random(state);
+    }
+    size += CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA) + block.size;
+  }
+
+  struct public_key_head public_key = { 0, 32 };
+
+  if (p) {
+    codec_encode_public_key_head(p + size, &public_key);
+    memset(p + size + CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA), 0xab, 32);
+  }
+  size += CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA) + 32;
+
+  struct signature_head signature = { 64 };
+
+  if (p) {
+    codec_encode_signature_head(p + size, &signature);
+    memset(p + size + CODEC_SIZE(SIGNATURE_HEAD_SCHEMA), 0xcd, 64);
+  }
+  size += CODEC_SIZE(SIGNATURE_HEAD_SCHEMA) + 64;
+
+  struct master_signature_head master_signature;
+
+  master_signature.master_signature_type = 0;
+  master_signature.master_signature_size = corpus_random(state) % 2 ? 64 : 0;
+
+  if (p) {
+    codec_encode_master_signature_head(p + size, &master_signature);
+    memset(p + size + CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA),
+           0xef,
+           master_signature.master_signature_size);
+  }
+  size += CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA) +
+          master_signature.master_signature_size;
+
+  return size;
+}
+
+int
+corpus_generate(struct corpus* corpus, size_t count, unsigned long seed)
+{
+  unsigned long long state = seed * 2654435761ULL + 1;
+
+  memset(corpus, 0, sizeof *corpus);
+
+  corpus->frames = calloc(count, sizeof *corpus->frames);
+  if (corpus->frames == NULL && count > 0) {
+    return E(CORPUS_GENERATE_ALLOC);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    struct corpus_frame* frame = &corpus->frames[i];
+    struct command_header header;
+    unsigned long kind = corpus_random(&state) % 8;
+    size_t payload_size;
+
+    header.flags = COMMAND_HEADER_IS_REQUEST;
+    header.tag = corpus_random(&state) & 0xffffffffUL;
+    header.version = 0;
+
+    unsigned long long payload_state = state;
+
+    if (kind < 3) { /* ping */
+      header.type = COMMAND_PING;
+      payload_size = corpus_random(&state) % 257;
+    } else { /* announce, possibly damaged below */
+      header.type = COMMAND_ANNOUNCE;
+      payload_size = corpus_announce(NULL, &state);
+    }
+
+    size_t encoded_size = payload_size;
+
+    /* kinds 6 and 7 are malformed: either truncated announces whose header
+     * agrees with the truncation, or announces with trailing garbage */
+    if (kind == 6 && payload_size > 0)
+      encoded_size = corpus_random(&state) % payload_size;
+    else if (kind == 7)
+      encoded_size = payload_size + 1 + corpus_random(&state) % 16;
+
+    header.size = encoded_size;
+
+    frame->flags = kind < 6 ? CORPUS_FRAME_VALID : 0;
+    frame->offset = corpus->buf.size;
+    frame->size = COMMAND_HEADER_SIZE + encoded_size;
+
+    size_t grown = encoded_size > payload_size ? encoded_size : payload_size;
+
+    if (mem_grow_buf(&corpus->buf, NULL, COMMAND_HEADER_SIZE + grown) !=
+        MEM_GROW_BUF_OK) {
+      corpus_free(corpus);
+      return E(CORPUS_GENERATE_ALLOC);
+    }
+
+    unsigned char* p = (unsigned char*)corpus->buf.p + frame->offset;
+
+    codec_encode_command_header(p, &header);
+    p += COMMAND_HEADER_SIZE;
+
+    if (header.type == COMMAND_PING)
+      corpus_fill(p, payload_size, &payload_state);
+    else
+      corpus_announce(p, &payload_state);
+
+    if (encoded_size > payload_size)
+      corpus_fill(p + payload_size, encoded_size - payload_size, &state);
+
+    /* drop what a truncation cut off so that frames stay back to back */
+    if (mem_shrink_buf(&corpus->buf, grown - encoded_size) !=
+        MEM_SHRINK_BUF_OK) {
+      corpus_free(corpus);
+      return E(CORPUS_GENERATE_ALLOC);
+    }
+
+    ++corpus->count;
+  }
+
+  return CORPUS_GENERATE_OK;
+}
+
+void
+corpus_free(struct corpus* corpus)
+{
+  mem_free_buf(&corpus->buf);
+  free(corpus->frames);
+  corpus->frames = NULL;
+  corpus->count = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stddef.h>
+
+#include "unilink.h"
+
+/*
+  Deterministic corpus of encoded commands, each one a header followed by its
+  payload, shared by the codec benchmark and the fuzzing harness.
+*/
+
+#define CORPUS_FRAME_VALID 0x1
+
+struct corpus_frame
+{
+  int flags;
+  size_t offset;
+  size_t size;
+};
+
+struct corpus
+{
+  /* Every frame, back to back */
+  struct mem_buf buf;
+
+  size_t count;
+  struct corpus_frame* frames;
+};
+
+enum
+{
+  CORPUS_GENERATE_OK,
+  CORPUS_GENERATE_ALLOC,
+} corpus_generate_errors;
+
+/* Generate count frames, about one in four of them malformed */
+int
+corpus_generate(struct corpus* corpus, size_t count, unsigned long seed);
+
+void
+corpus_free(struct corpus* corpus);
+
+#endif
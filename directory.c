@@ -0,0 +1,677 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+/* Largest power of two number of entries that fits in memory, 0 if that is
+ * less than 16 */
+static size_t
+directory_capacity(size_t memory)
+{
+  size_t capacity = 16;
+
+  if (memory / sizeof(struct directory_entry) < capacity)
+    return 0;
+
+  while (capacity <= memory / sizeof(struct directory_entry) / 2)
+    capacity *= 2;
+
+  return capacity;
+}
+
+int
+directory_init(struct directory* dir, size_t memory)
+{
+  memset(dir, 0, sizeof *dir);
+
+  size_t capacity = directory_capacity(memory);
+
+  if (capacity == 0) {
+    return E(DIRECTORY_INIT_SIZE);
+  }
+
+  /* pages of a large calloc(3) are only touched once entries land on them */
+  dir->entries = calloc(capacity, sizeof *dir->entries);
+  if (dir->entries == NULL) {
+    return E(DIRECTORY_INIT_ALLOC);
+  }
+
+  dir->capacity = capacity;
+  dir->max_count = capacity / 4 * 3;
+
+  return DIRECTORY_INIT_OK;
+}
+
+void
+directory_free(struct directory* dir)
+{
+  if (dir->map)
+    munmap(dir->map, dir->map_size);
+  else
+    free(dir->entries);
+
+  memset(dir, 0, sizeof *dir);
+}
+
+static uint32_t
+directory_hash(struct directory_key* key)
+{
+  /* FNV-1a */
+  uint32_t hash = 0x811c9dc5;
+
+  hash = (hash ^ key->type) * 0x01000193;
+  hash = (hash ^ key->size) * 0x01000193;
+
+  for (size_t i = 0; i < key->size; ++i)
+    hash = (hash ^ key->data[i]) * 0x01000193;
+
+  return hash;
+}
+
+/* Slot holding the peer with a key, or the empty slot where it would go */
+static size_t
+directory_probe(struct directory* dir, struct directory_key* key, uint32_t hash)
+{
+  size_t mask = dir->capacity - 1;
+  size_t i = hash & mask;
+
+  while (dir->entries[i].flags & DIRECTORY_ENTRY_USED) {
+    struct directory_entry* entry = &dir->entries[i];
+
+    if (entry->hash == hash && entry->key.type == key->type &&
+        entry->key.size == key->size &&
+        memcmp(entry->key.data, key->data, key->size) == 0)
+      break;
+
+    i = (i + 1) & mask;
+  }
+
+  return i;
+}
+
+static void
+directory_remove(struct directory* dir, size_t i)
+{
+  size_t mask = dir->capacity - 1;
+
+  memset(&dir->entries[i], 0, sizeof dir->entries[i]);
+  --dir->count;
+
+  /* move back the entries that probed past the freed slot so that lookups
+   * don't stop early, instead of leaving a tombstone */
+  for (size_t j = (i + 1) & mask; dir->entries[j].flags & DIRECTORY_ENTRY_USED;
+       j = (j + 1) & mask) {
+    size_t home = dir->entries[j].hash & mask;
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      dir->entries[i] = dir->entries[j];
+      memset(&dir->entries[j], 0, sizeof dir->entries[j]);
+      i = j;
+    }
+  }
+}
+
+/* Evict the least recently used of the entries a key would probe past, or
+ * of the first ones after its home slot */
+static void
+directory_evict(struct directory* dir, uint32_t hash)
+{
+  size_t mask = dir->capacity - 1;
+  size_t victim = dir->capacity;
+  size_t sampled = 0;
+
+  for (size_t i = hash & mask; sampled < DIRECTORY_EVICT_SAMPLE;
+       i = (i + 1) & mask) {
+    struct directory_entry* entry = &dir->entries[i];
+
+    if (!(entry->flags & DIRECTORY_ENTRY_USED))
+      continue;
+
+    /* ages are taken relative to the clock so that it can wrap */
+    if (victim == dir->capacity ||
+        dir->clock - entry->used > dir->clock - dir->entries[victim].used)
+      victim = i;
+
+    ++sampled;
+  }
+
+  directory_remove(dir, victim);
+  ++dir->evictions;
+  ++dir->changes;
+}
+
+static int
+directory_addr_from_block(struct address_block* block,
+                          struct directory_addr* out)
+{
+  memset(out, 0, sizeof *out);
+
+  switch (block->family) {
+    case FAMILY_IPV4:
+      if (block->size != 2 /* port */ + 4 /* ipv4 */)
+        return -1;
+
+      memcpy(out->addr, block->data + 2, 4);
+      break;
+    case FAMILY_IPV6:
+      if (block->size != 2 /* port */ + 16 /* ipv6 */)
+        return -1;
+
+      memcpy(out->addr, block->data + 2, 16);
+      break;
+    default:
+      return -1;
+  }
+
+  out->family = block->family;
+  memcpy(out->port, block->data, 2);
+
+  return 0;
+}
+
+static int
+directory_addr_from_sockaddr(struct sockaddr* sa,
+                             socklen_t sa_len,
+                             struct directory_addr* out)
+{
+  struct sockaddr_storage normalized;
+  socklen_t normalized_len;
+
+  if (net_sockaddr_normalize(sa, sa_len, &normalized, &normalized_len) !=
+      NET_SOCKADDR_NORMALIZE_OK)
+    return -1;
+
+  memset(out, 0, sizeof *out);
+
+  if (normalized.ss_family == AF_INET) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&normalized;
+
+    out->family = FAMILY_IPV4;
+    memcpy(out->port, &sin->sin_port, 2);
+    memcpy(out->addr, &sin->sin_addr, 4);
+  } else if (normalized.ss_family == AF_INET6) {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&normalized;
+
+    out->family = FAMILY_IPV6;
+    memcpy(out->port, &sin6->sin6_port, 2);
+    memcpy(out->addr, &sin6->sin6_addr, 16);
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+directory_addr_equal(struct directory_addr* a, struct directory_addr* b)
+{
+  return a->family == b->family && memcmp(a->port, b->port, 2) == 0 &&
+         memcmp(a->addr, b->addr, 16) == 0;
+}
+
+/* The fastest measured address, or the first announced one */
+static void
+directory_pick_best(struct directory_entry* entry)
+{
+  entry->best = 0;
+
+  for (unsigned char i = 0; i < entry->addr_count; ++i) {
+    uint32_t rtt = entry->addrs[i].rtt;
+    uint32_t best_rtt = entry->addrs[entry->best].rtt;
+
+    if (rtt != 0 && (best_rtt == 0 || rtt < best_rtt))
+      entry->best = i;
+  }
+}
+
+int
+directory_key_announce(struct announce_view* announce,
+                       struct directory_key* out)
+{
+  memset(out, 0, sizeof *out);
+
+  /* a key of any other type is not verified, anyone could announce it */
+  if (announce->public_key_type == PUBLIC_KEY_ED25519 &&
+      announce->public_key_size > 0 &&
+      announce->public_key_size <= DIRECTORY_KEY_DATA_SIZE) {
+    out->type = DIRECTORY_KEY_PUBLIC_KEY;
+    out->size = announce->public_key_size;
+    memcpy(out->data, announce->public_key, out->size);
+
+    return DIRECTORY_KEY_ANNOUNCE_OK;
+  }
+
+  struct address_block_iterator it;
+  struct address_block block;
+  struct directory_addr addr;
+
+  announce_address_blocks(announce, &it);
+
+  while (address_block_next(&it, &block)) {
+    if (directory_addr_from_block(&block, &addr) != 0)
+      continue;
+
+    out->type = DIRECTORY_KEY_ADDRESS;
+    out->size = 1 + 2 + 16;
+    out->data[0] = addr.family;
+    memcpy(out->data + 1, addr.port, 2);
+    memcpy(out->data + 3, addr.addr, 16);
+
+    return DIRECTORY_KEY_ANNOUNCE_OK;
+  }
+
+  return E(DIRECTORY_KEY_ANNOUNCE_NONE);
+}
+
+struct directory_entry*
+directory_find(struct directory* dir, struct directory_key* key)
+{
+  struct directory_entry* entry =
+    &dir->entries[directory_probe(dir, key, directory_hash(key))];
+
+  if (!(entry->flags & DIRECTORY_ENTRY_USED))
+    return NULL;
+
+  entry->used = ++dir->clock;
+
+  return entry;
+}
+
+struct directory_entry*
+directory_update(struct directory* dir,
+                 struct directory_key* key,
+                 unsigned char role,
+                 struct address_block_iterator* it,
+                 uint64_t now)
+{
+  struct directory_addr addrs[DIRECTORY_ADDRS_MAX];
+  unsigned char addr_count = 0;
+  struct address_block block;
+
+  while (addr_count < DIRECTORY_ADDRS_MAX && address_block_next(it, &block)) {
+    if (directory_addr_from_block(&block, &addrs[addr_count]) == 0)
+      ++addr_count;
+  }
+
+  uint32_t hash = directory_hash(key);
+  struct directory_entry* entry =
+    &dir->entries[directory_probe(dir, key, hash)];
+
+  if (!(entry->flags & DIRECTORY_ENTRY_USED)) {
+    /* nothing to remember about a peer we can't reach */
+    if (addr_count == 0)
+      return NULL;
+
+    if (dir->count >= dir->max_count) {
+      directory_evict(dir, hash);
+
+      /* eviction moves entries around */
+      entry = &dir->entries[directory_probe(dir, key, hash)];
+    }
+
+    entry->hash = hash;
+    entry->flags = DIRECTORY_ENTRY_USED;
+    entry->key = *key;
+    ++dir->count;
+  }
+
+  if (addr_count > 0) {
+    for (unsigned char i = 0; i < addr_count; ++i) {
+      for (unsigned char j = 0; j < entry->addr_count; ++j) {
+        if (directory_addr_equal(&addrs[i], &entry->addrs[j])) {
+          addrs[i].rtt = entry->addrs[j].rtt;
+          break;
+        }
+      }
+    }
+
+    memcpy(entry->addrs, addrs, addr_count * sizeof *addrs);
+    entry->addr_count = addr_count;
+    directory_pick_best(entry);
+  }
+
+  entry->used = ++dir->clock;
+  entry->role = role;
+  entry->last_seen = now;
+  ++dir->changes;
+
+  return entry;
+}
+
+void
+directory_set_rtt(struct directory* dir,
+                  struct directory_entry* entry,
+                  struct sockaddr* sa,
+                  socklen_t sa_len,
+                  uint32_t rtt)
+{
+  struct directory_addr addr;
+
+  if (directory_addr_from_sockaddr(sa, sa_len, &addr) != 0)
+    return;
+
+  for (unsigned char i = 0; i < entry->addr_count; ++i) {
+    if (directory_addr_equal(&addr, &entry->addrs[i])) {
+      /* 0 means unmeasured, sub-millisecond round trips are rounded up */
+      entry->addrs[i].rtt = rtt > 0 ? rtt : 1;
+      directory_pick_best(entry);
+      ++dir->changes;
+      return;
+    }
+  }
+}
+
+int
+directory_addr_sockaddr(struct directory_addr* addr,
+                        struct sockaddr_storage* sa,
+                        socklen_t* sa_len)
+{
+  memset(sa, 0, sizeof *sa);
+
+  if (addr->family == FAMILY_IPV4) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)sa;
+
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_port, addr->port, 2);
+    memcpy(&sin->sin_addr, addr->addr, 4);
+
+    *sa_len = sizeof *sin;
+  } else if (addr->family == FAMILY_IPV6) {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_port, addr->port, 2);
+    memcpy(&sin6->sin6_addr, addr->addr, 16);
+
+    *sa_len = sizeof *sin6;
+  } else {
+    return E(DIRECTORY_ADDR_SOCKADDR_FAMILY);
+  }
+
+  return DIRECTORY_ADDR_SOCKADDR_OK;
+}
+
+int
+directory_best_sockaddr(struct directory_entry* entry,
+                        struct sockaddr_storage* sa,
+                        socklen_t* sa_len)
+{
+  if (entry->best >= entry->addr_count ||
+      directory_addr_sockaddr(&entry->addrs[entry->best], sa, sa_len) !=
+        DIRECTORY_ADDR_SOCKADDR_OK) {
+    return E(DIRECTORY_BEST_SOCKADDR_NONE);
+  }
+
+  return DIRECTORY_BEST_SOCKADDR_OK;
+}
+
+size_t
+directory_known_good(struct directory* dir,
+                     struct directory_entry** out,
+                     size_t max)
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < dir->capacity; ++i) {
+    struct directory_entry* entry = &dir->entries[i];
+
+    if (!(entry->flags & DIRECTORY_ENTRY_USED) ||
+        entry->best >= entry->addr_count ||
+        entry->addrs[entry->best].rtt == 0)
+      continue;
+
+    /* insertion into out, kept sorted by most recently seen first */
+    size_t j = count < max ? count++ : max;
+
+    while (j > 0 && out[j - 1]->last_seen < entry->last_seen) {
+      if (j < max)
+        out[j] = out[j - 1];
+      --j;
+    }
+
+    if (j < max)
+      out[j] = entry;
+  }
+
+  return count;
+}
+
+static int
+directory_file_valid(struct directory_file_header* header, off_t size)
+{
+  return memcmp(header->magic, DIRECTORY_FILE_MAGIC, sizeof header->magic) ==
+           0 &&
+         header->version == DIRECTORY_FILE_VERSION &&
+         header->byte_order == DIRECTORY_FILE_BYTE_ORDER &&
+         header->entry_size == sizeof(struct directory_entry) &&
+         header->capacity >= 16 &&
+         (header->capacity & (header->capacity - 1)) == 0 &&
+         header->count <= header->capacity / 4 * 3 &&
+         (uint64_t)size ==
+           sizeof *header + header->capacity * sizeof(struct directory_entry);
+}
+
+/* Whether the entries of a file can be used as they are. Those of a file
+ * that was corrupted or written by another build could make lookups read
+ * past an entry or never find an empty slot. */
+static int
+directory_entries_valid(struct directory_entry* entries,
+                        struct directory_file_header* header)
+{
+  uint64_t count = 0;
+
+  for (uint64_t i = 0; i < header->capacity; ++i) {
+    struct directory_entry* entry = &entries[i];
+
+    if (entry->flags & ~DIRECTORY_ENTRY_USED)
+      return 0;
+
+    if (!(entry->flags & DIRECTORY_ENTRY_USED))
+      continue;
+
+    if ((entry->key.type != DIRECTORY_KEY_PUBLIC_KEY &&
+         entry->key.type != DIRECTORY_KEY_ADDRESS) ||
+        entry->key.size > DIRECTORY_KEY_DATA_SIZE ||
+        entry->hash != directory_hash(&entry->key) ||
+        entry->addr_count > DIRECTORY_ADDRS_MAX ||
+        (entry->best >= entry->addr_count && entry->best != 0))
+      return 0;
+
+    ++count;
+  }
+
+  return count == header->count;
+}
+
+/* Insert an entry from another table, evicting as updates do */
+static void
+directory_insert(struct directory* dir, struct directory_entry* entry)
+{
+  if (dir->count >= dir->max_count)
+    directory_evict(dir, entry->hash);
+
+  size_t i = directory_probe(dir, &entry->key, entry->hash);
+
+  if (!(dir->entries[i].flags & DIRECTORY_ENTRY_USED))
+    ++dir->count;
+
+  dir->entries[i] = *entry;
+}
+
+int
+directory_open(struct directory* dir, const char* path, size_t memory)
+{
+  size_t capacity = directory_capacity(memory);
+
+  if (capacity == 0) {
+    return E(DIRECTORY_OPEN_SIZE);
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    goto empty;
+  }
+
+  struct stat st;
+  struct directory_file_header header;
+
+  if (fstat(fd, &st) == -1 ||
+      read(fd, &header, sizeof header) != sizeof header ||
+      !directory_file_valid(&header, st.st_size)) {
+    close(fd);
+    goto empty;
+  }
+
+  /* a private mapping is never written back, the file only changes with the
+   * next checkpoint */
+  void* map =
+    mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    goto empty;
+  }
+
+  struct directory_entry* entries =
+    (struct directory_entry*)((unsigned char*)map + sizeof header);
+
+  if (!directory_entries_valid(entries, &header)) {
+    munmap(map, st.st_size);
+    goto empty;
+  }
+
+  if (header.capacity == capacity) {
+    memset(dir, 0, sizeof *dir);
+
+    dir->entries = entries;
+    dir->capacity = capacity;
+    dir->count = header.count;
+    dir->max_count = capacity / 4 * 3;
+    dir->clock = header.clock;
+    dir->map = map;
+    dir->map_size = st.st_size;
+
+    return DIRECTORY_OPEN_OK;
+  }
+
+  /* the memory cap changed, move every entry to a table of the new size */
+  if (directory_init(dir, memory) != DIRECTORY_INIT_OK) {
+    munmap(map, st.st_size);
+    return E(DIRECTORY_OPEN_ALLOC);
+  }
+
+  for (uint64_t i = 0; i < header.capacity; ++i) {
+    if (entries[i].flags & DIRECTORY_ENTRY_USED)
+      directory_insert(dir, &entries[i]);
+  }
+
+  dir->clock = header.clock;
+
+  munmap(map, st.st_size);
+
+  return DIRECTORY_OPEN_OK;
+
+empty:
+  if (directory_init(dir, memory) != DIRECTORY_INIT_OK) {
+    return E(DIRECTORY_OPEN_ALLOC);
+  }
+
+  return DIRECTORY_OPEN_OK;
+}
+
+static int
+directory_write(int fd, void* p, size_t size)
+{
+  while (size > 0) {
+    ssize_t write_ret = write(fd, p, size);
+
+    if (write_ret == -1) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    p = (unsigned char*)p + write_ret;
+    size -= (size_t)write_ret;
+  }
+
+  return 0;
+}
+
+int
+directory_checkpoint(struct directory* dir, const char* path)
+{
+  char tmp_path[PATH_MAX];
+
+  if ((size_t)snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path) >=
+      sizeof tmp_path) {
+    return E(DIRECTORY_CHECKPOINT_OPEN);
+  }
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return E(DIRECTORY_CHECKPOINT_OPEN);
+  }
+
+  struct directory_file_header header;
+
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, DIRECTORY_FILE_MAGIC, sizeof header.magic);
+  header.version = DIRECTORY_FILE_VERSION;
+  header.byte_order = DIRECTORY_FILE_BYTE_ORDER;
+  header.entry_size = sizeof *dir->entries;
+  header.clock = dir->clock;
+  header.capacity = dir->capacity;
+  header.count = dir->count;
+
+  if (directory_write(fd, &header, sizeof header) != 0 ||
+      directory_write(
+        fd, dir->entries, dir->capacity * sizeof *dir->entries) != 0 ||
+      fsync(fd) == -1) {
+    close(fd);
+    unlink(tmp_path);
+    return E(DIRECTORY_CHECKPOINT_WRITE);
+  }
+
+  close(fd);
+
+  if (rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+    return E(DIRECTORY_CHECKPOINT_RENAME);
+  }
+
+  /* the rename itself must reach the disk for the checkpoint to survive */
+  char dir_path[PATH_MAX];
+  const char* slash = strrchr(path, '/');
+
+  if (slash == NULL) {
+    strcpy(dir_path, ".");
+  } else {
+    size_t size = slash == path ? 1 : (size_t)(slash - path);
+
+    memcpy(dir_path, path, size);
+    dir_path[size] = '\0';
+  }
+
+  int dir_fd = open(dir_path, O_RDONLY);
+  if (dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  return DIRECTORY_CHECKPOINT_OK;
+}
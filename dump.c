@@ -0,0 +1,167 @@
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+/*
+  Decode a trace file written by a node built with -DTRACE:
+
+    trace-dump FILE
+
+  Records of every thread are printed oldest first, one per line, with the
+  time in nanoseconds and the thread that wrote them. The file can be read
+  while the node runs, the latest record of a thread may then be torn.
+*/
+
+struct dump_record
+{
+  struct trace_record record;
+  unsigned int thread;
+
+  /* Position in the records of the thread */
+  unsigned long seq;
+};
+
+static int
+dump_compare(const void* a, const void* b)
+{
+  const struct dump_record* ra = a;
+  const struct dump_record* rb = b;
+
+  if (ra->record.time != rb->record.time)
+    return ra->record.time < rb->record.time ? -1 : 1;
+
+  if (ra->thread != rb->thread)
+    return ra->thread < rb->thread ? -1 : 1;
+
+  return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static void
+dump_print(struct dump_record* dump)
+{
+  struct trace_record* record = &dump->record;
+
+  printf("%llu %u conn %lu ",
+         (unsigned long long)record->time,
+         dump->thread,
+         (unsigned long)record->conn_id);
+
+  switch (record->event) {
+    case TRACE_ACCEPT:
+      printf("accept fd %lld flags 0x%llx",
+             (long long)record->a,
+             (unsigned long long)record->b);
+      break;
+    case TRACE_RECV:
+      printf("recv %lld buffered %llu",
+             (long long)record->a,
+             (unsigned long long)record->b);
+      break;
+    case TRACE_DECODE:
+      printf("decode type %hu tag 0x%llx size %llu",
+             record->type,
+             (unsigned long long)record->a,
+             (unsigned long long)record->b);
+      break;
+    case TRACE_DISPATCH:
+      printf("dispatch type %hu octets %llu ns %llu",
+             record->type,
+             (unsigned long long)record->a,
+             (unsigned long long)record->b);
+      break;
+    case TRACE_SEND:
+      printf("send %lld of %llu",
+             (long long)record->a,
+             (unsigned long long)record->b);
+      break;
+    case TRACE_CLOSE:
+      printf("close flags 0x%llx", (unsigned long long)record->a);
+      break;
+    default:
+      printf("event %hu type %hu a %llu b %llu",
+             record->event,
+             record->type,
+             (unsigned long long)record->a,
+             (unsigned long long)record->b);
+      break;
+  }
+
+  printf("\n");
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s FILE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE* f = fopen(argv[1], "rb");
+
+  if (f == NULL) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  struct trace_file* file = malloc(sizeof *file);
+
+  if (file == NULL || fread(file, sizeof *file, 1, f) != 1) {
+    fprintf(stderr, "%s: not a trace file\n", argv[1]);
+    free(file);
+    fclose(f);
+    return EXIT_FAILURE;
+  }
+
+  fclose(f);
+
+  if (memcmp(file->magic, TRACE_MAGIC, sizeof file->magic) != 0 ||
+      file->version != TRACE_VERSION || file->ring_size != TRACE_RING_SIZE ||
+      file->threads_max != TRACE_THREADS_MAX) {
+    fprintf(stderr, "%s: not a trace file of this version\n", argv[1]);
+    free(file);
+    return EXIT_FAILURE;
+  }
+
+  unsigned int threads = atomic_load(&file->threads);
+
+  if (threads > TRACE_THREADS_MAX)
+    threads = TRACE_THREADS_MAX;
+
+  struct dump_record* dumps =
+    calloc((size_t)threads * TRACE_RING_SIZE + 1, sizeof *dumps);
+  size_t count = 0;
+
+  if (dumps == NULL) {
+    free(file);
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned int i = 0; i < threads; ++i) {
+    struct trace_ring* ring = &file->rings[i];
+    unsigned long head = atomic_load(&ring->head);
+    unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (unsigned long j = first; j < head; ++j) {
+      dumps[count].record = ring->records[j & (TRACE_RING_SIZE - 1)];
+      dumps[count].thread = i;
+      dumps[count].seq = j;
+      ++count;
+    }
+  }
+
+  qsort(dumps, count, sizeof *dumps, dump_compare);
+
+  for (size_t i = 0; i < count; ++i)
+    dump_print(&dumps[i]);
+
+  free(dumps);
+  free(file);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1020 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unilink.h"
+
+/*
+  SHA-512 and Ed25519 signature verification (RFC 8032), without anything
+  secret so everything runs in variable time.
+
+  Field elements are five 51 bits limbs, points use extended coordinates.
+  Verification checks the cofactored equation [8]([s]B - R - [h]A) = 0, a
+  batch checks a random linear combination of the equations of its
+  signatures with a single multi-scalar multiplication, sharing doublings
+  between every signature.
+*/
+
+#ifndef __SIZEOF_INT128__
+#error "Implement for compilers without 128 bits integers"
+#endif
+
+typedef unsigned __int128 ed25519_u128;
+
+static const uint64_t sha512_k[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+  0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+  0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+  0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+  0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+  0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+  0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+  0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+  0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+  0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+  0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+  0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+  0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+  0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+  0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+  0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+  0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+  0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+  0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+  0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+  0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static uint64_t
+sha512_load(const unsigned char* p)
+{
+  uint64_t v = 0;
+
+  for (int i = 0; i < 8; ++i)
+    v = (v << 8) | p[i];
+
+  return v;
+}
+
+#define SHA512_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static void
+sha512_block(struct sha512* sha, const unsigned char* block)
+{
+  uint64_t w[80];
+
+  for (int i = 0; i < 16; ++i)
+    w[i] = sha512_load(block + i * 8);
+
+  for (int i = 16; i < 80; ++i) {
+    uint64_t s0 = SHA512_ROTR(w[i - 15], 1) ^ SHA512_ROTR(w[i - 15], 8) ^
+                  (w[i - 15] >> 7);
+    uint64_t s1 = SHA512_ROTR(w[i - 2], 19) ^ SHA512_ROTR(w[i - 2], 61) ^
+                  (w[i - 2] >> 6);
+
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint64_t a = sha->state[0];
+  uint64_t b = sha->state[1];
+  uint64_t c = sha->state[2];
+  uint64_t d = sha->state[3];
+  uint64_t e = sha->state[4];
+  uint64_t f = sha->state[5];
+  uint64_t g = sha->state[6];
+  uint64_t h = sha->state[7];
+
+  for (int i = 0; i < 80; ++i) {
+    uint64_t s1 =
+      SHA512_ROTR(e, 14) ^ SHA512_ROTR(e, 18) ^ SHA512_ROTR(e, 41);
+    uint64_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+    uint64_t s0 =
+      SHA512_ROTR(a, 28) ^ SHA512_ROTR(a, 34) ^ SHA512_ROTR(a, 39);
+    uint64_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  sha->state[0] += a;
+  sha->state[1] += b;
+  sha->state[2] += c;
+  sha->state[3] += d;
+  sha->state[4] += e;
+  sha->state[5] += f;
+  sha->state[6] += g;
+  sha->state[7] += h;
+}
+
+void
+sha512_init(struct sha512* sha)
+{
+  static const uint64_t iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+    0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+  };
+
+  memcpy(sha->state, iv, sizeof iv);
+  sha->size = 0;
+}
+
+void
+sha512_update(struct sha512* sha, const void* p, size_t size)
+{
+  const unsigned char* in = p;
+  size_t used = sha->size % sizeof sha->buf;
+
+  sha->size += size;
+
+  if (used > 0) {
+    size_t n = sizeof sha->buf - used;
+
+    if (n > size)
+      n = size;
+
+    memcpy(sha->buf + used, in, n);
+    in += n;
+    size -= n;
+
+    if (used + n < sizeof sha->buf)
+      return;
+
+    sha512_block(sha, sha->buf);
+  }
+
+  while (size >= sizeof sha->buf) {
+    sha512_block(sha, in);
+    in += sizeof sha->buf;
+    size -= sizeof sha->buf;
+  }
+
+  memcpy(sha->buf, in, size);
+}
+
+void
+sha512_final(struct sha512* sha, unsigned char* out)
+{
+  size_t used = sha->size % sizeof sha->buf;
+  uint64_t bits = sha->size * 8;
+
+  sha->buf[used++] = 0x80;
+
+  /* the length takes the last 16 octets of a block */
+  if (used > sizeof sha->buf - 16) {
+    memset(sha->buf + used, 0, sizeof sha->buf - used);
+    sha512_block(sha, sha->buf);
+    used = 0;
+  }
+
+  memset(sha->buf + used, 0, sizeof sha->buf - used);
+
+  for (int i = 0; i < 8; ++i)
+    sha->buf[sizeof sha->buf - 1 - i] = (bits >> (i * 8)) & 0xff;
+
+  sha512_block(sha, sha->buf);
+
+  for (int i = 0; i < 64; ++i)
+    out[i] = (sha->state[i / 8] >> (56 - (i % 8) * 8)) & 0xff;
+}
+
+/* Field elements modulo 2^255 - 19, limbs are kept below 2^52 between
+ * operations */
+typedef uint64_t fe[5];
+
+#define FE_MASK ((1ULL << 51) - 1)
+
+static void
+fe_carry(fe h)
+{
+  uint64_t c;
+
+  c = h[0] >> 51;
+  h[0] &= FE_MASK;
+  h[1] += c;
+  c = h[1] >> 51;
+  h[1] &= FE_MASK;
+  h[2] += c;
+  c = h[2] >> 51;
+  h[2] &= FE_MASK;
+  h[3] += c;
+  c = h[3] >> 51;
+  h[3] &= FE_MASK;
+  h[4] += c;
+  c = h[4] >> 51;
+  h[4] &= FE_MASK;
+  h[0] += 19 * c;
+}
+
+static void
+fe_small(fe h, uint64_t v)
+{
+  h[0] = v;
+  h[1] = h[2] = h[3] = h[4] = 0;
+}
+
+static void
+fe_add(fe h, const fe f, const fe g)
+{
+  for (int i = 0; i < 5; ++i)
+    h[i] = f[i] + g[i];
+
+  fe_carry(h);
+}
+
+static void
+fe_sub(fe h, const fe f, const fe g)
+{
+  /* add 4p so that limbs don't go negative */
+  h[0] = f[0] + 0x1fffffffffffb4ULL - g[0];
+
+  for (int i = 1; i < 5; ++i)
+    h[i] = f[i] + 0x1ffffffffffffcULL - g[i];
+
+  fe_carry(h);
+}
+
+static void
+fe_neg(fe h, const fe f)
+{
+  fe zero;
+
+  fe_small(zero, 0);
+  fe_sub(h, zero, f);
+}
+
+static void
+fe_mul(fe h, const fe f, const fe g)
+{
+  uint64_t g1 = 19 * g[1];
+  uint64_t g2 = 19 * g[2];
+  uint64_t g3 = 19 * g[3];
+  uint64_t g4 = 19 * g[4];
+
+  ed25519_u128 t0 = (ed25519_u128)f[0] * g[0] + (ed25519_u128)f[1] * g4 +
+                    (ed25519_u128)f[2] * g3 + (ed25519_u128)f[3] * g2 +
+                    (ed25519_u128)f[4] * g1;
+  ed25519_u128 t1 = (ed25519_u128)f[0] * g[1] + (ed25519_u128)f[1] * g[0] +
+                    (ed25519_u128)f[2] * g4 + (ed25519_u128)f[3] * g3 +
+                    (ed25519_u128)f[4] * g2;
+  ed25519_u128 t2 = (ed25519_u128)f[0] * g[2] + (ed25519_u128)f[1] * g[1] +
+                    (ed25519_u128)f[2] * g[0] + (ed25519_u128)f[3] * g4 +
+                    (ed25519_u128)f[4] * g3;
+  ed25519_u128 t3 = (ed25519_u128)f[0] * g[3] + (ed25519_u128)f[1] * g[2] +
+                    (ed25519_u128)f[2] * g[1] + (ed25519_u128)f[3] * g[0] +
+                    (ed25519_u128)f[4] * g4;
+  ed25519_u128 t4 = (ed25519_u128)f[0] * g[4] + (ed25519_u128)f[1] * g[3] +
+                    (ed25519_u128)f[2] * g[2] + (ed25519_u128)f[3] * g[1] +
+                    (ed25519_u128)f[4] * g[0];
+
+  t1 += (uint64_t)(t0 >> 51);
+  h[0] = (uint64_t)t0 & FE_MASK;
+  t2 += (uint64_t)(t1 >> 51);
+  h[1] = (uint64_t)t1 & FE_MASK;
+  t3 += (uint64_t)(t2 >> 51);
+  h[2] = (uint64_t)t2 & FE_MASK;
+  t4 += (uint64_t)(t3 >> 51);
+  h[3] = (uint64_t)t3 & FE_MASK;
+  h[4] = (uint64_t)t4 & FE_MASK;
+  h[0] += 19 * (uint64_t)(t4 >> 51);
+  h[1] += h[0] >> 51;
+  h[0] &= FE_MASK;
+}
+
+static void
+fe_sq(fe h, const fe f)
+{
+  fe_mul(h, f, f);
+}
+
+/* h = f^(2^n) */
+static void
+fe_sqn(fe h, const fe f, int n)
+{
+  fe_sq(h, f);
+
+  while (--n > 0)
+    fe_sq(h, h);
+}
+
+static void
+fe_frombytes(fe h, const unsigned char* s)
+{
+  uint64_t x[4];
+
+  for (int i = 0; i < 4; ++i) {
+    x[i] = 0;
+
+    for (int j = 7; j >= 0; --j)
+      x[i] = (x[i] << 8) | s[i * 8 + j];
+  }
+
+  h[0] = x[0] & FE_MASK;
+  h[1] = ((x[0] >> 51) | (x[1] << 13)) & FE_MASK;
+  h[2] = ((x[1] >> 38) | (x[2] << 26)) & FE_MASK;
+  h[3] = ((x[2] >> 25) | (x[3] << 39)) & FE_MASK;
+  h[4] = (x[3] >> 12) & FE_MASK;
+}
+
+/* Canonical encoding, fully reduced */
+static void
+fe_tobytes(unsigned char* s, const fe f)
+{
+  fe t;
+
+  memcpy(t, f, sizeof t);
+  fe_carry(t);
+  fe_carry(t);
+
+  /* q is 1 when t is at least p, subtracting p is adding 19 and dropping
+   * bit 255 */
+  uint64_t q = (t[0] + 19) >> 51;
+
+  q = (t[1] + q) >> 51;
+  q = (t[2] + q) >> 51;
+  q = (t[3] + q) >> 51;
+  q = (t[4] + q) >> 51;
+
+  t[0] += 19 * q;
+  t[1] += t[0] >> 51;
+  t[0] &= FE_MASK;
+  t[2] += t[1] >> 51;
+  t[1] &= FE_MASK;
+  t[3] += t[2] >> 51;
+  t[2] &= FE_MASK;
+  t[4] += t[3] >> 51;
+  t[3] &= FE_MASK;
+  t[4] &= FE_MASK;
+
+  uint64_t x[4] = {
+    t[0] | (t[1] << 51),
+    (t[1] >> 13) | (t[2] << 38),
+    (t[2] >> 26) | (t[3] << 25),
+    (t[3] >> 39) | (t[4] << 12),
+  };
+
+  for (int i = 0; i < 32; ++i)
+    s[i] = (x[i / 8] >> ((i % 8) * 8)) & 0xff;
+}
+
+static int
+fe_iszero(const fe f)
+{
+  unsigned char s[32];
+  unsigned char bits = 0;
+
+  fe_tobytes(s, f);
+
+  for (int i = 0; i < 32; ++i)
+    bits |= s[i];
+
+  return bits == 0;
+}
+
+static int
+fe_isnegative(const fe f)
+{
+  unsigned char s[32];
+
+  fe_tobytes(s, f);
+
+  return s[0] & 1;
+}
+
+/* h = f^((p - 5) / 8) = f^(2^252 - 3) */
+static void
+fe_pow22523(fe h, const fe f)
+{
+  fe t0;
+  fe t1;
+  fe t2;
+
+  fe_sq(t0, f);
+  fe_sqn(t1, t0, 2);
+  fe_mul(t1, f, t1);
+  fe_mul(t0, t0, t1);
+  fe_sq(t0, t0);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 5);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 10);
+  fe_mul(t1, t1, t0);
+  fe_sqn(t2, t1, 20);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t1, t1, 10);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t1, t0, 50);
+  fe_mul(t1, t1, t0);
+  fe_sqn(t2, t1, 100);
+  fe_mul(t1, t2, t1);
+  fe_sqn(t1, t1, 50);
+  fe_mul(t0, t1, t0);
+  fe_sqn(t0, t0, 2);
+  fe_mul(h, t0, f);
+}
+
+/* h = 1 / f = f^(p - 2) = (f^(2^252 - 3))^8 * f^3 */
+static void
+fe_invert(fe h, const fe f)
+{
+  fe t;
+  fe f3;
+
+  fe_pow22523(t, f);
+  fe_sqn(t, t, 3);
+  fe_sq(f3, f);
+  fe_mul(f3, f3, f);
+  fe_mul(h, t, f3);
+}
+
+/* Points in extended coordinates, x = X / Z, y = Y / Z, x * y = T / Z */
+struct ge
+{
+  fe X;
+  fe Y;
+  fe Z;
+  fe T;
+};
+
+/* Point prepared to be added */
+struct ge_cached
+{
+  fe YplusX;
+  fe YminusX;
+  fe Z2;
+  fe T2d;
+};
+
+static fe ed25519_d;
+static fe ed25519_d2;
+static fe ed25519_sqrtm1;
+
+/* Odd multiples of the base point, B to 15B */
+static struct ge_cached ed25519_base[8];
+
+/* Makes the coefficients of batches unpredictable, 0 if there is none */
+static unsigned char ed25519_secret[32];
+static int ed25519_batch;
+
+static void
+ge_identity(struct ge* h)
+{
+  fe_small(h->X, 0);
+  fe_small(h->Y, 1);
+  fe_small(h->Z, 1);
+  fe_small(h->T, 0);
+}
+
+static void
+ge_cache(struct ge_cached* c, const struct ge* p)
+{
+  fe_add(c->YplusX, p->Y, p->X);
+  fe_sub(c->YminusX, p->Y, p->X);
+  fe_add(c->Z2, p->Z, p->Z);
+  fe_mul(c->T2d, p->T, ed25519_d2);
+}
+
+/* r = p + q, or p - q when subtract is set */
+static void
+ge_add(struct ge* r,
+       const struct ge* p,
+       const struct ge_cached* q,
+       int subtract)
+{
+  fe a;
+  fe b;
+  fe c;
+  fe d;
+  fe e;
+  fe f;
+  fe g;
+  fe h;
+
+  fe_sub(a, p->Y, p->X);
+  fe_mul(a, a, subtract ? q->YplusX : q->YminusX);
+  fe_add(b, p->Y, p->X);
+  fe_mul(b, b, subtract ? q->YminusX : q->YplusX);
+  fe_mul(c, p->T, q->T2d);
+  fe_mul(d, p->Z, q->Z2);
+
+  fe_sub(e, b, a);
+  fe_add(h, b, a);
+
+  if (subtract) {
+    fe_add(f, d, c);
+    fe_sub(g, d, c);
+  } else {
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+  }
+
+  fe_mul(r->X, e, f);
+  fe_mul(r->Y, g, h);
+  fe_mul(r->T, e, h);
+  fe_mul(r->Z, f, g);
+}
+
+static void
+ge_double(struct ge* r, const struct ge* p)
+{
+  fe a;
+  fe b;
+  fe c;
+  fe d;
+  fe e;
+  fe f;
+  fe g;
+  fe h;
+
+  fe_sq(a, p->X);
+  fe_sq(b, p->Y);
+  fe_sq(c, p->Z);
+  fe_add(c, c, c);
+  fe_neg(d, a);
+
+  fe_add(e, p->X, p->Y);
+  fe_sq(e, e);
+  fe_sub(e, e, a);
+  fe_sub(e, e, b);
+  fe_add(g, d, b);
+  fe_sub(f, g, c);
+  fe_sub(h, d, b);
+
+  fe_mul(r->X, e, f);
+  fe_mul(r->Y, g, h);
+  fe_mul(r->T, e, h);
+  fe_mul(r->Z, f, g);
+}
+
+/* Decode a point, negated when negate is set. Returns -1 for encodings that
+ * are not canonical or not on the curve. */
+static int
+ge_frombytes(struct ge* h, const unsigned char* s, int negate)
+{
+  unsigned char check[32];
+
+  fe_frombytes(h->Y, s);
+
+  /* y must be below p */
+  fe_tobytes(check, h->Y);
+  check[31] |= s[31] & 0x80;
+
+  if (memcmp(check, s, sizeof check) != 0)
+    return -1;
+
+  fe u;
+  fe v;
+  fe v3;
+  fe vxx;
+
+  /* x^2 = (y^2 - 1) / (d y^2 + 1) = u / v */
+  fe_small(h->Z, 1);
+  fe_sq(u, h->Y);
+  fe_mul(v, u, ed25519_d);
+  fe_sub(u, u, h->Z);
+  fe_add(v, v, h->Z);
+
+  /* x = u v^3 (u v^7)^((p - 5) / 8) */
+  fe_sq(v3, v);
+  fe_mul(v3, v3, v);
+  fe_sq(h->X, v3);
+  fe_mul(h->X, h->X, v);
+  fe_mul(h->X, h->X, u);
+  fe_pow22523(h->X, h->X);
+  fe_mul(h->X, h->X, v3);
+  fe_mul(h->X, h->X, u);
+
+  fe_sq(vxx, h->X);
+  fe_mul(vxx, vxx, v);
+
+  fe t;
+
+  fe_sub(t, vxx, u);
+
+  if (!fe_iszero(t)) {
+    fe_add(t, vxx, u);
+
+    if (!fe_iszero(t))
+      return -1;
+
+    fe_mul(h->X, h->X, ed25519_sqrtm1);
+  }
+
+  int sign = s[31] >> 7;
+
+  if (sign && fe_iszero(h->X))
+    return -1;
+
+  if (fe_isnegative(h->X) != (sign ^ (negate != 0)))
+    fe_neg(h->X, h->X);
+
+  fe_mul(h->T, h->X, h->Y);
+
+  return 0;
+}
+
+/* Odd multiples of a point, p to 15p */
+static void
+ge_table(struct ge_cached* table, const struct ge* p)
+{
+  struct ge p2;
+  struct ge q;
+  struct ge_cached c2;
+
+  ge_double(&p2, p);
+  ge_cache(&c2, &p2);
+  ge_cache(&table[0], p);
+
+  q = *p;
+
+  for (int i = 1; i < 8; ++i) {
+    ge_add(&q, &q, &c2, 0);
+    ge_cache(&table[i], &q);
+  }
+}
+
+static int
+ge_isidentity(const struct ge* p)
+{
+  fe t;
+
+  fe_sub(t, p->Y, p->Z);
+
+  return fe_iszero(p->X) && fe_iszero(t);
+}
+
+/* Order of the base point, little-endian */
+static const unsigned char ed25519_l[32] = {
+  0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7,
+  0xa2, 0xde, 0xf9, 0xde, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+};
+
+/* Reduce x modulo l into 32 octets. x holds 64 octet sized limbs of any
+ * non-negative value below 2^512, it is clobbered. */
+static void
+sc_reduce(unsigned char* r, int64_t* x)
+{
+  int64_t carry;
+
+  for (int i = 0; i < 63; ++i) {
+    x[i + 1] += x[i] >> 8;
+    x[i] &= 0xff;
+  }
+
+  /* 2^256 = 16 * 2^252 = -16 * (l - 2^252) modulo l */
+  for (int i = 63; i >= 32; --i) {
+    int j;
+
+    carry = 0;
+
+    for (j = i - 32; j < i - 12; ++j) {
+      x[j] += carry - 16 * x[i] * ed25519_l[j - (i - 32)];
+      carry = (x[j] + 128) >> 8;
+      x[j] -= carry * 256;
+    }
+
+    x[j] += carry;
+    x[i] = 0;
+  }
+
+  carry = 0;
+
+  for (int j = 0; j < 32; ++j) {
+    x[j] += carry - (x[31] >> 4) * ed25519_l[j];
+    carry = x[j] >> 8;
+    x[j] &= 0xff;
+  }
+
+  for (int j = 0; j < 32; ++j)
+    x[j] -= carry * ed25519_l[j];
+
+  for (int i = 0; i < 32; ++i) {
+    x[i + 1] += x[i] >> 8;
+    r[i] = x[i] & 0xff;
+  }
+}
+
+/* x += a * b, a and b of 32 octets */
+static void
+sc_muladd(int64_t* x, const unsigned char* a, const unsigned char* b)
+{
+  for (int i = 0; i < 32; ++i)
+    for (int j = 0; j < 32; ++j)
+      x[i + j] += (int64_t)a[i] * b[j];
+}
+
+/* Whether s is below l, as signatures must */
+static int
+sc_canonical(const unsigned char* s)
+{
+  for (int i = 31; i >= 0; --i) {
+    if (s[i] != ed25519_l[i])
+      return s[i] < ed25519_l[i];
+  }
+
+  return 0;
+}
+
+/* Signed sliding window of a scalar, odd digits from -15 to 15 */
+static void
+sc_slide(signed char* r, const unsigned char* a)
+{
+  for (int i = 0; i < 256; ++i)
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+
+  for (int i = 0; i < 256; ++i) {
+    if (!r[i])
+      continue;
+
+    for (int b = 1; b <= 6 && i + b < 256; ++b) {
+      if (!r[i + b])
+        continue;
+
+      if (r[i] + (r[i + b] << b) <= 15) {
+        r[i] += r[i + b] << b;
+        r[i + b] = 0;
+      } else if (r[i] - (r[i + b] << b) >= -15) {
+        r[i] -= r[i + b] << b;
+
+        for (int k = i + b; k < 256; ++k) {
+          if (!r[k]) {
+            r[k] = 1;
+            break;
+          }
+
+          r[k] = 0;
+        }
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+void
+ed25519_init(void)
+{
+  fe t;
+
+  /* d = -121665 / 121666 */
+  fe_small(t, 121666);
+  fe_invert(t, t);
+  fe_small(ed25519_d, 121665);
+  fe_mul(ed25519_d, ed25519_d, t);
+  fe_neg(ed25519_d, ed25519_d);
+  fe_add(ed25519_d2, ed25519_d, ed25519_d);
+
+  /* sqrt(-1) = 2^((p - 1) / 4) = (2^(2^252 - 3))^2 * 2 */
+  fe_small(t, 2);
+  fe_pow22523(ed25519_sqrtm1, t);
+  fe_sq(ed25519_sqrtm1, ed25519_sqrtm1);
+  fe_mul(ed25519_sqrtm1, ed25519_sqrtm1, t);
+
+  /* the base point has y = 4 / 5 and a positive x */
+  unsigned char b[32];
+  struct ge base;
+
+  memset(b, 0x66, sizeof b);
+  b[0] = 0x58;
+
+  ge_frombytes(&base, b, 0);
+  ge_table(ed25519_base, &base);
+
+  FILE* f = fopen("/dev/urandom", "rb");
+
+  if (f) {
+    ed25519_batch =
+      fread(ed25519_secret, sizeof ed25519_secret, 1, f) == 1;
+    fclose(f);
+  }
+}
+
+/* Everything needed for the equation of a signature, with its coefficient z:
+ * [z s]B - [z]R - [z h]A */
+struct ed25519_term
+{
+  struct ed25519_item* item;
+
+  /* -A and -R */
+  struct ge A;
+  struct ge R;
+
+  unsigned char h[32];
+  unsigned char z[32];
+  unsigned char zh[32];
+
+  struct ge_cached table_A[8];
+  struct ge_cached table_R[8];
+  signed char slide_A[256];
+  signed char slide_R[256];
+};
+
+/* Decode a signature and compute h, -1 if it can't be valid */
+static int
+ed25519_term(struct ed25519_term* term, struct ed25519_item* item)
+{
+  term->item = item;
+
+  if (!sc_canonical(item->signature + 32) ||
+      ge_frombytes(&term->A, item->public_key, 1) != 0 ||
+      ge_frombytes(&term->R, item->signature, 1) != 0)
+    return -1;
+
+  struct sha512 sha;
+  unsigned char digest[64];
+  int64_t x[64];
+
+  sha512_init(&sha);
+  sha512_update(&sha, item->signature, 32);
+  sha512_update(&sha, item->public_key, 32);
+  sha512_update(&sha, item->message, item->message_size);
+  sha512_final(&sha, digest);
+
+  for (int i = 0; i < 64; ++i)
+    x[i] = digest[i];
+
+  sc_reduce(term->h, x);
+
+  return 0;
+}
+
+/* Whether the sum of the equations of the terms, with their coefficients, is
+ * the identity. s is the scalar of B. */
+static int
+ed25519_check(struct ed25519_term* terms, size_t count, unsigned char* s)
+{
+  signed char slide_B[256];
+
+  sc_slide(slide_B, s);
+
+  for (size_t i = 0; i < count; ++i) {
+    ge_table(terms[i].table_A, &terms[i].A);
+    ge_table(terms[i].table_R, &terms[i].R);
+    sc_slide(terms[i].slide_A, terms[i].zh);
+    sc_slide(terms[i].slide_R, terms[i].z);
+  }
+
+  /* Straus: every multiplication shares the same doublings */
+  struct ge q;
+
+  ge_identity(&q);
+
+  for (int bit = 255; bit >= 0; --bit) {
+    ge_double(&q, &q);
+
+    if (slide_B[bit] != 0)
+      ge_add(&q,
+             &q,
+             &ed25519_base[abs(slide_B[bit]) / 2],
+             slide_B[bit] < 0);
+
+    for (size_t i = 0; i < count; ++i) {
+      signed char a = terms[i].slide_A[bit];
+      signed char r = terms[i].slide_R[bit];
+
+      if (a != 0)
+        ge_add(&q, &q, &terms[i].table_A[abs(a) / 2], a < 0);
+
+      if (r != 0)
+        ge_add(&q, &q, &terms[i].table_R[abs(r) / 2], r < 0);
+    }
+  }
+
+  /* clear the small order components */
+  ge_double(&q, &q);
+  ge_double(&q, &q);
+  ge_double(&q, &q);
+
+  return ge_isidentity(&q);
+}
+
+/* Verify a single decoded signature, z = 1 */
+static int
+ed25519_check_one(struct ed25519_term* term)
+{
+  memset(term->z, 0, sizeof term->z);
+  term->z[0] = 1;
+  memcpy(term->zh, term->h, sizeof term->zh);
+
+  unsigned char s[32];
+
+  memcpy(s, term->item->signature + 32, sizeof s);
+
+  return ed25519_check(term, 1, s);
+}
+
+int
+ed25519_verify(const unsigned char* public_key,
+               const unsigned char* signature,
+               const unsigned char* message,
+               size_t message_size)
+{
+  struct ed25519_item item = { public_key, signature, message, message_size,
+                               0 };
+
+  ed25519_verify_batch(&item, 1);
+
+  return item.valid;
+}
+
+void
+ed25519_verify_batch(struct ed25519_item* items, size_t count)
+{
+  struct ed25519_term* terms = malloc(count * sizeof *terms);
+  size_t n = 0;
+
+  if (terms == NULL) {
+    /* verify one at a time, without allocating */
+    struct ed25519_term term;
+
+    for (size_t i = 0; i < count; ++i)
+      items[i].valid = ed25519_term(&term, &items[i]) == 0 &&
+                       ed25519_check_one(&term);
+
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    items[i].valid = 0;
+
+    if (ed25519_term(&terms[n], &items[i]) == 0)
+      ++n;
+  }
+
+  if (n == 1 || (n > 1 && !ed25519_batch)) {
+    for (size_t i = 0; i < n; ++i)
+      terms[i].item->valid = ed25519_check_one(&terms[i]);
+  } else if (n > 1) {
+    /* z are 128 bits numbers derived from the signatures and a secret, an
+     * invalid signature can't be made to cancel out another */
+    int64_t s[64];
+
+    memset(s, 0, sizeof s);
+
+    for (size_t i = 0; i < n; ++i) {
+      struct ed25519_item* item = terms[i].item;
+      struct sha512 sha;
+      unsigned char digest[64];
+      int64_t x[64];
+
+      sha512_init(&sha);
+      sha512_update(&sha, ed25519_secret, sizeof ed25519_secret);
+      sha512_update(&sha, item->signature, 64);
+      sha512_update(&sha, item->public_key, 32);
+      sha512_update(&sha, terms[i].h, sizeof terms[i].h);
+      sha512_final(&sha, digest);
+
+      memset(terms[i].z, 0, sizeof terms[i].z);
+      memcpy(terms[i].z, digest, 16);
+      terms[i].z[0] |= 1;
+
+      memset(x, 0, sizeof x);
+      sc_muladd(x, terms[i].z, terms[i].h);
+      sc_reduce(terms[i].zh, x);
+
+      sc_muladd(s, terms[i].z, item->signature + 32);
+    }
+
+    unsigned char sum[32];
+
+    sc_reduce(sum, s);
+
+    if (ed25519_check(terms, n, sum)) {
+      for (size_t i = 0; i < n; ++i)
+        terms[i].item->valid = 1;
+    } else {
+      /* find out which ones are invalid */
+      for (size_t i = 0; i < n; ++i)
+        terms[i].item->valid = ed25519_check_one(&terms[i]);
+    }
+  }
+
+  free(terms);
+}
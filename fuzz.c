@@ -0,0 +1,205 @@
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "unilink.h"
+
+/*
+  Fuzzing harness for the decoders and the command receive path.
+
+  libFuzzer:
+    make fuzz CC=clang CFLAGS='-g -O1 -fsanitize=fuzzer,address
+      -DFUZZ_LIBFUZZER'
+
+  AFL, the corpus written by bench -w can be used as seeds:
+    make fuzz CC=afl-gcc
+    afl-fuzz -i seeds -o findings ./fuzz @@
+
+  Without libFuzzer, fuzz runs every file given as argument, or standard input
+  when the argument is -. Without arguments, it runs every prefix of every
+  frame of a generated corpus, which makes a quick regression check.
+*/
+
+static int
+fuzz_stream(struct command_frame* frame, void** p)
+{
+  (void)p;
+
+  /* touch every octet so that sanitizers see out of bounds chunks */
+  unsigned char sum = 0;
+
+  for (size_t i = 0; i < frame->size; ++i)
+    sum ^= frame->data[i];
+
+  if (frame->offset + frame->size > frame->header.size)
+    abort();
+
+  return sum == 0xff;
+}
+
+static int
+fuzz_announce(struct command_frame* frame, void** p)
+{
+  (void)p;
+
+  struct announce_view announce;
+  struct address_block_iterator it;
+  struct address_block block;
+  unsigned char* end = frame->data + frame->size;
+
+  if (decode_announce(frame->data, frame->size, &announce) !=
+      DECODE_ANNOUNCE_OK)
+    return -1;
+
+  if (announce.public_key + announce.public_key_size > end ||
+      announce.signature + announce.signature_size > end ||
+      announce.master_signature + announce.master_signature_size > end)
+    abort();
+
+  announce_address_blocks(&announce, &it);
+
+  while (address_block_next(&it, &block)) {
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+
+    if (block.data + block.size > end)
+      abort();
+
+    address_block_sockaddr(&block, &sa, &sa_len);
+  }
+
+  return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  static struct command_context cctx;
+  static struct net_context ctx;
+  static struct command_handler stream_handler;
+  static struct command_handler announce_handler;
+
+  if (stream_handler.fn == NULL) {
+    cctx.max_frame_size = COMMAND_MAX_FRAME_SIZE;
+
+    stream_handler.type_max = COMMAND_PING;
+    stream_handler.version_max = 0xffff;
+    stream_handler.flags = COMMAND_HANDLER_STREAM;
+    stream_handler.fn = fuzz_stream;
+
+    announce_handler.type_min = COMMAND_ANNOUNCE;
+    announce_handler.type_max = COMMAND_ANNOUNCE;
+    announce_handler.version_max = 0xffff;
+    announce_handler.fn = fuzz_announce;
+
+    command_register(&cctx, &stream_handler);
+    command_register(&cctx, &announce_handler);
+  }
+
+  /* an exactly sized copy lets sanitizers catch reads past the input */
+  struct net_tcp_conn tcp_conn;
+
+  memset(&tcp_conn, 0, sizeof tcp_conn);
+  tcp_conn.fd = -1;
+  tcp_conn.ctx = &ctx;
+
+  if (mem_grow_buf(&tcp_conn.receive_buf, (void*)data, size) !=
+      MEM_GROW_BUF_OK)
+    return 0;
+
+  struct command_header header;
+
+  if (decode_header(tcp_conn.receive_buf.p, size, &header) ==
+      DECODE_HEADER_OK) {
+    struct announce_view announce;
+    size_t payload_size = size - COMMAND_HEADER_SIZE;
+
+    if (payload_size > header.size)
+      payload_size = header.size;
+
+    decode_announce((unsigned char*)tcp_conn.receive_buf.p +
+                      COMMAND_HEADER_SIZE,
+                    payload_size,
+                    &announce);
+  }
+
+  struct net_event_data_received received;
+  void* p = &cctx;
+
+  received.flags = 0;
+  received.count = size;
+  received.tcp_conn = &tcp_conn;
+
+  net_cb_command_received(NET_EVENT_RECEIVED, &received, &p);
+
+  mem_free_buf(&tcp_conn.receive_buf);
+  mem_free_buf(&tcp_conn.send_buf);
+
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static int
+fuzz_file(FILE* f)
+{
+  struct mem_buf m = { 0 };
+  unsigned char chunk[4096];
+  size_t n;
+
+  while ((n = fread(chunk, 1, sizeof chunk, f)) > 0) {
+    if (mem_grow_buf(&m, chunk, n) != MEM_GROW_BUF_OK) {
+      mem_free_buf(&m);
+      return -1;
+    }
+  }
+
+  LLVMFuzzerTestOneInput(m.p, m.size);
+  mem_free_buf(&m);
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      FILE* f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+
+      if (f == NULL) {
+        perror(argv[i]);
+        return EXIT_FAILURE;
+      }
+
+      fuzz_file(f);
+
+      if (f != stdin)
+        fclose(f);
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  struct corpus corpus;
+
+  if (corpus_generate(&corpus, 1024, 1) != CORPUS_GENERATE_OK)
+    return EXIT_FAILURE;
+
+  for (size_t i = 0; i < corpus.count; ++i) {
+    for (size_t size = 0; size <= corpus.frames[i].size; ++size) {
+      LLVMFuzzerTestOneInput(
+        (unsigned char*)corpus.buf.p + corpus.frames[i].offset, size);
+    }
+  }
+
+  printf("%zu frames\n", corpus.count);
+
+  corpus_free(&corpus);
+
+  return EXIT_SUCCESS;
+}
+#endif
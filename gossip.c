@@ -0,0 +1,398 @@
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+void
+gossip_init(struct gossip* gossip, struct net_context* ctx)
+{
+  memset(gossip, 0, sizeof *gossip);
+
+  gossip->ctx = ctx;
+  gossip->filter_since = ctx->now;
+  gossip->next_round = ctx->now;
+
+  STAILQ_INIT(&gossip->pending);
+  STAILQ_INIT(&gossip->repairs);
+
+  gossip->callback.events =
+    NET_EVENT_CLOSED | NET_EVENT_TICK | NET_EVENT_MEMORY;
+  gossip->callback.p = gossip;
+  gossip->callback.cb = net_cb_gossip;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &gossip->callback, entry);
+}
+
+/* Octets a pending announce takes, its encoding being its own until it is
+ * queued on connections */
+static size_t
+gossip_pending_memory(struct gossip_pending* pending)
+{
+  return sizeof *pending + sizeof *pending->shared + pending->shared->size;
+}
+
+static void
+gossip_pending_free(struct gossip* gossip, struct gossip_pending* pending)
+{
+  --gossip->pending_count;
+  gossip->memory -= gossip_pending_memory(pending);
+  mem_shared_unref(pending->shared);
+  free(pending);
+}
+
+static void
+gossip_pendings_free(struct gossip* gossip, struct gossip_pendings* pendings)
+{
+  while (!STAILQ_EMPTY(pendings)) {
+    struct gossip_pending* pending = STAILQ_FIRST(pendings);
+
+    STAILQ_REMOVE_HEAD(pendings, entry);
+    gossip_pending_free(gossip, pending);
+  }
+}
+
+void
+gossip_free(struct gossip* gossip)
+{
+  LIST_REMOVE(&gossip->callback, entry);
+
+  gossip_pendings_free(gossip, &gossip->pending);
+  gossip_pendings_free(gossip, &gossip->repairs);
+}
+
+/* FNV-1a, 64 bits */
+static uint64_t
+gossip_hash_octets(uint64_t hash, const unsigned char* p, size_t size)
+{
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/* Hash of everything an announce is encoded from, which is the hash of its
+ * encoding without having to encode it */
+static uint64_t
+gossip_hash(struct announce_view* announce)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  unsigned char head[] = { announce->role,
+                           announce->address_block_count,
+                           announce->public_key_type,
+                           announce->master_signature_type };
+
+  struct address_block_iterator it;
+  struct address_block block;
+
+  hash = gossip_hash_octets(hash, head, sizeof head);
+
+  announce_address_blocks(announce, &it);
+
+  while (address_block_next(&it, &block)) {
+    hash = gossip_hash_octets(hash, &block.family, sizeof block.family);
+    hash = gossip_hash_octets(hash, block.data, block.size);
+  }
+
+  hash = gossip_hash_octets(
+    hash, announce->public_key, announce->public_key_size);
+  hash =
+    gossip_hash_octets(hash, announce->signature, announce->signature_size);
+  hash = gossip_hash_octets(
+    hash, announce->master_signature, announce->master_signature_size);
+
+  return hash;
+}
+
+/* Bits of a filter an announce sets, by double hashing */
+static size_t
+gossip_bit(uint64_t hash, size_t i)
+{
+  uint64_t h1 = hash & 0xffffffffULL;
+  uint64_t h2 = (hash >> 32) | 1;
+
+  return (size_t)((h1 + i * h2) % GOSSIP_FILTER_BITS);
+}
+
+static int
+gossip_filter_has(unsigned char* filter, uint64_t hash)
+{
+  for (size_t i = 0; i < GOSSIP_FILTER_HASHES; ++i) {
+    size_t bit = gossip_bit(hash, i);
+
+    if (!(filter[bit / 8] & (1 << (bit % 8))))
+      return 0;
+  }
+
+  return 1;
+}
+
+static void
+gossip_filter_add(struct gossip* gossip, uint64_t hash)
+{
+  unsigned long now = gossip->ctx->now;
+
+  /* start over in the older filter, what the newer one holds is still
+   * remembered until the next rotation */
+  if (gossip->filter_count >= GOSSIP_FILTER_ANNOUNCES ||
+      now - gossip->filter_since >= GOSSIP_FILTER_PERIOD) {
+    gossip->filter ^= 1;
+    gossip->filter_count = 0;
+    gossip->filter_since = now;
+
+    memset(gossip->filters[gossip->filter],
+           0,
+           sizeof gossip->filters[gossip->filter]);
+  }
+
+  for (size_t i = 0; i < GOSSIP_FILTER_HASHES; ++i) {
+    size_t bit = gossip_bit(hash, i);
+
+    gossip->filters[gossip->filter][bit / 8] |= 1 << (bit % 8);
+  }
+
+  ++gossip->filter_count;
+}
+
+int
+gossip_announce(struct gossip* gossip,
+                struct announce_view* announce,
+                struct net_tcp_conn* from)
+{
+  uint64_t hash = gossip_hash(announce);
+
+  if (gossip_filter_has(gossip->filters[0], hash) ||
+      gossip_filter_has(gossip->filters[1], hash)) {
+    ++gossip->duplicates;
+    return E(GOSSIP_ANNOUNCE_DUPLICATE);
+  }
+
+  /* not remembered, a later copy gets another chance */
+  if (gossip->pending_count >= GOSSIP_PENDING_MAX) {
+    ++gossip->dropped;
+    return E(GOSSIP_ANNOUNCE_FULL);
+  }
+
+  struct gossip_pending* pending = malloc(sizeof *pending);
+
+  if (pending == NULL)
+    return E(GOSSIP_ANNOUNCE_ALLOC);
+
+  size_t size = announce_size(announce);
+
+  pending->shared = mem_shared_alloc(COMMAND_HEADER_SIZE + size);
+
+  if (pending->shared == NULL) {
+    free(pending);
+    return E(GOSSIP_ANNOUNCE_ALLOC);
+  }
+
+  struct command_header header = {
+    .flags = COMMAND_HEADER_IS_REQUEST,
+    .type = COMMAND_ANNOUNCE,
+    .size = size,
+  };
+
+  codec_encode_command_header(pending->shared->data, &header);
+  encode_announce(announce, pending->shared->data + COMMAND_HEADER_SIZE);
+
+  pending->from = from;
+  pending->sent_count = 0;
+
+  STAILQ_INSERT_TAIL(&gossip->pending, pending, entry);
+  ++gossip->pending_count;
+  gossip->memory += gossip_pending_memory(pending);
+
+  gossip_filter_add(gossip, hash);
+
+  net_context_wake_at(gossip->ctx, gossip->next_round);
+
+  return GOSSIP_ANNOUNCE_OK;
+}
+
+/* Whether an announce can be queued on a connection */
+static int
+gossip_target(struct net_tcp_conn* tcp_conn, struct net_tcp_conn* from)
+{
+  /* announces are for peers, not for local clients, and follow ours so
+   * that the peer does not take them for our own */
+  return tcp_conn != from && (tcp_conn->flags & NET_TCP_CONN_ANNOUNCE_SENT) &&
+         !(tcp_conn->flags & (NET_TCP_CONN_CLOSING | NET_TCP_CONN_UNIX)) &&
+         tcp_conn->send_partial == 0 &&
+         tcp_conn->send_buf.size + tcp_conn->send_queued <= GOSSIP_QUEUED_MAX;
+}
+
+/* Whether an announce was already sent on a connection */
+static int
+gossip_sent_to(struct gossip_pending* pending, struct net_tcp_conn* tcp_conn)
+{
+  for (size_t i = 0; i < pending->sent_count; ++i)
+    if (pending->sent_to[i] == tcp_conn->id)
+      return 1;
+
+  return 0;
+}
+
+/* Queue an announce on up to max random connections it was not sent on out
+ * of seen ones, remembering them, and return how many were picked */
+static size_t
+gossip_send(struct gossip* gossip,
+            struct gossip_pending* pending,
+            size_t max,
+            size_t* out_seen,
+            unsigned long* sends)
+{
+  struct net_tcp_conn* targets[GOSSIP_FANOUT];
+  size_t seen = 0;
+
+  if (max > GOSSIP_FANOUT)
+    max = GOSSIP_FANOUT;
+
+  /* reservoir sampling, every connection is as likely to be picked */
+  struct net_tcp_conn* tcp_conn;
+  LIST_FOREACH(tcp_conn, &gossip->ctx->tcp_conns, entry)
+  {
+    if (!gossip_target(tcp_conn, pending->from) ||
+        gossip_sent_to(pending, tcp_conn))
+      continue;
+
+    if (seen < max) {
+      targets[seen] = tcp_conn;
+    } else {
+      size_t i = net_random(gossip->ctx, seen + 1);
+
+      if (i < max)
+        targets[i] = tcp_conn;
+    }
+
+    ++seen;
+  }
+
+  *out_seen = seen;
+
+  if (seen > max)
+    seen = max;
+
+  for (size_t i = 0; i < seen; ++i) {
+    if (net_tcp_conn_send_shared(targets[i], pending->shared) ==
+        NET_TCP_CONN_SEND_SHARED_OK)
+      ++*sends;
+
+    if (pending->sent_count < GOSSIP_FANOUT)
+      pending->sent_to[pending->sent_count++] = targets[i]->id;
+  }
+
+  return seen;
+}
+
+/* Queue pending announces on random connections, then announces due for a
+ * repair on those they were not sent on, GOSSIP_ROUND_SENDS times at most */
+static void
+gossip_round(struct gossip* gossip)
+{
+  struct net_context* ctx = gossip->ctx;
+  size_t budget = GOSSIP_ROUND_SENDS;
+
+  while (budget > 0 && !STAILQ_EMPTY(&gossip->pending)) {
+    struct gossip_pending* pending = STAILQ_FIRST(&gossip->pending);
+    size_t seen;
+    size_t picked =
+      gossip_send(gossip, pending, budget, &seen, &gossip->sends);
+
+    /* an announce nobody could take still uses up a send, so that a round
+     * stays bounded */
+    budget -= picked > 0 ? picked : 1;
+    ++gossip->forwarded;
+
+    STAILQ_REMOVE_HEAD(&gossip->pending, entry);
+
+    /* every connection took it */
+    if (picked > 0 && picked == seen) {
+      gossip_pending_free(gossip, pending);
+      continue;
+    }
+
+    pending->repair_at = ctx->now + GOSSIP_REPAIR_DELAY;
+    STAILQ_INSERT_TAIL(&gossip->repairs, pending, entry);
+  }
+
+  while (budget > 0 && !STAILQ_EMPTY(&gossip->repairs) &&
+         STAILQ_FIRST(&gossip->repairs)->repair_at <= ctx->now) {
+    struct gossip_pending* pending = STAILQ_FIRST(&gossip->repairs);
+    size_t seen;
+    size_t picked =
+      gossip_send(gossip, pending, budget, &seen, &gossip->repair_sends);
+
+    budget -= picked > 0 ? picked : 1;
+
+    STAILQ_REMOVE_HEAD(&gossip->repairs, entry);
+    gossip_pending_free(gossip, pending);
+  }
+}
+
+/* When a round is needed next, 0 if none is */
+static int
+gossip_due(struct gossip* gossip, unsigned long* at)
+{
+  if (!STAILQ_EMPTY(&gossip->pending)) {
+    *at = gossip->next_round;
+    return 1;
+  }
+
+  if (!STAILQ_EMPTY(&gossip->repairs)) {
+    unsigned long repair_at = STAILQ_FIRST(&gossip->repairs)->repair_at;
+
+    *at = repair_at > gossip->next_round ? repair_at : gossip->next_round;
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+net_cb_gossip(int event, void* event_data, void** p)
+{
+  struct gossip* gossip = *p;
+
+  if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+    struct gossip_pending* pending;
+
+    STAILQ_FOREACH(pending, &gossip->pending, entry)
+    {
+      if (pending->from == closed->tcp_conn)
+        pending->from = NULL;
+    }
+
+    STAILQ_FOREACH(pending, &gossip->repairs, entry)
+    {
+      if (pending->from == closed->tcp_conn)
+        pending->from = NULL;
+    }
+  } else if (event == NET_EVENT_TICK) {
+    struct net_context* ctx = gossip->ctx;
+    unsigned long at;
+
+    if (!gossip_due(gossip, &at))
+      return 0;
+
+    if (ctx->now >= at) {
+      gossip_round(gossip);
+      gossip->next_round = ctx->now + GOSSIP_ROUND_INTERVAL;
+    }
+
+    if (gossip_due(gossip, &at))
+      net_context_wake_at(ctx, at);
+  } else if (event == NET_EVENT_MEMORY) {
+    struct net_event_data_memory* memory = event_data;
+
+    memory->memory += gossip->memory;
+  }
+
+  return 0;
+}
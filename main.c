@@ -1,20 +1,21 @@
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include <errno.h>
-
-#ifdef DEBUG
 #include <netdb.h>
+
 #include <stdio.h>
-#endif
 
 #include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "queue.h"
@@ -44,18 +45,21 @@ net_cb_fn_test(int event, void* event_data, void** p)
              ((struct net_event_data_sent*)event_data)->count);
       break;
     case NET_EVENT_RECEIVED:
-      printf("NET_EVENT_RECEIVED - fd: %d count: %ld size: %ld size_int: %d "
-             "data: \"%.*s\"",
+      /* sizes only, -DTRACE records every recv(2) */
+      printf("NET_EVENT_RECEIVED - fd: %d count: %ld size: %ld",
              ((struct net_event_data_received*)event_data)->tcp_conn->fd,
              ((struct net_event_data_received*)event_data)->count,
              ((struct net_event_data_received*)event_data)
-               ->tcp_conn->receive_buf.size,
-             (int)((struct net_event_data_received*)event_data)
-               ->tcp_conn->receive_buf.size,
-             (int)((struct net_event_data_received*)event_data)
-               ->tcp_conn->receive_buf.size,
-             (const char*)((struct net_event_data_received*)event_data)
-               ->tcp_conn->receive_buf.p);
+               ->tcp_conn->receive_buf.size);
+      break;
+    case NET_EVENT_WAKE:
+      printf("NET_EVENT_WAKE - fd: %d",
+             ((struct net_event_data_wake*)event_data)->fd);
+      break;
+    case NET_EVENT_SLOW:
+      printf("NET_EVENT_SLOW - busy: %llu",
+             (unsigned long long)((struct net_event_data_slow*)event_data)
+               ->iteration->busy);
       break;
   }
 
@@ -64,365 +68,366 @@ net_cb_fn_test(int event, void* event_data, void** p)
 }
 #endif
 
-#if CHAR_BIT == 8
-inline unsigned char
-read_net_octet(unsigned char** p)
+struct announce_context
 {
-  /* Read 1 octet. TCP/UDP is octet oriented so we are
-   * guaranteed to have 8 bits per unsigned char and an unsigned char is
-   * guaranteed by the C standard to be able to hold at least 2^8-1. */
-  unsigned char v = (*p)[0];
-
-  *p += 1;
+  struct net_context* ctx;
+  struct directory* directory;
+  struct gossip* gossip;
+  struct verifier* verifier;
+};
+
+/* Whether two addresses are on the same host, ports aside */
+static int
+same_host(struct sockaddr* a,
+          socklen_t a_len,
+          struct sockaddr* b,
+          socklen_t b_len)
+{
+  struct sockaddr_storage na;
+  struct sockaddr_storage nb;
+  socklen_t na_len;
+  socklen_t nb_len;
+
+  if (net_sockaddr_normalize(a, a_len, &na, &na_len) !=
+        NET_SOCKADDR_NORMALIZE_OK ||
+      net_sockaddr_normalize(b, b_len, &nb, &nb_len) !=
+        NET_SOCKADDR_NORMALIZE_OK ||
+      na.ss_family != nb.ss_family)
+    return 0;
+
+  if (na.ss_family == AF_INET)
+    return memcmp(&((struct sockaddr_in*)&na)->sin_addr,
+                  &((struct sockaddr_in*)&nb)->sin_addr,
+                  sizeof(struct in_addr)) == 0;
+
+  if (na.ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6*)&na)->sin6_addr,
+                  &((struct sockaddr_in6*)&nb)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
 
-  return v;
+  return 0;
 }
 
-inline unsigned short
-read_net_2_octets(unsigned char** p)
+/* Act on an announce that can be trusted, own when it is that of the peer
+ * at the other end of tcp_conn rather than one it relays */
+static void
+announce_process(struct announce_context* actx,
+                 struct net_tcp_conn* tcp_conn,
+                 int own,
+                 struct announce_view* announce)
 {
-  unsigned short v;
+  struct net_context* ctx = actx->ctx;
+  struct address_block_iterator it;
+  struct address_block block;
+  struct net_addr addrs[NET_PEER_ADDRS_MAX];
+  size_t addr_count = 0;
 
-  /* Read 2 octets in network byte order. TCP/UDP is octet oriented so we are
-   * guaranteed to have 8 bits per unsigned char and an unsigned short is
-   * guaranteed by the C standard to be able to hold at least 2^16-1. */
-  v = ((*p)[1] << 0) | ((*p)[0] << 8);
+  announce_address_blocks(announce, &it);
 
-  *p += 2;
+  while (address_block_next(&it, &block)) {
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
 
-  return v;
-}
+#ifdef DEBUG
+    printf("family: %hhd size: %hd\n", block.family, block.size);
+#endif
 
-inline unsigned long
-read_net_4_octets(unsigned char** p)
-{
-  unsigned long v;
+    /* unknown families are skipped, they may be understood by other peers */
+    if (address_block_sockaddr(&block, &sa, &sa_len) !=
+        ADDRESS_BLOCK_SOCKADDR_OK) {
+#ifdef DEBUG
+      printf("could not decode address family: %hhd size: %hd\n",
+             block.family,
+             block.size);
+#endif
+      continue;
+    }
 
-  /* Read 4 octets in network byte order. TCP/UDP is octet oriented so we are
-   * guaranteed to have 8 bits per unsigned char and an unsigned long is
-   * guaranteed by the C standard to be able to hold at least 2^32-1. */
-  v = ((*p)[3] << 0) | ((*p)[2] << 8) | ((*p)[1] << 16) | ((*p)[0] << 24);
+#ifdef DEBUG
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    int err;
+
+    if ((err = getnameinfo((struct sockaddr*)&sa,
+                           sa_len,
+                           host,
+                           sizeof host,
+                           serv,
+                           sizeof serv,
+                           NI_NUMERICHOST | NI_NUMERICSERV)) == 0)
+      printf("decoded address: %s - decoded port: %s\n", host, serv);
+    else
+      printf("getnameinfo: %s sa_family: %hd\n",
+             gai_strerror(err),
+             ((struct sockaddr*)&sa)->sa_family);
+#endif
 
-  *p += 4;
+    /* an inbound connection announcing an address of the host it comes
+     * from leads to the peer accepting connections there, so that we don't
+     * also connect to it */
+    if (own && tcp_conn && tcp_conn->peer == NULL &&
+        !(tcp_conn->flags & NET_TCP_CONN_OUTBOUND) &&
+        same_host((struct sockaddr*)&sa,
+                  sa_len,
+                  (struct sockaddr*)&tcp_conn->sa,
+                  tcp_conn->sa_len)) {
+      if (net_peer_bind(ctx, tcp_conn, (struct sockaddr*)&sa, sa_len) ==
+          NET_PEER_BIND_DUPLICATE)
+        return;
+    }
 
-  return v;
-}
+    if (addr_count < NET_PEER_ADDRS_MAX) {
+      memcpy(&addrs[addr_count].sa, &sa, sa_len);
+      addrs[addr_count++].sa_len = sa_len;
+    }
+  }
 
-inline void
-write_net_octet(unsigned char** p, unsigned char v)
-{
-  (*p)[0] = v;
+  /* reconnects to the peer race every address it announced */
+  if (own && tcp_conn && tcp_conn->peer && addr_count > 0)
+    net_peer_set_addrs(tcp_conn->peer, addrs, addr_count);
 
-  *p += 1;
+  struct directory_key key;
+
+  if (directory_key_announce(announce, &key) == DIRECTORY_KEY_ANNOUNCE_OK) {
+    announce_address_blocks(announce, &it);
+
+    struct directory_entry* entry = directory_update(
+      actx->directory, &key, announce->role, &it, (uint64_t)time(NULL));
+
+    /* connecting to the peer measured the round trip to that address */
+    if (entry && own && tcp_conn &&
+        (tcp_conn->flags & NET_TCP_CONN_OUTBOUND))
+      directory_set_rtt(actx->directory,
+                        entry,
+                        (struct sockaddr*)&tcp_conn->sa,
+                        tcp_conn->sa_len,
+                        (uint32_t)tcp_conn->connect_time);
+  }
+
+  /* pass it on, announces that were already propagated are dropped */
+  gossip_announce(actx->gossip, announce, tcp_conn);
 }
 
-inline void
-write_net_2_octets(unsigned char** p, unsigned short v)
+/* Signed announces are processed once their signature is verified */
+static void
+announce_verified(struct verify_request* request, void* p)
 {
-  (*p)[1] = (v >> (0 * 8)) & UCHAR_MAX;
-  (*p)[0] = (v >> (1 * 8)) & UCHAR_MAX;
+  struct announce_view announce;
+
+  if (!request->valid ||
+      decode_announce(request->announce.p, request->announce.size, &announce) !=
+        DECODE_ANNOUNCE_OK)
+    return;
 
-  *p += 2;
+  announce_process(p, request->tcp_conn, request->own, &announce);
 }
 
-inline void
-write_net_4_octets(unsigned char** p, unsigned long v)
+int
+command_announce_received(struct command_frame* frame, void** p)
 {
-  (*p)[3] = (v >> (0 * 8)) & UCHAR_MAX;
-  (*p)[2] = (v >> (1 * 8)) & UCHAR_MAX;
-  (*p)[1] = (v >> (2 * 8)) & UCHAR_MAX;
-  (*p)[0] = (v >> (3 * 8)) & UCHAR_MAX;
+  struct announce_context* actx = *p;
 
-  *p += 4;
-}
+  if (frame->header.flags & COMMAND_HEADER_IS_REQUEST) {
+    struct announce_view announce;
 
-#else
-#error "Implement for CHAR_BIT != 8"
-#endif
+    if (decode_announce(frame->data, frame->size, &announce) !=
+        DECODE_ANNOUNCE_OK)
+      return -1;
 
-void
-command_state_free_ping(void* state)
-{
-  struct command_state_ping* state_ping = state;
+    struct net_tcp_conn* tcp_conn = frame->tcp_conn;
+    int own = 0;
+
+    /* the first announce of a connection is the peer's, those following it
+     * are relayed from other nodes */
+    if (tcp_conn && !(tcp_conn->flags & NET_TCP_CONN_ANNOUNCE_RECEIVED)) {
+      tcp_conn->flags |= NET_TCP_CONN_ANNOUNCE_RECEIVED;
+      own = 1;
+    }
+
+    if (announce.public_key_type == PUBLIC_KEY_ED25519) {
+      verifier_submit(actx->verifier,
+                      tcp_conn,
+                      own,
+                      &announce,
+                      frame->data,
+                      frame->size);
+      return 0;
+    }
+
+    announce_process(actx, tcp_conn, own, &announce);
+  }
 
-  free(state_ping->data);
-  state_ping->data = NULL;
-  state_ping->size = 0;
+  return 0;
 }
 
+/* Counters tell a lot about the node, they are only sent to local clients */
 int
-net_cb_command_received(int event, void* event_data, void** p)
+command_stats_received(struct command_frame* frame, void** p)
 {
-  (void)p;
+  struct net_context* ctx = *p;
+  struct net_tcp_conn* tcp_conn = frame->tcp_conn;
 
-  if (event == NET_EVENT_RECEIVED) {
-    struct net_event_data_received* received = event_data;
+  if (!(frame->header.flags & COMMAND_HEADER_IS_REQUEST) ||
+      tcp_conn == NULL || !(tcp_conn->flags & NET_TCP_CONN_UNIX))
+    return 0;
 
-    if (received->tcp_conn->receive_buf.size >= (1       /* flags */
-                                                 + 2 * 2 /* type and version */
-                                                 + 4 * 2 /* tag and size */
-                                                 )) {
-      struct command_header header;
-      unsigned char* buf = received->tcp_conn->receive_buf.p;
+  struct command_header response = frame->header;
 
-      header.flags = read_net_octet(&buf);
-      header.tag = read_net_4_octets(&buf);
-      header.type = read_net_2_octets(&buf);
-      header.version = read_net_2_octets(&buf);
-      header.size = read_net_4_octets(&buf);
+  response.flags = 0;
+  response.version = 0;
+  response.size = encode_stats(ctx, NULL);
 
-#ifdef DEBUG
-      printf("command_header {\n\tflags: 0x%hhx\n\ttag: 0x%lx\n\ttype: "
-             "0x%hx\n\tversion: 0x%hx\n"
-             "\tsize: 0x%lx\n}\n",
-             header.flags,
-             header.tag,
-             header.type,
-             header.version,
-             header.size);
-#endif
+  unsigned char* sbuf =
+    net_tcp_conn_write(tcp_conn, NULL, COMMAND_HEADER_SIZE + response.size);
 
-      switch (header.type) {
-        case COMMAND_PING:
-          if (received->tcp_conn->receive_buf.size >= header.size) {
-            if (header.flags & COMMAND_HEADER_IS_REQUEST) {
-              if (mem_grow_buf(&received->tcp_conn->send_buf,
-                               NULL,
-                               1               /* flags */
-                                 + 2 * 2       /* type and version */
-                                 + 4 * 2       /* tag and size */
-                                 + header.size /* data size */
-                               ) != MEM_GROW_BUF_OK) {
-                goto close_fd;
-              }
-
-              unsigned char* sbuf = received->tcp_conn->send_buf.p;
-
-              write_net_octet(&sbuf, 0);              /* flags */
-              write_net_4_octets(&sbuf, header.tag);  /* tag */
-              write_net_2_octets(&sbuf, header.type); /* type */
-              write_net_2_octets(&sbuf, 0);           /* version */
-              write_net_4_octets(&sbuf, header.size); /* size */
-
-              /* ping data */
-              memcpy(sbuf, buf, header.size);
-
-              buf += header.size;
-
-              if (mem_shrink_buf_head(
-                    &received->tcp_conn->receive_buf,
-                    (size_t)buf - (size_t)received->tcp_conn->receive_buf.p) !=
-                  MEM_SHRINK_BUF_HEAD_OK) {
-                goto close_fd;
-              }
-            } else {
-              struct command_state* state;
-
-              LIST_FOREACH(state, &received->tcp_conn->states, entry)
-              {
-                if (state->type != COMMAND_PING)
-                  continue;
-
-                struct command_state_ping* state_ping = state->state;
-
-                if (state_ping->tag != header.tag &&
-                    !(state_ping->progress &
-                      COMMAND_STATE_PING_AWAITING_RESPONSE))
-                  continue;
-
-                if (state_ping->size != header.size ||
-                    (memcmp(state_ping->data, buf, header.size) != 0)) {
-                  state_ping->progress |= COMMAND_STATE_PING_INVALID_RESPONSE;
-                } else {
-                  state_ping->progress |= COMMAND_STATE_PING_VALID_RESPONSE;
-                }
-
-                buf += header.size;
-
-                if (mem_shrink_buf_head(
-                      &received->tcp_conn->receive_buf,
-                      (size_t)buf -
-                        (size_t)received->tcp_conn->receive_buf.p) !=
-                    MEM_SHRINK_BUF_HEAD_OK) {
-                  goto close_fd;
-                }
-
-                break;
-              }
-            }
-          }
-          break;
-        case COMMAND_ANNOUNCE:
-          if (received->tcp_conn->receive_buf.size >= header.size) {
-            if (header.flags & COMMAND_HEADER_IS_REQUEST) {
-              struct command_announce announce = { 0 };
-              unsigned long remaining = header.size;
-
-              if (remaining < 1 /* role */
-                                + 2 /* port */)
-                goto close_fd;
-
-              announce.role = read_net_octet(&buf);
-              announce.port = read_net_2_octets(&buf);
-
-              remaining -= 3;
-
-              for (size_t index = 0;
-                   remaining > 0 && index < sizeof announce.more_addrs /
-                                              sizeof *announce.more_addrs;
-                   ++index) {
-                if (remaining < 2 /* family and size */)
-                  goto close_fd;
-
-                unsigned short family_and_size = read_net_2_octets(&buf);
-                remaining -= 2;
-
-                unsigned char family = family_and_size >> 12;
-                unsigned short size = family_and_size & ~(~0U << 12U);
+  if (sbuf == NULL)
+    return -1;
 
-#ifdef DEBUG
-                printf("family: %hhd size: %hd\n", family, size);
-#endif
+  codec_encode_command_header(sbuf, &response);
 
-                if (remaining < size) {
-#ifdef DEBUG
-                  printf("close_fd: remaining (%ld) < size\n", remaining);
-#endif
-                  goto close_fd;
-                }
+  /* the counters must not change between sizing and encoding */
+  encode_stats(ctx, sbuf + COMMAND_HEADER_SIZE);
+  net_metrics_frame(ctx, tcp_conn, &response, 1);
 
-#ifdef DEBUG
-                char host[NI_MAXHOST];
-                char serv[NI_MAXSERV];
-#endif
+  return 0;
+}
 
-                switch (family) {
-                  case FAMILY_IPV4:
-                    /* port */
-                    if (remaining < 2 ||
-                        (size != 2 /* port */ + 4 /* ipv4 */)) {
-#ifdef DEBUG
-                      printf("close_fd: port\n");
-#endif
-                      goto close_fd;
-                    }
+struct checkpoint_context
+{
+  struct directory* directory;
+  const char* path;
 
-                    struct sockaddr_in* sin =
-                      (struct sockaddr_in*)&announce.more_addrs[index];
+  /* When the next checkpoint may start */
+  unsigned long next;
 
-                    sin->sin_family = AF_INET;
+  /* directory->changes as of the last checkpoint */
+  unsigned long changes;
 
-                    sin->sin_port = read_net_2_octets(&buf);
-                    remaining -= 2;
+  /* Process writing the checkpoint, 0 if there is none */
+  pid_t pid;
+};
 
-                    /* address */
-                    if (remaining < 4) {
-#ifdef DEBUG
-                      printf("close_fd: address\n");
-#endif
-                      goto close_fd;
-                    }
+/* Log iterations of the loop that stalled it, in microseconds */
+int
+net_cb_slow(int event, void* event_data, void** p)
+{
+  (void)p;
 
-                    memcpy(&sin->sin_addr, buf, 4);
-                    buf += 4;
+  if (event != NET_EVENT_SLOW)
+    return 0;
+
+  struct net_iteration* it =
+    ((struct net_event_data_slow*)event_data)->iteration;
+
+  fprintf(stderr,
+          "slow iteration: busy %llu poll %llu accept %llu recv %llu "
+          "dispatch %llu send %llu timers %llu",
+          (unsigned long long)it->busy / 1000,
+          (unsigned long long)it->phases[NET_PHASE_POLL] / 1000,
+          (unsigned long long)it->phases[NET_PHASE_ACCEPT] / 1000,
+          (unsigned long long)it->phases[NET_PHASE_RECV] / 1000,
+          (unsigned long long)it->phases[NET_PHASE_DISPATCH] / 1000,
+          (unsigned long long)it->phases[NET_PHASE_SEND] / 1000,
+          (unsigned long long)it->phases[NET_PHASE_TIMERS] / 1000);
+
+  if (it->conn_time > 0)
+    fprintf(stderr,
+            ", connection %lu %llu",
+            it->conn_id,
+            (unsigned long long)it->conn_time / 1000);
+
+  if (it->type_time > 0)
+    fprintf(stderr,
+            ", command type %hu %llu",
+            it->type,
+            (unsigned long long)it->type_time / 1000);
+
+  fprintf(stderr, "\n");
 
-                    remaining -= 4;
+  return 0;
+}
 
-#ifdef DEBUG
-                    int err;
-                    if ((err = getnameinfo((struct sockaddr*)sin,
-                                           sizeof *sin,
-                                           host,
-                                           sizeof host,
-                                           serv,
-                                           sizeof serv,
-                                           NI_NUMERICHOST | NI_NUMERICSERV)) ==
-                        0)
-                      printf(
-                        "decoded address: %s - decoded port: %s\n", host, serv);
-                    else
-                      printf("getnameinfo: %s sa_family: %hd\n",
-                             gai_strerror(err),
-                             ((struct sockaddr*)sin)->sa_family);
-#endif
-                    break;
-                  case FAMILY_IPV6:
-                    /* port */
-                    if (remaining < 2 || (size != 2 /* port */ + 16 /* ipv6 */))
-                      goto close_fd;
+/* Periodically write the directory from a child process, which sees it as it
+ * was when forked while the loop goes on */
+int
+net_cb_checkpoint(int event, void* event_data, void** p)
+{
+  struct net_context* ctx = ((struct net_event_data_tick*)event_data)->ctx;
+  struct checkpoint_context* checkpoint = *p;
 
-                    struct sockaddr_in6* sin6 =
-                      (struct sockaddr_in6*)&announce.more_addrs[index];
+  if (event != NET_EVENT_TICK)
+    return 0;
 
-                    sin6->sin6_family = AF_INET6;
+  if (checkpoint->pid > 0 &&
+      waitpid(checkpoint->pid, NULL, WNOHANG) == checkpoint->pid)
+    checkpoint->pid = 0;
 
-                    sin6->sin6_port = read_net_2_octets(&buf);
-                    remaining -= 2;
+  if (ctx->now < checkpoint->next) {
+    net_context_wake_at(ctx, checkpoint->next);
+    return 0;
+  }
 
-                    /* address */
-                    if (remaining < 16)
-                      goto close_fd;
+  checkpoint->next = ctx->now + DIRECTORY_CHECKPOINT_INTERVAL;
 
-                    memcpy(&sin6->sin6_addr, buf, 16);
-                    buf += 16;
+  if (checkpoint->pid > 0 ||
+      checkpoint->changes == checkpoint->directory->changes)
+    return 0;
 
-                    remaining -= 16;
+  pid_t pid = fork();
 
+  if (pid == 0) {
+    _exit(directory_checkpoint(checkpoint->directory, checkpoint->path) ==
+              DIRECTORY_CHECKPOINT_OK
+            ? EXIT_SUCCESS
+            : EXIT_FAILURE);
+  }
+
+  if (pid > 0) {
+    checkpoint->pid = pid;
+    checkpoint->changes = checkpoint->directory->changes;
+  }
 #ifdef DEBUG
-                    if (getnameinfo((struct sockaddr*)sin6,
-                                    sizeof *sin6,
-                                    host,
-                                    sizeof host,
-                                    serv,
-                                    sizeof serv,
-                                    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
-                      printf(
-                        "decoded address: %s - decoded port: %s\n", host, serv);
-                    else
-                      printf("getnameinfo: %s sa_family: %hd\n",
-                             gai_strerror(err),
-                             ((struct sockaddr*)sin)->sa_family);
-#endif
-                    break;
-                  default:
-#ifdef DEBUG
-                    printf("could not decode unknown address family: %hhd "
-                           "size: %hd\n",
-                           family,
-                           size);
+  else {
+    perror("fork");
+  }
 #endif
-                    remaining -= size;
-                    buf += size;
-                }
-              }
-
-              /* TODO: Decide what to do with peer addresses */
-            }
-          }
-
-          if (mem_shrink_buf_head(
-                &received->tcp_conn->receive_buf,
-                (size_t)buf - (size_t)received->tcp_conn->receive_buf.p) !=
-              MEM_SHRINK_BUF_HEAD_OK) {
-            goto close_fd;
-          }
-          break;
-      }
-    }
 
-    /* don't go into this code path unless goto is used */
-    if (0) {
-      /* This will cause the networking loop to discard the fd and all resources
-       * associated with it */
+  return 0;
+}
 
-    close_fd:
-      shutdown(received->tcp_conn->fd, SHUT_RDWR);
-      close(received->tcp_conn->fd);
-      return 0;
+/* Connect to the peers of the directory we were connected to last */
+static void
+connect_known_peers(struct net_context* ctx, struct directory* directory)
+{
+  struct directory_entry* entries[DIRECTORY_WARM_PEERS];
+  size_t count =
+    directory_known_good(directory, entries, DIRECTORY_WARM_PEERS);
+
+  for (size_t i = 0; i < count; ++i) {
+    struct directory_entry* entry = entries[i];
+    struct net_addr addrs[NET_PEER_ADDRS_MAX];
+    size_t addr_count = 0;
+
+    /* the best address goes first, the peer is known by it */
+    if (directory_best_sockaddr(entry, &addrs[0].sa, &addrs[0].sa_len) !=
+        DIRECTORY_BEST_SOCKADDR_OK)
+      continue;
+
+    ++addr_count;
+
+    for (unsigned char j = 0;
+         j < entry->addr_count && addr_count < NET_PEER_ADDRS_MAX;
+         ++j) {
+      if (j != entry->best &&
+          directory_addr_sockaddr(&entry->addrs[j],
+                                  &addrs[addr_count].sa,
+                                  &addrs[addr_count].sa_len) ==
+            DIRECTORY_ADDR_SOCKADDR_OK)
+        ++addr_count;
     }
-  }
 
-  return 0;
+    net_connect_addrs(ctx, addrs, addr_count);
+  }
 }
 
 int
@@ -472,17 +477,17 @@ main(int argc, char* argv[])
   }
 
   struct net_context ctx;
-  memset(&ctx, 0, sizeof ctx);
+  net_context_init(&ctx);
 
-  ctx.tcp_boundfds[0] = tcp_fd;
-  ctx.tcp_boundfds[1] = -1;
-  ctx.tcp_boundfds[2] = -1;
-  ctx.tcp_boundfds[3] = -1;
+#ifdef TRACE
+  /* decoded with trace-dump, while running or after a crash */
+  const char* trace_env = getenv("UNILINK_TRACE");
 
-  ctx.udp_boundfds[0] = -1;
-  ctx.udp_boundfds[1] = -1;
-  ctx.udp_boundfds[2] = -1;
-  ctx.udp_boundfds[3] = -1;
+  if (trace_env)
+    trace_open(trace_env);
+#endif
+
+  ctx.tcp_boundfds[0] = tcp_fd;
 
   struct sockaddr_in sa2;
   memset(&sa2, 0, sizeof sa2);
@@ -502,15 +507,96 @@ main(int argc, char* argv[])
   printf("listening on port %hu\n", ntohs(sa2.sin_port));
 #endif
 
+  /* what peers connecting to each other at once compare */
+  memcpy(&ctx.self_sa, &sa2, sa2len);
+  ctx.self_sa_len = sa2len;
+
+  /* our announce is encoded once, for every peer */
+  struct announce_self self;
+  struct net_addr self_addr;
+
+  announce_self_init(&self, &ctx, ROLE_NODE);
+
+  memcpy(&self_addr.sa, &sa2, sa2len);
+  self_addr.sa_len = sa2len;
+
+  announce_self_set_addrs(&self, &self_addr, 1);
+
+  /* commands are also accepted in datagrams sent to the same port */
+  int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (udp_fd == -1) {
+#ifdef DEBUG
+    perror("socket");
+#endif
+    close(tcp_fd);
+    return EXIT_FAILURE;
+  }
+
+  if (bind(udp_fd, (struct sockaddr*)&sa2, sa2len) == -1 ||
+      net_set_nonblock(udp_fd) != NET_SET_NONBLOCK_OK) {
+#ifdef DEBUG
+    perror("bind");
+#endif
+    close(udp_fd);
+    close(tcp_fd);
+    return EXIT_FAILURE;
+  }
+
+  ctx.udp_boundfds[0] = udp_fd;
+
+  /* co-located processes can also connect through a UNIX domain socket */
+  if (argc > 2 && argv[2][0] != '\0') {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof sun);
+
+    sun.sun_family = AF_UNIX;
+
+    if (strlen(argv[2]) >= sizeof sun.sun_path) {
+      close(udp_fd);
+      close(tcp_fd);
+      return EXIT_FAILURE;
+    }
+
+    strcpy(sun.sun_path, argv[2]);
+
+    int unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_fd == -1) {
+#ifdef DEBUG
+      perror("socket");
+#endif
+      close(udp_fd);
+      close(tcp_fd);
+      return EXIT_FAILURE;
+    }
+
+    /* a previous instance may have left its socket behind */
+    unlink(sun.sun_path);
+
+    if (bind(unix_fd, (struct sockaddr*)&sun, sizeof sun) == -1 ||
+        listen(unix_fd, 256) == -1 ||
+        net_set_nonblock(unix_fd) != NET_SET_NONBLOCK_OK) {
+#ifdef DEBUG
+      perror("bind");
+#endif
+      close(unix_fd);
+      close(udp_fd);
+      close(tcp_fd);
+      return EXIT_FAILURE;
+    }
+
+    ctx.unix_boundfds[0] = unix_fd;
+  }
+
 #ifdef DEBUG
   struct net_callback* net_cb = calloc(1, sizeof *net_cb);
   if (net_cb == NULL) {
     perror("calloc");
+    close(udp_fd);
     close(tcp_fd);
     return EXIT_FAILURE;
   }
 
-  net_cb->events = ~0;
+  net_cb->events = ~NET_EVENT_TICK;
   net_cb->cb = net_cb_fn_test;
 
   LIST_INSERT_HEAD(&ctx.callbacks, net_cb, entry);
@@ -521,21 +607,203 @@ main(int argc, char* argv[])
 #ifdef DEBUG
     perror("calloc");
 #endif
+    close(udp_fd);
+    close(tcp_fd);
+    return EXIT_FAILURE;
+  }
+
+  /* the directory survives restarts when it has a file */
+  struct directory directory;
+  struct checkpoint_context checkpoint;
+  struct net_callback net_cb_checkpoint_tick;
+
+  memset(&checkpoint, 0, sizeof checkpoint);
+  checkpoint.directory = &directory;
+  checkpoint.path = getenv("UNILINK_DIRECTORY");
+
+  if ((checkpoint.path
+         ? directory_open(&directory, checkpoint.path, DIRECTORY_MEMORY_DEFAULT)
+         : directory_init(&directory, DIRECTORY_MEMORY_DEFAULT)) != 0) {
+    free(net_cb_received);
+    close(udp_fd);
+    close(tcp_fd);
+    return EXIT_FAILURE;
+  }
+
+  checkpoint.changes = directory.changes;
+
+  if (checkpoint.path) {
+    memset(&net_cb_checkpoint_tick, 0, sizeof net_cb_checkpoint_tick);
+
+    net_cb_checkpoint_tick.events = NET_EVENT_TICK;
+    net_cb_checkpoint_tick.p = &checkpoint;
+    net_cb_checkpoint_tick.cb = net_cb_checkpoint;
+
+    LIST_INSERT_HEAD(&ctx.callbacks, &net_cb_checkpoint_tick, entry);
+
+    connect_known_peers(&ctx, &directory);
+  }
+
+  struct gossip gossip;
+
+  gossip_init(&gossip, &ctx);
+
+  struct announce_context actx = { &ctx, &directory, &gossip, NULL };
+  struct verifier verifier;
+
+  verifier_init(&verifier, &ctx, announce_verified, &actx);
+  actx.verifier = &verifier;
+
+  /* signatures are verified by a thread per spare processor by default,
+   * on the loop thread with UNILINK_WORKERS=0 */
+  struct worker_pool pool;
+  const char* workers_env = getenv("UNILINK_WORKERS");
+  long workers = workers_env ? strtol(workers_env, NULL, 10)
+                             : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+  if (workers > WORKER_THREADS_MAX)
+    workers = WORKER_THREADS_MAX;
+
+  if (workers > 0 &&
+      worker_pool_init(&pool, &ctx, (size_t)workers) == WORKER_POOL_INIT_OK)
+    verifier.pool = &pool;
+
+  struct command_context cctx;
+  memset(&cctx, 0, sizeof cctx);
+
+  cctx.max_frame_size = COMMAND_MAX_FRAME_SIZE;
+
+  struct command_handler ping_handler;
+  memset(&ping_handler, 0, sizeof ping_handler);
+
+  ping_handler.type_min = COMMAND_PING;
+  ping_handler.type_max = COMMAND_PING;
+  ping_handler.version_max = USHRT_MAX;
+  ping_handler.flags = COMMAND_HANDLER_STREAM;
+  ping_handler.fn = command_ping_stream;
+
+  struct command_handler announce_handler;
+  memset(&announce_handler, 0, sizeof announce_handler);
+
+  announce_handler.type_min = COMMAND_ANNOUNCE;
+  announce_handler.type_max = COMMAND_ANNOUNCE;
+  announce_handler.version_max = USHRT_MAX;
+  announce_handler.p = &actx;
+  announce_handler.fn = command_announce_received;
+
+  struct command_handler stats_handler;
+  memset(&stats_handler, 0, sizeof stats_handler);
+
+  stats_handler.type_min = COMMAND_STATS;
+  stats_handler.type_max = COMMAND_STATS;
+  stats_handler.version_max = USHRT_MAX;
+  stats_handler.p = &ctx;
+  stats_handler.fn = command_stats_received;
+
+  if (command_register(&cctx, &ping_handler) != COMMAND_REGISTER_OK ||
+      command_register(&cctx, &announce_handler) != COMMAND_REGISTER_OK ||
+      command_register(&cctx, &stats_handler) != COMMAND_REGISTER_OK) {
+    if (verifier.pool)
+      worker_pool_free(verifier.pool);
+    verifier_free(&verifier);
+    gossip_free(&gossip);
+    directory_free(&directory);
+    free(net_cb_received);
+    close(udp_fd);
     close(tcp_fd);
     return EXIT_FAILURE;
   }
 
   net_cb_received->events = NET_EVENT_RECEIVED;
+  net_cb_received->p = &cctx;
   net_cb_received->cb = net_cb_command_received;
 
   LIST_INSERT_HEAD(&ctx.callbacks, net_cb_received, entry);
 
+  struct net_callback net_cb_datagram;
+  memset(&net_cb_datagram, 0, sizeof net_cb_datagram);
+
+  net_cb_datagram.events = NET_EVENT_DATAGRAM;
+  net_cb_datagram.p = &cctx;
+  net_cb_datagram.cb = net_cb_command_datagram;
+
+  LIST_INSERT_HEAD(&ctx.callbacks, &net_cb_datagram, entry);
+
+  /* iterations busy for longer than UNILINK_SLOW_MS milliseconds are logged */
+  struct net_callback net_cb_slow_iteration;
+  const char* slow_env = getenv("UNILINK_SLOW_MS");
+
+  if (slow_env && strtoul(slow_env, NULL, 10) > 0) {
+    ctx.slow_iteration = (uint64_t)strtoul(slow_env, NULL, 10) * 1000000;
+
+    memset(&net_cb_slow_iteration, 0, sizeof net_cb_slow_iteration);
+
+    net_cb_slow_iteration.events = NET_EVENT_SLOW;
+    net_cb_slow_iteration.cb = net_cb_slow;
+
+    LIST_INSERT_HEAD(&ctx.callbacks, &net_cb_slow_iteration, entry);
+  }
+
+  /* connections may hold UNILINK_MEMORY_MAX octets, new connections and
+   * reads from the largest are paused past three quarters of it, and
+   * UNILINK_CONN_MEMORY_MAX octets each */
+  const char* memory_env = getenv("UNILINK_MEMORY_MAX");
+  const char* conn_memory_env = getenv("UNILINK_CONN_MEMORY_MAX");
+
+  if (memory_env) {
+    ctx.memory_max = strtoul(memory_env, NULL, 10);
+    ctx.memory_soft = ctx.memory_max / 4 * 3;
+  }
+
+  if (conn_memory_env)
+    ctx.conn_memory_max = strtoul(conn_memory_env, NULL, 10);
+
+  /* what peers send is recorded to be replayed, after the command
+   * callbacks so that it sees received octets before they are consumed */
+  struct capture capture;
+  const char* capture_env = getenv("UNILINK_CAPTURE");
+
+  if (capture_env &&
+      capture_open(&capture, &ctx, capture_env) != CAPTURE_OPEN_OK) {
+#ifdef DEBUG
+    perror(capture_env);
+#endif
+  }
+
   int nonblock_ret = net_set_nonblock(tcp_fd);
   if (nonblock_ret != NET_SET_NONBLOCK_OK) {
+    close(udp_fd);
     close(tcp_fd);
     return EXIT_FAILURE;
   }
 
+  /* the remaining arguments are host and port pairs of peers to keep
+   * connections to, connections to every address of a host are raced */
+  for (int i = 3; i + 1 < argc; i += 2) {
+    struct addrinfo hints;
+    struct addrinfo* res;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if (getaddrinfo(argv[i], argv[i + 1], &hints, &res) != 0)
+      continue;
+
+    struct net_addr addrs[NET_PEER_ADDRS_MAX];
+    size_t addr_count = 0;
+
+    for (struct addrinfo* ai = res; ai && addr_count < NET_PEER_ADDRS_MAX;
+         ai = ai->ai_next) {
+      memcpy(&addrs[addr_count].sa, ai->ai_addr, ai->ai_addrlen);
+      addrs[addr_count++].sa_len = ai->ai_addrlen;
+    }
+
+    freeaddrinfo(res);
+
+    net_connect_addrs(&ctx, addrs, addr_count);
+  }
+
   net_loop(&ctx);
 
 #ifdef DEBUG
@@ -1,3 +1,5 @@
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -10,9 +12,19 @@ mem_free_buf(struct mem_buf* m)
     free(m->p);
     m->p = NULL;
     m->size = 0;
+    m->capacity = 0;
   }
 }
 
+/* Give back what an emptied buffer holds when it grew large, smaller ones are
+ * kept to be reused by the next message */
+static void
+mem_release_buf(struct mem_buf* m)
+{
+  if (m->size == 0 && m->capacity > MEM_BUF_KEEP)
+    mem_free_buf(m);
+}
+
 int
 mem_grow_buf(struct mem_buf* m, void* p, size_t size)
 {
@@ -22,20 +34,28 @@ mem_grow_buf(struct mem_buf* m, void* p, size_t size)
     return E(MEM_GROW_BUF_OVERFLOW);
   }
 
-  void* new_p = realloc(m->p, new_size);
+  /* capacity doubles so that a buffer filled little by little is only
+   * reallocated a logarithmic number of times */
+  if (new_size > m->capacity) {
+    size_t capacity =
+      m->capacity <= SIZE_MAX / 2 ? m->capacity * 2 : new_size;
+
+    if (capacity < new_size)
+      capacity = new_size;
 
-  /* if new_size is 0 then it is expected that realloc returns NULL, it is not
-   * an error. We will end up copying 0 bytes to a non-existent memory location
-   * because the only way new_size can be 0 is if size is 0.
-   */
-  if (new_p == NULL && new_size > 0) {
-    return E(MEM_GROW_BUF_ALLOC);
+    void* new_p = realloc(m->p, capacity);
+
+    if (new_p == NULL) {
+      return E(MEM_GROW_BUF_ALLOC);
+    }
+
+    m->p = new_p;
+    m->capacity = capacity;
   }
 
   if (p)
-    memcpy(new_p + m->size, p, size);
+    memcpy((unsigned char*)m->p + m->size, p, size);
 
-  m->p = new_p;
   m->size = new_size;
 
   return MEM_GROW_BUF_OK;
@@ -54,20 +74,11 @@ mem_shrink_buf_head(struct mem_buf* m, size_t size)
     return E(MEM_SHRINK_BUF_HEAD_UNDERFLOW);
   }
 
-  memmove(m->p, m->p + size, new_size);
-
-  void* new_p = realloc(m->p, new_size);
+  if (new_size > 0)
+    memmove(m->p, (unsigned char*)m->p + size, new_size);
 
-  /* if new_size is 0 then it is expected that realloc returns NULL, it is not
-   * an error. We will end up copying 0 bytes to a non-existent memory location
-   * because the only way new_size can be 0 is if size is 0.
-   */
-  if (new_p == NULL && new_size > 0) {
-    return E(MEM_SHRINK_BUF_HEAD_ALLOC);
-  }
-
-  m->p = new_p;
   m->size = new_size;
+  mem_release_buf(m);
 
   return MEM_SHRINK_BUF_HEAD_OK;
 }
@@ -85,18 +96,263 @@ mem_shrink_buf(struct mem_buf* m, size_t size)
     return E(MEM_SHRINK_BUF_UNDERFLOW);
   }
 
-  void* new_p = realloc(m->p, new_size);
+  m->size = new_size;
+  mem_release_buf(m);
+
+  return MEM_SHRINK_BUF_OK;
+}
+
+struct mem_shared*
+mem_shared_alloc(size_t size)
+{
+  if (size > SIZE_MAX - sizeof(struct mem_shared))
+    return NULL;
+
+  struct mem_shared* shared = malloc(sizeof *shared + size);
+
+  if (shared == NULL)
+    return NULL;
+
+  shared->refs = 1;
+  shared->size = size;
+
+  return shared;
+}
+
+struct mem_shared*
+mem_shared_ref(struct mem_shared* shared)
+{
+  ++shared->refs;
+
+  return shared;
+}
+
+void
+mem_shared_unref(struct mem_shared* shared)
+{
+  if (shared && --shared->refs == 0)
+    free(shared);
+}
+
+int
+mem_ring_init(struct mem_ring* ring, size_t size)
+{
+  memset(ring, 0, sizeof *ring);
+
+  if (size == 0 || (size & (size - 1)) != 0)
+    return E(MEM_RING_INIT_SIZE);
+
+  ring->slots = calloc(size, sizeof *ring->slots);
+
+  if (ring->slots == NULL)
+    return E(MEM_RING_INIT_ALLOC);
+
+  ring->mask = size - 1;
+
+  /* a slot can be pushed to when its sequence is the head position and
+   * popped from when it is the tail position plus one */
+  for (size_t i = 0; i < size; ++i)
+    atomic_init(&ring->slots[i].sequence, i);
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+
+  return MEM_RING_INIT_OK;
+}
+
+void
+mem_ring_free(struct mem_ring* ring)
+{
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+int
+mem_ring_push(struct mem_ring* ring, void* p)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct mem_ring_slot* slot;
 
-  /* if new_size is 0 then it is expected that realloc returns NULL, it is not
-   * an error. We will end up copying 0 bytes to a non-existent memory location
-   * because the only way new_size can be 0 is if size is 0.
-   */
-  if (new_p == NULL && new_size > 0) {
-    return E(MEM_SHRINK_BUF_ALLOC);
+  for (;;) {
+    slot = &ring->slots[head & ring->mask];
+
+    size_t sequence =
+      atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)head;
+
+    if (diff == 0) {
+      /* on failure head is updated to the current position */
+      if (atomic_compare_exchange_weak_explicit(&ring->head,
+                                                &head,
+                                                head + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      /* the slot was not popped from since the last lap */
+      return E(MEM_RING_PUSH_FULL);
+    } else {
+      head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
   }
 
-  m->p = new_p;
-  m->size = new_size;
+  slot->p = p;
+  atomic_store_explicit(&slot->sequence, head + 1, memory_order_release);
 
-  return MEM_SHRINK_BUF_OK;
+  return MEM_RING_PUSH_OK;
+}
+
+void*
+mem_ring_pop(struct mem_ring* ring)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  struct mem_ring_slot* slot;
+
+  for (;;) {
+    slot = &ring->slots[tail & ring->mask];
+
+    size_t sequence =
+      atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(tail + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail,
+                                                &tail,
+                                                tail + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+
+  void* p = slot->p;
+
+  /* free for the push one lap later */
+  atomic_store_explicit(
+    &slot->sequence, tail + ring->mask + 1, memory_order_release);
+
+  return p;
+}
+
+/* Calls of the allocator past here are the ones being counted */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+static atomic_ulong mem_count_total;
+
+#ifdef MEM_COUNT
+static pthread_mutex_t mem_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_count_site mem_count_table[MEM_COUNT_SITES];
+static size_t mem_count_used;
+
+static void
+mem_count(const char* file,
+          int line,
+          unsigned long allocs,
+          unsigned long frees,
+          size_t octets)
+{
+  atomic_fetch_add(&mem_count_total, allocs);
+
+  pthread_mutex_lock(&mem_count_lock);
+
+  /* sites are looked up by line first, __FILE__ of a file need not be the
+   * same pointer everywhere */
+  size_t i = (size_t)line % MEM_COUNT_SITES;
+
+  for (size_t n = 0; n < MEM_COUNT_SITES; ++n) {
+    struct mem_count_site* site = &mem_count_table[i];
+
+    if (site->file == NULL) {
+      site->file = file;
+      site->line = line;
+      ++mem_count_used;
+    }
+
+    if (site->line == line && strcmp(site->file, file) == 0) {
+      site->allocs += allocs;
+      site->frees += frees;
+      site->octets += octets;
+      break;
+    }
+
+    i = (i + 1) % MEM_COUNT_SITES;
+  }
+
+  pthread_mutex_unlock(&mem_count_lock);
+}
+
+void*
+mem_count_malloc(size_t size, const char* file, int line)
+{
+  mem_count(file, line, 1, 0, size);
+
+  return malloc(size);
+}
+
+void*
+mem_count_calloc(size_t count, size_t size, const char* file, int line)
+{
+  mem_count(file, line, 1, 0, count * size);
+
+  return calloc(count, size);
+}
+
+void*
+mem_count_realloc(void* p, size_t size, const char* file, int line)
+{
+  /* realloc(p, 0) frees p */
+  if (size == 0 && p != NULL)
+    mem_count(file, line, 0, 1, 0);
+  else
+    mem_count(file, line, 1, 0, size);
+
+  return realloc(p, size);
+}
+
+void
+mem_count_free(void* p, const char* file, int line)
+{
+  if (p != NULL)
+    mem_count(file, line, 0, 1, 0);
+
+  free(p);
+}
+#endif
+
+unsigned long
+mem_count_allocs(void)
+{
+  return atomic_load(&mem_count_total);
+}
+
+size_t
+mem_count_sites(struct mem_count_site* sites, size_t count)
+{
+#ifdef MEM_COUNT
+  size_t copied = 0;
+
+  pthread_mutex_lock(&mem_count_lock);
+
+  for (size_t i = 0; i < MEM_COUNT_SITES && copied < count; ++i)
+    if (mem_count_table[i].file != NULL)
+      sites[copied++] = mem_count_table[i];
+
+  size_t used = mem_count_used;
+
+  pthread_mutex_unlock(&mem_count_lock);
+
+  return used;
+#else
+  (void)sites;
+  (void)count;
+
+  return 0;
+#endif
 }
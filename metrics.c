@@ -0,0 +1,548 @@
+#include <sys/socket.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+#define NET_COUNTER_READ(name)                                                 \
+  values->name = atomic_load_explicit(&counters->name, memory_order_relaxed);
+
+void
+net_counters_read(struct net_counters* counters,
+                  struct net_counters_values* values)
+{
+  NET_COUNTERS(NET_COUNTER_READ)
+}
+
+static void
+net_command_counters_read(struct net_command_counters* counters,
+                          struct net_command_counters_values* values)
+{
+  NET_COMMAND_COUNTERS(NET_COUNTER_READ)
+}
+
+void
+net_metrics_snapshot(struct net_context* ctx,
+                     struct net_metrics_snapshot* snapshot)
+{
+  struct net_metrics* metrics = &ctx->metrics;
+
+  net_counters_read(&metrics->totals, &snapshot->totals);
+
+  snapshot->connections = atomic_load(&metrics->connections);
+  snapshot->accepted = atomic_load(&metrics->accepted);
+  snapshot->connected = atomic_load(&metrics->connected);
+  snapshot->closed = atomic_load(&metrics->closed);
+
+  for (size_t i = 0; i < NET_CLOSED_REASONS; ++i)
+    snapshot->closed_reasons[i] = atomic_load(&metrics->closed_reasons[i]);
+
+  for (size_t i = 0; i < NET_METRICS_TYPES; ++i)
+    net_command_counters_read(&metrics->commands[i], &snapshot->commands[i]);
+}
+
+void
+net_metrics_frame(struct net_context* ctx,
+                  struct net_tcp_conn* tcp_conn,
+                  struct command_header* header,
+                  int out)
+{
+  struct net_metrics* metrics = &ctx->metrics;
+  unsigned long octets = COMMAND_HEADER_SIZE + header->size;
+
+  if (tcp_conn)
+    net_counter_add(out ? &tcp_conn->counters.frames_out
+                        : &tcp_conn->counters.frames_in,
+                    1);
+
+  net_counter_add(
+    out ? &metrics->totals.frames_out : &metrics->totals.frames_in, 1);
+
+  if (header->type >= NET_METRICS_TYPES)
+    return;
+
+  struct net_command_counters* command = &metrics->commands[header->type];
+
+  if (out) {
+    net_counter_add(&command->frames_out, 1);
+    net_counter_add(&command->octets_out, octets);
+  } else {
+    net_counter_add(&command->frames_in, 1);
+    net_counter_add(&command->octets_in, octets);
+  }
+}
+
+uint64_t
+net_nanoseconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Bucket of a duration, durations below NET_LATENCY_SUB have a bucket each,
+ * then every power of 2 is split in NET_LATENCY_SUB buckets */
+static size_t
+net_latency_bucket(uint64_t duration)
+{
+  if (duration < NET_LATENCY_SUB)
+    return (size_t)duration;
+
+  size_t bits = 0;
+
+  while (bits < NET_LATENCY_BITS && (duration >> bits) >= 2 * NET_LATENCY_SUB)
+    ++bits;
+
+  if (bits + NET_LATENCY_SUB_BITS >= NET_LATENCY_BITS)
+    return NET_LATENCY_BUCKETS - 1;
+
+  return (bits + 1) * NET_LATENCY_SUB +
+         (size_t)((duration >> bits) - NET_LATENCY_SUB);
+}
+
+/* Highest duration that goes in a bucket */
+static uint64_t
+net_latency_bucket_max(size_t bucket)
+{
+  if (bucket < NET_LATENCY_SUB)
+    return bucket;
+
+  size_t bits = bucket / NET_LATENCY_SUB - 1;
+  uint64_t sub = bucket % NET_LATENCY_SUB;
+
+  return ((NET_LATENCY_SUB + sub + 1) << bits) - 1;
+}
+
+void
+net_latency_record(struct net_latency* latency, uint64_t duration)
+{
+  atomic_uint* bucket = &latency->buckets[net_latency_bucket(duration)];
+
+  atomic_store_explicit(
+    bucket,
+    atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+    memory_order_relaxed);
+
+  net_counter_add(&latency->count, 1);
+  net_counter_max(&latency->max, (unsigned long)duration);
+}
+
+unsigned long
+net_latency_percentile(struct net_latency* latency, unsigned int permille)
+{
+  unsigned long max = atomic_load(&latency->max);
+  unsigned long count = 0;
+
+  if (permille >= 1000)
+    return max;
+
+  /* the count may be behind the buckets while the loop records, the
+   * buckets are summed instead */
+  for (size_t i = 0; i < NET_LATENCY_BUCKETS; ++i)
+    count += atomic_load_explicit(&latency->buckets[i], memory_order_relaxed);
+
+  if (count == 0)
+    return 0;
+
+  /* rank of the duration, rounded up */
+  unsigned long rank = (unsigned long)(((unsigned long long)count * permille +
+                                        999) /
+                                       1000);
+  unsigned long seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (size_t i = 0; i < NET_LATENCY_BUCKETS; ++i) {
+    seen += atomic_load_explicit(&latency->buckets[i], memory_order_relaxed);
+
+    if (seen >= rank) {
+      uint64_t value = net_latency_bucket_max(i);
+
+      /* the bucket may go higher than anything recorded */
+      return value < max ? (unsigned long)value : max;
+    }
+  }
+
+  return max;
+}
+
+void
+net_metrics_response(struct net_tcp_conn* tcp_conn,
+                     struct command_header* header)
+{
+  struct command_state* state;
+
+  LIST_FOREACH(state, &tcp_conn->states, entry)
+  {
+    if (state->sent_at == 0 || state->type != header->type ||
+        state->tag != header->tag)
+      continue;
+
+    uint64_t round_trip = net_nanoseconds() - state->sent_at;
+
+    /* only the first response to a request is a round trip */
+    state->sent_at = 0;
+
+    if (header->type < NET_LATENCY_TYPES)
+      net_latency_record(
+        &tcp_conn->ctx->metrics.round_trips[header->type], round_trip);
+
+    if (tcp_conn->round_trips == NULL)
+      tcp_conn->round_trips = calloc(1, sizeof *tcp_conn->round_trips);
+
+    if (tcp_conn->round_trips)
+      net_latency_record(tcp_conn->round_trips, round_trip);
+
+    return;
+  }
+}
+
+void
+net_metrics_service(struct net_context* ctx,
+                    struct command_header* header,
+                    uint64_t duration)
+{
+  if (header->type < NET_LATENCY_TYPES)
+    net_latency_record(&ctx->metrics.service[header->type], duration);
+
+  if (duration > ctx->iteration.type_time) {
+    ctx->iteration.type = header->type;
+    ctx->iteration.type_time = duration;
+  }
+}
+
+static void
+net_latency_clear(struct net_latency* latency)
+{
+  atomic_store_explicit(&latency->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&latency->max, 0, memory_order_relaxed);
+
+  for (size_t i = 0; i < NET_LATENCY_BUCKETS; ++i)
+    atomic_store_explicit(&latency->buckets[i], 0, memory_order_relaxed);
+}
+
+static void
+net_latency_merge(struct net_latency* into, struct net_latency* latency)
+{
+  net_counter_add(&into->count, atomic_load(&latency->count));
+  net_counter_max(&into->max, atomic_load(&latency->max));
+
+  for (size_t i = 0; i < NET_LATENCY_BUCKETS; ++i)
+    atomic_store_explicit(
+      &into->buckets[i],
+      atomic_load_explicit(&into->buckets[i], memory_order_relaxed) +
+        atomic_load_explicit(&latency->buckets[i], memory_order_relaxed),
+      memory_order_relaxed);
+}
+
+void
+net_metrics_iteration(struct net_context* ctx)
+{
+  struct net_metrics* metrics = &ctx->metrics;
+  struct net_iteration* iteration = &ctx->iteration;
+  unsigned int current =
+    atomic_load_explicit(&metrics->loop_window, memory_order_relaxed);
+
+  if (ctx->now - ctx->loop_since >= NET_LOOP_WINDOW) {
+    current ^= 1;
+    net_latency_clear(&metrics->loop[current].busy);
+    net_latency_clear(&metrics->loop[current].lag);
+
+    for (size_t i = 0; i < NET_PHASES; ++i)
+      net_latency_clear(&metrics->loop[current].phases[i]);
+
+    atomic_store(&metrics->loop_window, current);
+    ctx->loop_since = ctx->now;
+  }
+
+  struct net_loop_window* window = &metrics->loop[current];
+
+  net_counter_add(&metrics->iterations, 1);
+  net_latency_record(&window->busy, iteration->busy);
+
+  if (iteration->due)
+    net_latency_record(&window->lag, iteration->lag);
+
+  /* phases an iteration went through, most go through few of them */
+  for (size_t i = 0; i < NET_PHASES; ++i) {
+    if (iteration->phases[i] > 0)
+      net_latency_record(&window->phases[i], iteration->phases[i]);
+  }
+}
+
+void
+net_metrics_loop(struct net_context* ctx, struct net_loop_window* window)
+{
+  memset(window, 0, sizeof *window);
+
+  for (size_t i = 0; i < 2; ++i) {
+    struct net_loop_window* from = &ctx->metrics.loop[i];
+
+    net_latency_merge(&window->busy, &from->busy);
+    net_latency_merge(&window->lag, &from->lag);
+
+    for (size_t j = 0; j < NET_PHASES; ++j)
+      net_latency_merge(&window->phases[j], &from->phases[j]);
+  }
+}
+
+int
+net_cb_metrics(int event, void* event_data, void** p)
+{
+  struct net_metrics* metrics = &((struct net_context*)*p)->metrics;
+
+  if (event == NET_EVENT_ESTABLISHED) {
+    struct net_event_data_established* established = event_data;
+
+    net_counter_add(&metrics->connections, 1);
+    net_counter_add(established->flags & NET_EVENT_ESTABLISHED_ACCEPT
+                      ? &metrics->accepted
+                      : &metrics->connected,
+                    1);
+  } else if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+
+    /* connections that failed to connect were never established */
+    if (!(closed->tcp_conn->flags & NET_TCP_CONN_CONNECTED))
+      return 0;
+
+    net_counter_sub(&metrics->connections, 1);
+    net_counter_add(&metrics->closed, 1);
+
+    for (size_t i = 0; i < NET_CLOSED_REASONS; ++i) {
+      if (closed->flags & (1 << i))
+        net_counter_add(&metrics->closed_reasons[i], 1);
+    }
+
+    if (closed->flags & NET_EVENT_CLOSED_MEMORY)
+      net_counter_add(&metrics->closed_memory, 1);
+  }
+
+  return 0;
+}
+
+/* Append a record unless its value is 0, which is what a missing record
+ * means */
+static void
+encode_stats_record(unsigned char* buf,
+                    size_t* size,
+                    unsigned char scope,
+                    unsigned long key,
+                    unsigned char counter,
+                    unsigned long value)
+{
+  if (value == 0)
+    return;
+
+  if (buf) {
+    struct stats_record record = {
+      .scope = scope,
+      .key = key,
+      .counter = counter,
+      .value_high = (unsigned long)((unsigned long long)value >> 32),
+      .value_low = value & 0xffffffffUL,
+    };
+
+    codec_encode_stats_record(buf + *size, &record);
+  }
+
+  *size += STATS_RECORD_SIZE;
+}
+
+/* Records of the count of a histogram followed by its percentiles, in the
+ * order of the STATS_* counters */
+static void
+encode_stats_latency(unsigned char* buf,
+                     size_t* size,
+                     unsigned char scope,
+                     unsigned long key,
+                     unsigned char counter,
+                     struct net_latency* latency)
+{
+  static const unsigned int permilles[] = { 500, 900, 990, 999, 1000 };
+
+  encode_stats_record(
+    buf, size, scope, key, counter++, atomic_load(&latency->count));
+
+  for (size_t i = 0; i < sizeof permilles / sizeof *permilles; ++i)
+    encode_stats_record(buf,
+                        size,
+                        scope,
+                        key,
+                        counter++,
+                        net_latency_percentile(latency, permilles[i]));
+}
+
+#define ENCODE_STATS_COUNTER(name)                                             \
+  encode_stats_record(buf, &size, scope, key, counter++, values.name);
+
+size_t
+encode_stats(struct net_context* ctx, unsigned char* buf)
+{
+  struct net_metrics_snapshot snapshot;
+  struct net_tcp_conn* tcp_conn;
+  unsigned long states = 0;
+  size_t size = 0;
+
+  net_metrics_snapshot(ctx, &snapshot);
+
+  /* states are only ever touched by the loop, they are counted on demand */
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    struct command_state* state;
+
+    LIST_FOREACH(state, &tcp_conn->states, entry)
+    {
+      ++states;
+    }
+  }
+
+  {
+    unsigned char scope = STATS_SCOPE_NODE;
+    unsigned long key = 0;
+    unsigned char counter = 0;
+    struct net_counters_values values = snapshot.totals;
+
+    NET_COUNTERS(ENCODE_STATS_COUNTER)
+
+    encode_stats_record(buf, &size, scope, key, STATS_STATES, states);
+    encode_stats_record(
+      buf, &size, scope, key, STATS_CONNECTIONS, snapshot.connections);
+    encode_stats_record(
+      buf, &size, scope, key, STATS_ACCEPTED, snapshot.accepted);
+    encode_stats_record(
+      buf, &size, scope, key, STATS_CONNECTED, snapshot.connected);
+    encode_stats_record(buf, &size, scope, key, STATS_CLOSED, snapshot.closed);
+
+    for (size_t i = 0; i < NET_CLOSED_REASONS; ++i)
+      encode_stats_record(buf,
+                          &size,
+                          scope,
+                          key,
+                          STATS_CLOSED_REASONS + i,
+                          snapshot.closed_reasons[i]);
+
+    struct net_metrics* metrics = &ctx->metrics;
+    struct net_loop_window window;
+
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_ITERATIONS,
+                        atomic_load(&metrics->iterations));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_FDS_READY,
+                        atomic_load(&metrics->fds_ready));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_FDS_SCANNED,
+                        atomic_load(&metrics->fds_scanned));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_SLOW_ITERATIONS,
+                        atomic_load(&metrics->slow_iterations));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_REFUSED,
+                        atomic_load(&metrics->refused));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_CLOSED_MEMORY,
+                        atomic_load(&metrics->closed_memory));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_MEMORY,
+                        atomic_load(&metrics->memory));
+    encode_stats_record(buf,
+                        &size,
+                        scope,
+                        key,
+                        STATS_MEMORY_PRESSURE,
+                        atomic_load(&metrics->memory_pressure));
+
+    net_metrics_loop(ctx, &window);
+
+    encode_stats_latency(buf, &size, scope, key, STATS_BUSY, &window.busy);
+    encode_stats_latency(buf, &size, scope, key, STATS_LAG, &window.lag);
+
+    for (size_t i = 0; i < NET_PHASES; ++i)
+      encode_stats_latency(buf,
+                           &size,
+                           scope,
+                           key,
+                           STATS_PHASES + i * STATS_LATENCY_COUNTERS,
+                           &window.phases[i]);
+  }
+
+  for (unsigned long key = 0; key < NET_METRICS_TYPES; ++key) {
+    unsigned char scope = STATS_SCOPE_COMMAND;
+    unsigned char counter = 0;
+    struct net_command_counters_values values = snapshot.commands[key];
+
+    NET_COMMAND_COUNTERS(ENCODE_STATS_COUNTER)
+
+    if (key < NET_LATENCY_TYPES) {
+      encode_stats_latency(buf,
+                           &size,
+                           scope,
+                           key,
+                           STATS_ROUND_TRIPS,
+                           &ctx->metrics.round_trips[key]);
+      encode_stats_latency(
+        buf, &size, scope, key, STATS_SERVICES, &ctx->metrics.service[key]);
+    }
+  }
+
+  size_t count = 0;
+
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    if (count++ == STATS_CONNECTIONS_MAX)
+      break;
+
+    unsigned char scope = STATS_SCOPE_CONNECTION;
+    unsigned long key = tcp_conn->id;
+    unsigned char counter = 0;
+    struct net_counters_values values;
+    struct command_state* state;
+    unsigned long conn_states = 0;
+
+    net_counters_read(&tcp_conn->counters, &values);
+
+    NET_COUNTERS(ENCODE_STATS_COUNTER)
+
+    LIST_FOREACH(state, &tcp_conn->states, entry)
+    {
+      ++conn_states;
+    }
+
+    encode_stats_record(buf, &size, scope, key, STATS_STATES, conn_states);
+
+    if (tcp_conn->round_trips)
+      encode_stats_latency(
+        buf, &size, scope, key, STATS_ROUND_TRIPS, tcp_conn->round_trips);
+  }
+
+  return size;
+}
@@ -1,65 +1,1727 @@
+#define _GNU_SOURCE
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "queue.h"
-#include "unilink.h"
+#include "queue.h"
+#include "unilink.h"
+
+#ifndef __linux__
+/* recvmmsg(2) and sendmmsg(2) are emulated with one system call per
+ * datagram where they are not available */
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+static unsigned long
+net_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+net_context_init(struct net_context* ctx)
+{
+  memset(ctx, 0, sizeof *ctx);
+
+  FD_ZERO(&ctx->readfds);
+  FD_ZERO(&ctx->writefds);
+
+  ctx->now = net_clock();
+
+  /* must not be 0 or the generator only ever returns 0 */
+  ctx->random = ((unsigned long long)time(NULL) << 20) ^
+                ((unsigned long long)getpid() << 1) ^ ctx->now ^ 1;
+
+  for (size_t i = 0; i < sizeof ctx->tcp_boundfds / sizeof *ctx->tcp_boundfds;
+       ++i) {
+    ctx->tcp_boundfds[i] = -1;
+  }
+
+  for (size_t i = 0;
+       i < sizeof ctx->unix_boundfds / sizeof *ctx->unix_boundfds;
+       ++i) {
+    ctx->unix_boundfds[i] = -1;
+  }
+
+  for (size_t i = 0; i < sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds;
+       ++i) {
+    ctx->udp_boundfds[i] = -1;
+    STAILQ_INIT(&ctx->udp_send_queues[i]);
+  }
+
+  for (size_t i = 0; i < sizeof ctx->wake_fds / sizeof *ctx->wake_fds; ++i) {
+    ctx->wake_fds[i] = -1;
+  }
+
+  ctx->post_wake_fds[0] = -1;
+  ctx->post_wake_fds[1] = -1;
+
+  ctx->conn_memory_max = NET_CONN_MEMORY_MAX;
+
+  ctx->peer_callback.events =
+    NET_EVENT_ESTABLISHED | NET_EVENT_CLOSED | NET_EVENT_TICK;
+  ctx->peer_callback.p = ctx;
+  ctx->peer_callback.cb = net_cb_peer;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &ctx->peer_callback, entry);
+
+  ctx->metrics_callback.events = NET_EVENT_ESTABLISHED | NET_EVENT_CLOSED;
+  ctx->metrics_callback.p = ctx;
+  ctx->metrics_callback.cb = net_cb_metrics;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &ctx->metrics_callback, entry);
+}
+
+void
+net_context_wake_at(struct net_context* ctx, unsigned long when)
+{
+  if (when < ctx->wake_at)
+    ctx->wake_at = when;
+}
+
+unsigned long
+net_random(struct net_context* ctx, unsigned long bound)
+{
+  /* xorshift64* */
+  ctx->random ^= ctx->random >> 12;
+  ctx->random ^= ctx->random << 25;
+  ctx->random ^= ctx->random >> 27;
+
+  return (unsigned long)((ctx->random * 0x2545F4914F6CDD1DULL) >> 11) % bound;
+}
+
+void
+net_fd_int_array_set(fd_set* set, int* nfds, int* array, size_t size)
+{
+  for (size_t i = 0; i < size / sizeof *array; ++i) {
+    int fd = array[i];
+
+    /* select(2) can't watch descriptors past FD_SETSIZE */
+    if (fd >= 0 && fd < FD_SETSIZE) {
+      FD_SET(fd, set);
+
+      if (fd >= *nfds) {
+        *nfds = fd + 1;
+      }
+    }
+  }
+}
+
+int
+net_wake_open(struct net_context* ctx, int fds[2])
+{
+  size_t i = 0;
+
+  while (i < sizeof ctx->wake_fds / sizeof *ctx->wake_fds &&
+         ctx->wake_fds[i] >= 0)
+    ++i;
+
+  if (i == sizeof ctx->wake_fds / sizeof *ctx->wake_fds)
+    return E(NET_WAKE_OPEN_FULL);
+
+#ifdef __linux__
+  fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fds[0] == -1)
+    return E(NET_WAKE_OPEN_ERROR);
+
+  fds[1] = fds[0];
+#else
+  if (pipe(fds) == -1)
+    return E(NET_WAKE_OPEN_ERROR);
+
+  /* a full pipe already wakes the loop up, signals never block */
+  if (net_set_nonblock(fds[0]) != NET_SET_NONBLOCK_OK ||
+      net_set_nonblock(fds[1]) != NET_SET_NONBLOCK_OK) {
+    close(fds[0]);
+    close(fds[1]);
+    return E(NET_WAKE_OPEN_ERROR);
+  }
+#endif
+
+  if (fds[0] >= FD_SETSIZE) {
+    close(fds[0]);
+    if (fds[1] != fds[0])
+      close(fds[1]);
+    return E(NET_WAKE_OPEN_ERROR);
+  }
+
+  ctx->wake_fds[i] = fds[0];
+  FD_SET(fds[0], &ctx->readfds);
+
+  return NET_WAKE_OPEN_OK;
+}
+
+void
+net_wake_close(struct net_context* ctx, int fds[2])
+{
+  for (size_t i = 0; i < sizeof ctx->wake_fds / sizeof *ctx->wake_fds; ++i) {
+    if (ctx->wake_fds[i] == fds[0])
+      ctx->wake_fds[i] = -1;
+  }
+
+  FD_CLR(fds[0], &ctx->readfds);
+
+  close(fds[0]);
+
+  if (fds[1] != fds[0])
+    close(fds[1]);
+
+  fds[0] = -1;
+  fds[1] = -1;
+}
+
+void
+net_wake_signal(int fd)
+{
+#ifdef __linux__
+  uint64_t one = 1;
+#else
+  unsigned char one = 1;
+#endif
+
+  /* only fails once the counter would overflow or the pipe is full, the fd
+   * is then signaled already */
+  ssize_t write_ret = write(fd, &one, sizeof one);
+  (void)write_ret;
+}
+
+/* Reset a wakeup fd to unsignaled */
+static void
+net_wake_drain(int fd)
+{
+#ifdef __linux__
+  uint64_t count;
+
+  /* reading the counter resets it */
+  ssize_t read_ret = read(fd, &count, sizeof count);
+  (void)read_ret;
+#else
+  unsigned char buf[256];
+
+  while (read(fd, buf, sizeof buf) > 0)
+    ;
+#endif
+}
+
+int
+net_post_init(struct net_context* ctx)
+{
+  if (mem_ring_init(&ctx->posts, NET_POST_RING_SIZE) != MEM_RING_INIT_OK)
+    return E(NET_POST_INIT_ALLOC);
+
+  if (net_wake_open(ctx, ctx->post_wake_fds) != NET_WAKE_OPEN_OK) {
+    mem_ring_free(&ctx->posts);
+    ctx->post_wake_fds[0] = -1;
+    ctx->post_wake_fds[1] = -1;
+    return E(NET_POST_INIT_WAKE);
+  }
+
+  atomic_init(&ctx->posts_signaled, 0);
+  atomic_init(&ctx->posts_memory, 0);
+
+  ctx->post_callback.events = NET_EVENT_WAKE;
+  ctx->post_callback.p = ctx;
+  ctx->post_callback.cb = net_cb_post;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &ctx->post_callback, entry);
+
+  return NET_POST_INIT_OK;
+}
+
+static void
+net_post_free_one(struct net_post* post)
+{
+  mem_shared_unref(post->shared);
+  free(post);
+}
+
+/* Octets a posted frame takes */
+static size_t
+net_post_memory(struct net_post* post)
+{
+  return sizeof *post + sizeof *post->shared + post->shared->size;
+}
+
+void
+net_post_free(struct net_context* ctx)
+{
+  struct net_post* post;
+
+  LIST_REMOVE(&ctx->post_callback, entry);
+
+  while ((post = mem_ring_pop(&ctx->posts)) != NULL)
+    net_post_free_one(post);
+
+  net_wake_close(ctx, ctx->post_wake_fds);
+  mem_ring_free(&ctx->posts);
+}
+
+int
+net_context_post(struct net_context* ctx,
+                 unsigned long conn_id,
+                 const void* data,
+                 size_t size)
+{
+  struct net_post* post = malloc(sizeof *post);
+
+  if (post == NULL)
+    return E(NET_CONTEXT_POST_ALLOC);
+
+  post->conn_id = conn_id;
+  post->shared = mem_shared_alloc(size);
+
+  if (post->shared == NULL) {
+    free(post);
+    return E(NET_CONTEXT_POST_ALLOC);
+  }
+
+  memcpy(post->shared->data, data, size);
+
+  /* before the loop may take it and count it out */
+  atomic_fetch_add_explicit(
+    &ctx->posts_memory, net_post_memory(post), memory_order_relaxed);
+
+  if (mem_ring_push(&ctx->posts, post) != MEM_RING_PUSH_OK) {
+    atomic_fetch_sub_explicit(
+      &ctx->posts_memory, net_post_memory(post), memory_order_relaxed);
+    net_post_free_one(post);
+    return E(NET_CONTEXT_POST_FULL);
+  }
+
+  /* a single wakeup for every frame posted until the loop takes them */
+  if (atomic_exchange(&ctx->posts_signaled, 1) == 0)
+    net_wake_signal(ctx->post_wake_fds[1]);
+
+  return NET_CONTEXT_POST_OK;
+}
+
+/* Queue a posted frame, or keep it for later while a frame is partially
+ * written or frames posted before it are waiting */
+static void
+net_post_queue(struct net_context* ctx,
+               struct net_tcp_conn* tcp_conn,
+               struct net_post* post)
+{
+  if (STAILQ_EMPTY(&tcp_conn->posted) &&
+      net_tcp_conn_send_shared(tcp_conn, post->shared) ==
+        NET_TCP_CONN_SEND_SHARED_OK) {
+    net_post_free_one(post);
+    return;
+  }
+
+  STAILQ_INSERT_TAIL(&tcp_conn->posted, post, entry);
+  ++ctx->posts_deferred;
+}
+
+/* Queue the frames that were kept for later, once they can be */
+static void
+net_post_flush(struct net_context* ctx)
+{
+  struct net_tcp_conn* tcp_conn;
+  size_t deferred = 0;
+
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    struct net_post* post;
+
+    while ((post = STAILQ_FIRST(&tcp_conn->posted)) != NULL &&
+           net_tcp_conn_send_shared(tcp_conn, post->shared) ==
+             NET_TCP_CONN_SEND_SHARED_OK) {
+      STAILQ_REMOVE_HEAD(&tcp_conn->posted, entry);
+      net_post_free_one(post);
+    }
+
+    /* closed connections freed theirs, this is recounted every time */
+    STAILQ_FOREACH(post, &tcp_conn->posted, entry)
+    {
+      ++deferred;
+    }
+  }
+
+  ctx->posts_deferred = deferred;
+}
+
+/* By decreasing connection id, then in the order they were posted */
+static int
+net_post_compare(const void* a, const void* b)
+{
+  const struct net_post* post_a = *(struct net_post* const*)a;
+  const struct net_post* post_b = *(struct net_post* const*)b;
+
+  if (post_a->conn_id != post_b->conn_id)
+    return post_a->conn_id > post_b->conn_id ? -1 : 1;
+
+  return post_a->order < post_b->order ? -1 : post_a->order > post_b->order;
+}
+
+/* Take the posted frames in batches sorted like the connections, so that a
+ * batch is matched to them in a single walk of the list */
+static void
+net_post_take(struct net_context* ctx)
+{
+  struct net_post* batch[NET_POST_BATCH];
+  size_t taken = 0;
+
+  atomic_store(&ctx->posts_signaled, 0);
+
+  for (;;) {
+    size_t count = 0;
+
+    while (count < NET_POST_BATCH &&
+           (batch[count] = mem_ring_pop(&ctx->posts)) != NULL) {
+      atomic_fetch_sub_explicit(&ctx->posts_memory,
+                                net_post_memory(batch[count]),
+                                memory_order_relaxed);
+      batch[count]->order = count;
+      ++count;
+    }
+
+    if (count == 0)
+      return;
+
+    qsort(batch, count, sizeof *batch, net_post_compare);
+
+    struct net_tcp_conn* tcp_conn = LIST_FIRST(&ctx->tcp_conns);
+
+    for (size_t i = 0; i < count; ++i) {
+      while (tcp_conn && tcp_conn->id > batch[i]->conn_id)
+        tcp_conn = LIST_NEXT(tcp_conn, entry);
+
+      if (tcp_conn && tcp_conn->id == batch[i]->conn_id) {
+        net_post_queue(ctx, tcp_conn, batch[i]);
+      } else {
+        ++ctx->posts_dropped;
+        net_post_free_one(batch[i]);
+      }
+    }
+
+    /* let the loop handle I/O, what is left is taken on the next iteration */
+    taken += count;
+
+    if (taken >= NET_POST_RING_SIZE) {
+      if (atomic_exchange(&ctx->posts_signaled, 1) == 0)
+        net_wake_signal(ctx->post_wake_fds[1]);
+      return;
+    }
+  }
+}
+
+int
+net_cb_post(int event, void* event_data, void** p)
+{
+  struct net_context* ctx = *p;
+  struct net_event_data_wake* wake = event_data;
+
+  if (event == NET_EVENT_WAKE && wake->fd == ctx->post_wake_fds[0])
+    net_post_take(ctx);
+
+  return 0;
+}
+
+int
+net_set_nonblock(int fd)
+{
+  int s = fcntl(fd, F_GETFL);
+  if (s == -1) {
+    return E(NET_SET_NONBLOCK_FCNTL_F_GETFL);
+  }
+
+  s = s | O_NONBLOCK;
+
+  s = fcntl(fd, F_SETFL, s);
+  if (s == -1) {
+    return E(NET_SET_NONBLOCK_FCNTL_F_SETFL);
+  }
+
+  return NET_SET_NONBLOCK_OK;
+}
+
+int
+net_udp_send(struct net_context* ctx,
+             int fd,
+             struct sockaddr* sa,
+             socklen_t sa_len,
+             void* data,
+             size_t size)
+{
+  /* a transport has no sockets, it takes the datagram right away */
+  if (ctx->transport) {
+    if (sa_len > sizeof(struct sockaddr_storage))
+      return E(NET_UDP_SEND_FD);
+
+    ctx->transport->datagram(ctx->transport, ctx, sa, sa_len, data, size);
+
+    return NET_UDP_SEND_OK;
+  }
+
+  size_t i = 0;
+
+  while (i < sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds &&
+         (fd < 0 || ctx->udp_boundfds[i] != fd))
+    ++i;
+
+  if (i == sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds ||
+      sa_len > sizeof(struct sockaddr_storage)) {
+    return E(NET_UDP_SEND_FD);
+  }
+
+  /* replies are dropped rather than held for a peer we can't keep up
+   * with, as the network would */
+  if (ctx->udp_send_queued[i] + sizeof(struct net_datagram) + size >
+      NET_UDP_QUEUED_MAX) {
+    return E(NET_UDP_SEND_FULL);
+  }
+
+  struct net_datagram* datagram = malloc(sizeof *datagram + size);
+  if (datagram == NULL) {
+    return E(NET_UDP_SEND_ALLOC);
+  }
+
+  memcpy(&datagram->sa, sa, sa_len);
+  datagram->sa_len = sa_len;
+  datagram->size = size;
+  memcpy(datagram->data, data, size);
+
+  STAILQ_INSERT_TAIL(&ctx->udp_send_queues[i], datagram, entry);
+  ctx->udp_send_queued[i] += sizeof *datagram + size;
+
+  return NET_UDP_SEND_OK;
+}
+
+static void
+net_udp_receive(struct net_context* ctx, int fd)
+{
+  struct mmsghdr msgs[NET_UDP_BATCH];
+  struct iovec iovs[NET_UDP_BATCH];
+  struct sockaddr_storage sas[NET_UDP_BATCH];
+
+  if (ctx->udp_receive_buf.size == 0 &&
+      mem_grow_buf(&ctx->udp_receive_buf,
+                   NULL,
+                   NET_UDP_BATCH * NET_UDP_DATAGRAM_SIZE) != MEM_GROW_BUF_OK) {
+    return;
+  }
+
+  do {
+    for (size_t i = 0; i < NET_UDP_BATCH; ++i) {
+      iovs[i].iov_base =
+        (unsigned char*)ctx->udp_receive_buf.p + i * NET_UDP_DATAGRAM_SIZE;
+      iovs[i].iov_len = NET_UDP_DATAGRAM_SIZE;
+
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_name = &sas[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof sas[i];
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+#ifdef __linux__
+    int count = recvmmsg(fd, msgs, NET_UDP_BATCH, 0, NULL);
+#else
+    int count = 0;
+
+    while (count < NET_UDP_BATCH) {
+      ssize_t recvmsg_ret = recvmsg(fd, &msgs[count].msg_hdr, 0);
+      if (recvmsg_ret == -1)
+        break;
+
+      msgs[count++].msg_len = (unsigned int)recvmsg_ret;
+    }
+
+    if (count == 0)
+      count = -1;
+#endif
+
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+
+      /* EAGAIN or an error we can't do anything about, like an ICMP error
+       * reported for a previous datagram */
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      /* datagrams that did not fit can't be complete commands */
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        continue;
+
+      struct net_callback* callback_entry;
+      LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+      {
+        if (callback_entry->events & NET_EVENT_DATAGRAM) {
+          struct net_event_data_datagram event_data;
+
+          event_data.flags = 0;
+          event_data.ctx = ctx;
+          event_data.fd = fd;
+          event_data.sa = &sas[i];
+          event_data.sa_len = msgs[i].msg_hdr.msg_namelen;
+          event_data.data = iovs[i].iov_base;
+          event_data.size = msgs[i].msg_len;
+
+          callback_entry->cb(
+            NET_EVENT_DATAGRAM, &event_data, &callback_entry->p);
+        }
+      }
+    }
+
+    /* a partial batch means the socket has been drained */
+    if (count < NET_UDP_BATCH)
+      break;
+  } while (1);
+}
+
+static void
+net_udp_flush(struct net_context* ctx, size_t index)
+{
+  int fd = ctx->udp_boundfds[index];
+  struct net_datagrams* queue = &ctx->udp_send_queues[index];
+
+  while (!STAILQ_EMPTY(queue)) {
+    struct mmsghdr msgs[NET_UDP_BATCH];
+    struct iovec iovs[NET_UDP_BATCH];
+    struct net_datagram* datagram;
+    unsigned int batch = 0;
+
+    STAILQ_FOREACH(datagram, queue, entry)
+    {
+      if (batch == NET_UDP_BATCH)
+        break;
+
+      iovs[batch].iov_base = datagram->data;
+      iovs[batch].iov_len = datagram->size;
+
+      memset(&msgs[batch], 0, sizeof msgs[batch]);
+      msgs[batch].msg_hdr.msg_name = &datagram->sa;
+      msgs[batch].msg_hdr.msg_namelen = datagram->sa_len;
+      msgs[batch].msg_hdr.msg_iov = &iovs[batch];
+      msgs[batch].msg_hdr.msg_iovlen = 1;
+
+      ++batch;
+    }
+
+#ifdef __linux__
+    int count = sendmmsg(fd, msgs, batch, 0);
+#else
+    int count = 0;
+
+    while ((unsigned int)count < batch &&
+           sendmsg(fd, &msgs[count].msg_hdr, 0) != -1)
+      ++count;
+
+    if (count == 0)
+      count = -1;
+#endif
+
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+
+      /* sendmmsg(2) until it returns that it would block */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      /* the first datagram can't be sent, drop it instead of retrying it
+       * forever */
+      count = 1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      datagram = STAILQ_FIRST(queue);
+      STAILQ_REMOVE_HEAD(queue, entry);
+      ctx->udp_send_queued[index] -= sizeof *datagram + datagram->size;
+      free(datagram);
+    }
+  }
+}
+
+int
+net_tcp_conn_send_fd(struct net_tcp_conn* tcp_conn, int fd)
+{
+  if (!(tcp_conn->flags & NET_TCP_CONN_UNIX)) {
+    return E(NET_TCP_CONN_SEND_FD_NOT_UNIX);
+  }
+
+  if (mem_grow_buf(&tcp_conn->send_fds, &fd, sizeof fd) != MEM_GROW_BUF_OK) {
+    return E(NET_TCP_CONN_SEND_FD_ALLOC);
+  }
+
+  return NET_TCP_CONN_SEND_FD_OK;
+}
+
+int
+net_tcp_conn_take_fd(struct net_tcp_conn* tcp_conn)
+{
+  int fd;
+
+  if (tcp_conn->receive_fds.size < sizeof fd)
+    return -1;
+
+  memcpy(&fd, tcp_conn->receive_fds.p, sizeof fd);
+
+  if (mem_shrink_buf_head(&tcp_conn->receive_fds, sizeof fd) !=
+      MEM_SHRINK_BUF_HEAD_OK) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+net_close_fds(struct mem_buf* fds)
+{
+  for (size_t i = 0; i < fds->size / sizeof(int); ++i) {
+    int fd;
+
+    memcpy(&fd, (unsigned char*)fds->p + i * sizeof fd, sizeof fd);
+    close(fd);
+  }
+
+  mem_free_buf(fds);
+}
+
+/* Release a connection that was closed and removed from its list */
+static void
+net_tcp_conn_free(struct net_tcp_conn* tcp_conn)
+{
+  mem_free_buf(&tcp_conn->receive_buf);
+  mem_free_buf(&tcp_conn->send_buf);
+  net_close_fds(&tcp_conn->receive_fds);
+  net_close_fds(&tcp_conn->send_fds);
+
+  while (!TAILQ_EMPTY(&tcp_conn->send_queue)) {
+    struct net_send_entry* send_entry = TAILQ_FIRST(&tcp_conn->send_queue);
+
+    TAILQ_REMOVE(&tcp_conn->send_queue, send_entry, entry);
+    mem_shared_unref(send_entry->shared);
+    mem_free_buf(&send_entry->tail);
+    free(send_entry);
+  }
+
+  while (!STAILQ_EMPTY(&tcp_conn->posted)) {
+    struct net_post* post = STAILQ_FIRST(&tcp_conn->posted);
+
+    STAILQ_REMOVE_HEAD(&tcp_conn->posted, entry);
+    mem_shared_unref(post->shared);
+    free(post);
+  }
+
+  /* Free all command states associated with connection */
+  struct command_state* state;
+  while (!LIST_EMPTY(&tcp_conn->states)) {
+    state = LIST_FIRST(&tcp_conn->states);
+    LIST_REMOVE(state, entry);
+    if (state->free) {
+      /* not a call to free(3), which -DMEM_COUNT redefines */
+      (*state->free)(state->state);
+    }
+    free(state);
+  }
+
+  free(tcp_conn->round_trips);
+  free(tcp_conn);
+}
+
+void
+net_tcp_conn_close(struct net_tcp_conn* tcp_conn, int flags)
+{
+  if (tcp_conn->flags & NET_TCP_CONN_CLOSING)
+    return;
+
+  tcp_conn->flags |= NET_TCP_CONN_CLOSING;
+  tcp_conn->close_flags = flags;
+}
+
+void
+net_close_closing(struct net_context* ctx)
+{
+  struct net_tcp_conn* tcp_conn = LIST_FIRST(&ctx->tcp_conns);
+
+  while (tcp_conn != NULL) {
+    struct net_tcp_conn* next = LIST_NEXT(tcp_conn, entry);
+
+    if (tcp_conn->flags & NET_TCP_CONN_CLOSING) {
+      if (ctx->transport) {
+        ctx->transport->close(ctx->transport, tcp_conn);
+      } else {
+        FD_CLR(tcp_conn->fd, &ctx->readfds);
+        FD_CLR(tcp_conn->fd, &ctx->writefds);
+
+        shutdown(tcp_conn->fd, SHUT_RDWR);
+        close(tcp_conn->fd);
+      }
+
+      TRACE_EVENT(TRACE_CLOSE, tcp_conn->id, 0, tcp_conn->close_flags, 0);
+
+      struct net_callback* callback_entry;
+      LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+      {
+        if (callback_entry->events & NET_EVENT_CLOSED) {
+          struct net_event_data_closed event_data;
+
+          event_data.flags = tcp_conn->close_flags;
+          event_data.tcp_conn = tcp_conn;
+
+          callback_entry->cb(
+            NET_EVENT_CLOSED, &event_data, &callback_entry->p);
+        }
+      }
+
+      /* callbacks only flag connections, next is still in the list */
+      LIST_REMOVE(tcp_conn, entry);
+      net_tcp_conn_free(tcp_conn);
+    }
+
+    tcp_conn = next;
+  }
+}
+
+/* Octets a connection holds, shared buffers aside as other connections may
+ * hold them too */
+static size_t
+net_tcp_conn_memory(struct net_tcp_conn* tcp_conn)
+{
+  size_t memory = sizeof *tcp_conn + tcp_conn->send_buf.capacity +
+                  tcp_conn->receive_buf.capacity +
+                  tcp_conn->send_fds.capacity + tcp_conn->receive_fds.capacity;
+
+  if (tcp_conn->round_trips)
+    memory += sizeof *tcp_conn->round_trips;
+
+  struct command_state* state;
+  LIST_FOREACH(state, &tcp_conn->states, entry)
+  {
+    memory += sizeof *state;
+  }
+
+  struct net_send_entry* send_entry;
+  TAILQ_FOREACH(send_entry, &tcp_conn->send_queue, entry)
+  {
+    memory += sizeof *send_entry + send_entry->tail.capacity;
+  }
+
+  /* unlike queued shared buffers, those of posted frames are only theirs */
+  struct net_post* post;
+  STAILQ_FOREACH(post, &tcp_conn->posted, entry)
+  {
+    memory += net_post_memory(post);
+  }
+
+  return memory;
+}
+
+/* Account what connections and the rest of the node hold, flagging the
+ * heaviest connections to be closed until everything fits in
+ * ctx->memory_max */
+static void
+net_memory_enforce(struct net_context* ctx)
+{
+  struct net_event_data_memory event_data;
+
+  event_data.flags = 0;
+  event_data.ctx = ctx;
+  event_data.memory =
+    atomic_load_explicit(&ctx->posts_memory, memory_order_relaxed);
+
+  for (size_t i = 0; i < sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds;
+       ++i)
+    event_data.memory += ctx->udp_send_queued[i];
+
+  struct net_callback* callback_entry;
+  LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+  {
+    if (callback_entry->events & NET_EVENT_MEMORY)
+      callback_entry->cb(NET_EVENT_MEMORY, &event_data, &callback_entry->p);
+  }
+
+  struct net_tcp_conn* tcp_conn;
+  size_t used = event_data.memory;
+
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    if (tcp_conn->flags & NET_TCP_CONN_CLOSING)
+      continue;
+
+    tcp_conn->memory = net_tcp_conn_memory(tcp_conn);
+    used += tcp_conn->memory;
+  }
+
+  /* rare enough that looking for the heaviest each time is fine */
+  while (ctx->memory_max > 0 && used > ctx->memory_max) {
+    struct net_tcp_conn* heaviest = NULL;
+
+    LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+    {
+      if (!(tcp_conn->flags & NET_TCP_CONN_CLOSING) &&
+          (heaviest == NULL || tcp_conn->memory > heaviest->memory))
+        heaviest = tcp_conn;
+    }
+
+    if (heaviest == NULL)
+      break;
+
+    net_tcp_conn_close(heaviest, NET_EVENT_CLOSED_MEMORY);
+    used -= heaviest->memory;
+  }
+
+  atomic_store_explicit(&ctx->metrics.memory, used, memory_order_relaxed);
+}
+
+/* Past ctx->memory_soft, clear bound TCP sockets from readfds so that new
+ * connections wait in the backlog, and connections holding more than their
+ * share so that they don't grow while the others drain. Local clients, which
+ * monitor the node, are still accepted. */
+static void
+net_memory_pause(struct net_context* ctx, fd_set* readfds)
+{
+  size_t used =
+    atomic_load_explicit(&ctx->metrics.memory, memory_order_relaxed);
+
+  if (ctx->memory_soft == 0 || used <= ctx->memory_soft)
+    return;
+
+  net_counter_add(&ctx->metrics.memory_pressure, 1);
+
+  for (size_t i = 0; i < sizeof ctx->tcp_boundfds / sizeof *ctx->tcp_boundfds;
+       ++i) {
+    if (ctx->tcp_boundfds[i] >= 0)
+      FD_CLR(ctx->tcp_boundfds[i], readfds);
+  }
+
+  struct net_tcp_conn* tcp_conn;
+  size_t count = 0;
+
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    ++count;
+  }
+
+  size_t share = ctx->memory_soft / (count > 0 ? count : 1);
+
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    if (tcp_conn->memory > share)
+      FD_CLR(tcp_conn->fd, readfds);
+  }
+}
+
+/* Count a call to recv(2) or send(2) and what it transferred */
+static void
+net_count_io(struct net_tcp_conn* tcp_conn, ssize_t ret, int send)
+{
+  struct net_counters* counters = &tcp_conn->counters;
+  struct net_counters* totals = &tcp_conn->ctx->metrics.totals;
+
+  if (send) {
+    net_counter_add(&counters->send_calls, 1);
+    net_counter_add(&totals->send_calls, 1);
+  } else {
+    net_counter_add(&counters->recv_calls, 1);
+    net_counter_add(&totals->recv_calls, 1);
+  }
+
+  if (ret > 0) {
+    net_counter_add(send ? &counters->octets_out : &counters->octets_in,
+                    (unsigned long)ret);
+    net_counter_add(send ? &totals->octets_out : &totals->octets_in,
+                    (unsigned long)ret);
+  } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    net_counter_add(send ? &counters->send_again : &counters->recv_again, 1);
+    net_counter_add(send ? &totals->send_again : &totals->recv_again, 1);
+  }
+}
+
+/* Record how many octets a connection holds in a buffer */
+static void
+net_count_buf(struct net_tcp_conn* tcp_conn, size_t size, int send)
+{
+  struct net_counters* totals = &tcp_conn->ctx->metrics.totals;
+
+  if (send) {
+    net_counter_max(&tcp_conn->counters.send_buf_max, size);
+    net_counter_max(&totals->send_buf_max, size);
+  } else {
+    net_counter_max(&tcp_conn->counters.receive_buf_max, size);
+    net_counter_max(&totals->receive_buf_max, size);
+  }
+}
+
+/* recv(2), also collecting file descriptors on UNIX domain connections */
+static ssize_t
+net_tcp_conn_recv(struct net_tcp_conn* tcp_conn, void* buf, size_t size)
+{
+  if (!(tcp_conn->flags & NET_TCP_CONN_UNIX))
+    return recv(tcp_conn->fd, buf, size, 0);
+
+  union
+  {
+    struct cmsghdr align;
+    unsigned char buf[CMSG_SPACE(NET_UNIX_FDS_MAX * sizeof(int))];
+  } control;
+
+  struct iovec iov = { .iov_base = buf, .iov_len = size };
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+
+  ssize_t recvmsg_ret = recvmsg(tcp_conn->fd, &msg, 0);
+  if (recvmsg_ret <= 0)
+    return recvmsg_ret;
+
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    size_t fds_size = cmsg->cmsg_len - CMSG_LEN(0);
+    size_t held = tcp_conn->receive_fds.size / sizeof(int);
+    size_t keep = fds_size / sizeof(int);
+
+    /* nothing may ever take them, a peer can't make us hold more */
+    if (held + keep > NET_UNIX_FDS_HELD_MAX)
+      keep = held < NET_UNIX_FDS_HELD_MAX ? NET_UNIX_FDS_HELD_MAX - held : 0;
+
+    if (keep > 0 && mem_grow_buf(&tcp_conn->receive_fds,
+                                 CMSG_DATA(cmsg),
+                                 keep * sizeof(int)) != MEM_GROW_BUF_OK)
+      keep = 0;
+
+    /* don't leak what we can't keep */
+    for (size_t i = keep; i < fds_size / sizeof(int); ++i) {
+      int fd;
+
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof fd, sizeof fd);
+      close(fd);
+    }
+  }
+
+  return recvmsg_ret;
+}
+
+/* sendmsg(2) of everything left to send, in order, passing pending file
+ * descriptors on UNIX domain connections */
+static ssize_t
+net_tcp_conn_send(struct net_tcp_conn* tcp_conn)
+{
+  struct iovec iov[NET_SEND_IOV_MAX];
+  size_t iov_count = 0;
+
+  if (tcp_conn->send_buf.size > 0) {
+    iov[iov_count].iov_base = tcp_conn->send_buf.p;
+    iov[iov_count++].iov_len = tcp_conn->send_buf.size;
+  }
+
+  struct net_send_entry* send_entry;
+  TAILQ_FOREACH(send_entry, &tcp_conn->send_queue, entry)
+  {
+    if (iov_count + 2 > NET_SEND_IOV_MAX)
+      break;
+
+    if (send_entry->offset < send_entry->shared->size) {
+      iov[iov_count].iov_base = send_entry->shared->data + send_entry->offset;
+      iov[iov_count++].iov_len = send_entry->shared->size - send_entry->offset;
+    }
+
+    if (send_entry->tail.size > 0) {
+      iov[iov_count].iov_base = send_entry->tail.p;
+      iov[iov_count++].iov_len = send_entry->tail.size;
+    }
+  }
+
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iov_count;
+
+  struct net_transport* transport = tcp_conn->ctx->transport;
+
+  if (transport)
+    return transport->send(transport, tcp_conn, iov, iov_count);
+
+  if (!(tcp_conn->flags & NET_TCP_CONN_UNIX) || tcp_conn->send_fds.size == 0)
+    return sendmsg(tcp_conn->fd, &msg, 0);
+
+  union
+  {
+    struct cmsghdr align;
+    unsigned char buf[CMSG_SPACE(NET_UNIX_FDS_MAX * sizeof(int))];
+  } control;
+
+  size_t count = tcp_conn->send_fds.size / sizeof(int);
+
+  if (count > NET_UNIX_FDS_MAX)
+    count = NET_UNIX_FDS_MAX;
+
+  memset(&control, 0, sizeof control);
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), tcp_conn->send_fds.p, count * sizeof(int));
+
+  ssize_t sendmsg_ret = sendmsg(tcp_conn->fd, &msg, 0);
+  if (sendmsg_ret > 0) {
+    /* the peer has its own copies now */
+    for (size_t i = 0; i < count; ++i)
+      close(((int*)tcp_conn->send_fds.p)[i]);
+
+    mem_shrink_buf_head(&tcp_conn->send_fds, count * sizeof(int));
+  }
+
+  return sendmsg_ret;
+}
+
+/* Drop the size octets net_tcp_conn_send managed to send */
+static int
+net_tcp_conn_sent(struct net_tcp_conn* tcp_conn, size_t size)
+{
+  size_t n = size < tcp_conn->send_buf.size ? size : tcp_conn->send_buf.size;
+
+  if (n > 0 && mem_shrink_buf_head(&tcp_conn->send_buf, n) !=
+                 MEM_SHRINK_BUF_HEAD_OK)
+    return -1;
+
+  size -= n;
+
+  while (size > 0 && !TAILQ_EMPTY(&tcp_conn->send_queue)) {
+    struct net_send_entry* send_entry = TAILQ_FIRST(&tcp_conn->send_queue);
+
+    n = send_entry->shared->size - send_entry->offset;
+
+    if (n > size)
+      n = size;
+
+    send_entry->offset += n;
+    size -= n;
+
+    n = size < send_entry->tail.size ? size : send_entry->tail.size;
+
+    if (n > 0 && mem_shrink_buf_head(&send_entry->tail, n) !=
+                   MEM_SHRINK_BUF_HEAD_OK)
+      return -1;
+
+    size -= n;
+
+    if (send_entry->offset == send_entry->shared->size &&
+        send_entry->tail.size == 0) {
+      tcp_conn->send_queued -= send_entry->shared->size;
+      TAILQ_REMOVE(&tcp_conn->send_queue, send_entry, entry);
+      mem_shared_unref(send_entry->shared);
+      free(send_entry);
+    }
+  }
+
+  return 0;
+}
+
+/* Whether a connection holding that many octets to handle or to send is past
+ * its quota, in which case it is closed */
+static int
+net_tcp_conn_over_quota(struct net_tcp_conn* tcp_conn, size_t held)
+{
+  size_t max = tcp_conn->ctx->conn_memory_max;
+
+  if (max == 0 || held <= max)
+    return 0;
+
+  net_tcp_conn_close(tcp_conn, NET_EVENT_CLOSED_MEMORY);
+
+  return 1;
+}
+
+unsigned char*
+net_tcp_conn_write(struct net_tcp_conn* tcp_conn, void* p, size_t size)
+{
+  /* octets written after a shared buffer was queued go after it */
+  struct mem_buf* m = TAILQ_EMPTY(&tcp_conn->send_queue)
+                        ? &tcp_conn->send_buf
+                        : &TAILQ_LAST(&tcp_conn->send_queue, net_send_queue)
+                             ->tail;
+  size_t queued = tcp_conn->send_buf.size + tcp_conn->send_queued + size;
+
+  if (m != &tcp_conn->send_buf)
+    queued += m->size;
+
+  /* a peer that does not read what it is sent is shed */
+  if (net_tcp_conn_over_quota(tcp_conn, queued))
+    return NULL;
+
+  if (mem_grow_buf(m, p, size) != MEM_GROW_BUF_OK)
+    return NULL;
+
+  return (unsigned char*)m->p + m->size - size;
+}
+
+int
+net_tcp_conn_send_shared(struct net_tcp_conn* tcp_conn,
+                         struct mem_shared* shared)
+{
+  if (tcp_conn->send_partial > 0)
+    return E(NET_TCP_CONN_SEND_SHARED_PARTIAL);
+
+  if (net_tcp_conn_over_quota(tcp_conn,
+                              tcp_conn->send_buf.size +
+                                tcp_conn->send_queued + shared->size))
+    return E(NET_TCP_CONN_SEND_SHARED_MEMORY);
+
+  struct net_send_entry* send_entry = calloc(1, sizeof *send_entry);
+
+  if (send_entry == NULL)
+    return E(NET_TCP_CONN_SEND_SHARED_ALLOC);
+
+  send_entry->shared = mem_shared_ref(shared);
+
+  TAILQ_INSERT_TAIL(&tcp_conn->send_queue, send_entry, entry);
+  tcp_conn->send_queued += shared->size;
+
+  /* the frames are whole, their headers are where they are expected */
+  for (size_t offset = 0; offset + COMMAND_HEADER_SIZE <= shared->size;) {
+    struct command_header header;
+
+    codec_decode_command_header(shared->data + offset, &header);
+    net_metrics_frame(tcp_conn->ctx, tcp_conn, &header, 1);
+
+    offset += COMMAND_HEADER_SIZE + header.size;
+  }
+
+  return NET_TCP_CONN_SEND_SHARED_OK;
+}
 
-void
-net_fd_int_array_set(fd_set* set, int* nfds, int* array, size_t size)
+static void
+net_accept(struct net_context* ctx, int fd, int flags)
 {
-  for (size_t i = 0; i < size / *array; ++i) {
-    int fd = array[i];
+  do {
+    struct net_tcp_conn* tcp_conn = calloc(1, sizeof *tcp_conn);
+    if (tcp_conn != NULL) {
+      TAILQ_INIT(&tcp_conn->send_queue);
+      STAILQ_INIT(&tcp_conn->posted);
+      tcp_conn->sa_len = sizeof tcp_conn->sa;
+
+      int accept_ret =
+        accept(fd, (struct sockaddr*)&tcp_conn->sa, &tcp_conn->sa_len);
+      if (accept_ret != -1) /* success */ {
+        int conn_fd = accept_ret;
+
+        /* select(2) can't watch it, the client is better off being refused
+         * right away than waiting on a connection that is never read from */
+        if (conn_fd >= FD_SETSIZE) {
+          net_counter_add(&ctx->metrics.refused, 1);
+          close(conn_fd);
+          free(tcp_conn);
+          continue;
+        }
 
-    if (fd >= 0) {
-      FD_SET(fd, set);
+        if (net_set_nonblock(conn_fd) != NET_SET_NONBLOCK_OK) {
+          close(conn_fd);
+          goto free_tcp_conn;
+        }
 
-      if (fd >= *nfds) {
-        *nfds = fd + 1;
+        FD_SET(conn_fd, &ctx->readfds);
+        if (conn_fd >= ctx->nfds) {
+          ctx->nfds = conn_fd + 1;
+        }
+
+        tcp_conn->flags = NET_TCP_CONN_CONNECTED | flags;
+        tcp_conn->fd = conn_fd;
+        tcp_conn->id = ++ctx->conn_id;
+        tcp_conn->ctx = ctx;
+
+        LIST_INSERT_HEAD(&ctx->tcp_conns, tcp_conn, entry);
+
+        TRACE_EVENT(TRACE_ACCEPT, tcp_conn->id, 0, conn_fd, tcp_conn->flags);
+
+        struct net_callback* callback_entry;
+        LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+        {
+          if (callback_entry->events & NET_EVENT_ESTABLISHED) {
+            struct net_event_data_established event_data;
+
+            event_data.flags = NET_EVENT_ESTABLISHED_ACCEPT;
+            event_data.tcp_conn = tcp_conn;
+
+            callback_entry->cb(
+              NET_EVENT_ESTABLISHED, &event_data, &callback_entry->p);
+          }
+        }
+      } else {
+      free_tcp_conn:
+        free(tcp_conn);
+
+        /* accept(2) until it returns an error saying it will block */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          break;
+        } else {
+          /*
+            also break because we don't want an infinite loop if
+            accept(2) somehow fails
+          */
+          break;
+        }
       }
+    } else {
+      /* stop trying to accept(2) if we're out of memory */
+      break;
     }
+  } while (1);
+}
+
+static int
+net_transport_open(struct net_context* ctx,
+                   struct sockaddr* sa,
+                   socklen_t sa_len,
+                   int flags,
+                   struct net_tcp_conn** out)
+{
+  struct net_tcp_conn* tcp_conn = calloc(1, sizeof *tcp_conn);
+  if (tcp_conn == NULL) {
+    return E(NET_OPEN_ALLOC);
+  }
+
+  TAILQ_INIT(&tcp_conn->send_queue);
+  STAILQ_INIT(&tcp_conn->posted);
+
+  tcp_conn->flags = flags;
+  tcp_conn->fd = -1;
+  memcpy(&tcp_conn->sa, sa, sa_len);
+  tcp_conn->sa_len = sa_len;
+  tcp_conn->opened_at = ctx->now;
+  tcp_conn->ctx = ctx;
+
+  if (ctx->transport->open(ctx->transport, tcp_conn) != 0) {
+    free(tcp_conn);
+    return E(NET_OPEN_CONNECT);
   }
+
+  tcp_conn->id = ++ctx->conn_id;
+
+  LIST_INSERT_HEAD(&ctx->tcp_conns, tcp_conn, entry);
+
+  if (out)
+    *out = tcp_conn;
+
+  return NET_OPEN_OK;
 }
 
 int
-net_set_nonblock(int fd)
+net_open(struct net_context* ctx,
+         struct sockaddr* sa,
+         socklen_t sa_len,
+         struct net_tcp_conn** out)
 {
-  int s = fcntl(fd, F_GETFL);
-  if (s == -1) {
-    return E(NET_SET_NONBLOCK_FCNTL_F_GETFL);
+  int flags = NET_TCP_CONN_OUTBOUND;
+
+  switch (sa->sa_family) {
+    case AF_INET:
+    case AF_INET6:
+      break;
+    case AF_UNIX:
+      flags |= NET_TCP_CONN_UNIX;
+      break;
+    default:
+      return E(NET_OPEN_FAMILY);
   }
 
-  s = s | O_NONBLOCK;
+  if (sa_len > sizeof(struct sockaddr_storage)) {
+    return E(NET_OPEN_FAMILY);
+  }
 
-  s = fcntl(fd, F_SETFL, s);
-  if (s == -1) {
-    return E(NET_SET_NONBLOCK_FCNTL_F_SETFL);
+  /* the transport reports when the connection is established */
+  if (ctx->transport)
+    return net_transport_open(ctx, sa, sa_len, flags, out);
+
+  int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return E(NET_OPEN_SOCKET);
   }
 
-  return NET_SET_NONBLOCK_OK;
+  if (fd >= FD_SETSIZE) {
+    close(fd);
+    return E(NET_OPEN_FDS);
+  }
+
+  if (net_set_nonblock(fd) != NET_SET_NONBLOCK_OK) {
+    close(fd);
+    return E(NET_OPEN_NONBLOCK);
+  }
+
+  struct net_tcp_conn* tcp_conn = calloc(1, sizeof *tcp_conn);
+  if (tcp_conn == NULL) {
+    close(fd);
+    return E(NET_OPEN_ALLOC);
+  }
+
+  TAILQ_INIT(&tcp_conn->send_queue);
+  STAILQ_INIT(&tcp_conn->posted);
+
+  int connect_ret = connect(fd, sa, sa_len);
+  if (connect_ret == 0) {
+    flags |= NET_TCP_CONN_CONNECTED;
+  } else if (errno != EINPROGRESS) {
+    free(tcp_conn);
+    close(fd);
+    return E(NET_OPEN_CONNECT);
+  }
+
+  /* an unconnected connection is watched for writability by the loop until
+   * connect(2) completes */
+  FD_SET(fd, &ctx->readfds);
+  if (fd >= ctx->nfds) {
+    ctx->nfds = fd + 1;
+  }
+
+  tcp_conn->flags = flags;
+  tcp_conn->fd = fd;
+  memcpy(&tcp_conn->sa, sa, sa_len);
+  tcp_conn->sa_len = sa_len;
+  tcp_conn->opened_at = ctx->now;
+  tcp_conn->id = ++ctx->conn_id;
+  tcp_conn->ctx = ctx;
+
+  LIST_INSERT_HEAD(&ctx->tcp_conns, tcp_conn, entry);
+
+  if (out)
+    *out = tcp_conn;
+
+  if (flags & NET_TCP_CONN_CONNECTED) {
+    struct net_callback* callback_entry;
+    LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+    {
+      if (callback_entry->events & NET_EVENT_ESTABLISHED) {
+        struct net_event_data_established event_data;
+
+        event_data.flags = NET_EVENT_ESTABLISHED_CONNECT;
+        event_data.tcp_conn = tcp_conn;
+
+        callback_entry->cb(
+          NET_EVENT_ESTABLISHED, &event_data, &callback_entry->p);
+      }
+    }
+  }
+
+  return NET_OPEN_OK;
+}
+
+/* Raise NET_EVENT_ESTABLISHED for a connection of a transport */
+static void
+net_transport_established(struct net_tcp_conn* tcp_conn, int flags)
+{
+  TRACE_EVENT(TRACE_ACCEPT, tcp_conn->id, 0, -1, tcp_conn->flags);
+
+  struct net_callback* callback_entry;
+  LIST_FOREACH(callback_entry, &tcp_conn->ctx->callbacks, entry)
+  {
+    if (callback_entry->events & NET_EVENT_ESTABLISHED) {
+      struct net_event_data_established event_data;
+
+      event_data.flags = flags;
+      event_data.tcp_conn = tcp_conn;
+
+      callback_entry->cb(
+        NET_EVENT_ESTABLISHED, &event_data, &callback_entry->p);
+    }
+  }
+}
+
+struct net_tcp_conn*
+net_transport_accept(struct net_context* ctx,
+                     struct sockaddr* sa,
+                     socklen_t sa_len,
+                     void* transport)
+{
+  if (sa_len > sizeof(struct sockaddr_storage))
+    return NULL;
+
+  struct net_tcp_conn* tcp_conn = calloc(1, sizeof *tcp_conn);
+  if (tcp_conn == NULL)
+    return NULL;
+
+  TAILQ_INIT(&tcp_conn->send_queue);
+  STAILQ_INIT(&tcp_conn->posted);
+
+  tcp_conn->flags = NET_TCP_CONN_CONNECTED;
+  tcp_conn->fd = -1;
+  memcpy(&tcp_conn->sa, sa, sa_len);
+  tcp_conn->sa_len = sa_len;
+  tcp_conn->id = ++ctx->conn_id;
+  tcp_conn->ctx = ctx;
+  tcp_conn->transport = transport;
+
+  LIST_INSERT_HEAD(&ctx->tcp_conns, tcp_conn, entry);
+
+  net_transport_established(tcp_conn, NET_EVENT_ESTABLISHED_ACCEPT);
+
+  return tcp_conn;
+}
+
+void
+net_transport_connected(struct net_tcp_conn* tcp_conn)
+{
+  /* a dial that lost its race may still complete */
+  if (tcp_conn->flags & NET_TCP_CONN_CLOSING)
+    return;
+
+  tcp_conn->flags |= NET_TCP_CONN_CONNECTED;
+
+  /* a handshake takes about one round trip */
+  tcp_conn->connect_time = tcp_conn->ctx->now - tcp_conn->opened_at;
+
+  net_transport_established(tcp_conn, NET_EVENT_ESTABLISHED_CONNECT);
+}
+
+void
+net_transport_received(struct net_tcp_conn* tcp_conn, void* data, size_t size)
+{
+  /* like the loop, nothing is received on a connection being closed */
+  if (tcp_conn->flags & NET_TCP_CONN_CLOSING)
+    return;
+
+  net_count_io(tcp_conn, (ssize_t)size, 0);
+
+  TRACE_EVENT(
+    TRACE_RECV, tcp_conn->id, 0, size, tcp_conn->receive_buf.size);
+
+  if (net_tcp_conn_over_quota(tcp_conn, tcp_conn->receive_buf.size + size))
+    return;
+
+  if (mem_grow_buf(&tcp_conn->receive_buf, data, size) != MEM_GROW_BUF_OK) {
+    net_tcp_conn_close(tcp_conn,
+                       NET_EVENT_CLOSED_INTERNAL | NET_EVENT_CLOSED_RECV);
+    return;
+  }
+
+  net_count_buf(tcp_conn, tcp_conn->receive_buf.size, 0);
+
+  struct net_callback* callback_entry;
+  LIST_FOREACH(callback_entry, &tcp_conn->ctx->callbacks, entry)
+  {
+    if (callback_entry->events & NET_EVENT_RECEIVED) {
+      struct net_event_data_received event_data;
+
+      event_data.flags = 0;
+      event_data.count = size;
+      event_data.tcp_conn = tcp_conn;
+
+      callback_entry->cb(NET_EVENT_RECEIVED, &event_data, &callback_entry->p);
+    }
+  }
+}
+
+void
+net_transport_datagram(struct net_context* ctx,
+                       struct sockaddr* sa,
+                       socklen_t sa_len,
+                       void* data,
+                       size_t size)
+{
+  struct sockaddr_storage ss;
+
+  if (sa_len > sizeof ss)
+    return;
+
+  memcpy(&ss, sa, sa_len);
+
+  struct net_callback* callback_entry;
+  LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+  {
+    if (callback_entry->events & NET_EVENT_DATAGRAM) {
+      struct net_event_data_datagram event_data;
+
+      event_data.flags = 0;
+      event_data.ctx = ctx;
+      event_data.fd = -1;
+      event_data.sa = &ss;
+      event_data.sa_len = sa_len;
+      event_data.data = data;
+      event_data.size = size;
+
+      callback_entry->cb(NET_EVENT_DATAGRAM, &event_data, &callback_entry->p);
+    }
+  }
+}
+
+/* Hand the transport what connections have to send until it takes no more */
+static void
+net_transport_send(struct net_context* ctx)
+{
+  struct net_tcp_conn* tcp_conn;
+  LIST_FOREACH(tcp_conn, &ctx->tcp_conns, entry)
+  {
+    if (!(tcp_conn->flags & NET_TCP_CONN_CONNECTED) ||
+        (tcp_conn->flags & NET_TCP_CONN_CLOSING))
+      continue;
+
+    while (tcp_conn->send_buf.size > 0 ||
+           !TAILQ_EMPTY(&tcp_conn->send_queue)) {
+      ssize_t send_ret = net_tcp_conn_send(tcp_conn);
+
+      net_count_io(tcp_conn, send_ret, 1);
+
+      TRACE_EVENT(TRACE_SEND,
+                  tcp_conn->id,
+                  0,
+                  send_ret,
+                  tcp_conn->send_buf.size + tcp_conn->send_queued);
+
+      /* the rest is sent once the transport makes room */
+      if (send_ret <= 0)
+        break;
+
+      if (net_tcp_conn_sent(tcp_conn, (size_t)send_ret) != 0) {
+        net_tcp_conn_close(tcp_conn,
+                           NET_EVENT_CLOSED_INTERNAL | NET_EVENT_CLOSED_SEND);
+        break;
+      }
+
+      struct net_callback* callback_entry;
+      LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+      {
+        if (callback_entry->events & NET_EVENT_SENT) {
+          struct net_event_data_sent event_data;
+
+          event_data.flags = 0;
+          event_data.count = (size_t)send_ret;
+          event_data.tcp_conn = tcp_conn;
+
+          callback_entry->cb(NET_EVENT_SENT, &event_data, &callback_entry->p);
+        }
+      }
+    }
+  }
+}
+
+void
+net_transport_step(struct net_context* ctx)
+{
+  net_memory_enforce(ctx);
+  net_close_closing(ctx);
+
+  if (ctx->posts_deferred > 0)
+    net_post_flush(ctx);
+
+  net_transport_send(ctx);
+
+  /* callbacks lower this to when their next timer is due */
+  ctx->wake_at = ctx->now + 1000;
+
+  struct net_callback* callback_entry;
+  LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+  {
+    if (callback_entry->events & NET_EVENT_TICK) {
+      struct net_event_data_tick event_data;
+
+      event_data.flags = 0;
+      event_data.ctx = ctx;
+
+      callback_entry->cb(NET_EVENT_TICK, &event_data, &callback_entry->p);
+    }
+  }
+
+  /* what timers wrote goes out now rather than on the next step */
+  net_close_closing(ctx);
+  net_transport_send(ctx);
+}
+
+/* Add the time since at to a phase of the current iteration, returns the
+ * time now */
+static uint64_t
+net_phase(struct net_context* ctx, int phase, uint64_t at)
+{
+  uint64_t now = net_nanoseconds();
+
+  ctx->iteration.phases[phase] += now - at;
+
+  return now;
+}
+
+/* Remember the connection the current iteration spent the longest on */
+static void
+net_iteration_conn(struct net_context* ctx,
+                   struct net_tcp_conn* tcp_conn,
+                   uint64_t since,
+                   uint64_t at)
+{
+  if (at - since > ctx->iteration.conn_time) {
+    ctx->iteration.conn_id = tcp_conn->id;
+    ctx->iteration.conn_time = at - since;
+  }
 }
 
 int
 net_loop(struct net_context* ctx)
 {
-  FD_ZERO(&ctx->readfds);
-  FD_ZERO(&ctx->writefds);
-
+  /* connections may have been opened already, the fd_sets were cleared by
+   * net_context_init */
   net_fd_int_array_set(
     &ctx->readfds, &ctx->nfds, ctx->tcp_boundfds, sizeof ctx->tcp_boundfds);
   net_fd_int_array_set(
     &ctx->writefds, &ctx->nfds, ctx->tcp_boundfds, sizeof ctx->tcp_boundfds);
   net_fd_int_array_set(
-    &ctx->readfds, &ctx->nfds, ctx->udp_boundfds, sizeof ctx->udp_boundfds);
+    &ctx->readfds, &ctx->nfds, ctx->unix_boundfds, sizeof ctx->unix_boundfds);
   net_fd_int_array_set(
-    &ctx->writefds, &ctx->nfds, ctx->udp_boundfds, sizeof ctx->udp_boundfds);
+    &ctx->readfds, &ctx->nfds, ctx->udp_boundfds, sizeof ctx->udp_boundfds);
+
+  ctx->loop_since = net_clock();
 
   do {
+    uint64_t at = net_nanoseconds();
+
+    memset(&ctx->iteration, 0, sizeof ctx->iteration);
+    ctx->iteration.start = at;
+
+    ctx->now = net_clock();
+
+    net_memory_enforce(ctx);
+    net_close_closing(ctx);
+
+    if (ctx->posts_deferred > 0)
+      net_post_flush(ctx);
+
+    /* like TCP connections, UDP sockets are only watched for writability
+     * while they have something to send */
+    for (size_t i = 0;
+         i < sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds;
+         ++i) {
+      if (ctx->udp_boundfds[i] < 0)
+        continue;
+
+      if (!STAILQ_EMPTY(&ctx->udp_send_queues[i])) {
+        FD_SET(ctx->udp_boundfds[i], &ctx->writefds);
+      } else {
+        FD_CLR(ctx->udp_boundfds[i], &ctx->writefds);
+      }
+    }
 
     /* remove every fd that has an empty send buffer from the writefds fd_set
      * and add every fd that has a non-empty send buffer to the writefds fd_set.
@@ -71,7 +1733,15 @@ net_loop(struct net_context* ctx)
     struct net_tcp_conn* set_writefds_tcp_conn_1;
     LIST_FOREACH(set_writefds_tcp_conn_1, &ctx->tcp_conns, entry)
     {
-      if (set_writefds_tcp_conn_1->send_buf.size > 0) {
+      /* a pending connect(2) completes when the fd becomes writable */
+      if (set_writefds_tcp_conn_1->send_buf.size > 0 ||
+          !TAILQ_EMPTY(&set_writefds_tcp_conn_1->send_queue) ||
+          !(set_writefds_tcp_conn_1->flags & NET_TCP_CONN_CONNECTED)) {
+        net_count_buf(set_writefds_tcp_conn_1,
+                      set_writefds_tcp_conn_1->send_buf.size +
+                        set_writefds_tcp_conn_1->send_queued,
+                      1);
+
         FD_SET(set_writefds_tcp_conn_1->fd, &ctx->writefds);
       } else {
         FD_CLR(set_writefds_tcp_conn_1->fd, &ctx->writefds);
@@ -90,82 +1760,101 @@ net_loop(struct net_context* ctx)
     fd_set readfds_copy = ctx->readfds;
     fd_set writefds_copy = ctx->writefds;
 
-    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    net_memory_pause(ctx, &readfds_copy);
+
+    /* sleep until the earliest timer, a second at most */
+    unsigned long timeout =
+      ctx->wake_at > ctx->now ? ctx->wake_at - ctx->now : 0;
+
+    struct timeval tv = { .tv_sec = timeout / 1000,
+                          .tv_usec = (timeout % 1000) * 1000 };
+
+    /* when timers are due, they may be late already. wake_at is 0 before
+     * the first iteration. */
+    uint64_t poll_at = net_nanoseconds();
+    uint64_t due_at = poll_at + (uint64_t)timeout * 1000000 -
+                      (ctx->wake_at > 0 && ctx->wake_at < ctx->now
+                         ? (uint64_t)(ctx->now - ctx->wake_at) * 1000000
+                         : 0);
 
     int select_ret =
       select(ctx->nfds, &readfds_copy, &writefds_copy, NULL, &tv);
 
+    at = net_phase(ctx, NET_PHASE_POLL, poll_at);
+
+    ctx->now = net_clock();
+
+    net_counter_add(&ctx->metrics.fds_scanned, (unsigned long)ctx->nfds);
+
     if (select_ret > 0) /* success */ {
+      net_counter_add(&ctx->metrics.fds_ready, (unsigned long)select_ret);
 
       for (size_t i = 0;
            i < sizeof ctx->tcp_boundfds / sizeof *ctx->tcp_boundfds;
            ++i) {
         int fd = ctx->tcp_boundfds[i];
 
-        if (fd >= 0) {
+        /* checking if we can call accept(2) on any bound TCP sockets */
+        if (fd >= 0 && FD_ISSET(fd, &readfds_copy)) /* ready to accept(2) */ {
+          net_accept(ctx, fd, 0);
+          at = net_phase(ctx, NET_PHASE_ACCEPT, at);
+        }
+      }
 
-          /* checking if we can call accept(2) on any bound TCP sockets */
-          if (FD_ISSET(fd, &readfds_copy)) /* ready to accept(2) */ {
-            do {
-              struct net_tcp_conn* tcp_conn = calloc(1, sizeof *tcp_conn);
-              if (tcp_conn != NULL) {
-                tcp_conn->sa_len = sizeof tcp_conn->sa;
-
-                int accept_ret = accept(
-                  fd, (struct sockaddr*)&tcp_conn->sa, &tcp_conn->sa_len);
-                if (accept_ret != -1) /* success */ {
-                  int conn_fd = accept_ret;
-
-                  if (net_set_nonblock(conn_fd) != NET_SET_NONBLOCK_OK) {
-                    close(conn_fd);
-                    goto free_tcp_conn;
-                  }
+      for (size_t i = 0;
+           i < sizeof ctx->unix_boundfds / sizeof *ctx->unix_boundfds;
+           ++i) {
+        int fd = ctx->unix_boundfds[i];
 
-                  FD_SET(conn_fd, &ctx->readfds);
-                  if (conn_fd >= ctx->nfds) {
-                    ctx->nfds = conn_fd + 1;
-                  }
+        /* same for bound UNIX domain sockets */
+        if (fd >= 0 && FD_ISSET(fd, &readfds_copy)) /* ready to accept(2) */ {
+          net_accept(ctx, fd, NET_TCP_CONN_UNIX);
+          at = net_phase(ctx, NET_PHASE_ACCEPT, at);
+        }
+      }
+
+      for (size_t i = 0;
+           i < sizeof ctx->udp_boundfds / sizeof *ctx->udp_boundfds;
+           ++i) {
+        int fd = ctx->udp_boundfds[i];
+
+        if (fd >= 0) {
+          /* datagrams are handled as they are received */
+          if (FD_ISSET(fd, &readfds_copy)) /* ready to recvmmsg(2) */ {
+            net_udp_receive(ctx, fd);
+            at = net_phase(ctx, NET_PHASE_RECV, at);
+          }
+
+          if (FD_ISSET(fd, &writefds_copy)) /* ready to sendmmsg(2) */ {
+            net_udp_flush(ctx, i);
+            at = net_phase(ctx, NET_PHASE_SEND, at);
+          }
+        }
+      }
 
-                  tcp_conn->flags = NET_TCP_CONN_CONNECTED;
-                  tcp_conn->fd = conn_fd;
+      for (size_t i = 0; i < sizeof ctx->wake_fds / sizeof *ctx->wake_fds;
+           ++i) {
+        int fd = ctx->wake_fds[i];
 
-                  LIST_INSERT_HEAD(&ctx->tcp_conns, tcp_conn, entry);
+        /* another thread has something for the loop */
+        if (fd >= 0 && FD_ISSET(fd, &readfds_copy)) {
+          net_wake_drain(fd);
 
-                  struct net_callback* callback_entry;
-                  LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
-                  {
-                    if (callback_entry->events & NET_EVENT_ESTABLISHED) {
-                      struct net_event_data_established event_data;
+          struct net_callback* callback_entry;
+          LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+          {
+            if (callback_entry->events & NET_EVENT_WAKE) {
+              struct net_event_data_wake event_data;
 
-                      event_data.flags = NET_EVENT_ESTABLISHED_ACCEPT;
-                      event_data.tcp_conn = tcp_conn;
+              event_data.flags = 0;
+              event_data.fd = fd;
 
-                      callback_entry->cb(
-                        NET_EVENT_ESTABLISHED, &event_data, &callback_entry->p);
-                    }
-                  }
-                } else {
-                free_tcp_conn:
-                  free(tcp_conn);
-
-                  /* accept(2) until it returns an error saying it will block */
-                  if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                      errno == EINTR) {
-                    break;
-                  } else {
-                    /*
-                      also break because we don't want an infinite loop if
-                      accept(2) somehow fails
-                    */
-                    break;
-                  }
-                }
-              } else {
-                /* stop trying to accept(2) if we're out of memory */
-                break;
-              }
-            } while (1);
+              callback_entry->cb(
+                NET_EVENT_WAKE, &event_data, &callback_entry->p);
+            }
           }
+
+          at = net_phase(ctx, NET_PHASE_DISPATCH, at);
         }
       }
 
@@ -175,11 +1864,25 @@ net_loop(struct net_context* ctx)
       {
         int fd = tcp_conn_entry->fd;
 
+        /* a callback closed it, don't touch it any more */
+        if (tcp_conn_entry->flags & NET_TCP_CONN_CLOSING)
+          continue;
+
+        uint64_t conn_at = at;
+
         if (FD_ISSET(fd, &readfds_copy)) {
           if (tcp_conn_entry->flags & NET_TCP_CONN_CONNECTED) {
             do {
               struct net_event_data_closed event_data;
 
+              /* a peer sending more than can be handled is shed */
+              if (tcp_conn_entry->ctx->conn_memory_max > 0 &&
+                  tcp_conn_entry->receive_buf.size + RECV_SIZE >
+                    tcp_conn_entry->ctx->conn_memory_max) {
+                event_data.flags = NET_EVENT_CLOSED_MEMORY;
+                goto close_fd_recv;
+              }
+
               /* grow the buffer to allow received data to be appended */
               int grow_ret =
                 mem_grow_buf(&tcp_conn_entry->receive_buf, NULL, RECV_SIZE);
@@ -194,12 +1897,21 @@ net_loop(struct net_context* ctx)
               }
 
               /* receive in the grown region */
-              ssize_t recv_ret =
-                recv(fd,
-                     tcp_conn_entry->receive_buf.p +
-                       tcp_conn_entry->receive_buf.size - RECV_SIZE,
-                     RECV_SIZE,
-                     0);
+              ssize_t recv_ret = net_tcp_conn_recv(
+                tcp_conn_entry,
+                tcp_conn_entry->receive_buf.p +
+                  tcp_conn_entry->receive_buf.size - RECV_SIZE,
+                RECV_SIZE);
+
+              net_count_io(tcp_conn_entry, recv_ret, 0);
+
+              TRACE_EVENT(TRACE_RECV,
+                          tcp_conn_entry->id,
+                          0,
+                          recv_ret,
+                          tcp_conn_entry->receive_buf.size - RECV_SIZE);
+
+              at = net_phase(ctx, NET_PHASE_RECV, at);
 
               if (recv_ret != -1 && recv_ret != 0) { /* success and not EOF */
 
@@ -215,6 +1927,9 @@ net_loop(struct net_context* ctx)
                   goto close_fd_recv;
                 }
 
+                net_count_buf(
+                  tcp_conn_entry, tcp_conn_entry->receive_buf.size, 0);
+
                 struct net_callback* callback_entry;
                 LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
                 {
@@ -230,6 +1945,19 @@ net_loop(struct net_context* ctx)
                                        &callback_entry->p);
                   }
                 }
+
+                at = net_phase(ctx, NET_PHASE_DISPATCH, at);
+
+                /* a callback closed it, with its own reason, before its
+                 * socket may have been shut down */
+                if (tcp_conn_entry->flags & NET_TCP_CONN_CLOSING)
+                  break;
+
+                /* file descriptors come with the octets of a command, those
+                 * left once every octet was handled were not wanted */
+                if (tcp_conn_entry->receive_buf.size == 0 &&
+                    tcp_conn_entry->receive_fds.size > 0)
+                  net_close_fds(&tcp_conn_entry->receive_fds);
               } else if (recv_ret == 0) {
                 /* socket was shutdown (EOF), close it */
                 event_data.flags = NET_EVENT_CLOSED_RECV;
@@ -278,6 +2006,9 @@ net_loop(struct net_context* ctx)
               shutdown(fd, SHUT_RDWR);
               close(fd);
 
+              TRACE_EVENT(
+                TRACE_CLOSE, tcp_conn_entry->id, 0, event_data.flags, 0);
+
               struct net_callback* callback_entry;
               LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
               {
@@ -290,31 +2021,41 @@ net_loop(struct net_context* ctx)
                 }
               }
 
+              at = net_phase(ctx, NET_PHASE_DISPATCH, at);
+
               goto remove_list_entry;
             } while (1);
           }
         }
 
-        if (FD_ISSET(fd, &writefds_copy)) {
+        if (FD_ISSET(fd, &writefds_copy) &&
+            !(tcp_conn_entry->flags & NET_TCP_CONN_CLOSING)) {
           if (tcp_conn_entry->flags & NET_TCP_CONN_CONNECTED) {
-            while (tcp_conn_entry->send_buf.size >
-                   0) /* send(2) until buffer is empty */ {
+            /* send(2) until buffer and queue are empty */
+            while (tcp_conn_entry->send_buf.size > 0 ||
+                   !TAILQ_EMPTY(&tcp_conn_entry->send_queue)) {
               struct net_event_data_closed event_data;
 
-              /* try to send our whole buffer */
-              ssize_t send_ret = send(fd,
-                                      tcp_conn_entry->send_buf.p,
-                                      tcp_conn_entry->send_buf.size,
-                                      0);
+              /* try to send everything we have */
+              ssize_t send_ret = net_tcp_conn_send(tcp_conn_entry);
+
+              net_count_io(tcp_conn_entry, send_ret, 1);
+
+              TRACE_EVENT(TRACE_SEND,
+                          tcp_conn_entry->id,
+                          0,
+                          send_ret,
+                          tcp_conn_entry->send_buf.size +
+                            tcp_conn_entry->send_queued);
+
+              at = net_phase(ctx, NET_PHASE_SEND, at);
 
               if (send_ret != -1) { /* success */
                 /*
-                  shrink of the number of bytes sent from the start of the
-                  buffer
+                  drop the number of bytes sent from the start of the buffer
+                  and queue
                 */
-                int shrink_ret = mem_shrink_buf_head(&tcp_conn_entry->send_buf,
-                                                     (size_t)send_ret);
-                if (shrink_ret != MEM_SHRINK_BUF_HEAD_OK) {
+                if (net_tcp_conn_sent(tcp_conn_entry, (size_t)send_ret) != 0) {
 
                   /* the buffer is potentially corrupted, close the connection
                    */
@@ -338,6 +2079,8 @@ net_loop(struct net_context* ctx)
                   }
                 }
 
+                at = net_phase(ctx, NET_PHASE_DISPATCH, at);
+
               } else { /* error */
 
                 /* send(2) until it returns that it would block */
@@ -364,6 +2107,9 @@ net_loop(struct net_context* ctx)
               shutdown(fd, SHUT_RDWR);
               close(fd);
 
+              TRACE_EVENT(
+                TRACE_CLOSE, tcp_conn_entry->id, 0, event_data.flags, 0);
+
               struct net_callback* callback_entry;
               LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
               {
@@ -375,6 +2121,8 @@ net_loop(struct net_context* ctx)
                 }
               }
 
+              at = net_phase(ctx, NET_PHASE_DISPATCH, at);
+
               goto remove_list_entry;
             }
           } else /* not yet connected. check result of connect(2) */ {
@@ -396,6 +2144,16 @@ net_loop(struct net_context* ctx)
               if (connect_ret == 0) { /* connect(2) succeeded */
                 tcp_conn_entry->flags |= NET_TCP_CONN_CONNECTED;
 
+                /* a handshake takes about one round trip */
+                tcp_conn_entry->connect_time =
+                  ctx->now - tcp_conn_entry->opened_at;
+
+                TRACE_EVENT(TRACE_ACCEPT,
+                            tcp_conn_entry->id,
+                            0,
+                            fd,
+                            tcp_conn_entry->flags);
+
                 struct net_callback* callback_entry;
                 LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
                 {
@@ -409,6 +2167,8 @@ net_loop(struct net_context* ctx)
                       NET_EVENT_ESTABLISHED, &event_data, &callback_entry->p);
                   }
                 }
+
+                at = net_phase(ctx, NET_PHASE_ACCEPT, at);
               } else {
                 /* connect(2) failed, close the fd */
 
@@ -418,6 +2178,12 @@ net_loop(struct net_context* ctx)
                 shutdown(fd, SHUT_RDWR);
                 close(fd);
 
+                TRACE_EVENT(TRACE_CLOSE,
+                            tcp_conn_entry->id,
+                            0,
+                            NET_EVENT_CLOSED_CONNECT,
+                            0);
+
                 struct net_callback* callback_entry;
                 LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
                 {
@@ -432,6 +2198,8 @@ net_loop(struct net_context* ctx)
                   }
                 }
 
+                at = net_phase(ctx, NET_PHASE_ACCEPT, at);
+
                 goto remove_list_entry;
               }
             }
@@ -442,10 +2210,14 @@ net_loop(struct net_context* ctx)
           }
         }
 
+        net_iteration_conn(ctx, tcp_conn_entry, conn_at, at);
+
         continue;
         /* control flow must only go below if goto is used */
 
       remove_list_entry:
+        net_iteration_conn(ctx, tcp_conn_entry, conn_at, at);
+
         LIST_REMOVE(tcp_conn_entry, entry);
 
         /*
@@ -456,27 +2228,59 @@ net_loop(struct net_context* ctx)
         */
         LIST_NEXT(&temp_entry, entry) = LIST_NEXT(tcp_conn_entry, entry);
 
-        mem_free_buf(&tcp_conn_entry->receive_buf);
-        mem_free_buf(&tcp_conn_entry->send_buf);
-
-        /* Free all command states associated with connection */
-        struct command_state* state;
-        while (!LIST_EMPTY(&tcp_conn_entry->states)) {
-          state = LIST_FIRST(&tcp_conn_entry->states);
-          LIST_REMOVE(state, entry);
-          if (state->free) {
-            state->free(state->state);
-          }
-          free(state);
-        }
-
-        free(tcp_conn_entry);
+        net_tcp_conn_free(tcp_conn_entry);
 
         tcp_conn_entry = &temp_entry;
       }
     } else if (select_ret == 0) /* timeout */ {
     } else /* error */ {
     }
+
+    if (at >= due_at) {
+      ctx->iteration.due = 1;
+      ctx->iteration.lag = at - due_at;
+    }
+
+    /* callbacks lower this to when their next timer is due */
+    ctx->wake_at = ctx->now + 1000;
+
+    struct net_callback* callback_entry;
+    LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+    {
+      if (callback_entry->events & NET_EVENT_TICK) {
+        struct net_event_data_tick event_data;
+
+        event_data.flags = 0;
+        event_data.ctx = ctx;
+
+        callback_entry->cb(NET_EVENT_TICK, &event_data, &callback_entry->p);
+      }
+    }
+
+    at = net_phase(ctx, NET_PHASE_TIMERS, at);
+
+    ctx->iteration.busy = at - ctx->iteration.start -
+                          ctx->iteration.phases[NET_PHASE_POLL];
+
+    net_metrics_iteration(ctx);
+
+    if (ctx->slow_iteration > 0 &&
+        ctx->iteration.busy >= ctx->slow_iteration) {
+      net_counter_add(&ctx->metrics.slow_iterations, 1);
+
+      LIST_FOREACH(callback_entry, &ctx->callbacks, entry)
+      {
+        if (callback_entry->events & NET_EVENT_SLOW) {
+          struct net_event_data_slow event_data;
+
+          event_data.flags = 0;
+          event_data.ctx = ctx;
+          event_data.iteration = &ctx->iteration;
+
+          callback_entry->cb(NET_EVENT_SLOW, &event_data, &callback_entry->p);
+        }
+      }
+    }
   } while (1);
 
   return NET_LOOP_OK;
@@ -0,0 +1,732 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+int
+net_sockaddr_normalize(struct sockaddr* sa,
+                       socklen_t sa_len,
+                       struct sockaddr_storage* out,
+                       socklen_t* out_len)
+{
+  memset(out, 0, sizeof *out);
+
+  switch (sa->sa_family) {
+    case AF_INET: {
+      struct sockaddr_in* sin = (struct sockaddr_in*)sa;
+      struct sockaddr_in* out_sin = (struct sockaddr_in*)out;
+
+      if (sa_len < sizeof *sin) {
+        return E(NET_SOCKADDR_NORMALIZE_FAMILY);
+      }
+
+      out_sin->sin_family = AF_INET;
+      out_sin->sin_port = sin->sin_port;
+      out_sin->sin_addr = sin->sin_addr;
+
+      *out_len = sizeof *out_sin;
+    } break;
+    case AF_INET6: {
+      struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+
+      if (sa_len < sizeof *sin6) {
+        return E(NET_SOCKADDR_NORMALIZE_FAMILY);
+      }
+
+      /* a dual-stack listener sees IPv4 peers as IPv4-mapped addresses */
+      if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        struct sockaddr_in* out_sin = (struct sockaddr_in*)out;
+
+        out_sin->sin_family = AF_INET;
+        out_sin->sin_port = sin6->sin6_port;
+        memcpy(&out_sin->sin_addr, &sin6->sin6_addr.s6_addr[12], 4);
+
+        *out_len = sizeof *out_sin;
+        break;
+      }
+
+      struct sockaddr_in6* out_sin6 = (struct sockaddr_in6*)out;
+
+      out_sin6->sin6_family = AF_INET6;
+      out_sin6->sin6_port = sin6->sin6_port;
+      out_sin6->sin6_addr = sin6->sin6_addr;
+      out_sin6->sin6_scope_id = sin6->sin6_scope_id;
+
+      *out_len = sizeof *out_sin6;
+    } break;
+    case AF_UNIX: {
+      size_t path_offset = offsetof(struct sockaddr_un, sun_path);
+
+      if (sa_len <= path_offset || sa_len > sizeof(struct sockaddr_un)) {
+        return E(NET_SOCKADDR_NORMALIZE_FAMILY);
+      }
+
+      memcpy(out, sa, sa_len);
+
+      /* pathnames may or may not be counted with their terminating null
+       * character, abstract addresses are taken as they are */
+      char* path = ((struct sockaddr_un*)out)->sun_path;
+
+      if (path[0] != '\0')
+        sa_len = path_offset + strnlen(path, sa_len - path_offset);
+
+      *out_len = sa_len;
+    } break;
+    default:
+      return E(NET_SOCKADDR_NORMALIZE_FAMILY);
+  }
+
+  return NET_SOCKADDR_NORMALIZE_OK;
+}
+
+static unsigned long
+net_sockaddr_hash(struct sockaddr_storage* sa, socklen_t sa_len)
+{
+  /* FNV-1a, normalized addresses are short and have no padding left */
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  unsigned char* p = (unsigned char*)sa;
+
+  for (socklen_t i = 0; i < sa_len; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return (unsigned long)hash;
+}
+
+/* Total order on normalized addresses, both ends of a connection agree on it */
+static int
+net_sockaddr_compare(struct sockaddr_storage* a,
+                     socklen_t a_len,
+                     struct sockaddr_storage* b,
+                     socklen_t b_len)
+{
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+  if (cmp != 0)
+    return cmp;
+
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+/* Slot holding the peer with a normalized address, or the empty slot where
+ * it would be inserted */
+static size_t
+net_peers_probe(struct net_peers* peers,
+                struct sockaddr_storage* sa,
+                socklen_t sa_len,
+                unsigned long hash)
+{
+  size_t mask = peers->capacity - 1;
+  size_t i = hash & mask;
+
+  while (peers->slots[i] != NULL) {
+    struct net_peer* peer = peers->slots[i];
+
+    if (peer->hash == hash && peer->sa_len == sa_len &&
+        memcmp(&peer->sa, sa, sa_len) == 0)
+      break;
+
+    i = (i + 1) & mask;
+  }
+
+  return i;
+}
+
+static int
+net_peers_grow(struct net_peers* peers)
+{
+  size_t capacity = peers->capacity ? peers->capacity * 2 : 16;
+
+  struct net_peer** slots = calloc(capacity, sizeof *slots);
+  if (slots == NULL) {
+    return -1;
+  }
+
+  struct net_peers grown = { slots, capacity, peers->count, peers->next_due };
+
+  for (size_t i = 0; i < peers->capacity; ++i) {
+    struct net_peer* peer = peers->slots[i];
+
+    if (peer)
+      slots[net_peers_probe(&grown, &peer->sa, peer->sa_len, peer->hash)] =
+        peer;
+  }
+
+  free(peers->slots);
+  *peers = grown;
+
+  return 0;
+}
+
+static struct net_peer*
+net_peers_insert(struct net_peers* peers,
+                 struct sockaddr_storage* sa,
+                 socklen_t sa_len)
+{
+  unsigned long hash = net_sockaddr_hash(sa, sa_len);
+
+  if (peers->capacity > 0) {
+    struct net_peer* peer =
+      peers->slots[net_peers_probe(peers, sa, sa_len, hash)];
+
+    if (peer)
+      return peer;
+  }
+
+  /* keep the load factor under 3/4 so that probe sequences stay short */
+  if ((peers->count + 1) * 4 > peers->capacity * 3 &&
+      net_peers_grow(peers) != 0)
+    return NULL;
+
+  struct net_peer* peer = calloc(1, sizeof *peer);
+  if (peer == NULL) {
+    return NULL;
+  }
+
+  memcpy(&peer->sa, sa, sa_len);
+  peer->sa_len = sa_len;
+  peer->hash = hash;
+
+  /* until told otherwise, the peer is only reachable where it is known by */
+  memcpy(&peer->addrs[0].sa, sa, sa_len);
+  peer->addrs[0].sa_len = sa_len;
+  peer->addr_count = 1;
+
+  peers->slots[net_peers_probe(peers, sa, sa_len, hash)] = peer;
+  ++peers->count;
+
+  return peer;
+}
+
+static void
+net_peer_dial_cancel(struct net_peer* peer);
+
+static void
+net_peers_remove(struct net_peers* peers, struct net_peer* peer)
+{
+  size_t mask = peers->capacity - 1;
+  size_t i = net_peers_probe(peers, &peer->sa, peer->sa_len, peer->hash);
+
+  peers->slots[i] = NULL;
+  --peers->count;
+
+  /* move back the peers that probed past the freed slot so that lookups
+   * don't stop early, instead of leaving a tombstone */
+  for (size_t j = (i + 1) & mask; peers->slots[j] != NULL;
+       j = (j + 1) & mask) {
+    size_t home = peers->slots[j]->hash & mask;
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      peers->slots[i] = peers->slots[j];
+      peers->slots[j] = NULL;
+      i = j;
+    }
+  }
+
+  if (peer->tcp_conn && peer->tcp_conn->peer == peer)
+    peer->tcp_conn->peer = NULL;
+
+  net_peer_dial_cancel(peer);
+
+  free(peer);
+}
+
+struct net_peer*
+net_peer_find(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len)
+{
+  struct sockaddr_storage key;
+  socklen_t key_len;
+
+  if (ctx->peers.capacity == 0 ||
+      net_sockaddr_normalize(sa, sa_len, &key, &key_len) !=
+        NET_SOCKADDR_NORMALIZE_OK)
+    return NULL;
+
+  return ctx->peers.slots[net_peers_probe(
+    &ctx->peers, &key, key_len, net_sockaddr_hash(&key, key_len))];
+}
+
+/* Make a tick scan the table by the given time */
+static void
+net_peers_due(struct net_context* ctx, unsigned long when)
+{
+  if (ctx->peers.next_due == 0 || when < ctx->peers.next_due)
+    ctx->peers.next_due = when;
+
+  net_context_wake_at(ctx, when);
+}
+
+static void
+net_peer_schedule(struct net_context* ctx, struct net_peer* peer)
+{
+  unsigned int shift = peer->attempts > 0 ? peer->attempts - 1 : 0;
+  unsigned long delay = NET_PEER_BACKOFF_MAX;
+
+  if (shift < 16 && (NET_PEER_BACKOFF_MIN << shift) < NET_PEER_BACKOFF_MAX)
+    delay = NET_PEER_BACKOFF_MIN << shift;
+
+  /* jitter keeps peers that lost each other at once from retrying in step */
+  peer->next_attempt =
+    ctx->now + delay / 2 + net_random(ctx, delay - delay / 2 + 1);
+
+  net_peers_due(ctx, peer->next_attempt);
+}
+
+static int
+net_peer_self_lowest(struct net_context* ctx, struct net_peer* peer)
+{
+  return net_sockaddr_compare(
+           &ctx->self_sa, ctx->self_sa_len, &peer->sa, peer->sa_len) < 0;
+}
+
+/*
+  Make tcp_conn the connection of the peer. When the peer already has another
+  one, both peers connected to each other at once. Each end sees the
+  connection opened by the peer with the lowest address, so both keep the
+  same one without having to talk about it. Without our own address, or when
+  both connections go the same way, the oldest one is kept. Returns the
+  connection that was closed, NULL if none was.
+*/
+static struct net_tcp_conn*
+net_peer_attach(struct net_context* ctx,
+                struct net_peer* peer,
+                struct net_tcp_conn* tcp_conn)
+{
+  struct net_tcp_conn* other = peer->tcp_conn;
+  struct net_tcp_conn* keep = tcp_conn;
+  struct net_tcp_conn* drop = NULL;
+
+  if (other && other != tcp_conn) {
+    keep = other;
+
+    if (ctx->self_sa_len > 0 && !(other->flags & NET_TCP_CONN_OUTBOUND) !=
+                                  !(tcp_conn->flags & NET_TCP_CONN_OUTBOUND)) {
+      /* we opened the outbound connection */
+      if (!!(tcp_conn->flags & NET_TCP_CONN_OUTBOUND) ==
+          net_peer_self_lowest(ctx, peer))
+        keep = tcp_conn;
+    }
+
+    drop = keep == tcp_conn ? other : tcp_conn;
+  }
+
+  keep->peer = peer;
+  peer->tcp_conn = keep;
+
+  if (keep->flags & NET_TCP_CONN_CONNECTED)
+    peer->attempts = 0;
+
+  if (drop) {
+    drop->peer = NULL;
+    net_tcp_conn_close(drop, NET_EVENT_CLOSED_DUPLICATE);
+  }
+
+  return drop;
+}
+
+/* Close the connection attempts of the race in progress, if any */
+static void
+net_peer_dial_cancel(struct net_peer* peer)
+{
+  for (size_t i = 0; i < NET_PEER_ADDRS_MAX; ++i) {
+    if (peer->dials[i]) {
+      peer->dials[i]->peer = NULL;
+      net_tcp_conn_close(peer->dials[i], NET_EVENT_CLOSED_CANCELLED);
+      peer->dials[i] = NULL;
+    }
+  }
+
+  peer->dial_started = 0;
+  peer->dial_at = 0;
+}
+
+static void
+net_peer_dial_won(struct net_context* ctx, struct net_peer* peer, size_t i)
+{
+  struct net_tcp_conn* tcp_conn = peer->dials[i];
+
+  /* the other attempts lost the race */
+  peer->dials[i] = NULL;
+  net_peer_dial_cancel(peer);
+
+  peer->preferred = i;
+
+  net_peer_attach(ctx, peer, tcp_conn);
+}
+
+/* Start the next connection attempt of the race */
+static void
+net_peer_dial_next(struct net_context* ctx, struct net_peer* peer)
+{
+  peer->dial_at = 0;
+
+  while (peer->dial_started < peer->addr_count) {
+    size_t i = peer->dial_order[peer->dial_started++];
+    struct net_tcp_conn* tcp_conn;
+
+    /* addresses that can't even be tried give their turn to the next one */
+    if (net_open(ctx,
+                 (struct sockaddr*)&peer->addrs[i].sa,
+                 peer->addrs[i].sa_len,
+                 &tcp_conn) != NET_OPEN_OK)
+      continue;
+
+    tcp_conn->peer = peer;
+    peer->dials[i] = tcp_conn;
+
+    /* connect(2) may have completed before the peer was attached */
+    if (tcp_conn->flags & NET_TCP_CONN_CONNECTED) {
+      net_peer_dial_won(ctx, peer, i);
+      return;
+    }
+
+    if (peer->dial_started < peer->addr_count) {
+      peer->dial_at = ctx->now + NET_PEER_DIAL_DELAY;
+      net_peers_due(ctx, peer->dial_at);
+    }
+
+    return;
+  }
+
+  for (size_t i = 0; i < NET_PEER_ADDRS_MAX; ++i) {
+    if (peer->dials[i])
+      return;
+  }
+
+  /* every address was tried and failed */
+  peer->dial_started = 0;
+
+  ++peer->attempts;
+  net_peer_schedule(ctx, peer);
+}
+
+/*
+  Race connections to the addresses of a peer, starting with the one the last
+  connection was established to and alternating address families, a new
+  attempt starting every NET_PEER_DIAL_DELAY milliseconds or as soon as the
+  previous one fails (RFC 8305).
+*/
+static void
+net_peer_dial(struct net_context* ctx, struct net_peer* peer)
+{
+  unsigned char used[NET_PEER_ADDRS_MAX] = { 0 };
+  size_t last = peer->preferred < peer->addr_count ? peer->preferred : 0;
+
+  peer->dial_order[0] = last;
+  used[last] = 1;
+
+  for (size_t n = 1; n < peer->addr_count; ++n) {
+    size_t pick = peer->addr_count;
+
+    for (size_t i = 0; i < peer->addr_count; ++i) {
+      if (used[i])
+        continue;
+
+      if (pick == peer->addr_count)
+        pick = i;
+
+      if (peer->addrs[i].sa.ss_family != peer->addrs[last].sa.ss_family) {
+        pick = i;
+        break;
+      }
+    }
+
+    peer->dial_order[n] = pick;
+    used[pick] = 1;
+    last = pick;
+  }
+
+  peer->dial_started = 0;
+  net_peer_dial_next(ctx, peer);
+}
+
+int
+net_peer_set_addrs(struct net_peer* peer, struct net_addr* addrs, size_t count)
+{
+  /* the race in progress refers to the current addresses by index */
+  if (peer->dial_started > 0) {
+    return E(NET_PEER_SET_ADDRS_DIALING);
+  }
+
+  struct net_addr normalized[NET_PEER_ADDRS_MAX];
+  size_t normalized_count = 0;
+
+  for (size_t i = 0; i < count && normalized_count < NET_PEER_ADDRS_MAX;
+       ++i) {
+    struct net_addr* addr = &normalized[normalized_count];
+
+    if (net_sockaddr_normalize((struct sockaddr*)&addrs[i].sa,
+                               addrs[i].sa_len,
+                               &addr->sa,
+                               &addr->sa_len) != NET_SOCKADDR_NORMALIZE_OK)
+      continue;
+
+    size_t j = 0;
+
+    while (j < normalized_count &&
+           (normalized[j].sa_len != addr->sa_len ||
+            memcmp(&normalized[j].sa, &addr->sa, addr->sa_len) != 0))
+      ++j;
+
+    if (j == normalized_count)
+      ++normalized_count;
+  }
+
+  if (normalized_count == 0) {
+    return E(NET_PEER_SET_ADDRS_FAMILY);
+  }
+
+  /* remember the winner as long as it is still one of the addresses */
+  struct net_addr* preferred = &peer->addrs[peer->preferred];
+  size_t i = 0;
+
+  while (i < normalized_count &&
+         (normalized[i].sa_len != preferred->sa_len ||
+          memcmp(&normalized[i].sa, &preferred->sa, preferred->sa_len) != 0))
+    ++i;
+
+  memcpy(peer->addrs, normalized, normalized_count * sizeof *normalized);
+  peer->addr_count = normalized_count;
+  peer->preferred = i < normalized_count ? i : 0;
+
+  return NET_PEER_SET_ADDRS_OK;
+}
+
+static void
+net_peer_want(struct net_context* ctx, struct net_peer* peer)
+{
+  peer->flags |= NET_PEER_WANTED;
+
+  /* the peer is already connected, being connected to, or is waiting for
+   * its backoff to elapse */
+  if (peer->tcp_conn || peer->dial_started > 0 ||
+      peer->next_attempt > ctx->now)
+    return;
+
+  net_peer_dial(ctx, peer);
+}
+
+int
+net_connect(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len)
+{
+  struct sockaddr_storage key;
+  socklen_t key_len;
+
+  if (net_sockaddr_normalize(sa, sa_len, &key, &key_len) !=
+      NET_SOCKADDR_NORMALIZE_OK) {
+    return E(NET_CONNECT_FAMILY);
+  }
+
+  struct net_peer* peer = net_peers_insert(&ctx->peers, &key, key_len);
+  if (peer == NULL) {
+    return E(NET_CONNECT_ALLOC);
+  }
+
+  net_peer_want(ctx, peer);
+
+  return NET_CONNECT_OK;
+}
+
+int
+net_connect_addrs(struct net_context* ctx,
+                  struct net_addr* addrs,
+                  size_t count)
+{
+  struct sockaddr_storage key;
+  socklen_t key_len;
+
+  if (count == 0 || net_sockaddr_normalize((struct sockaddr*)&addrs[0].sa,
+                                           addrs[0].sa_len,
+                                           &key,
+                                           &key_len) !=
+                      NET_SOCKADDR_NORMALIZE_OK) {
+    return E(NET_CONNECT_FAMILY);
+  }
+
+  struct net_peer* peer = net_peers_insert(&ctx->peers, &key, key_len);
+  if (peer == NULL) {
+    return E(NET_CONNECT_ALLOC);
+  }
+
+  net_peer_set_addrs(peer, addrs, count);
+  net_peer_want(ctx, peer);
+
+  return NET_CONNECT_OK;
+}
+
+void
+net_disconnect(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len)
+{
+  struct net_peer* peer = net_peer_find(ctx, sa, sa_len);
+
+  if (peer)
+    net_peers_remove(&ctx->peers, peer);
+}
+
+void
+net_peers_free(struct net_context* ctx)
+{
+  for (size_t i = 0; i < ctx->peers.capacity; ++i) {
+    free(ctx->peers.slots[i]);
+  }
+
+  free(ctx->peers.slots);
+  memset(&ctx->peers, 0, sizeof ctx->peers);
+}
+
+int
+net_peer_bind(struct net_context* ctx,
+              struct net_tcp_conn* tcp_conn,
+              struct sockaddr* sa,
+              socklen_t sa_len)
+{
+  struct sockaddr_storage key;
+  socklen_t key_len;
+
+  if (net_sockaddr_normalize(sa, sa_len, &key, &key_len) !=
+      NET_SOCKADDR_NORMALIZE_OK) {
+    return E(NET_PEER_BIND_FAMILY);
+  }
+
+  struct net_peer* peer = net_peers_insert(&ctx->peers, &key, key_len);
+  if (peer == NULL) {
+    return E(NET_PEER_BIND_ALLOC);
+  }
+
+  if (tcp_conn->peer == peer)
+    return NET_PEER_BIND_OK;
+
+  if (tcp_conn->peer && tcp_conn->peer->tcp_conn == tcp_conn)
+    tcp_conn->peer->tcp_conn = NULL;
+
+  if (net_peer_attach(ctx, peer, tcp_conn) == tcp_conn) {
+    return E(NET_PEER_BIND_DUPLICATE);
+  }
+
+  /* a race of ours would only end up losing against this connection */
+  if (peer->dial_started > 0 &&
+      !(tcp_conn->flags & NET_TCP_CONN_OUTBOUND) &&
+      !(ctx->self_sa_len > 0 && net_peer_self_lowest(ctx, peer)))
+    net_peer_dial_cancel(peer);
+
+  return NET_PEER_BIND_OK;
+}
+
+static void
+net_peers_tick(struct net_context* ctx)
+{
+  struct net_peers* peers = &ctx->peers;
+
+  if (peers->next_due == 0)
+    return;
+
+  /* the loop forgets when to wake up before every tick */
+  if (peers->next_due > ctx->now) {
+    net_context_wake_at(ctx, peers->next_due);
+    return;
+  }
+
+  /* dialing may schedule new attempts, they must not be forgotten */
+  peers->next_due = 0;
+
+  for (size_t i = 0; i < peers->capacity; ++i) {
+    struct net_peer* peer = peers->slots[i];
+
+    if (peer == NULL)
+      continue;
+
+    if (peer->dial_started > 0) {
+      if (peer->dial_at == 0)
+        continue;
+
+      if (peer->dial_at <= ctx->now)
+        net_peer_dial_next(ctx, peer);
+      else
+        net_peers_due(ctx, peer->dial_at);
+    } else if ((peer->flags & NET_PEER_WANTED) && peer->tcp_conn == NULL) {
+      if (peer->next_attempt <= ctx->now)
+        net_peer_dial(ctx, peer);
+      else
+        net_peers_due(ctx, peer->next_attempt);
+    }
+  }
+}
+
+/* Index of the address a connection attempt of the race is made to */
+static size_t
+net_peer_dial_index(struct net_peer* peer, struct net_tcp_conn* tcp_conn)
+{
+  size_t i = 0;
+
+  while (i < NET_PEER_ADDRS_MAX && peer->dials[i] != tcp_conn)
+    ++i;
+
+  return i;
+}
+
+int
+net_cb_peer(int event, void* event_data, void** p)
+{
+  struct net_context* ctx = *p;
+
+  if (event == NET_EVENT_ESTABLISHED) {
+    struct net_tcp_conn* tcp_conn =
+      ((struct net_event_data_established*)event_data)->tcp_conn;
+    struct net_peer* peer = tcp_conn->peer;
+
+    if (peer == NULL)
+      return 0;
+
+    size_t i = net_peer_dial_index(peer, tcp_conn);
+
+    if (i < NET_PEER_ADDRS_MAX)
+      net_peer_dial_won(ctx, peer, i);
+    else if (peer->tcp_conn == tcp_conn)
+      peer->attempts = 0;
+  } else if (event == NET_EVENT_CLOSED) {
+    struct net_tcp_conn* tcp_conn =
+      ((struct net_event_data_closed*)event_data)->tcp_conn;
+    struct net_peer* peer = tcp_conn->peer;
+
+    if (peer == NULL)
+      return 0;
+
+    size_t i = net_peer_dial_index(peer, tcp_conn);
+
+    if (i < NET_PEER_ADDRS_MAX) {
+      /* a failed attempt hands over to the next one right away */
+      peer->dials[i] = NULL;
+      tcp_conn->peer = NULL;
+
+      net_peer_dial_next(ctx, peer);
+      return 0;
+    }
+
+    if (peer->tcp_conn != tcp_conn)
+      return 0;
+
+    peer->tcp_conn = NULL;
+    tcp_conn->peer = NULL;
+
+    if (peer->flags & NET_PEER_WANTED) {
+      ++peer->attempts;
+      net_peer_schedule(ctx, peer);
+    } else if (peer->dial_started == 0) {
+      /* peers we don't keep connections to are only known while connected */
+      net_peers_remove(&ctx->peers, peer);
+    }
+  } else if (event == NET_EVENT_TICK) {
+    net_peers_tick(ctx);
+  }
+
+  return 0;
+}
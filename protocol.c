@@ -1,102 +1,365 @@
-#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <string.h>
 
 #include "queue.h"
 #include "unilink.h"
 
-struct header
+unsigned char
+read_net_octet(unsigned char** p)
+{
+  unsigned char v = codec_load_1(*p);
+
+  *p += 1;
+
+  return v;
+}
+
+unsigned short
+read_net_2_octets(unsigned char** p)
+{
+  unsigned short v = codec_load_2(*p);
+
+  *p += 2;
+
+  return v;
+}
+
+unsigned long
+read_net_4_octets(unsigned char** p)
+{
+  unsigned long v = codec_load_4(*p);
+
+  *p += 4;
+
+  return v;
+}
+
+void
+write_net_octet(unsigned char** p, unsigned char v)
+{
+  codec_store_1(*p, v);
+
+  *p += 1;
+}
+
+void
+write_net_2_octets(unsigned char** p, unsigned short v)
 {
-  unsigned int flags;
-  unsigned long tag;
-  unsigned short type;
-  unsigned short version;
-  unsigned long size;
-};
-
-enum
+  codec_store_2(*p, v);
+
+  *p += 2;
+}
+
+void
+write_net_4_octets(unsigned char** p, unsigned long v)
 {
-  DECODE_HEADER_OK,
-  DECODE_HEADER_SIZE_TOO_SMALL,
-} decode_header_errors;
+  codec_store_4(*p, v);
+
+  *p += 4;
+}
 
 int
-decode_header(unsigned char* buf, size_t size, struct header* out)
+decode_header(unsigned char* buf, size_t size, struct command_header* out)
 {
-  if (size < 1 + 4 + 2 + 2 + 4) {
+  if (size < COMMAND_HEADER_SIZE) {
     return E(DECODE_HEADER_SIZE_TOO_SMALL);
   }
 
-  out->flags = read_net_octet(&buf);
-  out->tag = read_net_4_octets(&buf);
-  out->type = read_net_2_octets(&buf);
-  out->version = read_net_2_octets(&buf);
-  out->size = read_net_4_octets(&buf);
+  codec_decode_command_header(buf, out);
 
   return DECODE_HEADER_OK;
 }
 
-struct address_block
+int
+decode_announce(unsigned char* buf, size_t size, struct announce_view* out)
 {
-  unsigned char family;
-  unsigned short size;
-  unsigned char* data;
-};
+  /* every length is checked against what is left before the octets it covers
+   * are read, so a single pass is enough to validate the whole command */
+  size_t remaining = size;
+
+  struct announce_head head;
+
+  if (remaining < CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA)) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  codec_decode_announce_head(buf, &head);
+  buf += CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA);
+  remaining -= CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA);
+
+  out->role = head.role;
+  out->address_block_count = head.address_block_count;
+  out->address_blocks = buf;
+
+  for (size_t i = 0; i < out->address_block_count; ++i) {
+    struct address_block_head block;
+
+    if (remaining < CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA)) {
+      return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+    }
+
+    codec_decode_address_block_head(buf, &block);
+    buf += CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA);
+    remaining -= CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA);
+
+    if (remaining < block.size) {
+      return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+    }
+
+    buf += block.size;
+    remaining -= block.size;
+  }
+
+  struct public_key_head public_key;
+
+  if (remaining < CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA)) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  codec_decode_public_key_head(buf, &public_key);
+  buf += CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA);
+  remaining -= CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA);
+
+  out->public_key_type = public_key.public_key_type;
+  out->public_key_size = public_key.public_key_size;
+
+  if (remaining < out->public_key_size) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  out->public_key = buf;
+  buf += out->public_key_size;
+  remaining -= out->public_key_size;
+
+  struct signature_head signature;
+
+  if (remaining < CODEC_SIZE(SIGNATURE_HEAD_SCHEMA)) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  codec_decode_signature_head(buf, &signature);
+  buf += CODEC_SIZE(SIGNATURE_HEAD_SCHEMA);
+  remaining -= CODEC_SIZE(SIGNATURE_HEAD_SCHEMA);
+
+  out->signature_size = signature.signature_size;
+
+  if (remaining < out->signature_size) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
 
-struct announce
+  out->signature = buf;
+  buf += out->signature_size;
+  remaining -= out->signature_size;
+
+  struct master_signature_head master_signature;
+
+  if (remaining < CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA)) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  codec_decode_master_signature_head(buf, &master_signature);
+  buf += CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA);
+  remaining -= CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA);
+
+  out->master_signature_type = master_signature.master_signature_type;
+  out->master_signature_size = master_signature.master_signature_size;
+
+  if (remaining < out->master_signature_size) {
+    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
+  }
+
+  out->master_signature = buf;
+  remaining -= out->master_signature_size;
+
+  if (remaining > 0) {
+    return E(DECODE_ANNOUNCE_TRAILING_DATA);
+  }
+
+  return DECODE_ANNOUNCE_OK;
+}
+
+/* Size of the address blocks of an announce, with their heads */
+static size_t
+announce_address_blocks_size(struct announce_view* announce)
+{
+  struct address_block_iterator it;
+  struct address_block block;
+  size_t size = 0;
+
+  announce_address_blocks(announce, &it);
+
+  while (address_block_next(&it, &block))
+    size += CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA) + block.size;
+
+  return size;
+}
+
+size_t
+announce_size(struct announce_view* announce)
+{
+  return CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA) +
+         announce_address_blocks_size(announce) +
+         CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA) + announce->public_key_size +
+         CODEC_SIZE(SIGNATURE_HEAD_SCHEMA) + announce->signature_size +
+         CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA) +
+         announce->master_signature_size;
+}
+
+void
+encode_announce(struct announce_view* announce, unsigned char* buf)
+{
+  struct announce_head head = {
+    .role = announce->role,
+    .address_block_count = announce->address_block_count,
+  };
+
+  codec_encode_announce_head(buf, &head);
+  buf += CODEC_SIZE(ANNOUNCE_HEAD_SCHEMA);
+
+  /* address blocks are already encoded, heads included */
+  size_t size = announce_address_blocks_size(announce);
+
+  memmove(buf, announce->address_blocks, size);
+  buf += size;
+
+  struct public_key_head public_key = {
+    .public_key_type = announce->public_key_type,
+    .public_key_size = announce->public_key_size,
+  };
+
+  codec_encode_public_key_head(buf, &public_key);
+  buf += CODEC_SIZE(PUBLIC_KEY_HEAD_SCHEMA);
+  memmove(buf, announce->public_key, announce->public_key_size);
+  buf += announce->public_key_size;
+
+  struct signature_head signature = {
+    .signature_size = announce->signature_size,
+  };
+
+  codec_encode_signature_head(buf, &signature);
+  buf += CODEC_SIZE(SIGNATURE_HEAD_SCHEMA);
+  memmove(buf, announce->signature, announce->signature_size);
+  buf += announce->signature_size;
+
+  struct master_signature_head master_signature = {
+    .master_signature_type = announce->master_signature_type,
+    .master_signature_size = announce->master_signature_size,
+  };
+
+  codec_encode_master_signature_head(buf, &master_signature);
+  buf += CODEC_SIZE(MASTER_SIGNATURE_HEAD_SCHEMA);
+  memmove(buf, announce->master_signature, announce->master_signature_size);
+}
+
+void
+announce_address_blocks(struct announce_view* announce,
+                        struct address_block_iterator* it)
 {
-  unsigned char role;
-  unsigned char address_block_count;
-  struct address_block* address_blocks;
-  unsigned char public_key_type;
-  unsigned short public_key_size;
-  unsigned char* public_key;
-  unsigned short signature_size;
-  unsigned char* signature;
-  unsigned char master_signature_type;
-  unsigned short master_signature_size;
-  unsigned char* master_signature;
-};
-
-enum
+  it->p = announce->address_blocks;
+  it->remaining = announce->address_block_count;
+}
+
+int
+address_block_next(struct address_block_iterator* it,
+                   struct address_block* out)
 {
-  DECODE_ANNOUNCE_OK,
-  DECODE_ANNOUNCE_SIZE_TOO_SMALL,
-  DECODE_ANNOUNCE_ALLOC_FAILURE,
-} decode_announce_errors;
+  if (it->remaining == 0)
+    return 0;
+
+  /* the announce was validated by decode_announce, no need to check sizes */
+  struct address_block_head head;
+
+  codec_decode_address_block_head(it->p, &head);
+  it->p += CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA);
+
+  out->family = head.family;
+  out->size = head.size;
+  out->data = it->p;
+
+  it->p += out->size;
+  --it->remaining;
+
+  return 1;
+}
 
 int
-decode_announce(unsigned char* buf, size_t size, struct announce* out)
+address_block_sockaddr(struct address_block* block,
+                       struct sockaddr_storage* sa,
+                       socklen_t* sa_len)
 {
-  size_t octets_read = 0;
+  unsigned char* buf = block->data;
 
-  if (size < 2) {
-    return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
-  }
+  memset(sa, 0, sizeof *sa);
 
-  out->role = read_net_octet(&buf);
-  out->address_block_count = read_net_octet(&buf);
+  switch (block->family) {
+    case FAMILY_IPV4: {
+      if (block->size != 2 /* port */ + 4 /* ipv4 */) {
+        return E(ADDRESS_BLOCK_SOCKADDR_SIZE);
+      }
 
-  octets_read += 2;
+      struct sockaddr_in* sin = (struct sockaddr_in*)sa;
 
-  out->address_blocks =
-    calloc(out->address_block_count, sizeof *out->address_blocks);
-  if (out->address_blocks == NULL) {
-    return E(DECODE_ANNOUNCE_ALLOC_FAILURE);
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(read_net_2_octets(&buf));
+      memcpy(&sin->sin_addr, buf, 4);
+
+      *sa_len = sizeof *sin;
+    } break;
+    case FAMILY_IPV6: {
+      if (block->size != 2 /* port */ + 16 /* ipv6 */) {
+        return E(ADDRESS_BLOCK_SOCKADDR_SIZE);
+      }
+
+      struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(read_net_2_octets(&buf));
+      memcpy(&sin6->sin6_addr, buf, 16);
+
+      *sa_len = sizeof *sin6;
+    } break;
+    default:
+      return E(ADDRESS_BLOCK_SOCKADDR_FAMILY);
   }
 
-  for (size_t i = 0; i < out->address_block_count; ++i) {
-    if (size < octets_read + 2) {
-      return E(DECODE_HEADER_SIZE_TOO_SMALL);
-    }
+  return ADDRESS_BLOCK_SOCKADDR_OK;
+}
 
-    unsigned short family_and_size = read_net_2_octets(&buf);
+int
+encode_address_block(struct sockaddr* sa,
+                     socklen_t sa_len,
+                     unsigned char* buf,
+                     size_t* size)
+{
+  struct address_block_head head;
+  unsigned char* p = buf + CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA);
 
-    octets_read += 2;
+  if (sa->sa_family == AF_INET && sa_len >= sizeof(struct sockaddr_in)) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)sa;
 
-    out->address_blocks[i].family = family_and_size >> 12;
-    out->address_blocks[i].size = family_and_size & ~(~0U << 12U);
+    head.family = FAMILY_IPV4;
+    head.size = 2 /* port */ + 4 /* ipv4 */;
 
-    if (size < octets_read + out->address_blocks[i].size) {
-      return E(DECODE_ANNOUNCE_SIZE_TOO_SMALL);
-    }
+    write_net_2_octets(&p, ntohs(sin->sin_port));
+    memcpy(p, &sin->sin_addr, 4);
+  } else if (sa->sa_family == AF_INET6 &&
+             sa_len >= sizeof(struct sockaddr_in6)) {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+
+    head.family = FAMILY_IPV6;
+    head.size = 2 /* port */ + 16 /* ipv6 */;
+
+    write_net_2_octets(&p, ntohs(sin6->sin6_port));
+    memcpy(p, &sin6->sin6_addr, 16);
+  } else {
+    return E(ENCODE_ADDRESS_BLOCK_FAMILY);
   }
+
+  codec_encode_address_block_head(buf, &head);
+  *size = CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA) + head.size;
+
+  return ENCODE_ADDRESS_BLOCK_OK;
 }
@@ -0,0 +1,491 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+/*
+  Replay of traffic captured by unilink-select with UNILINK_CAPTURE.
+
+  usage: replay [-m] file host port
+
+  Every captured connection is opened to host and port and sent what was
+  received on it, at the pace it was received, or as fast as possible with
+  -m. Responses are read and dropped. With -m, connections the capture
+  closed stay open until nothing was received for a second, as the client
+  that was captured likely waited for responses before closing.
+
+  Once every record was replayed and every connection closed, or nothing was
+  received for a second, it reports throughput, how late sends were on the
+  schedule of the capture and how long the node took to start responding
+  after being sent something. Throughput counts what was actually sent, up to
+  when the last of it was sent or the last response received, whichever is
+  later.
+*/
+
+/* Octets waiting to be sent over all connections above which -m waits */
+#define REPLAY_QUEUED_MAX (4 << 20)
+
+/* How long responses are waited for after the last record or response,
+ * milliseconds */
+#define REPLAY_LINGER 1000
+
+struct replay_conn
+{
+  /* Id of the connection in the capture */
+  unsigned long id;
+
+  /* NULL until opened and once closed */
+  struct net_tcp_conn* tcp_conn;
+  int opened;
+
+  /* The capture closed it, it is closed once what it has to send is sent */
+  int closing;
+
+  /* When it was sent something the node did not start responding to yet,
+   * 0 if there is nothing */
+  uint64_t sent_at;
+};
+
+struct replay
+{
+  struct net_context* ctx;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  int max_speed;
+
+  unsigned char* data;
+  size_t size;
+  size_t offset;
+
+  /* Connections by captured id, sorted */
+  struct replay_conn* conns;
+  size_t count;
+
+  /* Connections by id in ctx, which are given in order from 1 */
+  struct replay_conn** opened;
+  size_t opened_count;
+
+  /* When the replay started, and when the next record is due on the schedule
+   * of the capture */
+  uint64_t start;
+  uint64_t due;
+
+  /* When the last record was replayed, 0 until then, and when something
+   * was last sent and received */
+  uint64_t done_at;
+  uint64_t flushed_at;
+  uint64_t received_at;
+
+  unsigned long records;
+  unsigned long octets_out;
+  unsigned long octets_in;
+  unsigned long closed_by_node;
+  unsigned long dropped;
+
+  struct net_latency lateness;
+  struct net_latency responses;
+};
+
+static int
+replay_compare_id(const void* a, const void* b)
+{
+  const struct replay_conn* ca = a;
+  const struct replay_conn* cb = b;
+
+  return ca->id < cb->id ? -1 : ca->id > cb->id;
+}
+
+/* Check every record and collect the connections they are about */
+static int
+replay_index(struct replay* replay)
+{
+  size_t offset = CAPTURE_MAGIC_SIZE;
+  size_t capacity = 0;
+
+  if (replay->size < CAPTURE_MAGIC_SIZE ||
+      memcmp(replay->data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+    return -1;
+
+  while (offset < replay->size) {
+    struct capture_record record;
+
+    if (replay->size - offset < CAPTURE_RECORD_SIZE)
+      return -1;
+
+    codec_decode_capture_record(replay->data + offset, &record);
+    offset += CAPTURE_RECORD_SIZE;
+
+    if (replay->size - offset < record.size)
+      return -1;
+
+    offset += record.size;
+
+    if (record.kind != CAPTURE_OPEN)
+      continue;
+
+    if (replay->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+
+      struct replay_conn* conns =
+        realloc(replay->conns, capacity * sizeof *conns);
+
+      if (conns == NULL)
+        return -1;
+
+      replay->conns = conns;
+    }
+
+    memset(&replay->conns[replay->count], 0, sizeof *replay->conns);
+    replay->conns[replay->count++].id = record.conn_id;
+  }
+
+  qsort(replay->conns, replay->count, sizeof *replay->conns, replay_compare_id);
+
+  replay->opened = calloc(replay->count + 1, sizeof *replay->opened);
+
+  return replay->opened ? 0 : -1;
+}
+
+static struct replay_conn*
+replay_find(struct replay* replay, unsigned long id)
+{
+  struct replay_conn key = { .id = id };
+
+  return bsearch(&key,
+                 replay->conns,
+                 replay->count,
+                 sizeof *replay->conns,
+                 replay_compare_id);
+}
+
+static struct replay_conn*
+replay_conn_of(struct replay* replay, struct net_tcp_conn* tcp_conn)
+{
+  if (tcp_conn->id == 0 || tcp_conn->id > replay->opened_count)
+    return NULL;
+
+  return replay->opened[tcp_conn->id - 1];
+}
+
+static void
+replay_open(struct replay* replay, struct replay_conn* conn)
+{
+  struct net_tcp_conn* tcp_conn;
+
+  conn->opened = 1;
+
+  if (net_open(replay->ctx,
+               (struct sockaddr*)&replay->sa,
+               replay->sa_len,
+               &tcp_conn) != NET_OPEN_OK)
+    return;
+
+  /* every connection opened is indexed, conn_id counts them from 1 */
+  if (tcp_conn->id > replay->count) {
+    net_tcp_conn_close(tcp_conn, 0);
+    return;
+  }
+
+  replay->opened[tcp_conn->id - 1] = conn;
+  replay->opened_count = tcp_conn->id;
+  conn->tcp_conn = tcp_conn;
+}
+
+static size_t
+replay_queued(struct replay* replay)
+{
+  struct net_tcp_conn* tcp_conn;
+  size_t queued = 0;
+
+  LIST_FOREACH(tcp_conn, &replay->ctx->tcp_conns, entry)
+  {
+    queued += tcp_conn->send_buf.size + tcp_conn->send_queued;
+  }
+
+  return queued;
+}
+
+static void
+replay_record(struct replay* replay,
+              struct capture_record* record,
+              unsigned char* data,
+              uint64_t now)
+{
+  struct replay_conn* conn = replay_find(replay, record->conn_id);
+
+  /* connections opened before the capture started are not replayed */
+  if (conn == NULL) {
+    ++replay->dropped;
+    return;
+  }
+
+  if (record->kind == CAPTURE_OPEN) {
+    if (!conn->opened)
+      replay_open(replay, conn);
+  } else if (record->kind == CAPTURE_DATA) {
+    if (conn->tcp_conn == NULL ||
+        net_tcp_conn_write(conn->tcp_conn, data, record->size) == NULL) {
+      ++replay->dropped;
+      return;
+    }
+
+    if (conn->sent_at == 0)
+      conn->sent_at = now;
+
+    if (!replay->max_speed)
+      net_latency_record(&replay->lateness, now - replay->due);
+  } else if (record->kind == CAPTURE_CLOSE) {
+    conn->closing = 1;
+  }
+}
+
+static void
+replay_report(struct replay* replay)
+{
+  /* the replay lasts until what was written is sent and responded to */
+  uint64_t end = replay->done_at;
+
+  if (replay->flushed_at > end)
+    end = replay->flushed_at;
+
+  if (replay->received_at > end)
+    end = replay->received_at;
+
+  double seconds = (end - replay->start) / 1e9;
+
+  printf("%-24s %10lu\n", "records", replay->records);
+  printf("%-24s %10zu\n", "connections", replay->opened_count);
+  printf("%-24s %10lu\n", "closed by node", replay->closed_by_node);
+  printf("%-24s %10lu\n", "dropped", replay->dropped);
+  printf("%-24s %10lu\n", "octets sent", replay->octets_out);
+  printf("%-24s %10lu\n", "octets received", replay->octets_in);
+  printf("%-24s %10.3f s\n", "elapsed", seconds);
+  printf("%-24s %10.2f MB/s\n",
+         "throughput",
+         seconds > 0 ? replay->octets_out / seconds / 1e6 : 0);
+
+  struct
+  {
+    const char* name;
+    struct net_latency* latency;
+  } histograms[] = {
+    { "lateness", &replay->lateness },
+    { "response", &replay->responses },
+  };
+
+  for (size_t i = 0; i < sizeof histograms / sizeof *histograms; ++i) {
+    struct net_latency* latency = histograms[i].latency;
+
+    if (atomic_load(&latency->count) == 0)
+      continue;
+
+    printf("%-24s p50 %lu p90 %lu p99 %lu max %lu ns\n",
+           histograms[i].name,
+           net_latency_percentile(latency, 500),
+           net_latency_percentile(latency, 900),
+           net_latency_percentile(latency, 990),
+           net_latency_percentile(latency, 1000));
+  }
+}
+
+static void
+replay_tick(struct replay* replay)
+{
+  struct net_context* ctx = replay->ctx;
+  uint64_t now = net_nanoseconds();
+
+  while (replay->offset < replay->size) {
+    struct capture_record record;
+
+    codec_decode_capture_record(replay->data + replay->offset, &record);
+
+    if (replay->max_speed) {
+      if (replay_queued(replay) >= REPLAY_QUEUED_MAX)
+        break;
+    } else {
+      uint64_t due = replay->due + (uint64_t)record.delay * 1000;
+
+      if (due > now) {
+        net_context_wake_at(ctx, ctx->now + (due - now) / 1000000);
+        break;
+      }
+
+      replay->due = due;
+    }
+
+    replay->offset += CAPTURE_RECORD_SIZE;
+    replay_record(
+      replay, &record, replay->data + replay->offset, net_nanoseconds());
+    replay->offset += record.size;
+    ++replay->records;
+  }
+
+  /* connections are closed once what they were sent was */
+  int open = 0;
+
+  for (size_t i = 0; i < replay->count; ++i) {
+    struct replay_conn* conn = &replay->conns[i];
+
+    if (conn->tcp_conn == NULL)
+      continue;
+
+    if (conn->closing && conn->tcp_conn->send_buf.size == 0 &&
+        TAILQ_EMPTY(&conn->tcp_conn->send_queue) && !replay->max_speed)
+      net_tcp_conn_close(conn->tcp_conn, 0);
+    else
+      open = 1;
+  }
+
+  if (replay->offset < replay->size) {
+    if (replay->max_speed)
+      net_context_wake_at(ctx, ctx->now);
+
+    return;
+  }
+
+  if (replay->done_at == 0)
+    replay->done_at = now;
+
+  uint64_t quiet_since = replay->done_at;
+
+  if (replay->flushed_at > quiet_since)
+    quiet_since = replay->flushed_at;
+
+  if (replay->received_at > quiet_since)
+    quiet_since = replay->received_at;
+
+  if (!open || now - quiet_since >= (uint64_t)REPLAY_LINGER * 1000000) {
+    replay_report(replay);
+    exit(EXIT_SUCCESS);
+  }
+
+  net_context_wake_at(
+    ctx, ctx->now + REPLAY_LINGER - (now - quiet_since) / 1000000);
+}
+
+static int
+net_cb_replay(int event, void* event_data, void** p)
+{
+  struct replay* replay = *p;
+
+  if (event == NET_EVENT_RECEIVED) {
+    struct net_event_data_received* received = event_data;
+    struct net_tcp_conn* tcp_conn = received->tcp_conn;
+    struct replay_conn* conn = replay_conn_of(replay, tcp_conn);
+
+    replay->octets_in += received->count;
+    replay->received_at = net_nanoseconds();
+
+    if (conn && conn->sent_at) {
+      net_latency_record(&replay->responses,
+                         net_nanoseconds() - conn->sent_at);
+      conn->sent_at = 0;
+    }
+
+    mem_shrink_buf_head(&tcp_conn->receive_buf, tcp_conn->receive_buf.size);
+  } else if (event == NET_EVENT_SENT) {
+    struct net_event_data_sent* sent = event_data;
+
+    replay->octets_out += sent->count;
+    replay->flushed_at = net_nanoseconds();
+  } else if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+    struct replay_conn* conn = replay_conn_of(replay, closed->tcp_conn);
+
+    if (conn == NULL)
+      return 0;
+
+    if (!conn->closing)
+      ++replay->closed_by_node;
+
+    conn->tcp_conn = NULL;
+  } else if (event == NET_EVENT_TICK) {
+    replay_tick(replay);
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  static struct net_context ctx;
+  static struct replay replay;
+  int arg = 1;
+
+  if (argc > arg && strcmp(argv[arg], "-m") == 0) {
+    replay.max_speed = 1;
+    ++arg;
+  }
+
+  if (argc - arg != 3) {
+    fprintf(stderr, "usage: %s [-m] file host port\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE* file = fopen(argv[arg], "rb");
+
+  if (file == NULL) {
+    perror(argv[arg]);
+    return EXIT_FAILURE;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  replay.data = size > 0 ? malloc((size_t)size) : NULL;
+  replay.size = (size_t)size;
+
+  if (replay.data == NULL ||
+      fread(replay.data, replay.size, 1, file) != 1 ||
+      replay_index(&replay) != 0) {
+    fprintf(stderr, "%s: not a capture file\n", argv[arg]);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  fclose(file);
+
+  struct addrinfo hints;
+  struct addrinfo* res;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(argv[arg + 1], argv[arg + 2], &hints, &res) != 0) {
+    fprintf(stderr, "%s: unknown host\n", argv[arg + 1]);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(&replay.sa, res->ai_addr, res->ai_addrlen);
+  replay.sa_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  net_context_init(&ctx);
+
+  replay.ctx = &ctx;
+  replay.offset = CAPTURE_MAGIC_SIZE;
+  replay.start = net_nanoseconds();
+  replay.due = replay.start;
+
+  struct net_callback callback;
+  memset(&callback, 0, sizeof callback);
+
+  callback.events =
+    NET_EVENT_RECEIVED | NET_EVENT_SENT | NET_EVENT_CLOSED | NET_EVENT_TICK;
+  callback.p = &replay;
+  callback.cb = net_cb_replay;
+
+  LIST_INSERT_HEAD(&ctx.callbacks, &callback, entry);
+
+  net_loop(&ctx);
+
+  return EXIT_SUCCESS;
+}
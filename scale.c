@@ -0,0 +1,445 @@
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unilink.h"
+
+/*
+  Connection scaling benchmark of a running unilink-select.
+
+  usage: scale [-c connections] [-s step] [-a active] [-r rounds]
+               [-z size] [-P pid] host port
+
+  Connections to host and port are opened step at a time, up to
+  connections, raising RLIMIT_NOFILE as far as allowed. After each step,
+  a ping on its last connection tells when the node accepted it, which
+  gives the accept rate. Then active connections spread over those held
+  each ping the node with size octets at the same time, rounds times, while
+  the others stay idle. Every step reports the accept rate, the resident
+  memory of the node of process id pid per connection held, and
+  percentiles of the ping round trips.
+
+  It stops at the first connection that can't be opened or that the node
+  closes, which happens once its descriptors reach FD_SETSIZE. To a
+  loopback host, connections come from several loopback addresses so that
+  ephemeral ports don't run out. The pings are sent over poll(2), as
+  select(2) can't watch as many connections.
+*/
+
+/* How long a connect(2) or a ping waits for the node, seconds */
+#define SCALE_TIMEOUT 5
+
+/* Connections opened from a loopback address before using the next one */
+#define SCALE_SOURCE_CONNS 20000
+
+/* Descriptors kept for the process besides connections */
+#define SCALE_FDS_SPARE 64
+
+/* Largest ping payload */
+#define SCALE_PING_MAX 4096
+
+struct scale
+{
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  int loopback;
+  size_t ping_size;
+
+  int* fds;
+  size_t count;
+
+  unsigned char ping[COMMAND_HEADER_SIZE + SCALE_PING_MAX];
+  unsigned long tag;
+};
+
+/* Resident memory of a process in octets, 0 if unknown */
+static unsigned long
+scale_rss(long pid)
+{
+  char path[64];
+  char line[256];
+  unsigned long kib = 0;
+
+  if (pid <= 0)
+    return 0;
+
+  snprintf(path, sizeof path, "/proc/%ld/status", pid);
+
+  FILE* file = fopen(path, "r");
+
+  if (file == NULL)
+    return 0;
+
+  while (fgets(line, sizeof line, file) != NULL)
+    if (sscanf(line, "VmRSS: %lu kB", &kib) == 1)
+      break;
+
+  fclose(file);
+
+  return kib * 1024;
+}
+
+/* Raise the soft limit on descriptors to what count connections need, or
+ * as far as allowed, and return it */
+static size_t
+scale_nofile(size_t count)
+{
+  struct rlimit rlim;
+
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == -1)
+    return 0;
+
+  rlim_t wanted = count + SCALE_FDS_SPARE;
+
+  if (rlim.rlim_cur < wanted) {
+    struct rlimit raised = rlim;
+
+    raised.rlim_cur = wanted;
+
+    if (raised.rlim_max < wanted)
+      raised.rlim_max = wanted;
+
+    /* raising the hard limit needs privileges, the soft one does not */
+    if (setrlimit(RLIMIT_NOFILE, &raised) == -1) {
+      raised.rlim_cur = rlim.rlim_max;
+      raised.rlim_max = rlim.rlim_max;
+
+      if (setrlimit(RLIMIT_NOFILE, &raised) == -1)
+        raised.rlim_cur = rlim.rlim_cur;
+    }
+
+    rlim.rlim_cur = raised.rlim_cur;
+  }
+
+  return rlim.rlim_cur == RLIM_INFINITY ? (size_t)-1 : (size_t)rlim.rlim_cur;
+}
+
+/* Open the i-th connection, -1 with errno set if it could not be */
+static int
+scale_open(struct scale* scale, size_t i)
+{
+  int fd = socket(scale->sa.ss_family, SOCK_STREAM, 0);
+
+  if (fd == -1)
+    return -1;
+
+  struct timeval timeout = { SCALE_TIMEOUT, 0 };
+  int one = 1;
+
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  if (scale->loopback) {
+    struct sockaddr_in source;
+
+    memset(&source, 0, sizeof source);
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr =
+      htonl(INADDR_LOOPBACK + (in_addr_t)(i / SCALE_SOURCE_CONNS));
+
+    if (bind(fd, (struct sockaddr*)&source, sizeof source) == -1) {
+      int saved = errno;
+
+      close(fd);
+      errno = saved;
+      return -1;
+    }
+  }
+
+  if (connect(fd, (struct sockaddr*)&scale->sa, scale->sa_len) == -1) {
+    int saved = errno;
+
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Send a ping on a connection, -1 if it could not be */
+static int
+scale_ping_send(struct scale* scale, int fd)
+{
+  struct command_header header;
+  size_t size = COMMAND_HEADER_SIZE + scale->ping_size;
+
+  header.flags = COMMAND_HEADER_IS_REQUEST;
+  header.tag = ++scale->tag & 0xffffffffUL;
+  header.type = COMMAND_PING;
+  header.version = 0;
+  header.size = scale->ping_size;
+
+  codec_encode_command_header(scale->ping, &header);
+
+  return send(fd, scale->ping, size, MSG_NOSIGNAL) == (ssize_t)size ? 0 : -1;
+}
+
+/* Read from a connection what is left of a ping response, how much that was
+ * or -1 if it was closed or timed out */
+static ssize_t
+scale_ping_recv(int fd, size_t left)
+{
+  unsigned char buf[COMMAND_HEADER_SIZE + SCALE_PING_MAX];
+  ssize_t recv_ret = recv(fd, buf, left, 0);
+
+  return recv_ret > 0 ? recv_ret : -1;
+}
+
+/* Ping on a connection and wait for the whole response, -1 if it did not
+ * come */
+static int
+scale_ping(struct scale* scale, int fd)
+{
+  size_t left = COMMAND_HEADER_SIZE + scale->ping_size;
+
+  if (scale_ping_send(scale, fd) == -1)
+    return -1;
+
+  while (left > 0) {
+    ssize_t recv_ret = scale_ping_recv(fd, left);
+
+    if (recv_ret == -1)
+      return -1;
+
+    left -= (size_t)recv_ret;
+  }
+
+  return 0;
+}
+
+/* Ping on active connections at once, recording round trips. Returns how
+ * many got no response. */
+static size_t
+scale_ping_active(struct scale* scale,
+                  size_t active,
+                  struct pollfd* pfds,
+                  size_t* left,
+                  uint64_t* sent_at,
+                  struct net_latency* latency)
+{
+  size_t failed = 0;
+  size_t waiting = 0;
+
+  if (active > scale->count)
+    active = scale->count;
+
+  for (size_t k = 0; k < active; ++k) {
+    pfds[k].fd = scale->fds[k * scale->count / active];
+    pfds[k].events = POLLIN;
+    left[k] = COMMAND_HEADER_SIZE + scale->ping_size;
+    sent_at[k] = net_nanoseconds();
+
+    if (scale_ping_send(scale, pfds[k].fd) == -1) {
+      pfds[k].fd = -1;
+      ++failed;
+    } else {
+      ++waiting;
+    }
+  }
+
+  while (waiting > 0) {
+    int poll_ret = poll(pfds, active, SCALE_TIMEOUT * 1000);
+
+    if (poll_ret <= 0)
+      break;
+
+    for (size_t k = 0; k < active; ++k) {
+      if (pfds[k].fd < 0 || pfds[k].revents == 0)
+        continue;
+
+      ssize_t recv_ret = scale_ping_recv(pfds[k].fd, left[k]);
+
+      if (recv_ret == -1) {
+        pfds[k].fd = -1;
+        ++failed;
+        --waiting;
+        continue;
+      }
+
+      left[k] -= (size_t)recv_ret;
+
+      if (left[k] == 0) {
+        net_latency_record(latency, net_nanoseconds() - sent_at[k]);
+        pfds[k].fd = -1;
+        --waiting;
+      }
+    }
+  }
+
+  return failed + waiting;
+}
+
+int
+main(int argc, char* argv[])
+{
+  static struct scale scale;
+  static struct net_latency latency;
+  size_t max = 100000;
+  size_t step = 1000;
+  size_t active = 100;
+  unsigned long rounds = 10;
+  long pid = 0;
+  int arg = 1;
+
+  scale.ping_size = 32;
+
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (strcmp(argv[arg], "-c") == 0)
+      max = strtoul(argv[arg + 1], NULL, 0);
+    else if (strcmp(argv[arg], "-s") == 0)
+      step = strtoul(argv[arg + 1], NULL, 0);
+    else if (strcmp(argv[arg], "-a") == 0)
+      active = strtoul(argv[arg + 1], NULL, 0);
+    else if (strcmp(argv[arg], "-r") == 0)
+      rounds = strtoul(argv[arg + 1], NULL, 0);
+    else if (strcmp(argv[arg], "-z") == 0)
+      scale.ping_size = strtoul(argv[arg + 1], NULL, 0);
+    else if (strcmp(argv[arg], "-P") == 0)
+      pid = strtol(argv[arg + 1], NULL, 0);
+  }
+
+  if (argc - arg != 2 || step == 0 || scale.ping_size > SCALE_PING_MAX) {
+    fprintf(stderr,
+            "usage: %s [-c connections] [-s step] [-a active] [-r rounds] "
+            "[-z size] [-P pid] host port\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* res;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(argv[arg], argv[arg + 1], &hints, &res) != 0) {
+    fprintf(stderr, "%s: unknown host\n", argv[arg]);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(&scale.sa, res->ai_addr, res->ai_addrlen);
+  scale.sa_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  scale.loopback =
+    scale.sa.ss_family == AF_INET &&
+    (ntohl(((struct sockaddr_in*)&scale.sa)->sin_addr.s_addr) >> 24) == 127;
+
+  size_t nofile = scale_nofile(max);
+
+  if (nofile < max + SCALE_FDS_SPARE) {
+    max = nofile > SCALE_FDS_SPARE ? nofile - SCALE_FDS_SPARE : 0;
+    fprintf(stderr, "descriptors limited to %zu connections\n", max);
+  }
+
+  scale.fds = calloc(max > 0 ? max : 1, sizeof *scale.fds);
+
+  struct pollfd* pfds = calloc(active > 0 ? active : 1, sizeof *pfds);
+  size_t* left = calloc(active > 0 ? active : 1, sizeof *left);
+  uint64_t* sent_at = calloc(active > 0 ? active : 1, sizeof *sent_at);
+
+  if (scale.fds == NULL || pfds == NULL || left == NULL || sent_at == NULL) {
+    fprintf(stderr, "could not allocate %zu connections\n", max);
+    return EXIT_FAILURE;
+  }
+
+  unsigned long rss_base = scale_rss(pid);
+
+  printf("%11s %10s %10s %10s %10s %10s %10s %7s\n",
+         "connections",
+         "accepts/s",
+         "rss KiB",
+         "rss/conn",
+         "p50 us",
+         "p99 us",
+         "max us",
+         "failed");
+
+  const char* stopped = NULL;
+  int stopped_errno = 0;
+
+  while (scale.count < max && stopped == NULL) {
+    size_t first = scale.count;
+    size_t target = first + step < max ? first + step : max;
+    uint64_t start = net_nanoseconds();
+
+    while (scale.count < target) {
+      int fd = scale_open(&scale, scale.count);
+
+      if (fd == -1) {
+        stopped = "could not open a connection";
+        stopped_errno = errno;
+        break;
+      }
+
+      scale.fds[scale.count++] = fd;
+    }
+
+    if (scale.count == first)
+      break;
+
+    /* the node accepts in order, once the last connection of the step
+     * responds every one before it was accepted */
+    if (scale_ping(&scale, scale.fds[scale.count - 1]) == -1) {
+      stopped = "the node closed a connection or did not respond";
+      stopped_errno = 0;
+    }
+
+    double elapsed = (net_nanoseconds() - start) / 1e9;
+
+    memset(&latency, 0, sizeof latency);
+
+    size_t failed = 0;
+
+    for (unsigned long r = 0; r < rounds && active > 0; ++r)
+      failed += scale_ping_active(
+        &scale, active, pfds, left, sent_at, &latency);
+
+    unsigned long rss = scale_rss(pid);
+
+    printf("%11zu %10.0f %10lu %10lu %10.1f %10.1f %10.1f %7zu\n",
+           scale.count,
+           elapsed > 0 ? (scale.count - first) / elapsed : 0,
+           rss / 1024,
+           rss > rss_base ? (rss - rss_base) / scale.count : 0,
+           net_latency_percentile(&latency, 500) / 1e3,
+           net_latency_percentile(&latency, 990) / 1e3,
+           net_latency_percentile(&latency, 1000) / 1e3,
+           failed);
+    fflush(stdout);
+  }
+
+  if (stopped != NULL)
+    printf("stopped at %zu connections: %s%s%s\n",
+           scale.count,
+           stopped,
+           stopped_errno ? ", " : "",
+           stopped_errno ? strerror(stopped_errno) : "");
+
+  printf("a connection holds %zu octets in the node besides its buffers\n",
+         sizeof(struct net_tcp_conn));
+
+  for (size_t i = 0; i < scale.count; ++i)
+    close(scale.fds[i]);
+
+  free(sent_at);
+  free(left);
+  free(pfds);
+  free(scale.fds);
+
+  return stopped != NULL && scale.count < max ? EXIT_FAILURE : EXIT_SUCCESS;
+}
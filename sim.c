@@ -0,0 +1,679 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+/* Node i has the address SIM_NET + i + 1 */
+#define SIM_NET 0x0a000000UL
+#define SIM_NODES_MAX 0xfffffeUL
+
+/* Source ports of the connections a node opens wrap around in
+ * [SIM_PORT_FIRST, 65535] */
+#define SIM_PORT_FIRST 32768
+
+enum
+{
+  SIM_CONNECT = 1,
+  SIM_ESTABLISHED,
+  SIM_REFUSED,
+  SIM_DATA,
+  SIM_CLOSE,
+  SIM_DATAGRAM,
+  SIM_TIMER,
+} sim_event_kinds;
+
+void
+sim_init(struct sim* sim, unsigned long long seed)
+{
+  memset(sim, 0, sizeof *sim);
+
+  sim->now = 1000000000ULL;
+  sim->random = seed;
+  sim->latency = 20000000ULL;
+  sim->window = SIM_WINDOW_DEFAULT;
+
+  LIST_INIT(&sim->pipes);
+}
+
+static void
+sim_unref(struct sim_pipe* pipe)
+{
+  if (--pipe->refs > 0)
+    return;
+
+  LIST_REMOVE(pipe, entry);
+  free(pipe);
+}
+
+void
+sim_free(struct sim* sim)
+{
+  for (size_t i = 0; i < sim->events; ++i) {
+    if (sim->heap[i]->pipe)
+      sim_unref(sim->heap[i]->pipe);
+
+    free(sim->heap[i]);
+  }
+
+  /* connections still open keep pointers to their end */
+  while (!LIST_EMPTY(&sim->pipes)) {
+    struct sim_pipe* pipe = LIST_FIRST(&sim->pipes);
+
+    for (int i = 0; i < 2; ++i) {
+      if (pipe->ends[i].tcp_conn)
+        pipe->ends[i].tcp_conn->transport = NULL;
+    }
+
+    LIST_REMOVE(pipe, entry);
+    free(pipe);
+  }
+
+  for (size_t i = 0; i < sim->count; ++i) {
+    sim->nodes[i]->ctx->transport = NULL;
+    free(sim->nodes[i]);
+  }
+
+  free(sim->nodes);
+  free(sim->heap);
+  free(sim->run);
+
+  memset(sim, 0, sizeof *sim);
+}
+
+/* Uniformly distributed random number in [0, bound), like net_random */
+static unsigned long
+sim_random(struct sim* sim, unsigned long bound)
+{
+  /* xorshift64* */
+  sim->random ^= sim->random >> 12;
+  sim->random ^= sim->random << 25;
+  sim->random ^= sim->random >> 27;
+
+  return (unsigned long)((sim->random * 0x2545F4914F6CDD1DULL) >> 11) % bound;
+}
+
+static int
+sim_before(struct sim_event* a, struct sim_event* b)
+{
+  return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void
+sim_swap(struct sim* sim, size_t a, size_t b)
+{
+  struct sim_event* event = sim->heap[a];
+
+  sim->heap[a] = sim->heap[b];
+  sim->heap[b] = event;
+}
+
+static void
+sim_up(struct sim* sim, size_t i)
+{
+  while (i > 0 && sim_before(sim->heap[i], sim->heap[(i - 1) / 2])) {
+    sim_swap(sim, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+sim_down(struct sim* sim, size_t i)
+{
+  for (;;) {
+    size_t first = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+
+    if (left < sim->events && sim_before(sim->heap[left], sim->heap[first]))
+      first = left;
+
+    if (right < sim->events && sim_before(sim->heap[right], sim->heap[first]))
+      first = right;
+
+    if (first == i)
+      return;
+
+    sim_swap(sim, i, first);
+    i = first;
+  }
+}
+
+static struct sim_event*
+sim_event_alloc(int kind, size_t node, size_t size)
+{
+  struct sim_event* event = calloc(1, sizeof *event + size);
+
+  if (event == NULL)
+    return NULL;
+
+  event->kind = kind;
+  event->node = node;
+  event->size = size;
+
+  return event;
+}
+
+/* Schedule an event at its time, it is freed if it can't be */
+static void
+sim_schedule(struct sim* sim, struct sim_event* event)
+{
+  if (sim->events == sim->events_capacity) {
+    size_t capacity = sim->events_capacity ? sim->events_capacity * 2 : 1024;
+    struct sim_event** heap = realloc(sim->heap, capacity * sizeof *heap);
+
+    if (heap == NULL) {
+      if (event->pipe)
+        sim_unref(event->pipe);
+
+      free(event);
+      return;
+    }
+
+    sim->heap = heap;
+    sim->events_capacity = capacity;
+  }
+
+  event->seq = sim->seq++;
+
+  sim->heap[sim->events++] = event;
+  sim_up(sim, sim->events - 1);
+}
+
+/* Schedule an event to an end of a pipe, after what was sent to it */
+static void
+sim_schedule_end(struct sim* sim,
+                 struct sim_event* event,
+                 struct sim_pipe* pipe,
+                 int side,
+                 uint64_t at)
+{
+  struct sim_end* end = &pipe->ends[side];
+
+  if (at < end->arrives_at)
+    at = end->arrives_at;
+
+  end->arrives_at = at;
+
+  event->at = at;
+  event->node = end->node;
+  event->pipe = pipe;
+  event->side = side;
+  ++pipe->refs;
+
+  sim_schedule(sim, event);
+}
+
+/* When a segment the node sends now arrives, UINT64_MAX if it is lost and
+ * not sent again */
+static uint64_t
+sim_arrival(struct sim* sim, struct sim_node* node, size_t size, int again)
+{
+  uint64_t at = sim->now;
+
+  if (sim->bandwidth > 0) {
+    if (node->uplink_at > at)
+      at = node->uplink_at;
+
+    at += (uint64_t)size * 1000000000ULL / sim->bandwidth;
+    node->uplink_at = at;
+  }
+
+  at += sim->latency;
+
+  uint64_t rto = sim->latency * 3 > SIM_RTO_MIN ? sim->latency * 3
+                                                 : SIM_RTO_MIN;
+
+  while (sim->loss > 0 && sim_random(sim, 1000000) < sim->loss) {
+    ++sim->lost;
+
+    if (!again)
+      return UINT64_MAX;
+
+    at += rto;
+    rto *= 2;
+  }
+
+  return at;
+}
+
+/* Node accepting connections on an address, NULL if there is none */
+static struct sim_node*
+sim_resolve(struct sim* sim, struct sockaddr* sa, socklen_t sa_len)
+{
+  if (sa->sa_family != AF_INET || sa_len < sizeof(struct sockaddr_in))
+    return NULL;
+
+  struct sockaddr_in* sin = (struct sockaddr_in*)sa;
+  unsigned long addr = ntohl(sin->sin_addr.s_addr);
+
+  if (ntohs(sin->sin_port) != SIM_PORT || addr <= SIM_NET ||
+      addr - SIM_NET > sim->count)
+    return NULL;
+
+  return sim->nodes[addr - SIM_NET - 1];
+}
+
+/* Have a node step once the events due now happened */
+static void
+sim_runnable(struct sim* sim, struct sim_node* node)
+{
+  if (node->runnable)
+    return;
+
+  node->runnable = 1;
+  node->ctx->now = (unsigned long)(sim->now / 1000000);
+  sim->run[sim->run_count++] = node->index;
+}
+
+static int
+sim_open(struct net_transport* transport, struct net_tcp_conn* tcp_conn)
+{
+  struct sim_node* node = transport->p;
+  struct sim* sim = node->sim;
+
+  /* connections to anything else than a node are refused */
+  if (tcp_conn->sa.ss_family != AF_INET)
+    return -1;
+
+  struct sim_node* target =
+    sim_resolve(sim, (struct sockaddr*)&tcp_conn->sa, tcp_conn->sa_len);
+  struct sim_pipe* pipe = calloc(1, sizeof *pipe);
+  struct sim_event* event =
+    sim_event_alloc(target ? SIM_CONNECT : SIM_REFUSED, 0, 0);
+
+  if (pipe == NULL || event == NULL) {
+    free(pipe);
+    free(event);
+    return -1;
+  }
+
+  memcpy(&pipe->sa, &node->ctx->self_sa, sizeof pipe->sa);
+  pipe->sa.sin_port = htons(node->port);
+
+  node->port = node->port == 65535 ? SIM_PORT_FIRST : node->port + 1;
+
+  for (int i = 0; i < 2; ++i) {
+    pipe->ends[i].pipe = pipe;
+    pipe->ends[i].side = i;
+  }
+
+  pipe->ends[0].node = node->index;
+  pipe->ends[0].tcp_conn = tcp_conn;
+  pipe->ends[1].node = target ? target->index : node->index;
+  pipe->refs = 1;
+
+  LIST_INSERT_HEAD(&sim->pipes, pipe, entry);
+
+  tcp_conn->transport = &pipe->ends[0];
+
+  /* a refusal comes back a round trip later */
+  if (target == NULL) {
+    pipe->ends[1].closed = 1;
+    sim_schedule_end(sim, event, pipe, 0, sim->now + 2 * sim->latency);
+  } else {
+    sim_schedule_end(sim, event, pipe, 1, sim_arrival(sim, node, 0, 1));
+  }
+
+  return 0;
+}
+
+static ssize_t
+sim_send(struct net_transport* transport,
+         struct net_tcp_conn* tcp_conn,
+         struct iovec* iov,
+         size_t iov_count)
+{
+  struct sim_node* node = transport->p;
+  struct sim* sim = node->sim;
+  struct sim_end* end = tcp_conn->transport;
+  size_t room = end->in_flight < sim->window ? sim->window - end->in_flight : 0;
+  size_t sent = 0;
+  size_t i = 0;
+  size_t offset = 0;
+
+  /* segments are filled from as many buffers as they can */
+  while (i < iov_count && sent < room) {
+    size_t size = 0;
+
+    for (size_t j = i, o = offset; j < iov_count; ++j, o = 0)
+      size += iov[j].iov_len - o;
+
+    if (size > room - sent)
+      size = room - sent;
+
+    if (size > SIM_SEGMENT_SIZE)
+      size = SIM_SEGMENT_SIZE;
+
+    struct sim_event* event = sim_event_alloc(SIM_DATA, 0, size);
+
+    if (event == NULL)
+      break;
+
+    for (size_t filled = 0; filled < size;) {
+      size_t n = iov[i].iov_len - offset;
+
+      if (n > size - filled)
+        n = size - filled;
+
+      memcpy(event->data + filled, (unsigned char*)iov[i].iov_base + offset, n);
+      filled += n;
+      offset += n;
+
+      if (offset == iov[i].iov_len) {
+        ++i;
+        offset = 0;
+      }
+    }
+
+    sim_schedule_end(
+      sim, event, end->pipe, !end->side, sim_arrival(sim, node, size, 1));
+
+    ++sim->segments;
+    sim->octets += size;
+    sent += size;
+  }
+
+  if (sent == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  end->in_flight += sent;
+
+  return (ssize_t)sent;
+}
+
+static void
+sim_close(struct net_transport* transport, struct net_tcp_conn* tcp_conn)
+{
+  struct sim_node* node = transport->p;
+  struct sim_end* end = tcp_conn->transport;
+
+  if (end == NULL)
+    return;
+
+  struct sim_pipe* pipe = end->pipe;
+  struct sim_end* peer = &pipe->ends[!end->side];
+
+  end->tcp_conn = NULL;
+  end->closed = 1;
+  tcp_conn->transport = NULL;
+
+  /* the other end learns it after what was sent to it */
+  if (!peer->closed) {
+    struct sim_event* event = sim_event_alloc(SIM_CLOSE, 0, 0);
+
+    if (event)
+      sim_schedule_end(node->sim,
+                       event,
+                       pipe,
+                       !end->side,
+                       sim_arrival(node->sim, node, 0, 1));
+  }
+
+  sim_unref(pipe);
+}
+
+static void
+sim_datagram(struct net_transport* transport,
+             struct net_context* ctx,
+             struct sockaddr* sa,
+             socklen_t sa_len,
+             void* data,
+             size_t size)
+{
+  struct sim_node* node = transport->p;
+  struct sim* sim = node->sim;
+  struct sim_node* target = sim_resolve(sim, sa, sa_len);
+
+  (void)ctx;
+
+  if (target == NULL)
+    return;
+
+  uint64_t at = sim_arrival(sim, node, size, 0);
+
+  if (at == UINT64_MAX)
+    return;
+
+  struct sim_event* event = sim_event_alloc(SIM_DATAGRAM, target->index, size);
+
+  if (event == NULL)
+    return;
+
+  memcpy(&event->sa, &node->ctx->self_sa, sizeof event->sa);
+  memcpy(event->data, data, size);
+  event->at = at;
+
+  ++sim->datagrams;
+
+  sim_schedule(sim, event);
+}
+
+int
+sim_add(struct sim* sim, struct net_context* ctx)
+{
+  if (sim->count == SIM_NODES_MAX)
+    return E(SIM_ADD_FULL);
+
+  if (sim->count == sim->capacity) {
+    size_t capacity = sim->capacity ? sim->capacity * 2 : 64;
+    struct sim_node** nodes = realloc(sim->nodes, capacity * sizeof *nodes);
+
+    if (nodes == NULL)
+      return E(SIM_ADD_ALLOC);
+
+    sim->nodes = nodes;
+
+    size_t* run = realloc(sim->run, capacity * sizeof *run);
+
+    if (run == NULL)
+      return E(SIM_ADD_ALLOC);
+
+    sim->run = run;
+    sim->capacity = capacity;
+  }
+
+  struct sim_node* node = calloc(1, sizeof *node);
+
+  if (node == NULL)
+    return E(SIM_ADD_ALLOC);
+
+  node->sim = sim;
+  node->index = sim->count;
+  node->ctx = ctx;
+  node->port = SIM_PORT_FIRST;
+
+  node->transport.open = sim_open;
+  node->transport.send = sim_send;
+  node->transport.close = sim_close;
+  node->transport.datagram = sim_datagram;
+  node->transport.p = node;
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof sa);
+
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(SIM_PORT);
+  sa.sin_addr.s_addr = htonl(SIM_NET + node->index + 1);
+
+  memcpy(&ctx->self_sa, &sa, sizeof sa);
+  ctx->self_sa_len = sizeof sa;
+
+  ctx->transport = &node->transport;
+  ctx->now = (unsigned long)(sim->now / 1000000);
+
+  /* must not be 0 or the generator only ever returns 0 */
+  ctx->random = (unsigned long long)sim_random(sim, ULONG_MAX) << 1 | 1;
+
+  sim->nodes[sim->count++] = node;
+
+  /* every node steps once to start its timers */
+  sim_runnable(sim, node);
+
+  return SIM_ADD_OK;
+}
+
+/* Let the context of the end an event is for know about it */
+static void
+sim_handle_end(struct sim* sim, struct sim_event* event)
+{
+  struct sim_pipe* pipe = event->pipe;
+  struct sim_end* end = &pipe->ends[event->side];
+  struct sim_node* node = sim->nodes[end->node];
+
+  sim_runnable(sim, node);
+
+  if (event->kind == SIM_CONNECT) {
+    /* the node that opened it gave up already */
+    if (pipe->ends[0].closed) {
+      end->closed = 1;
+      return;
+    }
+
+    struct sim_event* reply = sim_event_alloc(SIM_ESTABLISHED, 0, 0);
+
+    if (reply)
+      end->tcp_conn = net_transport_accept(node->ctx,
+                                           (struct sockaddr*)&pipe->sa,
+                                           sizeof pipe->sa,
+                                           end);
+
+    if (end->tcp_conn == NULL) {
+      end->closed = 1;
+
+      if (reply)
+        reply->kind = SIM_REFUSED;
+      else if ((reply = sim_event_alloc(SIM_REFUSED, 0, 0)) == NULL)
+        return;
+    } else {
+      ++pipe->refs;
+    }
+
+    sim_schedule_end(sim, reply, pipe, 0, sim_arrival(sim, node, 0, 1));
+    return;
+  }
+
+  if (event->kind == SIM_DATA) {
+    struct sim_end* sender = &pipe->ends[!event->side];
+
+    /* the window of the sender opens again */
+    sender->in_flight -= event->size;
+
+    if (sender->tcp_conn && (sender->tcp_conn->send_buf.size > 0 ||
+                             !TAILQ_EMPTY(&sender->tcp_conn->send_queue)))
+      sim_runnable(sim, sim->nodes[sender->node]);
+  }
+
+  if (end->tcp_conn == NULL)
+    return;
+
+  switch (event->kind) {
+    case SIM_ESTABLISHED:
+      net_transport_connected(end->tcp_conn);
+      break;
+    case SIM_REFUSED:
+      ++sim->refused;
+      net_tcp_conn_close(end->tcp_conn, NET_EVENT_CLOSED_CONNECT);
+      break;
+    case SIM_DATA:
+      net_transport_received(end->tcp_conn, event->data, event->size);
+      break;
+    case SIM_CLOSE:
+      net_tcp_conn_close(end->tcp_conn, NET_EVENT_CLOSED_RECV);
+      break;
+  }
+}
+
+static void
+sim_handle(struct sim* sim, struct sim_event* event)
+{
+  ++sim->handled;
+
+  if (event->pipe) {
+    sim_handle_end(sim, event);
+    sim_unref(event->pipe);
+    return;
+  }
+
+  struct sim_node* node = sim->nodes[event->node];
+
+  if (event->kind == SIM_DATAGRAM) {
+    sim_runnable(sim, node);
+    net_transport_datagram(node->ctx,
+                           (struct sockaddr*)&event->sa,
+                           sizeof event->sa,
+                           event->data,
+                           event->size);
+  } else if (event->kind == SIM_TIMER && event->at == node->timer_at) {
+    /* earlier timers of the node were replaced by this one */
+    node->timer_at = 0;
+    sim_runnable(sim, node);
+  }
+}
+
+/* Step a node and schedule its next step for when its timers are due */
+static void
+sim_step(struct sim* sim, struct sim_node* node)
+{
+  struct net_context* ctx = node->ctx;
+
+  node->runnable = 0;
+
+  net_transport_step(ctx);
+
+  /* a timer that is due already is run on the next millisecond */
+  uint64_t at =
+    (uint64_t)(ctx->wake_at > ctx->now ? ctx->wake_at : ctx->now + 1) *
+    1000000;
+
+  if (node->timer_at != 0 && node->timer_at <= at)
+    return;
+
+  struct sim_event* event = sim_event_alloc(SIM_TIMER, node->index, 0);
+
+  if (event == NULL)
+    return;
+
+  event->at = at;
+  node->timer_at = at;
+
+  sim_schedule(sim, event);
+}
+
+void
+sim_run(struct sim* sim, unsigned long duration)
+{
+  uint64_t until = sim->now + (uint64_t)duration * 1000000;
+
+  do {
+    /* nodes step once everything due at the same time happened to them */
+    for (size_t i = 0; i < sim->run_count; ++i)
+      sim_step(sim, sim->nodes[sim->run[i]]);
+
+    sim->run_count = 0;
+
+    if (sim->events == 0 || sim->heap[0]->at > until)
+      break;
+
+    sim->now = sim->heap[0]->at;
+
+    while (sim->events > 0 && sim->heap[0]->at == sim->now) {
+      struct sim_event* event = sim->heap[0];
+
+      sim->heap[0] = sim->heap[--sim->events];
+      sim_down(sim, 0);
+
+      sim_handle(sim, event);
+      free(event);
+    }
+  } while (1);
+
+  sim->now = until;
+}
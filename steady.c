@@ -0,0 +1,254 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+/*
+  Check that the loop does not allocate once it reached steady state.
+
+  usage: steady [-n pings] [-w warmup] [-c connections] [-z size]
+
+  A node answering pings runs its loop on a thread. connections opened to it
+  over loopback each ping it in turn, warmup times and then pings times, with
+  size octets. Its objects are built with -DMEM_COUNT so that allocations
+  are counted by call site. It fails, listing the sites responsible, if any
+  allocation was made after the warm-up.
+*/
+
+/* Largest ping payload */
+#define STEADY_PING_MAX 4096
+
+struct steady
+{
+  int* fds;
+  size_t count;
+  size_t ping_size;
+  unsigned long tag;
+  unsigned char ping[COMMAND_HEADER_SIZE + STEADY_PING_MAX];
+  unsigned char response[COMMAND_HEADER_SIZE + STEADY_PING_MAX];
+};
+
+static void*
+steady_loop(void* p)
+{
+  net_loop(p);
+
+  return NULL;
+}
+
+/* Ping on every connection, then wait for every response, -1 if one did not
+ * come whole */
+static int
+steady_round(struct steady* steady)
+{
+  size_t size = COMMAND_HEADER_SIZE + steady->ping_size;
+
+  for (size_t i = 0; i < steady->count; ++i) {
+    struct command_header header;
+
+    header.flags = COMMAND_HEADER_IS_REQUEST;
+    header.tag = ++steady->tag & 0xffffffffUL;
+    header.type = COMMAND_PING;
+    header.version = 0;
+    header.size = steady->ping_size;
+
+    codec_encode_command_header(steady->ping, &header);
+
+    if (send(steady->fds[i], steady->ping, size, MSG_NOSIGNAL) !=
+        (ssize_t)size)
+      return -1;
+  }
+
+  for (size_t i = 0; i < steady->count; ++i) {
+    size_t received = 0;
+
+    while (received < size) {
+      ssize_t recv_ret =
+        recv(steady->fds[i], steady->response + received, size - received, 0);
+
+      if (recv_ret <= 0)
+        return -1;
+
+      received += (size_t)recv_ret;
+    }
+  }
+
+  return 0;
+}
+
+/* The same call site in a snapshot, NULL if it was not there */
+static struct mem_count_site*
+steady_site(struct mem_count_site* sites,
+            size_t count,
+            struct mem_count_site* site)
+{
+  for (size_t i = 0; i < count; ++i)
+    if (sites[i].line == site->line && strcmp(sites[i].file, site->file) == 0)
+      return &sites[i];
+
+  return NULL;
+}
+
+int
+main(int argc, char* argv[])
+{
+  static struct net_context ctx;
+  static struct command_context cctx;
+  static struct steady steady;
+  static struct mem_count_site before[MEM_COUNT_SITES];
+  static struct mem_count_site after[MEM_COUNT_SITES];
+  static struct command_handler ping_handler;
+  static struct net_callback received;
+  unsigned long pings = 100000;
+  unsigned long warmup = 1000;
+  size_t connections = 4;
+
+  steady.ping_size = 32;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0)
+      pings = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-w") == 0)
+      warmup = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-c") == 0)
+      connections = strtoul(argv[i + 1], NULL, 0);
+    else if (strcmp(argv[i], "-z") == 0)
+      steady.ping_size = strtoul(argv[i + 1], NULL, 0);
+  }
+
+  if (connections == 0 || steady.ping_size > STEADY_PING_MAX) {
+    fprintf(stderr, "at least a connection and pings up to %d octets\n",
+            STEADY_PING_MAX);
+    return EXIT_FAILURE;
+  }
+
+  int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof sa;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (tcp_fd == -1 || bind(tcp_fd, (struct sockaddr*)&sa, sa_len) == -1 ||
+      listen(tcp_fd, 256) == -1 ||
+      getsockname(tcp_fd, (struct sockaddr*)&sa, &sa_len) == -1 ||
+      net_set_nonblock(tcp_fd) != NET_SET_NONBLOCK_OK) {
+    perror("listen");
+    return EXIT_FAILURE;
+  }
+
+  net_context_init(&ctx);
+
+  ctx.tcp_boundfds[0] = tcp_fd;
+
+  ping_handler.type_min = COMMAND_PING;
+  ping_handler.type_max = COMMAND_PING;
+  ping_handler.version_max = USHRT_MAX;
+  ping_handler.flags = COMMAND_HANDLER_STREAM;
+  ping_handler.fn = command_ping_stream;
+
+  cctx.max_frame_size = COMMAND_MAX_FRAME_SIZE;
+
+  if (command_register(&cctx, &ping_handler) != COMMAND_REGISTER_OK)
+    return EXIT_FAILURE;
+
+  received.events = NET_EVENT_RECEIVED;
+  received.p = &cctx;
+  received.cb = net_cb_command_received;
+
+  LIST_INSERT_HEAD(&ctx.callbacks, &received, entry);
+
+  /* the loop never returns, the thread ends with the process, which is why
+   * everything it uses is static */
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, steady_loop, &ctx) != 0)
+    return EXIT_FAILURE;
+
+  steady.fds = calloc(connections, sizeof *steady.fds);
+
+  if (steady.fds == NULL)
+    return EXIT_FAILURE;
+
+  for (; steady.count < connections; ++steady.count) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd == -1 || connect(fd, (struct sockaddr*)&sa, sa_len) == -1) {
+      perror("connect");
+      return EXIT_FAILURE;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    steady.fds[steady.count] = fd;
+  }
+
+  for (unsigned long i = 0; i < warmup; ++i)
+    if (steady_round(&steady) == -1) {
+      fprintf(stderr, "no response during warm-up\n");
+      return EXIT_FAILURE;
+    }
+
+  size_t before_count = mem_count_sites(before, MEM_COUNT_SITES);
+  unsigned long allocs = mem_count_allocs();
+  uint64_t start = net_nanoseconds();
+
+  for (unsigned long i = 0; i < pings; ++i)
+    if (steady_round(&steady) == -1) {
+      fprintf(stderr, "no response after %lu rounds\n", i);
+      return EXIT_FAILURE;
+    }
+
+  uint64_t elapsed = net_nanoseconds() - start;
+
+  allocs = mem_count_allocs() - allocs;
+
+  size_t after_count = mem_count_sites(after, MEM_COUNT_SITES);
+  unsigned long total = pings * connections;
+
+  if (before_count > MEM_COUNT_SITES)
+    before_count = MEM_COUNT_SITES;
+
+  if (after_count > MEM_COUNT_SITES)
+    after_count = MEM_COUNT_SITES;
+
+  printf("%lu pings over %zu connections, %.0f ns per round\n",
+         total,
+         connections,
+         pings > 0 ? (double)elapsed / pings : 0);
+  printf("%lu allocations after warm-up, %.4f per ping\n",
+         allocs,
+         total > 0 ? (double)allocs / total : 0);
+
+  for (size_t i = 0; i < after_count; ++i) {
+    struct mem_count_site* site = &after[i];
+    struct mem_count_site* was = steady_site(before, before_count, site);
+    unsigned long site_allocs = site->allocs - (was ? was->allocs : 0);
+
+    if (site_allocs > 0)
+      printf("  %s:%d %lu allocations, %lu octets\n",
+             site->file,
+             site->line,
+             site_allocs,
+             site->octets - (was ? was->octets : 0));
+  }
+
+#ifndef MEM_COUNT
+  printf("built without -DMEM_COUNT, nothing was counted\n");
+  return EXIT_FAILURE;
+#else
+  return allocs == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+}
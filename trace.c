@@ -0,0 +1,79 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+struct trace_file* trace_file;
+
+_Thread_local struct trace_ring* trace_ring;
+
+int
+trace_open(const char* path)
+{
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+  if (fd == -1)
+    return E(TRACE_OPEN_FILE);
+
+  if (ftruncate(fd, sizeof *trace_file) == -1) {
+    close(fd);
+    return E(TRACE_OPEN_FILE);
+  }
+
+  /* shared with the file, what was written survives a crash */
+  void* p =
+    mmap(NULL, sizeof *trace_file, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  if (p == MAP_FAILED)
+    return E(TRACE_OPEN_MAP);
+
+  struct trace_file* file = p;
+
+  memcpy(file->magic, TRACE_MAGIC, sizeof file->magic);
+  file->version = TRACE_VERSION;
+  file->ring_size = TRACE_RING_SIZE;
+  file->threads_max = TRACE_THREADS_MAX;
+
+  trace_file = file;
+
+  return TRACE_OPEN_OK;
+}
+
+void
+trace_close(void)
+{
+  if (trace_file == NULL)
+    return;
+
+  munmap(trace_file, sizeof *trace_file);
+  trace_file = NULL;
+}
+
+#ifdef TRACE
+struct trace_ring*
+trace_ring_claim(void)
+{
+  struct trace_file* file = trace_file;
+
+  if (file == NULL)
+    return NULL;
+
+  unsigned int i = atomic_load(&file->threads);
+
+  do {
+    if (i >= TRACE_THREADS_MAX)
+      return NULL;
+  } while (!atomic_compare_exchange_weak(&file->threads, &i, i + 1));
+
+  trace_ring = &file->rings[i];
+
+  return trace_ring;
+}
+#endif
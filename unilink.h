@@ -7,9 +7,13 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
+#include "codec.h"
 #include "queue.h"
 
 #define RECV_SIZE sysconf(_SC_PAGESIZE)
@@ -29,12 +33,20 @@ struct net_callback
 
 LIST_HEAD(net_callbacks, net_callback);
 
+/*
+  Growable buffer of size octets at p. Shrinking keeps what was allocated so
+  that buffers reused for every message stop being reallocated once they are
+  large enough, emptied buffers only give it back above MEM_BUF_KEEP.
+*/
 struct mem_buf
 {
   void* p;
   size_t size;
+  size_t capacity;
 };
 
+#define MEM_BUF_KEEP (64UL << 10)
+
 void
 mem_free_buf(struct mem_buf* m);
 
@@ -70,6 +82,131 @@ enum
 int
 mem_shrink_buf(struct mem_buf* m, size_t size);
 
+/*
+  Allocation counting, compiled in with -DMEM_COUNT. malloc, calloc, realloc
+  and free in every file including this header then go through hooks
+  counting calls and octets per call site, to check that a path does not
+  allocate. Without it the counts stay 0.
+*/
+struct mem_count_site
+{
+  const char* file;
+  int line;
+
+  /* Calls that allocated or freed, and octets asked for */
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long octets;
+};
+
+/* Call sites counted, later ones are only counted in the totals */
+#define MEM_COUNT_SITES 512
+
+#ifdef MEM_COUNT
+#include <stdlib.h>
+
+void*
+mem_count_malloc(size_t size, const char* file, int line);
+
+void*
+mem_count_calloc(size_t count, size_t size, const char* file, int line);
+
+void*
+mem_count_realloc(void* p, size_t size, const char* file, int line);
+
+void
+mem_count_free(void* p, const char* file, int line);
+
+#define malloc(size) mem_count_malloc(size, __FILE__, __LINE__)
+#define calloc(count, size) mem_count_calloc(count, size, __FILE__, __LINE__)
+#define realloc(p, size) mem_count_realloc(p, size, __FILE__, __LINE__)
+#define free(p) mem_count_free(p, __FILE__, __LINE__)
+#endif
+
+/* Calls that allocated so far, over every thread */
+unsigned long
+mem_count_allocs(void);
+
+/* Copy up to count call sites to sites, returning how many there are */
+size_t
+mem_count_sites(struct mem_count_site* sites, size_t count);
+
+/*
+  Immutable reference counted buffer, to send the same octets on several
+  connections without copying them. Whoever holds a reference must not
+  change data.
+*/
+struct mem_shared
+{
+  unsigned long refs;
+  size_t size;
+  unsigned char data[];
+};
+
+/* Allocate a buffer of size octets holding a single reference, NULL if out of
+ * memory */
+struct mem_shared*
+mem_shared_alloc(size_t size);
+
+struct mem_shared*
+mem_shared_ref(struct mem_shared* shared);
+
+/* Drop a reference, freeing the buffer with the last one */
+void
+mem_shared_unref(struct mem_shared* shared);
+
+#define MEM_CACHE_LINE 64
+
+struct mem_ring_slot
+{
+  atomic_size_t sequence;
+  void* p;
+};
+
+/*
+  Bounded queue of pointers that any number of threads can push to and pop
+  from at once without locks. The positions are on cache lines of their own
+  so that producers and consumers don't slow each other down.
+*/
+struct mem_ring
+{
+  struct mem_ring_slot* slots;
+  size_t mask;
+
+  unsigned char pad_head[MEM_CACHE_LINE];
+  atomic_size_t head;
+  unsigned char pad_tail[MEM_CACHE_LINE];
+  atomic_size_t tail;
+  unsigned char pad_end[MEM_CACHE_LINE];
+};
+
+enum
+{
+  MEM_RING_INIT_OK,
+  MEM_RING_INIT_SIZE,
+  MEM_RING_INIT_ALLOC,
+} mem_ring_init_errors;
+
+/* size must be a power of two */
+int
+mem_ring_init(struct mem_ring* ring, size_t size);
+
+void
+mem_ring_free(struct mem_ring* ring);
+
+enum
+{
+  MEM_RING_PUSH_OK,
+  MEM_RING_PUSH_FULL,
+} mem_ring_push_errors;
+
+int
+mem_ring_push(struct mem_ring* ring, void* p);
+
+/* Oldest pointer pushed, NULL if the ring is empty */
+void*
+mem_ring_pop(struct mem_ring* ring);
+
 typedef void
 command_state_free_fn(void*);
 
@@ -83,12 +220,250 @@ struct command_state
   unsigned short type;
   void* state;
   command_state_free_fn* free;
+
+  /* Tag of the request the state waits for a response to and when it was
+   * sent, from net_nanoseconds. The round trip is recorded when the response
+   * arrives, sent_at is 0 when there is nothing to record. */
+  unsigned long tag;
+  uint64_t sent_at;
 };
 
 LIST_HEAD(command_states, command_state);
 
+#define COMMAND_HEADER_IS_REQUEST 0x1
+
+/*
+  Layouts of the fixed size sections of protocol.md, see codec.h.
+*/
+
+#define COMMAND_HEADER_SCHEMA(F, S)                                            \
+  F(flags, 1)   /* COMMAND_HEADER_* flags */                                   \
+  F(tag, 4)     /* Tag number, used for unordered command pipelining */        \
+  F(type, 2)    /* Type of the command */                                      \
+  F(version, 2) /* Version of the command */                                   \
+  F(size, 4)    /* Size of data following the header */
+
+CODEC_DEFINE(command_header, COMMAND_HEADER_SCHEMA)
+
+#define COMMAND_HEADER_SIZE CODEC_SIZE(COMMAND_HEADER_SCHEMA)
+
+#define STATS_RECORD_SCHEMA(F, S)                                              \
+  F(scope, 1)      /* STATS_SCOPE_* */                                         \
+  F(key, 4)        /* Command type or connection id */                         \
+  F(counter, 1)    /* STATS_* counter */                                       \
+  F(value_high, 4) /* Upper 32 bits of the value */                            \
+  F(value_low, 4)  /* Lower 32 bits of the value */
+
+CODEC_DEFINE(stats_record, STATS_RECORD_SCHEMA)
+
+#define STATS_RECORD_SIZE CODEC_SIZE(STATS_RECORD_SCHEMA)
+
+/* Record of a capture file, followed by size octets received for
+ * CAPTURE_DATA, see capture_open */
+#define CAPTURE_RECORD_SCHEMA(F, S)                                            \
+  F(kind, 1)    /* CAPTURE_* */                                                \
+  F(conn_id, 4) /* Connection the record is about */                           \
+  F(delay, 4)   /* Microseconds since the previous record */                   \
+  F(size, 4)    /* Size of data following the record */
+
+CODEC_DEFINE(capture_record, CAPTURE_RECORD_SCHEMA)
+
+#define CAPTURE_RECORD_SIZE CODEC_SIZE(CAPTURE_RECORD_SCHEMA)
+
+#define ANNOUNCE_HEAD_SCHEMA(F, S)                                             \
+  F(role, 1)                                                                   \
+  F(address_block_count, 1)
+
+#define ADDRESS_BLOCK_HEAD_SCHEMA(F, S) S(family, size, 2, 12)
+
+#define PUBLIC_KEY_HEAD_SCHEMA(F, S)                                           \
+  S(public_key_type, public_key_size, 2, 12)
+
+#define SIGNATURE_HEAD_SCHEMA(F, S) F(signature_size, 2)
+
+#define MASTER_SIGNATURE_HEAD_SCHEMA(F, S)                                     \
+  F(master_signature_type, 1)                                                  \
+  F(master_signature_size, 2)
+
+CODEC_DEFINE(announce_head, ANNOUNCE_HEAD_SCHEMA)
+CODEC_DEFINE(address_block_head, ADDRESS_BLOCK_HEAD_SCHEMA)
+CODEC_DEFINE(public_key_head, PUBLIC_KEY_HEAD_SCHEMA)
+CODEC_DEFINE(signature_head, SIGNATURE_HEAD_SCHEMA)
+CODEC_DEFINE(master_signature_head, MASTER_SIGNATURE_HEAD_SCHEMA)
+
 #define NET_TCP_CONN_CONNECTED 0x1
 
+/* The connection is a UNIX domain stream socket rather than a TCP one */
+#define NET_TCP_CONN_UNIX 0x2
+
+/* We initiated the connection with net_open */
+#define NET_TCP_CONN_OUTBOUND 0x4
+
+/* net_tcp_conn_close was called, the loop closes the connection before its
+ * next select(2) */
+#define NET_TCP_CONN_CLOSING 0x8
+
+/* Our own announce was queued on the connection. Peers take the first
+ * announce of a connection as that of the node at the other end, announces
+ * of other nodes are only relayed on connections that carry ours */
+#define NET_TCP_CONN_ANNOUNCE_SENT 0x10
+
+/* The first announce of the connection, that of the peer, was received */
+#define NET_TCP_CONN_ANNOUNCE_RECEIVED 0x20
+
+/* How many file descriptors can be passed along with a single send(2) */
+#define NET_UNIX_FDS_MAX 16
+
+/* How many file descriptors passed by a peer are held until they are taken,
+ * further ones are closed as they arrive */
+#define NET_UNIX_FDS_HELD_MAX 64
+
+/* Shared buffer queued on a connection, followed by the octets written to the
+ * connection after it was queued */
+struct net_send_entry
+{
+  TAILQ_ENTRY(net_send_entry) entry;
+  struct mem_shared* shared;
+
+  /* Octets of shared already sent */
+  size_t offset;
+
+  struct mem_buf tail;
+};
+
+TAILQ_HEAD(net_send_queue, net_send_entry);
+
+/*
+  Counters of connections, of the whole node and of command types. Only the
+  loop thread writes them, with net_counter_add and net_counter_max, other
+  threads can read them with atomic_load at any time. The loop does not pay
+  for atomic read-modify-write instructions as it is the only writer.
+
+  The order of the lists is the one of the STATS_* counters.
+*/
+#define NET_COUNTERS(X)                                                        \
+  X(octets_in)                                                                 \
+  X(octets_out)                                                                \
+  X(frames_in)                                                                 \
+  X(frames_out)                                                                \
+  X(recv_calls)                                                                \
+  X(send_calls)                                                                \
+  X(recv_again)                                                                \
+  X(send_again)                                                                \
+  X(receive_buf_max)                                                           \
+  X(send_buf_max)
+
+#define NET_COMMAND_COUNTERS(X)                                                \
+  X(octets_in)                                                                 \
+  X(octets_out)                                                                \
+  X(frames_in)                                                                 \
+  X(frames_out)
+
+#define NET_COUNTER_ATOMIC(name) atomic_ulong name;
+#define NET_COUNTER_VALUE(name) unsigned long name;
+
+struct net_counters
+{
+  NET_COUNTERS(NET_COUNTER_ATOMIC)
+};
+
+struct net_counters_values
+{
+  NET_COUNTERS(NET_COUNTER_VALUE)
+};
+
+struct net_command_counters
+{
+  NET_COMMAND_COUNTERS(NET_COUNTER_ATOMIC)
+};
+
+struct net_command_counters_values
+{
+  NET_COMMAND_COUNTERS(NET_COUNTER_VALUE)
+};
+
+static inline void
+net_counter_add(atomic_ulong* counter, unsigned long n)
+{
+  atomic_store_explicit(
+    counter,
+    atomic_load_explicit(counter, memory_order_relaxed) + n,
+    memory_order_relaxed);
+}
+
+static inline void
+net_counter_sub(atomic_ulong* counter, unsigned long n)
+{
+  atomic_store_explicit(
+    counter,
+    atomic_load_explicit(counter, memory_order_relaxed) - n,
+    memory_order_relaxed);
+}
+
+static inline void
+net_counter_max(atomic_ulong* counter, unsigned long value)
+{
+  if (value > atomic_load_explicit(counter, memory_order_relaxed))
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+void
+net_counters_read(struct net_counters* counters,
+                  struct net_counters_values* values);
+
+/*
+  Log-linear histogram of durations in nanoseconds, with NET_LATENCY_SUB
+  buckets for every power of 2, the error of a percentile is within 1 /
+  NET_LATENCY_SUB of its value. Written by the loop thread only, readable from
+  any thread like counters.
+*/
+#define NET_LATENCY_SUB_BITS 4
+#define NET_LATENCY_SUB (1 << NET_LATENCY_SUB_BITS)
+
+/* Durations of 2^NET_LATENCY_BITS nanoseconds and more, about 18 minutes,
+ * all go in the last bucket */
+#define NET_LATENCY_BITS 40
+
+#define NET_LATENCY_BUCKETS                                                    \
+  ((NET_LATENCY_BITS - NET_LATENCY_SUB_BITS + 1) * NET_LATENCY_SUB)
+
+struct net_latency
+{
+  atomic_ulong count;
+  atomic_ulong max;
+  atomic_uint buckets[NET_LATENCY_BUCKETS];
+};
+
+void
+net_latency_record(struct net_latency* latency, uint64_t duration);
+
+/* Duration permille of the recorded durations are at most, the highest one
+ * recorded for 1000. 0 when nothing was recorded. */
+unsigned long
+net_latency_percentile(struct net_latency* latency, unsigned int permille);
+
+/* Monotonic time in nanoseconds, to measure durations */
+uint64_t
+net_nanoseconds(void);
+
+/* Frame posted from another thread for the connection with id conn_id */
+struct net_post
+{
+  STAILQ_ENTRY(net_post) entry;
+  unsigned long conn_id;
+
+  /* Position in the batch it was taken off the ring in, keeps frames for the
+   * same connection in order once sorted */
+  size_t order;
+
+  struct mem_shared* shared;
+};
+
+STAILQ_HEAD(net_posts, net_post);
+
+/* How many buffers are handed to a single sendmsg(2) */
+#define NET_SEND_IOV_MAX 16
+
 struct net_tcp_conn
 {
   LIST_ENTRY(net_tcp_conn) entry;
@@ -99,10 +474,324 @@ struct net_tcp_conn
   struct mem_buf send_buf;
   struct mem_buf receive_buf;
   struct command_states states;
+
+  /* File descriptors waiting to be passed to the peer and file descriptors
+   * the peer passed to us, as arrays of int. UNIX domain connections only. */
+  struct mem_buf send_fds;
+  struct mem_buf receive_fds;
+
+  /* Header of the command whose payload is being streamed to its handler,
+   * only meaningful while stream_remaining is not 0 */
+  struct command_header stream_header;
+
+  /* How many octets of the streamed payload have not been received yet */
+  unsigned long stream_remaining;
+
+  /* Handler receiving the streamed payload, NULL if it is being skipped */
+  struct command_handler* stream_handler;
+
+  /* Peer this connection is known to lead to, NULL until it is known */
+  struct net_peer* peer;
+
+  /* NET_EVENT_CLOSED_* flags reported once a closing connection is closed */
+  int close_flags;
+
+  /* When net_open started connect(2), and how many milliseconds it took to
+   * complete, outbound connections only */
+  unsigned long opened_at;
+  unsigned long connect_time;
+  /* What to send once send_buf is empty, in order, and how many octets of it
+   * are left */
+  struct net_send_queue send_queue;
+  size_t send_queued;
+
+  /* Octets of a frame that is being written in pieces with
+   * net_tcp_conn_write, no other frame can be queued until it is complete */
+  unsigned long send_partial;
+
+  /* Frames posted from other threads waiting for send_partial to be 0 */
+  struct net_posts posted;
+
+  /* Names the connection to other threads, never reused. Connections are
+   * only ever inserted at the head of tcp_conns, which is thus sorted by
+   * decreasing id. */
+  unsigned long id;
+
+  struct net_context* ctx;
+
+  struct net_counters counters;
+
+  /* Round trips of the requests we sent on this connection, allocated with
+   * the first response, NULL until then */
+  struct net_latency* round_trips;
+
+  /* Time handlers spent on the streamed command so far */
+  uint64_t stream_service;
+
+  /* What the transport of the context keeps about the connection, see
+   * struct net_transport */
+  void* transport;
+
+  /* Octets it held when the loop last accounted for its buffers, command
+   * states and queues, shared buffers aside */
+  size_t memory;
 };
 
 LIST_HEAD(net_tcp_conns, net_tcp_conn);
 
+/* Command types counted separately, like the ones that can be handled */
+#define NET_METRICS_TYPES 256
+
+/* Command types whose latency is recorded, the lowest ones */
+#define NET_LATENCY_TYPES 16
+
+/* Distinct NET_EVENT_CLOSED_* flags counted in closed_reasons. Later ones
+ * have counters of their own, so that the ids of STATS counters stay. */
+#define NET_CLOSED_REASONS 6
+
+/* Phases of an iteration of the loop: blocked in select(2), accepting and
+ * establishing connections, receiving, in event handlers, sending, and in
+ * NET_EVENT_TICK handlers */
+enum
+{
+  NET_PHASE_POLL,
+  NET_PHASE_ACCEPT,
+  NET_PHASE_RECV,
+  NET_PHASE_DISPATCH,
+  NET_PHASE_SEND,
+  NET_PHASE_TIMERS,
+  NET_PHASES,
+} net_phases;
+
+/* Time the current iteration of the loop spent so far, in nanoseconds */
+struct net_iteration
+{
+  uint64_t start;
+  uint64_t phases[NET_PHASES];
+
+  /* Everything but select(2), once the iteration is over */
+  uint64_t busy;
+
+  /* Connection that took the longest to receive from, handle and send to,
+   * conn_id is 0 if no connection was ready */
+  unsigned long conn_id;
+  uint64_t conn_time;
+
+  /* Command type handlers spent the longest on, type_time is 0 if no
+   * command was handled */
+  unsigned short type;
+  uint64_t type_time;
+
+  /* Whether the time select(2) was to return by had come when
+   * NET_EVENT_TICK was raised, and how late it was */
+  int due;
+  uint64_t lag;
+};
+
+/* How long loop histograms cover, in milliseconds */
+#define NET_LOOP_WINDOW 60000
+
+/* Durations of iterations of the loop, of its phases, and how late timers
+ * fired */
+struct net_loop_window
+{
+  struct net_latency busy;
+  struct net_latency lag;
+  struct net_latency phases[NET_PHASES];
+};
+
+/*
+  Counters of the node. There is a single loop thread writing them, they are
+  surrounded by padding so that threads reading them don't share a cache line
+  with what the loop and threads posting frames write.
+*/
+struct net_metrics
+{
+  unsigned char pad_head[MEM_CACHE_LINE];
+
+  struct net_counters totals;
+
+  /* Connections established and not closed yet, established by accept(2)
+   * and connect(2), and closed once established, by NET_EVENT_CLOSED_* flag
+   * from the lowest bit */
+  atomic_ulong connections;
+  atomic_ulong accepted;
+  atomic_ulong connected;
+  atomic_ulong closed;
+  atomic_ulong closed_reasons[NET_CLOSED_REASONS];
+
+  /* Connections closed as soon as accepted, their descriptor being past
+   * FD_SETSIZE */
+  atomic_ulong refused;
+
+  /* Connections closed with NET_EVENT_CLOSED_MEMORY, STATS counter 86 */
+  atomic_ulong closed_memory;
+
+  /* Octets connections held when last accounted, and iterations that found
+   * them past ctx->memory_soft */
+  atomic_ulong memory;
+  atomic_ulong memory_pressure;
+
+  /* Commands received and queued to be sent, by type */
+  struct net_command_counters commands[NET_METRICS_TYPES];
+
+  /* Round trips of requests we sent and time handlers spent on commands we
+   * received, by type */
+  struct net_latency round_trips[NET_LATENCY_TYPES];
+  struct net_latency service[NET_LATENCY_TYPES];
+
+  /* Iterations of the loop, how many fds select(2) found ready and was given
+   * to scan over all of them, and iterations that were slower than
+   * ctx->slow_iteration */
+  atomic_ulong iterations;
+  atomic_ulong fds_ready;
+  atomic_ulong fds_scanned;
+  atomic_ulong slow_iterations;
+
+  /* The window iterations are recorded in and the previous one, which is
+   * cleared to become the current one every NET_LOOP_WINDOW. Readers merge
+   * both, and may see a window being cleared. */
+  struct net_loop_window loop[2];
+  atomic_uint loop_window;
+
+  unsigned char pad_end[MEM_CACHE_LINE];
+};
+
+struct net_metrics_snapshot
+{
+  struct net_counters_values totals;
+
+  unsigned long connections;
+  unsigned long accepted;
+  unsigned long connected;
+  unsigned long closed;
+  unsigned long closed_reasons[NET_CLOSED_REASONS];
+
+  struct net_command_counters_values commands[NET_METRICS_TYPES];
+};
+
+/* Largest datagram that can be received, bigger ones are dropped */
+#define NET_UDP_DATAGRAM_SIZE 2048
+
+/* How many datagrams are received or sent with a single system call */
+#define NET_UDP_BATCH 32
+
+/* Octets of datagrams a UDP socket may have waiting to be sent, further
+ * ones are dropped */
+#define NET_UDP_QUEUED_MAX (512UL << 10)
+
+struct net_datagram
+{
+  STAILQ_ENTRY(net_datagram) entry;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  size_t size;
+  unsigned char data[];
+};
+
+STAILQ_HEAD(net_datagrams, net_datagram);
+
+/* Keep a connection to the peer, reconnecting after it is lost */
+#define NET_PEER_WANTED 0x1
+
+/* Reconnects are delayed by a random time between half and all of
+ * NET_PEER_BACKOFF_MIN << attempts milliseconds, capped to the maximum */
+#define NET_PEER_BACKOFF_MIN 1000UL
+#define NET_PEER_BACKOFF_MAX 300000UL
+
+/* How many addresses of a peer are raced when connecting to it */
+#define NET_PEER_ADDRS_MAX 4
+
+/* Delay between the starts of two connection attempts of a race */
+#define NET_PEER_DIAL_DELAY 250UL
+
+struct net_addr
+{
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+};
+
+struct net_peer
+{
+  /* Address the peer accepts connections on, see net_sockaddr_normalize */
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  unsigned long hash;
+
+  int flags;
+
+  /* The single connection to the peer, NULL if there is none */
+  struct net_tcp_conn* tcp_conn;
+
+  /* Connection attempts that failed in a row, and when to make the next one */
+  unsigned int attempts;
+  unsigned long next_attempt;
+
+  /* Every address the peer can be reached on, normalized */
+  struct net_addr addrs[NET_PEER_ADDRS_MAX];
+  size_t addr_count;
+
+  /* Address the last connection was established to, tried first */
+  size_t preferred;
+
+  /* Race in progress: connection attempts by address, the order addresses
+   * are tried in, how many were started and when to start the next one.
+   * dial_started is 0 when there is no race. */
+  struct net_tcp_conn* dials[NET_PEER_ADDRS_MAX];
+  unsigned char dial_order[NET_PEER_ADDRS_MAX];
+  size_t dial_started;
+  unsigned long dial_at;
+};
+
+/* Open-addressing hash table of peers. Peers are allocated on their own so
+ * that connections can keep pointers to them while the table moves. */
+struct net_peers
+{
+  struct net_peer** slots;
+
+  /* Power of two, or 0 before the first insertion */
+  size_t capacity;
+  size_t count;
+
+  /* Earliest next attempt of a wanted peer without connection, 0 if none */
+  unsigned long next_due;
+};
+
+/*
+  Connections and datagrams of a context go through a transport instead of
+  sockets when it has one, like the simulated network of sim.c. Such a
+  context is not run by net_loop: the transport reports what happens with
+  the net_transport_ functions and runs net_transport_step.
+*/
+struct net_context;
+
+struct net_transport
+{
+  /* Start connecting a connection to its address, which is reported with
+   * net_transport_connected. Not 0 if it can't be. */
+  int (*open)(struct net_transport* transport, struct net_tcp_conn* tcp_conn);
+
+  /* Take what it can of the octets to send, like sendmsg(2) */
+  ssize_t (*send)(struct net_transport* transport,
+                  struct net_tcp_conn* tcp_conn,
+                  struct iovec* iov,
+                  size_t iov_count);
+
+  /* Forget a connection that is being closed */
+  void (*close)(struct net_transport* transport,
+                struct net_tcp_conn* tcp_conn);
+
+  /* Send a datagram, or drop it */
+  void (*datagram)(struct net_transport* transport,
+                   struct net_context* ctx,
+                   struct sockaddr* sa,
+                   socklen_t sa_len,
+                   void* data,
+                   size_t size);
+
+  void* p;
+};
+
 struct net_context
 {
   /*
@@ -114,11 +803,30 @@ struct net_context
   /*
     Store bound non-blocking UDP sockets in this array.
     Unused elements must be negative.
-
-    NOT IMPLEMENTED YET.
   */
   int udp_boundfds[4];
 
+  /*
+    Store bound non-blocking UNIX domain stream sockets in this array.
+    Unused elements must be negative.
+  */
+  int unix_boundfds[4];
+
+  /*
+    Store the watched end of wakeup fds opened by net_wake_open in this
+    array. Unused elements must be negative.
+  */
+  int wake_fds[4];
+
+  /* Datagrams waiting to be sent on the UDP socket of the same index, and
+   * the octets they take */
+  struct net_datagrams udp_send_queues[4];
+  size_t udp_send_queued[4];
+
+  /* Where datagrams are received, NET_UDP_BATCH * NET_UDP_DATAGRAM_SIZE
+   * octets once allocated */
+  struct mem_buf udp_receive_buf;
+
   /*
     We use readfds to:
       - Perform non-blocking accept(2).
@@ -130,6 +838,7 @@ struct net_context
     We use writefds to:
       - Perform non-blocking connect(2).
       - Perform non-blocking send(2), emptying local write buffers.
+      - Perform non-blocking sendmmsg(2), emptying UDP send queues.
   */
   fd_set writefds;
 
@@ -140,8 +849,100 @@ struct net_context
 
   /* A list that contains every registered event callback */
   struct net_callbacks callbacks;
+
+  /* Monotonic time in milliseconds, updated around every select(2) */
+  unsigned long now;
+
+  /* Latest time select(2) may sleep until, lowered by net_context_wake_at.
+   * Reset to a second from now before every NET_EVENT_TICK. */
+  unsigned long wake_at;
+
+  /* State of the generator jittering timers */
+  unsigned long long random;
+
+  /* Address we accept connections on, as announced to peers. It decides which
+   * connection survives when two peers connect to each other at once. */
+  struct sockaddr_storage self_sa;
+  socklen_t self_sa_len;
+
+  struct net_peers peers;
+
+  /* Keeps the peer table in sync with connections, registered by
+   * net_context_init */
+  struct net_callback peer_callback;
+
+  struct net_metrics metrics;
+
+  /* Counts connections, registered by net_context_init */
+  struct net_callback metrics_callback;
+
+  /* Id of the latest connection */
+  unsigned long conn_id;
+
+  /* Frames posted from other threads, and whether the loop was woken up for
+   * them since it last took them */
+  struct mem_ring posts;
+  atomic_int posts_signaled;
+  int post_wake_fds[2];
+
+  /* Connections may have frames in posted when not 0 */
+  size_t posts_deferred;
+
+  /* Frames posted for connections that were closed */
+  unsigned long posts_dropped;
+
+  /* Octets of the frames posted that the loop did not take yet */
+  atomic_size_t posts_memory;
+
+  /* Takes posted frames, registered by net_post_init */
+  struct net_callback post_callback;
+
+  struct net_iteration iteration;
+
+  /* Busy time after which an iteration raises NET_EVENT_SLOW, in
+   * nanoseconds, never if 0 */
+  uint64_t slow_iteration;
+
+  /* When the current loop window started */
+  unsigned long loop_since;
+
+  /* Sockets are used when NULL */
+  struct net_transport* transport;
+
+  /*
+    Octets connections may hold in buffers, command states and queues, along
+    with queued datagrams, posted frames and what NET_EVENT_MEMORY handlers
+    report, no limit if 0. Past memory_soft, connections are no longer
+    accepted over TCP and those holding more than their share are not read
+    from. Past memory_max, the connections holding the most are closed with
+    NET_EVENT_CLOSED_MEMORY until everything fits.
+  */
+  size_t memory_soft;
+  size_t memory_max;
+
+  /* Octets a connection may hold waiting to be handled or sent before it is
+   * closed with NET_EVENT_CLOSED_MEMORY, no limit if 0 */
+  size_t conn_memory_max;
 };
 
+/* Default ctx->conn_memory_max, room for frames of COMMAND_MAX_FRAME_SIZE */
+#define NET_CONN_MEMORY_MAX (4UL << 20)
+
+/* Zero a context, mark every bound socket element unused and initialize its
+ * queues. Must be called before filling in a context. */
+void
+net_context_init(struct net_context* ctx);
+
+/* Make select(2) return by the given time so that NET_EVENT_TICK callbacks
+ * can run their timers */
+void
+net_context_wake_at(struct net_context* ctx, unsigned long when);
+
+/* Uniformly distributed random number in [0, bound), bound must not be 0.
+ * Only meant to spread timers, not for anything secret. */
+unsigned long
+net_random(struct net_context* ctx, unsigned long bound);
+
 void
 net_fd_int_array_set(fd_set* set, int* nfds, int* array, size_t size);
 
@@ -155,10 +956,105 @@ enum
 int
 net_set_nonblock(int fd);
 
+enum
+{
+  NET_OPEN_OK,
+  NET_OPEN_FAMILY,
+  NET_OPEN_SOCKET,
+  NET_OPEN_NONBLOCK,
+  NET_OPEN_CONNECT,
+  NET_OPEN_ALLOC,
+  NET_OPEN_FDS,
+} net_open_errors;
+
+/*
+  Start a non-blocking connect(2) to a TCP or UNIX domain stream address. The
+  connection is added to the context right away and NET_EVENT_ESTABLISHED is
+  raised once it completes, which may be before this returns. Fails with
+  NET_OPEN_FDS once descriptors reach FD_SETSIZE, which select(2) can't
+  watch.
+*/
+int
+net_open(struct net_context* ctx,
+         struct sockaddr* sa,
+         socklen_t sa_len,
+         struct net_tcp_conn** out);
+
+enum
+{
+  NET_TCP_CONN_SEND_FD_OK,
+  NET_TCP_CONN_SEND_FD_NOT_UNIX,
+  NET_TCP_CONN_SEND_FD_ALLOC,
+} net_tcp_conn_send_fd_errors;
+
+/* Close a connection from a callback. The loop closes it before its next
+ * select(2), raising NET_EVENT_CLOSED with the given flags. */
+void
+net_tcp_conn_close(struct net_tcp_conn* tcp_conn, int flags);
+
+/* Close the connections that were asked to be closed since the last call,
+ * which the loop does on its own. For contexts torn down outside of it. */
+void
+net_close_closing(struct net_context* ctx);
+
+/* Append size octets to what is sent on the connection, copied from p unless
+ * it is NULL. Returns where they were placed for the caller to fill them in,
+ * NULL if out of memory or if the connection would hold more than
+ * ctx->conn_memory_max, closing it. */
+unsigned char*
+net_tcp_conn_write(struct net_tcp_conn* tcp_conn, void* p, size_t size);
+
+enum
+{
+  NET_TCP_CONN_SEND_SHARED_OK,
+  NET_TCP_CONN_SEND_SHARED_PARTIAL,
+  NET_TCP_CONN_SEND_SHARED_ALLOC,
+  NET_TCP_CONN_SEND_SHARED_MEMORY,
+} net_tcp_conn_send_shared_errors;
+
+/* Send whole frames held by a shared buffer after what was already written,
+ * taking a reference to it. Fails while a frame is partially written. */
+int
+net_tcp_conn_send_shared(struct net_tcp_conn* tcp_conn,
+                         struct mem_shared* shared);
+
+/* Pass a file descriptor to the peer of a UNIX domain connection. It is sent
+ * along with the next octets of the send buffer, then closed. */
+int
+net_tcp_conn_send_fd(struct net_tcp_conn* tcp_conn, int fd);
+
+/* Take the oldest file descriptor passed by the peer, -1 if there is none.
+ * Those not taken by the handlers of the octets they came with are closed. */
+int
+net_tcp_conn_take_fd(struct net_tcp_conn* tcp_conn);
+
+enum
+{
+  NET_UDP_SEND_OK,
+  NET_UDP_SEND_FD,
+  NET_UDP_SEND_ALLOC,
+  NET_UDP_SEND_FULL,
+} net_udp_send_errors;
+
+/* Queue a datagram to be sent on one of the bound UDP sockets, unless the
+ * socket already has NET_UDP_QUEUED_MAX octets waiting */
+int
+net_udp_send(struct net_context* ctx,
+             int fd,
+             struct sockaddr* sa,
+             socklen_t sa_len,
+             void* data,
+             size_t size);
+
 #define NET_EVENT_ESTABLISHED 0x1
 #define NET_EVENT_CLOSED 0x2
 #define NET_EVENT_SENT 0x4
 #define NET_EVENT_RECEIVED 0x8
+#define NET_EVENT_DATAGRAM 0x10
+#define NET_EVENT_TICK 0x20
+#define NET_EVENT_WAKE 0x40
+#define NET_EVENT_SLOW 0x80
+#define NET_EVENT_MEMORY 0x100
 
 #define NET_EVENT_ESTABLISHED_ACCEPT 0x1
 #define NET_EVENT_ESTABLISHED_CONNECT 0x2
@@ -174,6 +1070,15 @@ struct net_event_data_established
 #define NET_EVENT_CLOSED_RECV 0x4
 #define NET_EVENT_CLOSED_CONNECT 0x8
 
+/* Another connection to the same peer was kept instead */
+#define NET_EVENT_CLOSED_DUPLICATE 0x10
+
+/* Another connection attempt to the same peer completed first */
+#define NET_EVENT_CLOSED_CANCELLED 0x20
+
+/* It held more than its quota, or the most when memory ran short */
+#define NET_EVENT_CLOSED_MEMORY 0x40
+
 struct net_event_data_closed
 {
   int flags;
@@ -200,6 +1105,273 @@ struct net_event_data_received
   struct net_tcp_conn* tcp_conn;
 };
 
+struct net_event_data_datagram
+{
+  int flags;
+
+  struct net_context* ctx;
+
+  /* Bound UDP socket the datagram was received on */
+  int fd;
+
+  /* Source of the datagram, replies are sent back to it */
+  struct sockaddr_storage* sa;
+  socklen_t sa_len;
+
+  unsigned char* data;
+  size_t size;
+};
+
+/* Raised once every loop iteration, after I/O was handled, so that timers
+ * can check ctx->now against their deadlines */
+struct net_event_data_tick
+{
+  int flags;
+  struct net_context* ctx;
+};
+
+/* Raised once a wakeup fd was signaled, after it was drained so that a
+ * signal sent while the event is handled raises it again */
+struct net_event_data_wake
+{
+  int flags;
+  int fd;
+};
+
+/* Raised after an iteration of the loop that was busy for longer than
+ * ctx->slow_iteration, with what it spent its time on */
+struct net_event_data_slow
+{
+  int flags;
+  struct net_context* ctx;
+  struct net_iteration* iteration;
+};
+
+/* Raised once every loop iteration as memory is accounted, handlers add the
+ * octets they hold on behalf of peers outside of connections */
+struct net_event_data_memory
+{
+  int flags;
+  struct net_context* ctx;
+  size_t memory;
+};
+
+enum
+{
+  NET_WAKE_OPEN_OK,
+  NET_WAKE_OPEN_FULL,
+  NET_WAKE_OPEN_ERROR,
+} net_wake_open_errors;
+
+/*
+  Open an fd other threads can wake the loop up with. fds[0] is watched by
+  the loop and fds[1] is signaled with net_wake_signal, they are the same
+  eventfd(2) on Linux and the ends of a pipe elsewhere.
+*/
+int
+net_wake_open(struct net_context* ctx, int fds[2]);
+
+void
+net_wake_close(struct net_context* ctx, int fds[2]);
+
+/* Safe to call from any thread and from signal handlers */
+void
+net_wake_signal(int fd);
+
+/* Frames that can be waiting to be taken by the loop */
+#define NET_POST_RING_SIZE 1024
+
+/* Frames sorted by connection at once */
+#define NET_POST_BATCH 256
+
+enum
+{
+  NET_POST_INIT_OK,
+  NET_POST_INIT_ALLOC,
+  NET_POST_INIT_WAKE,
+} net_post_init_errors;
+
+/* Allow net_context_post to be called, before the loop starts */
+int
+net_post_init(struct net_context* ctx);
+
+/* Frames that were not taken yet are dropped */
+void
+net_post_free(struct net_context* ctx);
+
+enum
+{
+  NET_CONTEXT_POST_OK,
+  NET_CONTEXT_POST_ALLOC,
+  NET_CONTEXT_POST_FULL,
+} net_context_post_errors;
+
+/*
+  Send size octets of whole frames on the connection with id conn_id. Safe to
+  call from any thread without locking, the octets are copied and handed to
+  the loop, which queues them in batches. Frames posted by a thread are sent
+  in order, they are dropped if the connection closed.
+*/
+int
+net_context_post(struct net_context* ctx,
+                 unsigned long conn_id,
+                 const void* data,
+                 size_t size);
+
+int
+net_cb_post(int event, void* event_data, void** p);
+
+/* Copy the counters of the node, from any thread */
+void
+net_metrics_snapshot(struct net_context* ctx,
+                     struct net_metrics_snapshot* snapshot);
+
+/* Count a command received or queued to be sent, tcp_conn is NULL for
+ * datagrams */
+void
+net_metrics_frame(struct net_context* ctx,
+                  struct net_tcp_conn* tcp_conn,
+                  struct command_header* header,
+                  int out);
+
+/* Record the round trip of the request a response answers, if a command
+ * state of the connection waits for it */
+void
+net_metrics_response(struct net_tcp_conn* tcp_conn,
+                     struct command_header* header);
+
+/* Record the time handlers spent on a command received */
+void
+net_metrics_service(struct net_context* ctx,
+                    struct command_header* header,
+                    uint64_t duration);
+
+/* Record the iteration of the loop that just ended in the current window */
+void
+net_metrics_iteration(struct net_context* ctx);
+
+/* Merge the current and the previous loop windows */
+void
+net_metrics_loop(struct net_context* ctx, struct net_loop_window* window);
+
+int
+net_cb_metrics(int event, void* event_data, void** p);
+
+/*
+  Tracepoints of the hot paths, compiled in with -DTRACE and to nothing
+  otherwise. Every thread writes fixed size records to its own ring in the
+  file mapped by trace_open, where they stay when the node crashes. The
+  trace-dump tool decodes the file at any time.
+*/
+enum
+{
+  TRACE_ACCEPT = 1, /* a: fd, b: NET_TCP_CONN_* flags */
+  TRACE_RECV,       /* a: recv(2) return value, b: octets buffered before */
+  TRACE_DECODE,     /* type, a: tag, b: payload size */
+  TRACE_DISPATCH,   /* type, a: octets handled, b: nanoseconds spent */
+  TRACE_SEND,       /* a: send(2) return value, b: octets there were */
+  TRACE_CLOSE,      /* a: NET_EVENT_CLOSED_* flags */
+} trace_events;
+
+struct trace_record
+{
+  uint64_t time;
+  uint32_t conn_id;
+  uint16_t event;
+  uint16_t type;
+  uint64_t a;
+  uint64_t b;
+};
+
+/* Records of a ring, a power of 2 */
+#define TRACE_RING_SIZE 4096
+
+/* Threads that can have a ring, the others are not traced */
+#define TRACE_THREADS_MAX 16
+
+struct trace_ring
+{
+  /* Records written so far, the latest TRACE_RING_SIZE of them are kept */
+  atomic_ulong head;
+  unsigned char pad[MEM_CACHE_LINE - sizeof(atomic_ulong)];
+
+  struct trace_record records[TRACE_RING_SIZE];
+};
+
+#define TRACE_MAGIC "unitrace"
+#define TRACE_VERSION 1
+
+/* Layout of a trace file, in the byte order of the node that wrote it */
+struct trace_file
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t ring_size;
+  uint32_t threads_max;
+
+  /* Rings claimed by threads */
+  atomic_uint threads;
+
+  unsigned char pad[MEM_CACHE_LINE - 24];
+
+  struct trace_ring rings[TRACE_THREADS_MAX];
+};
+
+enum
+{
+  TRACE_OPEN_OK,
+  TRACE_OPEN_FILE,
+  TRACE_OPEN_MAP,
+} trace_open_errors;
+
+/* Create the trace file at path and start tracing to it */
+int
+trace_open(const char* path);
+
+/* Stop tracing, threads must not record any more */
+void
+trace_close(void);
+
+#ifdef TRACE
+extern struct trace_file* trace_file;
+extern _Thread_local struct trace_ring* trace_ring;
+
+/* Ring of the calling thread, claimed on its first record. NULL if there
+ * is no trace file or every ring is taken. */
+struct trace_ring*
+trace_ring_claim(void);
+
+static inline void
+trace_event(unsigned short event,
+            unsigned long conn_id,
+            unsigned short type,
+            uint64_t a,
+            uint64_t b)
+{
+  struct trace_ring* ring = trace_ring ? trace_ring : trace_ring_claim();
+
+  if (ring == NULL)
+    return;
+
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct trace_record* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+  record->time = net_nanoseconds();
+  record->conn_id = (uint32_t)conn_id;
+  record->event = event;
+  record->type = type;
+  record->a = a;
+  record->b = b;
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define TRACE_EVENT(event, conn_id, type, a, b)                                \
+  trace_event(event, conn_id, type, (uint64_t)(a), (uint64_t)(b))
+#else
+#define TRACE_EVENT(event, conn_id, type, a, b) ((void)0)
+#endif
+
 enum
 {
   NET_LOOP_OK,
@@ -208,6 +1380,139 @@ enum
 int
 net_loop(struct net_context* ctx);
 
+/* A transport accepted a connection from sa, NULL if out of memory.
+ * NET_EVENT_ESTABLISHED is raised with tcp_conn->transport already set. */
+struct net_tcp_conn*
+net_transport_accept(struct net_context* ctx,
+                     struct sockaddr* sa,
+                     socklen_t sa_len,
+                     void* transport);
+
+/* A connection the transport was asked to open was established */
+void
+net_transport_connected(struct net_tcp_conn* tcp_conn);
+
+/* size octets were received on a connection. A transport closes connections
+ * with net_tcp_conn_close, NET_EVENT_CLOSED_CONNECT when they could not be
+ * established. */
+void
+net_transport_received(struct net_tcp_conn* tcp_conn, void* data, size_t size);
+
+/* A datagram was received from sa */
+void
+net_transport_datagram(struct net_context* ctx,
+                       struct sockaddr* sa,
+                       socklen_t sa_len,
+                       void* data,
+                       size_t size);
+
+/*
+  What an iteration of net_loop does besides waiting on sockets: close the
+  connections that were asked to be, hand the transport what there is to
+  send, raise NET_EVENT_TICK and send what the timers wrote. Run by the
+  transport with ctx->now set, after reporting events to the context and once
+  ctx->wake_at is reached.
+*/
+void
+net_transport_step(struct net_context* ctx);
+
+enum
+{
+  NET_SOCKADDR_NORMALIZE_OK,
+  NET_SOCKADDR_NORMALIZE_FAMILY,
+} net_sockaddr_normalize_errors;
+
+/*
+  Copy an address in the form peers are keyed by: IPv4-mapped IPv6 addresses
+  become IPv4 ones and everything that does not identify the address, like
+  padding and the IPv6 flow label, is zeroed so that equal addresses compare
+  equal with memcmp(3).
+*/
+int
+net_sockaddr_normalize(struct sockaddr* sa,
+                       socklen_t sa_len,
+                       struct sockaddr_storage* out,
+                       socklen_t* out_len);
+
+/* Find a peer by address, NULL if it is not in the table */
+struct net_peer*
+net_peer_find(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len);
+
+enum
+{
+  NET_CONNECT_OK,
+  NET_CONNECT_FAMILY,
+  NET_CONNECT_ALLOC,
+} net_connect_errors;
+
+/*
+  Keep a connection to the peer accepting connections on an address. Nothing
+  is done if there already is one, inbound or outbound. Otherwise a connection
+  is opened, now or once the backoff of previous failed attempts has elapsed,
+  and reopened whenever it is lost.
+*/
+int
+net_connect(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len);
+
+/* Same as net_connect, for a peer reachable on several addresses. The peer
+ * is known by the first one. Connections to them are raced, see
+ * net_peer_set_addrs. */
+int
+net_connect_addrs(struct net_context* ctx,
+                  struct net_addr* addrs,
+                  size_t count);
+
+enum
+{
+  NET_PEER_SET_ADDRS_OK,
+  NET_PEER_SET_ADDRS_FAMILY,
+  NET_PEER_SET_ADDRS_DIALING,
+} net_peer_set_addrs_errors;
+
+/*
+  Replace the addresses a peer can be reached on, up to NET_PEER_ADDRS_MAX of
+  them. Connecting to the peer races connections to every address with
+  staggered starts, keeps the first one established and cancels the others
+  with NET_EVENT_CLOSED_CANCELLED. The address that won is tried first the
+  next time. Addresses can't be replaced during a race.
+*/
+int
+net_peer_set_addrs(struct net_peer* peer, struct net_addr* addrs, size_t count);
+
+/* Stop reconnecting to a peer and forget it. Its connection is left open. */
+void
+net_disconnect(struct net_context* ctx, struct sockaddr* sa, socklen_t sa_len);
+
+/* Forget every peer, for contexts torn down outside of net_loop. Their
+ * connections must be closed first. */
+void
+net_peers_free(struct net_context* ctx);
+
+enum
+{
+  NET_PEER_BIND_OK,
+  NET_PEER_BIND_FAMILY,
+  NET_PEER_BIND_ALLOC,
+  NET_PEER_BIND_DUPLICATE,
+} net_peer_bind_errors;
+
+/*
+  Record that a connection leads to the peer accepting connections on an
+  address, typically once an inbound connection announced it. When the peer
+  already has another connection, both ends keep the one opened by the peer
+  with the lowest address and the other is closed with
+  NET_EVENT_CLOSED_DUPLICATE. NET_PEER_BIND_DUPLICATE is returned when that is
+  tcp_conn.
+*/
+int
+net_peer_bind(struct net_context* ctx,
+              struct net_tcp_conn* tcp_conn,
+              struct sockaddr* sa,
+              socklen_t sa_len);
+
+int
+net_cb_peer(int event, void* event_data, void** p);
+
 unsigned char
 read_net_octet(unsigned char** p);
 unsigned short
@@ -222,31 +1527,163 @@ write_net_2_octets(unsigned char** p, unsigned short v);
 void
 write_net_4_octets(unsigned char** p, unsigned long v);
 
-#define COMMAND_HEADER_IS_REQUEST 0x1
-
 enum
 {
   COMMAND_PING,
   COMMAND_ANNOUNCE,
+  COMMAND_STATS,
 } command_types;
 
-struct command_header
+/* Default limit on the payload size a peer may declare in a header */
+#define COMMAND_MAX_FRAME_SIZE (1UL << 20)
+
+struct command_frame
 {
-  unsigned char flags;
+  struct command_header header;
 
-  /* Tag number, used for unordered command pipelining */
-  unsigned long tag;
+  /* Connection the command was received on, NULL for datagrams */
+  struct net_tcp_conn* tcp_conn;
 
-  /* Type of the command */
-  unsigned short type;
+  /* Datagram the command was received in, NULL for connections */
+  struct net_event_data_datagram* datagram;
+
+  /* Payload of the command, or the current chunk of it for streaming
+   * handlers */
+  unsigned char* data;
+  size_t size;
+
+  /* Position of data in the payload, a streaming handler has seen the last
+   * chunk when offset + size == header.size. The first chunk may be empty. */
+  unsigned long offset;
+};
+
+/* A handler returning anything but 0 causes its connection to be closed */
+typedef int
+command_handler_fn(struct command_frame* frame, void** p);
+
+/* Deliver the payload in chunks as it arrives instead of buffering it */
+#define COMMAND_HANDLER_STREAM 0x1
+
+struct command_handler
+{
+  /* Inclusive ranges of types and versions handled */
+  unsigned short type_min;
+  unsigned short type_max;
+  unsigned short version_min;
+  unsigned short version_max;
+
+  int flags;
+  void* p;
+  command_handler_fn* fn;
+
+  /* How many commands were dispatched to this handler */
+  unsigned long hits;
+};
+
+/* Types at or above this value can't be registered and are always skipped */
+#define COMMAND_TYPES_SIZE 256
+
+/* How many handlers with distinct version ranges a type can have */
+#define COMMAND_HANDLERS_PER_TYPE 4
+
+struct command_context
+{
+  /* Frames declaring a payload larger than this many octets are rejected and
+   * their connection is closed, 0 means no limit */
+  unsigned long max_frame_size;
 
-  /* Version of the command */
-  unsigned short version;
+  /* How many commands were skipped because no handler matched them */
+  unsigned long unknown;
 
-  /* Size of data following the header */
-  unsigned long size;
+  /* Dispatch table indexed by command type, unused elements are NULL */
+  struct command_handler* handlers[COMMAND_TYPES_SIZE]
+                                  [COMMAND_HANDLERS_PER_TYPE];
 };
 
+enum
+{
+  COMMAND_REGISTER_OK,
+  COMMAND_REGISTER_RANGE,
+  COMMAND_REGISTER_FULL,
+  COMMAND_REGISTER_OVERLAP,
+} command_register_errors;
+
+int
+command_register(struct command_context* cctx, struct command_handler* handler);
+
+struct command_handler*
+command_lookup(struct command_context* cctx,
+               unsigned short type,
+               unsigned short version);
+
+int
+net_cb_command_received(int event, void* event_data, void** p);
+
+int
+net_cb_command_datagram(int event, void* event_data, void** p);
+
+enum
+{
+  STATS_SCOPE_NODE,
+  STATS_SCOPE_COMMAND,
+  STATS_SCOPE_CONNECTION,
+} stats_scopes;
+
+/* Records of a histogram, its count then its percentiles */
+#define STATS_LATENCY_COUNTERS 6
+
+/* The first ones are in the order of NET_COUNTERS */
+enum
+{
+  STATS_OCTETS_IN,
+  STATS_OCTETS_OUT,
+  STATS_FRAMES_IN,
+  STATS_FRAMES_OUT,
+  STATS_RECV_CALLS,
+  STATS_SEND_CALLS,
+  STATS_RECV_AGAIN,
+  STATS_SEND_AGAIN,
+  STATS_RECEIVE_BUF_MAX,
+  STATS_SEND_BUF_MAX,
+  STATS_STATES,
+  STATS_CONNECTIONS,
+  STATS_ACCEPTED,
+  STATS_CONNECTED,
+  STATS_CLOSED,
+  STATS_CLOSED_REASONS,
+  STATS_ROUND_TRIPS = STATS_CLOSED_REASONS + NET_CLOSED_REASONS,
+  STATS_ROUND_TRIP_P50,
+  STATS_ROUND_TRIP_P90,
+  STATS_ROUND_TRIP_P99,
+  STATS_ROUND_TRIP_P999,
+  STATS_ROUND_TRIP_MAX,
+  STATS_SERVICES,
+  STATS_SERVICE_P50,
+  STATS_SERVICE_P90,
+  STATS_SERVICE_P99,
+  STATS_SERVICE_P999,
+  STATS_SERVICE_MAX,
+  STATS_ITERATIONS,
+  STATS_FDS_READY,
+  STATS_FDS_SCANNED,
+  STATS_SLOW_ITERATIONS,
+  STATS_BUSY,
+  STATS_LAG = STATS_BUSY + STATS_LATENCY_COUNTERS,
+  STATS_PHASES = STATS_LAG + STATS_LATENCY_COUNTERS,
+  STATS_REFUSED = STATS_PHASES + NET_PHASES * STATS_LATENCY_COUNTERS,
+  STATS_CLOSED_MEMORY,
+  STATS_MEMORY,
+  STATS_MEMORY_PRESSURE,
+} stats_counters;
+
+/* Connections a stats response has records for, the most recent ones */
+#define STATS_CONNECTIONS_MAX 1024
+
+/* Encode the payload of a stats response in buf, which can be NULL to only
+ * get its size. Loop thread only. */
+size_t
+encode_stats(struct net_context* ctx, unsigned char* buf);
+
 enum
 {
   ROLE_NODE,
@@ -261,32 +1698,1094 @@ enum
   FAMILY_IPV6
 } address_families;
 
-struct command_announce
+enum
 {
-  /* Role of the peer */
-  unsigned char role;
+  PUBLIC_KEY_UNSPECIFIED,
+  PUBLIC_KEY_ED25519,
+} public_key_types;
 
-  /* Port the peer is listening on, 0 for none */
-  unsigned short port;
+enum
+{
+  DECODE_HEADER_OK,
+  DECODE_HEADER_SIZE_TOO_SMALL,
+} decode_header_errors;
+
+int
+decode_header(unsigned char* buf, size_t size, struct command_header* out);
 
-  /* Additional peer addresses and ports that the peer is sharing, if an element
-   * is entirely zero, it should be ignored */
-  struct sockaddr_storage more_addrs[4];
+struct address_block
+{
+  unsigned char family;
+  unsigned short size;
+  unsigned char* data;
 };
 
-#define COMMAND_STATE_PING_AWAITING_RESPONSE 0x0
-#define COMMAND_STATE_PING_VALID_RESPONSE 0x1
-#define COMMAND_STATE_PING_INVALID_RESPONSE 0x2
+struct address_block_iterator
+{
+  unsigned char* p;
+  unsigned char remaining;
+};
 
-struct command_state_ping
+/*
+  Decoded announce pointing into the buffer it was decoded from, it is only
+  valid for as long as that buffer is.
+*/
+struct announce_view
 {
-  unsigned long tag;
-  int progress;
-  size_t size;
-  void* data;
+  unsigned char role;
+  unsigned char address_block_count;
+
+  /* Encoded address blocks, use announce_address_blocks to iterate them */
+  unsigned char* address_blocks;
+
+  unsigned char public_key_type;
+  unsigned short public_key_size;
+  unsigned char* public_key;
+
+  unsigned short signature_size;
+  unsigned char* signature;
+
+  unsigned char master_signature_type;
+  unsigned short master_signature_size;
+  unsigned char* master_signature;
 };
 
+enum
+{
+  DECODE_ANNOUNCE_OK,
+  DECODE_ANNOUNCE_SIZE_TOO_SMALL,
+  DECODE_ANNOUNCE_TRAILING_DATA,
+} decode_announce_errors;
+
+int
+decode_announce(unsigned char* buf, size_t size, struct announce_view* out);
+
+/* Size of an announce once encoded */
+size_t
+announce_size(struct announce_view* announce);
+
+/* Encode an announce to buf, which must hold announce_size octets */
 void
-command_state_free_ping(void* p);
+encode_announce(struct announce_view* announce, unsigned char* buf);
+
+void
+announce_address_blocks(struct announce_view* announce,
+                        struct address_block_iterator* it);
+
+/* Returns 0 once every address block has been iterated */
+int
+address_block_next(struct address_block_iterator* it,
+                   struct address_block* out);
+
+enum
+{
+  ADDRESS_BLOCK_SOCKADDR_OK,
+  ADDRESS_BLOCK_SOCKADDR_FAMILY,
+  ADDRESS_BLOCK_SOCKADDR_SIZE,
+} address_block_sockaddr_errors;
+
+int
+address_block_sockaddr(struct address_block* block,
+                       struct sockaddr_storage* sa,
+                       socklen_t* sa_len);
+
+/* Largest address block we encode, with its head */
+#define ADDRESS_BLOCK_SIZE_MAX                                                 \
+  (CODEC_SIZE(ADDRESS_BLOCK_HEAD_SCHEMA) + 2 /* port */ + 16 /* ipv6 */)
+
+enum
+{
+  ENCODE_ADDRESS_BLOCK_OK,
+  ENCODE_ADDRESS_BLOCK_FAMILY,
+} encode_address_block_errors;
+
+/* Encode a TCP address as an address block with its head to buf, which must
+ * hold ADDRESS_BLOCK_SIZE_MAX octets, and set size to its size */
+int
+encode_address_block(struct sockaddr* sa,
+                     socklen_t sa_len,
+                     unsigned char* buf,
+                     size_t* size);
+
+/* Largest public key a peer can be known by in the directory */
+#define DIRECTORY_KEY_DATA_SIZE 32
+
+/* How many addresses are remembered per peer */
+#define DIRECTORY_ADDRS_MAX 4
+
+/* Memory used by the directory of main() */
+#define DIRECTORY_MEMORY_DEFAULT (64UL << 20)
+
+/* How often main() checkpoints its directory when it changed, in
+ * milliseconds */
+#define DIRECTORY_CHECKPOINT_INTERVAL 60000UL
+
+/* How many known peers main() connects to when it starts */
+#define DIRECTORY_WARM_PEERS 8
+
+enum
+{
+  DIRECTORY_KEY_PUBLIC_KEY,
+  DIRECTORY_KEY_ADDRESS,
+} directory_key_types;
+
+/* Peers are known by their public key when it is one announces are verified
+ * with, or by their first address */
+struct directory_key
+{
+  unsigned char type;
+  unsigned char size;
+  unsigned char data[DIRECTORY_KEY_DATA_SIZE];
+};
+
+struct directory_addr
+{
+  /* FAMILY_IPV4 or FAMILY_IPV6, as in address blocks */
+  unsigned char family;
+  unsigned char port[2];
+  unsigned char addr[16];
+
+  /* Round-trip time in milliseconds, 0 when it was never measured */
+  uint32_t rtt;
+};
+
+#define DIRECTORY_ENTRY_USED 0x1
+
+/* How many entries are considered for eviction, see struct directory */
+#define DIRECTORY_EVICT_SAMPLE 8
+
+/* Entries are fixed-size and hold no pointers so that they can be copied and
+ * stored as they are */
+struct directory_entry
+{
+  uint32_t hash;
+  unsigned char flags;
+  unsigned char role;
+  unsigned char addr_count;
+
+  /* Index of the address to connect to */
+  unsigned char best;
+
+  struct directory_key key;
+
+  /* Value of the directory clock when the entry was last looked up or
+   * updated */
+  uint32_t used;
+
+  /* Seconds since the epoch of the last announce */
+  uint64_t last_seen;
+
+  struct directory_addr addrs[DIRECTORY_ADDRS_MAX];
+};
+
+/*
+  Open-addressing hash table of every peer we heard of, sized once from a
+  memory cap. When it is full, inserting a peer evicts the least recently used
+  of the first DIRECTORY_EVICT_SAMPLE entries on its probe sequence. Sampling
+  where the new entry goes, rather than sweeping the table, keeps the load
+  even so that probe sequences stay short.
+*/
+struct directory
+{
+  struct directory_entry* entries;
+
+  /* Power of two */
+  size_t capacity;
+  size_t count;
+
+  /* count never goes over this, it keeps probe sequences short */
+  size_t max_count;
+
+  /* Ticks on every lookup and update */
+  uint32_t clock;
+
+  unsigned long evictions;
+
+  /* Bumped on every change, tells whether a checkpoint is needed */
+  unsigned long changes;
+
+  /* File mapping the entries live in, NULL when they were allocated */
+  void* map;
+  size_t map_size;
+};
+
+#define DIRECTORY_FILE_MAGIC "unilinkd"
+#define DIRECTORY_FILE_VERSION 1
+
+/* Written in the byte order of the host, a file from another one is ignored */
+#define DIRECTORY_FILE_BYTE_ORDER 0x01020304
+
+/* A directory file is this header followed by the entries of the table as
+ * they are in memory, so that it can be used as soon as it is mapped */
+struct directory_file_header
+{
+  unsigned char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t entry_size;
+  uint32_t clock;
+  uint64_t capacity;
+  uint64_t count;
+  unsigned char reserved[24];
+};
+
+enum
+{
+  DIRECTORY_INIT_OK,
+  DIRECTORY_INIT_SIZE,
+  DIRECTORY_INIT_ALLOC,
+} directory_init_errors;
+
+/* Make an empty directory using at most memory octets */
+int
+directory_init(struct directory* dir, size_t memory);
+
+void
+directory_free(struct directory* dir);
+
+enum
+{
+  DIRECTORY_OPEN_OK,
+  DIRECTORY_OPEN_SIZE,
+  DIRECTORY_OPEN_ALLOC,
+} directory_open_errors;
+
+/*
+  Make a directory from the last checkpoint written to path, or an empty one
+  when there is none that can be used, its header or one of its entries not
+  being one we could have written. A checkpoint made with the same memory
+  cap is mapped privately and used in place. One made with another cap has
+  its entries inserted into a new table.
+*/
+int
+directory_open(struct directory* dir, const char* path, size_t memory);
+
+enum
+{
+  DIRECTORY_CHECKPOINT_OK,
+  DIRECTORY_CHECKPOINT_OPEN,
+  DIRECTORY_CHECKPOINT_WRITE,
+  DIRECTORY_CHECKPOINT_RENAME,
+} directory_checkpoint_errors;
+
+/* Write the directory to path. The file is replaced in a single rename(2)
+ * once its new content is on disk, so a crash leaves either checkpoint. */
+int
+directory_checkpoint(struct directory* dir, const char* path);
+
+enum
+{
+  DIRECTORY_KEY_ANNOUNCE_OK,
+  DIRECTORY_KEY_ANNOUNCE_NONE,
+} directory_key_announce_errors;
+
+/* Key of the peer that made an announce. Only announces that were verified
+ * may be given a public key. */
+int
+directory_key_announce(struct announce_view* announce,
+                       struct directory_key* out);
+
+/* Find a peer, NULL if it is unknown. The entry stays valid until the next
+ * update. */
+struct directory_entry*
+directory_find(struct directory* dir, struct directory_key* key);
+
+/*
+  Insert or refresh a peer with the addresses left in an iterator, evicting
+  a least recently used peer when the directory is full. Round-trip times
+  of addresses that were already known are kept, and so are the addresses of
+  a known peer that announced none. Returns NULL for an unknown peer without
+  any address. The entry stays valid until the next update.
+*/
+struct directory_entry*
+directory_update(struct directory* dir,
+                 struct directory_key* key,
+                 unsigned char role,
+                 struct address_block_iterator* it,
+                 uint64_t now);
+
+/* Record the round-trip time measured to an address of a peer, which makes
+ * the fastest address the best one */
+void
+directory_set_rtt(struct directory* dir,
+                  struct directory_entry* entry,
+                  struct sockaddr* sa,
+                  socklen_t sa_len,
+                  uint32_t rtt);
+
+enum
+{
+  DIRECTORY_ADDR_SOCKADDR_OK,
+  DIRECTORY_ADDR_SOCKADDR_FAMILY,
+} directory_addr_sockaddr_errors;
+
+int
+directory_addr_sockaddr(struct directory_addr* addr,
+                        struct sockaddr_storage* sa,
+                        socklen_t* sa_len);
+
+enum
+{
+  DIRECTORY_BEST_SOCKADDR_OK,
+  DIRECTORY_BEST_SOCKADDR_NONE,
+} directory_best_sockaddr_errors;
+
+/* Address to connect to a peer on, in O(1) */
+int
+directory_best_sockaddr(struct directory_entry* entry,
+                        struct sockaddr_storage* sa,
+                        socklen_t* sa_len);
+
+/* Fill out with up to max peers we have connected to, most recently seen
+ * first, and return how many there are */
+size_t
+directory_known_good(struct directory* dir,
+                     struct directory_entry** out,
+                     size_t max);
+
+struct sha512
+{
+  uint64_t state[8];
+  uint64_t size;
+  unsigned char buf[128];
+};
+
+void
+sha512_init(struct sha512* sha);
+
+void
+sha512_update(struct sha512* sha, const void* p, size_t size);
+
+/* Write the 64 octets digest to out */
+void
+sha512_final(struct sha512* sha, unsigned char* out);
+
+#define ED25519_PUBLIC_KEY_SIZE 32
+#define ED25519_SIGNATURE_SIZE 64
+
+/* Signature to verify with ed25519_verify_batch, which sets valid */
+struct ed25519_item
+{
+  const unsigned char* public_key;
+  const unsigned char* signature;
+  const unsigned char* message;
+  size_t message_size;
+  int valid;
+};
+
+/* Compute the constants and read the secret that makes batches safe, must be
+ * called once before verifying, before any other thread verifies */
+void
+ed25519_init(void);
+
+/* 1 if the signature of message is valid for public_key, 0 otherwise */
+int
+ed25519_verify(const unsigned char* public_key,
+               const unsigned char* signature,
+               const unsigned char* message,
+               size_t message_size);
+
+/* Verify several signatures at once, much faster than one at a time when
+ * they are all valid. It is safe to call from several threads at once. */
+void
+ed25519_verify_batch(struct ed25519_item* items, size_t count);
+
+/*
+  Threads that run expensive work, like verifying signatures, away from the
+  loop. Jobs are handed to the workers and back through lock-free rings,
+  workers wait on a pipe holding an octet per job and wake the loop up
+  through a wakeup fd once a job is done, so the loop never takes a lock.
+*/
+
+#define WORKER_THREADS_MAX 8
+#define WORKER_QUEUE_SIZE 1024
+
+struct worker_job;
+
+typedef void
+worker_fn(struct worker_job* job);
+
+struct worker_job
+{
+  /* Run on a worker thread, which must not touch anything else the loop
+   * uses */
+  worker_fn* run;
+
+  /* Then called on the loop thread */
+  worker_fn* complete;
+
+  void* p;
+
+  /* Connection the job is for if any, NULL once it closed */
+  struct net_tcp_conn* tcp_conn;
+
+  /* Only used on the loop thread */
+  LIST_ENTRY(worker_job) entry;
+};
+
+LIST_HEAD(worker_jobs, worker_job);
+
+struct worker_pool
+{
+  struct net_context* ctx;
+
+  pthread_t threads[WORKER_THREADS_MAX];
+  size_t thread_count;
+
+  /* Jobs to run and jobs that were run */
+  struct mem_ring jobs;
+  struct mem_ring done;
+
+  /* Pipe the workers read an octet from before taking a job */
+  int job_fds[2];
+
+  int wake_fds[2];
+
+  /* Submitted jobs that were not completed yet, never more than
+   * WORKER_QUEUE_SIZE so that the done ring can't fill up */
+  struct worker_jobs running;
+  size_t running_count;
+
+  unsigned long submitted;
+  unsigned long completed;
+
+  /* Completes jobs and forgets closed connections, registered by
+   * worker_pool_init */
+  struct net_callback callback;
+};
+
+enum
+{
+  WORKER_POOL_INIT_OK,
+  WORKER_POOL_INIT_THREADS,
+  WORKER_POOL_INIT_ALLOC,
+  WORKER_POOL_INIT_PIPE,
+  WORKER_POOL_INIT_WAKE,
+  WORKER_POOL_INIT_THREAD,
+} worker_pool_init_errors;
+
+/* Start threads workers, from 1 to WORKER_THREADS_MAX */
+int
+worker_pool_init(struct worker_pool* pool,
+                 struct net_context* ctx,
+                 size_t threads);
+
+/* Let the workers run what was submitted and stop them, jobs are not
+ * completed */
+void
+worker_pool_free(struct worker_pool* pool);
+
+enum
+{
+  WORKER_POOL_SUBMIT_OK,
+  WORKER_POOL_SUBMIT_FULL,
+} worker_pool_submit_errors;
+
+/* Have the job run then completed, run, complete and tcp_conn must be set */
+int
+worker_pool_submit(struct worker_pool* pool, struct worker_job* job);
+
+int
+net_cb_worker_pool(int event, void* event_data, void** p);
+
+/*
+  Verification of announces signed with an Ed25519 key. Announces are queued
+  as they are received and verified in batches once per loop iteration, by
+  a worker pool when there is one. Verified key and message pairs are
+  remembered so that copies of an announce arriving through gossip are not
+  verified again.
+*/
+
+/* Signatures verified together */
+#define VERIFY_BATCH_MAX 64
+
+/* Announces waiting for verification or being verified, further ones are
+ * dropped */
+#define VERIFY_PENDING_MAX 4096
+
+/* Verified pairs remembered, a power of two, and the size of their
+ * fingerprints */
+#define VERIFY_CACHE_SIZE 4096
+#define VERIFY_FINGERPRINT_SIZE 16
+
+struct verify_request
+{
+  STAILQ_ENTRY(verify_request) entry;
+
+  /* Connection the announce came from, NULL for datagrams or once it
+   * closed */
+  struct net_tcp_conn* tcp_conn;
+
+  /* The announce is that of the peer at the other end of tcp_conn rather
+   * than one it relays, see NET_TCP_CONN_ANNOUNCE_RECEIVED */
+  int own;
+
+  /* Copy of the announce, its first signed_size octets are signed */
+  struct mem_buf announce;
+  size_t signed_size;
+
+  /* Within announce */
+  unsigned char* public_key;
+  unsigned char* signature;
+
+  unsigned char fingerprint[VERIFY_FINGERPRINT_SIZE];
+
+  /* Set once verified */
+  int valid;
+};
+
+STAILQ_HEAD(verify_requests, verify_request);
+
+/* Batch of requests verified at once. verify_job_run only touches the job so
+ * that it can run on another thread. */
+struct verify_job
+{
+  LIST_ENTRY(verify_job) entry;
+  struct verifier* verifier;
+  struct verify_requests requests;
+  size_t count;
+
+  /* How the job is handed to a worker pool */
+  struct worker_job work;
+};
+
+LIST_HEAD(verify_jobs, verify_job);
+
+/* Called on the loop thread for every request once verified, valid tells
+ * whether the announce can be trusted */
+typedef void
+verify_done_fn(struct verify_request* request, void* p);
+
+struct verifier
+{
+  struct net_context* ctx;
+
+  struct verify_requests pending;
+
+  /* Requests pending or in jobs */
+  size_t pending_count;
+
+  /* Jobs being verified */
+  struct verify_jobs jobs;
+
+  /* Octets requests and jobs take, reported on NET_EVENT_MEMORY */
+  size_t memory;
+
+  unsigned char cache[VERIFY_CACHE_SIZE][VERIFY_FINGERPRINT_SIZE];
+
+  verify_done_fn* done;
+  void* done_p;
+
+  /* Where jobs are verified, NULL to verify on the loop thread. Requests
+   * stay pending while it is full. */
+  struct worker_pool* pool;
+
+  /* Signatures found valid and invalid, announces found in the cache or
+   * dropped, and batches verified */
+  unsigned long valid;
+  unsigned long invalid;
+  unsigned long cached;
+  unsigned long dropped;
+  unsigned long batches;
+
+  /* Starts jobs, forgets closed connections and reports memory, registered
+   * by verifier_init */
+  struct net_callback callback;
+};
+
+/* Also calls ed25519_init */
+void
+verifier_init(struct verifier* verifier,
+              struct net_context* ctx,
+              verify_done_fn* done,
+              void* done_p);
+
+/* Jobs must not be running */
+void
+verifier_free(struct verifier* verifier);
+
+enum
+{
+  VERIFIER_SUBMIT_OK,
+  VERIFIER_SUBMIT_SIZE,
+  VERIFIER_SUBMIT_FULL,
+  VERIFIER_SUBMIT_ALLOC,
+} verifier_submit_errors;
+
+/* Queue an announce signed with an Ed25519 key, decoded from size octets at
+ * data, which are copied. Announces found in the cache are done before this
+ * returns. */
+int
+verifier_submit(struct verifier* verifier,
+                struct net_tcp_conn* tcp_conn,
+                int own,
+                struct announce_view* announce,
+                unsigned char* data,
+                size_t size);
+
+void
+verify_job_run(struct verify_job* job);
+
+/* Cache the results, call done for every request and free the job */
+void
+verify_job_complete(struct verify_job* job);
+
+int
+net_cb_verifier(int event, void* event_data, void** p);
+
+/*
+  Announce propagation. An announce is encoded once and the same buffer is
+  queued on up to GOSSIP_FANOUT random connections. A pair of Bloom filters
+  remembers what was propagated recently so that an announce reaching us
+  again is not sent around once more. As a peer may be left out by every
+  node it is connected to, an announce is sent again GOSSIP_REPAIR_DELAY
+  milliseconds later to up to GOSSIP_FANOUT of the connections it was not
+  sent on, including those established in the meantime.
+*/
+
+/* Connections an announce is forwarded to */
+#define GOSSIP_FANOUT 8
+
+/* Connections announces may be queued on in a round, and how many
+ * milliseconds there are between rounds */
+#define GOSSIP_ROUND_SENDS 64
+#define GOSSIP_ROUND_INTERVAL 100UL
+
+/* Announces waiting for a round or for their repair, further ones are
+ * dropped */
+#define GOSSIP_PENDING_MAX 1024
+
+#define GOSSIP_REPAIR_DELAY 2000UL
+
+/* Connections with more octets than this left to send are skipped */
+#define GOSSIP_QUEUED_MAX (256UL << 10)
+
+/* Size of each filter in bits and bits set per announce. The older filter is
+ * cleared and reused once the newer one took in GOSSIP_FILTER_ANNOUNCES
+ * announces or is GOSSIP_FILTER_PERIOD milliseconds old. */
+#define GOSSIP_FILTER_BITS (1UL << 16)
+#define GOSSIP_FILTER_HASHES 4
+#define GOSSIP_FILTER_ANNOUNCES 4096
+#define GOSSIP_FILTER_PERIOD 600000UL
+
+struct gossip_pending
+{
+  STAILQ_ENTRY(gossip_pending) entry;
+
+  /* Encoded command */
+  struct mem_shared* shared;
+
+  /* Connection the announce came from, which it is not sent back to. NULL
+   * for datagrams or once the connection closed. */
+  struct net_tcp_conn* from;
+
+  /* Ids of the connections it was sent on, and when it is sent again */
+  unsigned long sent_to[GOSSIP_FANOUT];
+  size_t sent_count;
+  unsigned long repair_at;
+};
+
+STAILQ_HEAD(gossip_pendings, gossip_pending);
+
+struct gossip
+{
+  struct net_context* ctx;
+
+  unsigned char filters[2][GOSSIP_FILTER_BITS / 8];
+
+  /* Filter announces are added to, how many were and since when */
+  size_t filter;
+  size_t filter_count;
+  unsigned long filter_since;
+
+  struct gossip_pendings pending;
+
+  /* Announces sent once, by when they are sent again */
+  struct gossip_pendings repairs;
+
+  /* Announces in either queue, and the octets they take, reported on
+   * NET_EVENT_MEMORY */
+  size_t pending_count;
+  size_t memory;
+
+  /* When the next round may start */
+  unsigned long next_round;
+
+  /* Announces propagated, connections they were queued on, those of them
+   * when sent again, announces suppressed as already seen and dropped for
+   * lack of room */
+  unsigned long forwarded;
+  unsigned long sends;
+  unsigned long repair_sends;
+  unsigned long duplicates;
+  unsigned long dropped;
+
+  /* Runs rounds, forgets closed connections and reports memory, registered
+   * by gossip_init */
+  struct net_callback callback;
+};
+
+void
+gossip_init(struct gossip* gossip, struct net_context* ctx);
+
+void
+gossip_free(struct gossip* gossip);
+
+enum
+{
+  GOSSIP_ANNOUNCE_OK,
+  GOSSIP_ANNOUNCE_DUPLICATE,
+  GOSSIP_ANNOUNCE_FULL,
+  GOSSIP_ANNOUNCE_ALLOC,
+} gossip_announce_errors;
+
+/* Queue an announce to be propagated unless it was recently. from is the
+ * connection it came from, NULL if none. */
+int
+gossip_announce(struct gossip* gossip,
+                struct announce_view* announce,
+                struct net_tcp_conn* from);
+
+int
+net_cb_gossip(int event, void* event_data, void** p);
+
+/*
+  Our own announce. It is encoded once and the encoding is kept until the
+  addresses or keys it is made of change. Peers are sent it once connected,
+  then every ANNOUNCE_INTERVAL milliseconds give or take a quarter.
+*/
+
+/* Longer than GOSSIP_FILTER_PERIOD even with jitter, so that every announce
+ * is propagated again */
+#define ANNOUNCE_INTERVAL 900000UL
+
+/* Connections due within this many milliseconds of the first one are sent
+ * the announce at the same time */
+#define ANNOUNCE_BATCH 1000UL
+
+/* Largest public key and signatures we announce */
+#define ANNOUNCE_PUBLIC_KEY_MAX 64
+#define ANNOUNCE_SIGNATURE_MAX 128
+
+/* When a connection is next sent our announce, kept as a command state */
+struct announce_due
+{
+  struct net_tcp_conn* tcp_conn;
+  unsigned long at;
+
+  /* Position in the heap of the announce_self */
+  size_t index;
+};
+
+struct announce_self
+{
+  struct net_context* ctx;
+
+  unsigned char role;
+
+  unsigned char address_block_count;
+  unsigned char address_blocks[NET_PEER_ADDRS_MAX * ADDRESS_BLOCK_SIZE_MAX];
+  size_t address_blocks_size;
+
+  unsigned char public_key_type;
+  unsigned short public_key_size;
+  unsigned char public_key[ANNOUNCE_PUBLIC_KEY_MAX];
+
+  unsigned short signature_size;
+  unsigned char signature[ANNOUNCE_SIGNATURE_MAX];
+
+  unsigned char master_signature_type;
+  unsigned short master_signature_size;
+  unsigned char master_signature[ANNOUNCE_SIGNATURE_MAX];
+
+  /* Encoded command, NULL until it is needed after a change */
+  struct mem_shared* encoded;
+
+  /* Min-heap of connections by when they are due */
+  struct announce_due** heap;
+  size_t count;
+  size_t capacity;
+
+  /* How many times the announce was encoded and queued on a connection */
+  unsigned long builds;
+  unsigned long sends;
+
+  /* Schedules connections and sends the announce, registered by
+   * announce_self_init */
+  struct net_callback callback;
+};
+
+void
+announce_self_init(struct announce_self* self,
+                   struct net_context* ctx,
+                   unsigned char role);
+
+void
+announce_self_free(struct announce_self* self);
+
+/* Set the addresses we accept connections on, those that can't be announced
+ * are left out */
+void
+announce_self_set_addrs(struct announce_self* self,
+                        struct net_addr* addrs,
+                        size_t count);
+
+enum
+{
+  ANNOUNCE_SELF_SET_KEYS_OK,
+  ANNOUNCE_SELF_SET_KEYS_SIZE,
+} announce_self_set_keys_errors;
+
+/* Set the public key and signatures from those of an announce */
+int
+announce_self_set_keys(struct announce_self* self,
+                       struct announce_view* keys);
+
+/* Encoded announce command, encoded now if it changed. NULL if out of
+ * memory. */
+struct mem_shared*
+announce_self_encoded(struct announce_self* self);
+
+int
+net_cb_announce_self(int event, void* event_data, void** p);
+
+/* A capture file starts with CAPTURE_MAGIC, without its terminating 0 */
+#define CAPTURE_MAGIC "unicap1\n"
+#define CAPTURE_MAGIC_SIZE 8
+
+enum
+{
+  CAPTURE_OPEN = 1,
+  CAPTURE_DATA,
+  CAPTURE_CLOSE,
+} capture_kinds;
+
+/* Records what peers that connected to us send, to be replayed later */
+struct capture
+{
+  struct net_context* ctx;
+  FILE* file;
+
+  /* When the previous record was written, from net_nanoseconds */
+  uint64_t last;
+
+  unsigned long records;
+
+  /* Writes the records, registered by capture_open */
+  struct net_callback callback;
+};
+
+enum
+{
+  CAPTURE_OPEN_OK,
+  CAPTURE_OPEN_FILE,
+} capture_open_errors;
+
+/*
+  Start capturing the octets received on connections accepted over TCP to
+  the file at path, with when they were received. The callback is inserted
+  at the head of the callbacks, so that NET_EVENT_RECEIVED reaches it before
+  the receive buffer is consumed: it must be opened after the callbacks
+  handling commands are registered.
+*/
+int
+capture_open(struct capture* capture,
+             struct net_context* ctx,
+             const char* path);
+
+void
+capture_close(struct capture* capture);
+
+int
+net_cb_capture(int event, void* event_data, void** p);
+
+/* Port every simulated node accepts connections on, node i has the address
+ * 10.0.0.0 + i + 1 */
+#define SIM_PORT 7000
+
+/* Octets a simulated connection delivers at once, and may have in flight in
+ * each direction by default */
+#define SIM_SEGMENT_SIZE 1460
+#define SIM_WINDOW_DEFAULT (64UL << 10)
+
+/* Shortest wait before a lost segment is sent again, in nanoseconds */
+#define SIM_RTO_MIN 200000000ULL
+
+struct sim;
+struct sim_pipe;
+
+/* Simulated endpoint of a connection */
+struct sim_end
+{
+  struct sim_pipe* pipe;
+  int side;
+
+  /* Node the end belongs to, and its connection, NULL before it is accepted
+   * and once it is closed */
+  size_t node;
+  struct net_tcp_conn* tcp_conn;
+  int closed;
+
+  /* When what was last sent to the end arrives, later segments arrive after
+   * it as the stream is ordered */
+  uint64_t arrives_at;
+
+  /* Octets the end sent that did not arrive yet */
+  size_t in_flight;
+};
+
+/* Both ends of a connection, the one that opened it first */
+struct sim_pipe
+{
+  LIST_ENTRY(sim_pipe) entry;
+
+  struct sim_end ends[2];
+
+  /* Address of the end that opened it, as seen by the other one */
+  struct sockaddr_in sa;
+
+  /* Ends still open plus events in flight to either end, freed at 0 */
+  unsigned long refs;
+};
+
+LIST_HEAD(sim_pipes, sim_pipe);
+
+struct sim_node
+{
+  struct sim* sim;
+  size_t index;
+
+  struct net_context* ctx;
+  struct net_transport transport;
+
+  /* When the uplink is done with what it was given */
+  uint64_t uplink_at;
+
+  /* When the next step of the node is due, 0 if none is */
+  uint64_t timer_at;
+
+  int runnable;
+
+  /* Source port of the next connection the node opens */
+  unsigned short port;
+};
+
+struct sim_event
+{
+  uint64_t at;
+
+  /* Events due at once happen in the order they were scheduled in */
+  unsigned long seq;
+
+  int kind;
+
+  /* Node, or end of a pipe, the event happens to */
+  size_t node;
+  struct sim_pipe* pipe;
+  int side;
+
+  /* Sender of a datagram */
+  struct sockaddr_in sa;
+
+  size_t size;
+  unsigned char data[];
+};
+
+/*
+  In-memory network of nodes, each a context using it as its transport,
+  driven by a virtual clock so that a run only depends on its seed. Every
+  node has an uplink of bandwidth octets per second, unlimited if 0, whose
+  segments take latency nanoseconds to arrive. Each one is lost with a
+  probability of loss per million: TCP segments then arrive an exponentially
+  backed off retransmission timeout later, datagrams never do.
+*/
+struct sim
+{
+  /* Virtual time in nanoseconds, starting at a second as timers take 0 for
+   * unset */
+  uint64_t now;
+
+  unsigned long long random;
+
+  uint64_t latency;
+  unsigned long bandwidth;
+  unsigned long loss;
+
+  /* Octets a connection may have in flight in each direction */
+  size_t window;
+
+  struct sim_node** nodes;
+  size_t count;
+  size_t capacity;
+
+  /* Min-heap of events by when they are due */
+  struct sim_event** heap;
+  size_t events;
+  size_t events_capacity;
+  unsigned long seq;
+
+  /* Nodes that had an event since they last stepped, by index */
+  size_t* run;
+  size_t run_count;
+
+  struct sim_pipes pipes;
+
+  /* Events that happened, segments and octets sent over connections, lost
+   * segments, datagrams and connections refused */
+  unsigned long handled;
+  unsigned long segments;
+  unsigned long octets;
+  unsigned long lost;
+  unsigned long datagrams;
+  unsigned long refused;
+};
+
+/* Empty network with a latency of 20 milliseconds, unlimited bandwidth and
+ * no loss. seed must not be 0. */
+void
+sim_init(struct sim* sim, unsigned long long seed);
+
+/* Free the network, its contexts must not be used any more */
+void
+sim_free(struct sim* sim);
+
+enum
+{
+  SIM_ADD_OK,
+  SIM_ADD_FULL,
+  SIM_ADD_ALLOC,
+} sim_add_errors;
+
+/*
+  Add an initialized context as the next node, which accepts connections on
+  ctx->self_sa. Its clock and random generator are set from the network, so
+  modules reading them must be initialized afterwards.
+*/
+int
+sim_add(struct sim* sim, struct net_context* ctx);
+
+/* Run the network for duration milliseconds of virtual time */
+void
+sim_run(struct sim* sim, unsigned long duration);
+
+#define COMMAND_STATE_PING_AWAITING_RESPONSE 0x0
+#define COMMAND_STATE_PING_VALID_RESPONSE 0x1
+#define COMMAND_STATE_PING_INVALID_RESPONSE 0x2
+
+struct command_state_ping
+{
+  unsigned long tag;
+  int progress;
+  size_t size;
+  void* data;
+};
+
+void
+command_state_free_ping(void* p);
+
+/* Handler of pings, streamed: echoes requests as they arrive and checks
+ * responses against the command_state_ping they answer */
+int
+command_ping_stream(struct command_frame* frame, void** p);
 
 #endif
@@ -0,0 +1,314 @@
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+void
+verifier_init(struct verifier* verifier,
+              struct net_context* ctx,
+              verify_done_fn* done,
+              void* done_p)
+{
+  memset(verifier, 0, sizeof *verifier);
+
+  ed25519_init();
+
+  verifier->ctx = ctx;
+  verifier->done = done;
+  verifier->done_p = done_p;
+
+  STAILQ_INIT(&verifier->pending);
+  LIST_INIT(&verifier->jobs);
+
+  verifier->callback.events =
+    NET_EVENT_CLOSED | NET_EVENT_TICK | NET_EVENT_MEMORY;
+  verifier->callback.p = verifier;
+  verifier->callback.cb = net_cb_verifier;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &verifier->callback, entry);
+}
+
+static void
+verify_request_free(struct verifier* verifier, struct verify_request* request)
+{
+  verifier->memory -= sizeof *request + request->announce.capacity;
+  mem_free_buf(&request->announce);
+  free(request);
+}
+
+static void
+verify_requests_free(struct verifier* verifier,
+                     struct verify_requests* requests)
+{
+  while (!STAILQ_EMPTY(requests)) {
+    struct verify_request* request = STAILQ_FIRST(requests);
+
+    STAILQ_REMOVE_HEAD(requests, entry);
+    verify_request_free(verifier, request);
+  }
+}
+
+void
+verifier_free(struct verifier* verifier)
+{
+  LIST_REMOVE(&verifier->callback, entry);
+
+  verify_requests_free(verifier, &verifier->pending);
+  verifier->pending_count = 0;
+
+  while (!LIST_EMPTY(&verifier->jobs)) {
+    struct verify_job* job = LIST_FIRST(&verifier->jobs);
+
+    LIST_REMOVE(job, entry);
+    verify_requests_free(verifier, &job->requests);
+    free(job);
+  }
+
+  verifier->memory = 0;
+}
+
+/* Slot of the cache a fingerprint goes in */
+static unsigned char*
+verify_cache_slot(struct verifier* verifier, unsigned char* fingerprint)
+{
+  size_t i = ((size_t)fingerprint[0] | (size_t)fingerprint[1] << 8 |
+              (size_t)fingerprint[2] << 16) &
+             (VERIFY_CACHE_SIZE - 1);
+
+  return verifier->cache[i];
+}
+
+int
+verifier_submit(struct verifier* verifier,
+                struct net_tcp_conn* tcp_conn,
+                int own,
+                struct announce_view* announce,
+                unsigned char* data,
+                size_t size)
+{
+  if (announce->public_key_size != ED25519_PUBLIC_KEY_SIZE ||
+      announce->signature_size != ED25519_SIGNATURE_SIZE)
+    return E(VERIFIER_SUBMIT_SIZE);
+
+  if (verifier->pending_count >= VERIFY_PENDING_MAX) {
+    ++verifier->dropped;
+    return E(VERIFIER_SUBMIT_FULL);
+  }
+
+  struct verify_request* request = calloc(1, sizeof *request);
+
+  if (request == NULL)
+    return E(VERIFIER_SUBMIT_ALLOC);
+
+  if (mem_grow_buf(&request->announce, data, size) != MEM_GROW_BUF_OK) {
+    free(request);
+    return E(VERIFIER_SUBMIT_ALLOC);
+  }
+
+  verifier->memory += sizeof *request + request->announce.capacity;
+
+  unsigned char* p = request->announce.p;
+
+  /* everything before the signature size is signed */
+  request->tcp_conn = tcp_conn;
+  request->own = own;
+  request->signed_size =
+    (size_t)(announce->signature - data) - CODEC_SIZE(SIGNATURE_HEAD_SCHEMA);
+  request->public_key = p + (announce->public_key - data);
+  request->signature = p + (announce->signature - data);
+
+  struct sha512 sha;
+  unsigned char digest[64];
+
+  sha512_init(&sha);
+  sha512_update(&sha, request->public_key, ED25519_PUBLIC_KEY_SIZE);
+  sha512_update(&sha, p, request->signed_size);
+  sha512_final(&sha, digest);
+
+  memcpy(request->fingerprint, digest, sizeof request->fingerprint);
+
+  if (memcmp(verify_cache_slot(verifier, request->fingerprint),
+             request->fingerprint,
+             sizeof request->fingerprint) == 0) {
+    ++verifier->cached;
+
+    request->valid = 1;
+    verifier->done(request, verifier->done_p);
+    verify_request_free(verifier, request);
+
+    return VERIFIER_SUBMIT_OK;
+  }
+
+  STAILQ_INSERT_TAIL(&verifier->pending, request, entry);
+  ++verifier->pending_count;
+
+  return VERIFIER_SUBMIT_OK;
+}
+
+void
+verify_job_run(struct verify_job* job)
+{
+  struct ed25519_item items[VERIFY_BATCH_MAX];
+  struct verify_request* request;
+  size_t count = 0;
+
+  STAILQ_FOREACH(request, &job->requests, entry)
+  {
+    items[count].public_key = request->public_key;
+    items[count].signature = request->signature;
+    items[count].message = request->announce.p;
+    items[count].message_size = request->signed_size;
+    ++count;
+  }
+
+  ed25519_verify_batch(items, count);
+
+  count = 0;
+
+  STAILQ_FOREACH(request, &job->requests, entry)
+  {
+    request->valid = items[count++].valid;
+  }
+}
+
+void
+verify_job_complete(struct verify_job* job)
+{
+  struct verifier* verifier = job->verifier;
+
+  LIST_REMOVE(job, entry);
+  ++verifier->batches;
+
+  while (!STAILQ_EMPTY(&job->requests)) {
+    struct verify_request* request = STAILQ_FIRST(&job->requests);
+
+    STAILQ_REMOVE_HEAD(&job->requests, entry);
+    --verifier->pending_count;
+
+    if (request->valid) {
+      ++verifier->valid;
+
+      memcpy(verify_cache_slot(verifier, request->fingerprint),
+             request->fingerprint,
+             sizeof request->fingerprint);
+    } else {
+      ++verifier->invalid;
+    }
+
+    verifier->done(request, verifier->done_p);
+    verify_request_free(verifier, request);
+  }
+
+  verifier->memory -= sizeof *job;
+  free(job);
+}
+
+static void
+verify_job_work_run(struct worker_job* work)
+{
+  verify_job_run(work->p);
+}
+
+static void
+verify_job_work_complete(struct worker_job* work)
+{
+  verify_job_complete(work->p);
+}
+
+/* Move pending requests to jobs of up to VERIFY_BATCH_MAX requests, as long
+ * as the pool has room for them */
+static void
+verifier_start(struct verifier* verifier)
+{
+  while (!STAILQ_EMPTY(&verifier->pending)) {
+    /* requests wait for the workers rather than take the loop thread, they
+     * still count towards VERIFY_PENDING_MAX */
+    if (verifier->pool &&
+        verifier->pool->running_count >= WORKER_QUEUE_SIZE)
+      return;
+
+    struct verify_job* job = calloc(1, sizeof *job);
+
+    /* try again on the next tick */
+    if (job == NULL)
+      return;
+
+    verifier->memory += sizeof *job;
+
+    job->verifier = verifier;
+    STAILQ_INIT(&job->requests);
+
+    while (job->count < VERIFY_BATCH_MAX &&
+           !STAILQ_EMPTY(&verifier->pending)) {
+      struct verify_request* request = STAILQ_FIRST(&verifier->pending);
+
+      STAILQ_REMOVE_HEAD(&verifier->pending, entry);
+      STAILQ_INSERT_TAIL(&job->requests, request, entry);
+      ++job->count;
+    }
+
+    /* requests are for several connections, they are forgotten by
+     * net_cb_verifier */
+    job->work.run = verify_job_work_run;
+    job->work.complete = verify_job_work_complete;
+    job->work.p = job;
+    job->work.tcp_conn = NULL;
+
+    if (verifier->pool == NULL) {
+      LIST_INSERT_HEAD(&verifier->jobs, job, entry);
+      verify_job_run(job);
+      verify_job_complete(job);
+      continue;
+    }
+
+    if (worker_pool_submit(verifier->pool, &job->work) !=
+        WORKER_POOL_SUBMIT_OK) {
+      /* back in front of the others, in order, for the next tick */
+      STAILQ_CONCAT(&job->requests, &verifier->pending);
+      STAILQ_CONCAT(&verifier->pending, &job->requests);
+      verifier->memory -= sizeof *job;
+      free(job);
+      return;
+    }
+
+    LIST_INSERT_HEAD(&verifier->jobs, job, entry);
+  }
+}
+
+int
+net_cb_verifier(int event, void* event_data, void** p)
+{
+  struct verifier* verifier = *p;
+
+  if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+    struct verify_request* request;
+    struct verify_job* job;
+
+    STAILQ_FOREACH(request, &verifier->pending, entry)
+    {
+      if (request->tcp_conn == closed->tcp_conn)
+        request->tcp_conn = NULL;
+    }
+
+    LIST_FOREACH(job, &verifier->jobs, entry)
+    {
+      STAILQ_FOREACH(request, &job->requests, entry)
+      {
+        if (request->tcp_conn == closed->tcp_conn)
+          request->tcp_conn = NULL;
+      }
+    }
+  } else if (event == NET_EVENT_TICK) {
+    verifier_start(verifier);
+  } else if (event == NET_EVENT_MEMORY) {
+    struct net_event_data_memory* memory = event_data;
+
+    memory->memory += verifier->memory;
+  }
+
+  return 0;
+}
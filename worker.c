@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "unilink.h"
+
+static void*
+worker_main(void* p)
+{
+  struct worker_pool* pool = p;
+
+  for (;;) {
+    unsigned char token;
+    ssize_t read_ret = read(pool->job_fds[0], &token, sizeof token);
+
+    if (read_ret == -1 && errno == EINTR)
+      continue;
+
+    /* the pool is being freed */
+    if (read_ret != 1)
+      return NULL;
+
+    /* the octet was written after the job was pushed, it is there */
+    struct worker_job* job = mem_ring_pop(&pool->jobs);
+
+    job->run(job);
+
+    /* can't be full, no more jobs are submitted than the ring holds */
+    mem_ring_push(&pool->done, job);
+    net_wake_signal(pool->wake_fds[1]);
+  }
+}
+
+static void
+worker_pool_close(struct worker_pool* pool)
+{
+  if (pool->job_fds[0] >= 0) {
+    close(pool->job_fds[0]);
+    close(pool->job_fds[1]);
+  }
+
+  if (pool->wake_fds[0] >= 0)
+    net_wake_close(pool->ctx, pool->wake_fds);
+
+  mem_ring_free(&pool->jobs);
+  mem_ring_free(&pool->done);
+}
+
+/* Stop the threads once they took every job, reading the job pipe then
+ * returns end of file */
+static void
+worker_pool_join(struct worker_pool* pool)
+{
+  close(pool->job_fds[1]);
+
+  for (size_t i = 0; i < pool->thread_count; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  close(pool->job_fds[0]);
+  pool->job_fds[0] = -1;
+  pool->thread_count = 0;
+}
+
+int
+worker_pool_init(struct worker_pool* pool,
+                 struct net_context* ctx,
+                 size_t threads)
+{
+  memset(pool, 0, sizeof *pool);
+
+  pool->ctx = ctx;
+  pool->job_fds[0] = -1;
+  pool->wake_fds[0] = -1;
+
+  LIST_INIT(&pool->running);
+
+  if (threads == 0 || threads > WORKER_THREADS_MAX)
+    return E(WORKER_POOL_INIT_THREADS);
+
+  if (mem_ring_init(&pool->jobs, WORKER_QUEUE_SIZE) != MEM_RING_INIT_OK ||
+      mem_ring_init(&pool->done, WORKER_QUEUE_SIZE) != MEM_RING_INIT_OK) {
+    worker_pool_close(pool);
+    return E(WORKER_POOL_INIT_ALLOC);
+  }
+
+  if (pipe(pool->job_fds) == -1) {
+    pool->job_fds[0] = -1;
+    worker_pool_close(pool);
+    return E(WORKER_POOL_INIT_PIPE);
+  }
+
+  fcntl(pool->job_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pool->job_fds[1], F_SETFD, FD_CLOEXEC);
+
+  if (net_wake_open(ctx, pool->wake_fds) != NET_WAKE_OPEN_OK) {
+    pool->wake_fds[0] = -1;
+    worker_pool_close(pool);
+    return E(WORKER_POOL_INIT_WAKE);
+  }
+
+  for (; pool->thread_count < threads; ++pool->thread_count) {
+    if (pthread_create(&pool->threads[pool->thread_count],
+                       NULL,
+                       worker_main,
+                       pool) != 0) {
+      worker_pool_join(pool);
+      worker_pool_close(pool);
+      return E(WORKER_POOL_INIT_THREAD);
+    }
+  }
+
+  pool->callback.events = NET_EVENT_CLOSED | NET_EVENT_WAKE;
+  pool->callback.p = pool;
+  pool->callback.cb = net_cb_worker_pool;
+
+  LIST_INSERT_HEAD(&ctx->callbacks, &pool->callback, entry);
+
+  return WORKER_POOL_INIT_OK;
+}
+
+void
+worker_pool_free(struct worker_pool* pool)
+{
+  LIST_REMOVE(&pool->callback, entry);
+
+  worker_pool_join(pool);
+  worker_pool_close(pool);
+
+  /* the jobs belong to whoever submitted them */
+  LIST_INIT(&pool->running);
+  pool->running_count = 0;
+}
+
+int
+worker_pool_submit(struct worker_pool* pool, struct worker_job* job)
+{
+  if (pool->running_count >= WORKER_QUEUE_SIZE)
+    return E(WORKER_POOL_SUBMIT_FULL);
+
+  if (mem_ring_push(&pool->jobs, job) != MEM_RING_PUSH_OK)
+    return E(WORKER_POOL_SUBMIT_FULL);
+
+  LIST_INSERT_HEAD(&pool->running, job, entry);
+  ++pool->running_count;
+  ++pool->submitted;
+
+  unsigned char token = 0;
+
+  /* the pipe holds more octets than there can be jobs, this never blocks
+   * for long */
+  while (write(pool->job_fds[1], &token, sizeof token) == -1 &&
+         errno == EINTR)
+    ;
+
+  return WORKER_POOL_SUBMIT_OK;
+}
+
+int
+net_cb_worker_pool(int event, void* event_data, void** p)
+{
+  struct worker_pool* pool = *p;
+
+  if (event == NET_EVENT_CLOSED) {
+    struct net_event_data_closed* closed = event_data;
+    struct worker_job* job;
+
+    LIST_FOREACH(job, &pool->running, entry)
+    {
+      if (job->tcp_conn == closed->tcp_conn)
+        job->tcp_conn = NULL;
+    }
+  } else if (event == NET_EVENT_WAKE) {
+    struct net_event_data_wake* wake = event_data;
+    struct worker_job* job;
+
+    if (wake->fd != pool->wake_fds[0])
+      return 0;
+
+    while ((job = mem_ring_pop(&pool->done)) != NULL) {
+      LIST_REMOVE(job, entry);
+      --pool->running_count;
+      ++pool->completed;
+
+      job->complete(job);
+    }
+  }
+
+  return 0;
+}